@@ -1,250 +1,356 @@
 #pragma once
 
-#include <unordered_map>
+#include <algorithm>
+#include <array>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <stdexcept>
-#include <limits>
 
 #include "isa.h"
+#include "encoding.h"
+#include "image.h"
+#include "layout.h"
+
+//  Encodes every instruction the moment the parser reduces it and emits it into the
+//  image, nothing of the program is kept around. A label reference is resolved as soon
+//  as both ends are known: branches within a section and references into .text, which
+//  sits at address 0, when the label is defined, everything else once the layout is
+//  final. Until then the reference is a fixup against the emitted word, so memory grows
+//  with the labels and open fixups, not with the program.
+//
+//  With a profile .text is held back instead and encoded by Finish in the order
+//  CodeLayout picks (see layout.h), the other sections still stream.
 
-class InstructionList
+class Assembler
 {
 public:
-    struct ParsedInstruction
-    {
-        std::string     label;
-        std::string     jump_label;
-        Instruction     mnemonics{ 0 };
-        InstructionType type{ 0 };
-        Register        r1{ 0 };
-        Register        r2{ 0 };
-        Register        r3{ 0 };
-        uint16_t        imm16{ 0 };
-    };
+    explicit Assembler(Image& image):
+    _image(image)
+    {
+    }
 
-    void Append(const std::string& label, const std::string& mnemonics, const std::string& op1, const std::string& op2, const std::string& op3)
+    // Lays .text out by the block counts in profile, call before anything is emitted
+    void UseProfile(Profile profile)
     {
-        _instructions.emplace_back(ParseInstruction(label, mnemonics, op1, op2, op3));
+        _layout = std::make_unique<CodeLayout>(std::move(profile));
     }
 
-private:
-    std::vector<ParsedInstruction> _instructions;
+    void Label(const std::string& name)
+    {
+        if (HoldBack())
+        {
+            _layout->Label(name);
+            return;
+        }
+
+        Symbol symbol{ _image.CurrentSection(), _image.Current().Size() };
+        if (!_symbols.emplace(name, symbol).second)
+            throw std::runtime_error(std::string("Duplicate label: ") + name);
 
-    ParsedInstruction ParseInstruction(const std::string& label, const std::string& mnemonics, const std::string& op1, const std::string& op2, const std::string& op3)
+        auto it = _pending.find(name);
+        if (it == _pending.end())
+            return;
+
+        std::vector<Fixup>& fixups = it->second;
+        fixups.erase(std::remove_if(fixups.begin(), fixups.end(),
+            [&](const Fixup& fixup) { return Resolve(fixup, symbol, nullptr); }), fixups.end());
+        if (fixups.empty())
+            _pending.erase(it);
+    }
+
+    // Operands as the parser has them, see parser.y
+    void Emit(const std::string& mnemonics, const std::string& op1 = {}, const std::string& op2 = {}, const std::string& op3 = {})
     {
-        ParsedInstruction res;
+        if (HoldBack())
+        {
+            _layout->Emit(mnemonics, op1, op2, op3);
+            return;
+        }
 
-        res.label = label;
-        res.mnemonics = ParseMnemonics(mnemonics);
+        Instruction op = ParseMnemonics(mnemonics);
+        if (_image.Current().Size() % sizeof(WORD) != 0)
+            throw std::runtime_error(std::string("Instruction is not word aligned: ") + mnemonics);
 
-        switch (GetInstructionType(res.mnemonics))
+        WORD word = 0;
+        switch (GetInstructionType(op))
         {
         case InstructionType::OP_R3:
-            res.r1 = ParseRegister(op1);
-            res.r2 = ParseRegister(op2);
-            res.r3 = ParseRegister(op3);
+            word = Encode(op, ParseRegister(op1), ParseRegister(op2), ParseRegister(op3));
             break;
         case InstructionType::OP_R2_IMM16:
-            res.r1 = ParseRegister(op1);
-            res.r2 = ParseRegister(op2);
-            res.imm16 = ParseImmediate16(op3);
+            word = EncodeImm16(op, ParseRegister(op1), ParseRegister(op2), ParseImmediate16(op3));
+            break;
         case InstructionType::OP_R2:
-            res.r1 = ParseRegister(op1);
-            res.r2 = ParseRegister(op2);
+            if (IsLoadStore(op))
+                word = ParseAddress(Encode(op, ParseRegister(op1)), op2);
+            else
+                word = Encode(op, ParseRegister(op1), ParseRegister(op2));
+            break;
         case InstructionType::OP_R1_IMM16:
-            res.r1 = ParseRegister(op1);
-            res.imm16 = ParseImmediate16(op2);
+            word = EncodeImm16(op, ParseRegister(op1), Register::RZ, ParseImmediate16(op2));
+            break;
+        case InstructionType::OP_R1:
+            word = Encode(op, ParseRegister(op1));
+            break;
         case InstructionType::OP_J:
-            res.r1 = ParseRegister(op1);
-            res.jump_label = op2;
-        case InstructionType::OP:
+            word = EncodeJ(op, Reference(IsBranch(op) ? Fixup::Kind::Branch : Fixup::Kind::Jump, op1));
+            break;
+        case InstructionType::OP_LIST:
+            word = EncodeImm16(op, Register::RZ, Register::RZ, ParseRegisterList(op1));
             break;
-        default:
+        case InstructionType::OP:
+            word = Encode(op);
             break;
         }
 
-        return res;
+        _image.Current().Emit(&word, sizeof(word));
     }
 
-    Instruction ParseMnemonics(const std::string& mnemonics)
+    // Patches what is still open, call before the image is written
+    void Finish()
     {
-        static const std::unordered_map<std::string, Instruction> instruction_map
+        if (_layout)
         {
-            { "ADD",    Instruction::ADD    },
-            { "ADDI",   Instruction::ADDI   },
-            { "SUB",    Instruction::SUB    },
-            { "SUBI",   Instruction::SUBI   },
-            { "LUI",    Instruction::LUI    },
-            { "SHL",    Instruction::SHL    },
-            { "SHLI",   Instruction::SHLI   },
-            { "SHR",    Instruction::SHR    },
-            { "SHRI",   Instruction::SHRI   },
-            { "OR",     Instruction::OR     },
-            { "ORI",    Instruction::ORI    },
-            { "AND",    Instruction::AND    },
-            { "ANDI",   Instruction::ANDI   },
-            { "XOR",    Instruction::XOR    },
-            { "XORI",   Instruction::XORI   },
-            { "NOT",    Instruction::NOT    },
-            { "LB",     Instruction::LB     },
-            { "LBU",    Instruction::LBU    },
-            { "LH",     Instruction::LH     },
-            { "LHU",    Instruction::LHU    },
-            { "LW",     Instruction::LW     },
-            { "LWU",    Instruction::LWU    },
-            { "SB",     Instruction::SB     },
-            { "SH",     Instruction::SH     },
-            { "SW",     Instruction::SW     },
-            { "CMP",    Instruction::CMP    },
-            { "CMPI",   Instruction::CMPI   },
-            { "B",      Instruction::B      },
-            { "BEQ",    Instruction::BEQ    },
-            { "BNE",    Instruction::BNE    },
-            { "BGT",    Instruction::BGT    },
-            { "BGE",    Instruction::BGE    },
-            { "BLT",    Instruction::BLT    },
-            { "BLE",    Instruction::BLE    },
-            { "J",      Instruction::J      },
-            { "JR",     Instruction::JR     },
-            { "CALL",   Instruction::CALL   },
-            { "CALLR",  Instruction::CALLR  },
-            { "RET",    Instruction::RET    },
-            { "PUSH",   Instruction::PUSH   },
-            { "POP",    Instruction::POP    }
-            { "HALT",   Instruction::HALT    }
-        };
-
-        auto it = instruction_map.find(mnemonics);
-        if (it == instruction_map.end())
-            throw std::runtime_error(std::string("Invalid mnemonics: ") + mnemonics);
-        
-        return it->second;
+            if (_image.Get(Section::TEXT).Size() != 0)
+                throw std::runtime_error(HELD_BACK);
+
+            std::unique_ptr<CodeLayout> layout = std::move(_layout);
+            Section current = _image.CurrentSection();
+            _image.Switch(Section::TEXT);
+            for (const Statement& statement : layout->Order())
+            {
+                if (statement.mnemonic.empty())
+                    Label(statement.op1);
+                else
+                    Emit(statement.mnemonic, statement.op1, statement.op2, statement.op3);
+            }
+            _image.Switch(current);
+        }
+
+        std::array<uint64_t, Image::SECTIONS> bases = _image.Layout();
+        for (const auto& [name, fixups] : _pending)
+        {
+            Symbol symbol;
+            if (!Find(name, symbol))
+                throw std::runtime_error(std::string("Undefined label: ") + name);
+
+            for (const Fixup& fixup : fixups)
+                Resolve(fixup, symbol, &bases);
+        }
+
+        _pending.clear();
     }
 
-    Register ParseRegister(const std::string& reg)
+private:
+    struct Symbol
     {
-        static const std::unordered_map<std::string, Register> instruction_map
-        {
-            { "RZ",     Register::RZ    },
-            { "R1",     Register::R1    },
-            { "R2",     Register::R2    },
-            { "R3",     Register::R3    },
-            { "R4",     Register::R4    },
-            { "R5",     Register::R5    },
-            { "R6",     Register::R6    },
-            { "R7",     Register::R7    },
-            { "R8",     Register::R8    }
-        };
-
-        auto it = instruction_map.find(reg);
-        if (it == instruction_map.end())
-            throw std::runtime_error(std::string("Invalid register: ") + reg);
-        
-        return it->second;
+        Section     section;
+        uint64_t    offset;
+    };
+
+    struct Fixup
+    {
+        enum class Kind : BYTE { Branch, Jump, High, Low };
+
+        Kind        kind;
+        Section     section;
+        uint64_t    offset;         // of the instruction word
+        std::string name;
+    };
+
+    static constexpr const char* HELD_BACK = "Profile guided layout needs .text to hold instructions only";
+
+    // Whether .text goes to the layout. Anything already in .text came from a directive,
+    // which would not move with the code.
+    bool HoldBack() const
+    {
+        if (!_layout || _image.CurrentSection() != Section::TEXT)
+            return false;
+        if (_image.Get(Section::TEXT).Size() != 0)
+            throw std::runtime_error(HELD_BACK);
+
+        return true;
     }
 
-    InstructionType GetInstructionType(Instruction instruction)
+    // The bits a reference contributes to the instruction word, 0 while it is open
+    WORD Reference(Fixup::Kind kind, const std::string& target)
     {
-        static const std::unordered_map<Instruction, InstructionType> instruction_type_map
+        Fixup fixup{ kind, _image.CurrentSection(), _image.Current().Size(), target };
+
+        Symbol symbol;
+        uint64_t delta = 0;
+        if (Find(target, symbol) && Distance(fixup, symbol, nullptr, delta))
+            return Bits(fixup, symbol, delta);
+
+        _pending[target].push_back(std::move(fixup));
+        return 0;
+    }
+
+    // A number is an address, which is its offset in .text
+    bool Find(const std::string& name, Symbol& symbol) const
+    {
+        if (!name.empty() && ::isdigit(static_cast<unsigned char>(name[0])))
         {
-            { Instruction::ADD,       InstructionType::OP_R3            },
-            { Instruction::ADDI,      InstructionType::OP_R2_IMM16      },
-            { Instruction::SUB,       InstructionType::OP_R3            },
-            { Instruction::SUBI,      InstructionType::OP_R2_IMM16      },
-            { Instruction::LUI,       InstructionType::OP_R1_IMM16      },
-            { Instruction::SHL,       InstructionType::OP_R3            },
-            { Instruction::SHLI,      InstructionType::OP_R2_IMM16      },
-            { Instruction::SHR,       InstructionType::OP_R3            },
-            { Instruction::SHRI,      InstructionType::OP_R2_IMM16      },
-            { Instruction::OR,        InstructionType::OP_R3            },
-            { Instruction::ORI,       InstructionType::OP_R2_IMM16      },
-            { Instruction::AND,       InstructionType::OP_R3            },
-            { Instruction::ANDI,      InstructionType::OP_R2_IMM16      },
-            { Instruction::XOR,       InstructionType::OP_R3            },
-            { Instruction::XORI,      InstructionType::OP_R2_IMM16      },
-            { Instruction::NOT,       InstructionType::OP_R3            },
-            { Instruction::LB,        InstructionType::OP_R2            },
-            { Instruction::LBU,       InstructionType::OP_R2            },
-            { Instruction::LH,        InstructionType::OP_R2            },
-            { Instruction::LHU,       InstructionType::OP_R2            },
-            { Instruction::LW,        InstructionType::OP_R2            },
-            { Instruction::LWU,       InstructionType::OP_R2            },
-            { Instruction::SB,        InstructionType::OP_R2            },
-            { Instruction::SH,        InstructionType::OP_R2            },
-            { Instruction::SW,        InstructionType::OP_R2            },
-            { Instruction::CMP,       InstructionType::OP_R2            },
-            { Instruction::CMPI,      InstructionType::OP_R1_IMM16      },
-            { Instruction::B,         InstructionType::OP_J             },
-            { Instruction::BEQ,       InstructionType::OP_J             },
-            { Instruction::BNE,       InstructionType::OP_J             },
-            { Instruction::BGT,       InstructionType::OP_J             },
-            { Instruction::BGE,       InstructionType::OP_J             },
-            { Instruction::BLT,       InstructionType::OP_J             },
-            { Instruction::BLE,       InstructionType::OP_J             },
-            { Instruction::J,         InstructionType::OP_J             },
-            { Instruction::JR,        InstructionType::OP_J             },
-            { Instruction::CALL,      InstructionType::OP_J             },
-            { Instruction::CALLR,     InstructionType::OP_R1            },
-            { Instruction::RET,       InstructionType::OP               },
-            { Instruction::PUSH,      InstructionType::OP_R1            },
-            { Instruction::POP,       InstructionType::OP_R1            }
-            { Instruction::HALT,      InstructionType::OP               }
-        };
-
-        auto it = instruction_type_map.find(instruction);
-        if (it == instruction_type_map.end())
-            throw std::runtime_error(std::string("Undefined instruction type: ") + std::to_string(static_cast<uint8_t>(instruction)));
-        
-        return it->second;
+            symbol = Symbol{ Section::TEXT, Image::ParseNumber(name) };
+            return true;
+        }
+
+        auto it = _symbols.find(name);
+        if (it == _symbols.end())
+            return false;
+
+        symbol = it->second;
+        return true;
     }
 
-    uint16_t ParseImmediate16(const std::string& imm)
+    // Patches the fixup if the addresses it needs are known
+    bool Resolve(const Fixup& fixup, const Symbol& symbol, const std::array<uint64_t, Image::SECTIONS>* bases)
     {
-        int tmp = std::stoi(imm);
-        if (tmp > std::numeric_limits<uint16_t>::max())
-            throw std::runtime_error(std::string("Invalid imm16: ") + std::to_string(tmp));
-        
-        return static_cast<uint16_t>(tmp);
+        uint64_t delta = 0;
+        if (!Distance(fixup, symbol, bases, delta))
+            return false;
+
+        _image.Get(fixup.section).Patch(fixup.offset, Bits(fixup, symbol, delta));
+        return true;
     }
 
+    // Start of the symbol's section minus that of the fixup's for branches, the symbol's
+    // section start for everything else
+    static bool Distance(const Fixup& fixup, const Symbol& symbol, const std::array<uint64_t, Image::SECTIONS>* bases, uint64_t& delta)
+    {
+        if (fixup.kind == Fixup::Kind::Branch && fixup.section == symbol.section)
+            delta = 0;
+        else if (bases)
+            delta = (*bases)[static_cast<size_t>(symbol.section)] - (fixup.kind == Fixup::Kind::Branch ? (*bases)[static_cast<size_t>(fixup.section)] : 0);
+        else if (symbol.section == Section::TEXT && fixup.kind != Fixup::Kind::Branch)
+            delta = 0;
+        else
+            return false;
 
-};
+        return true;
+    }
 
-class Assembler
-{
-public:
+    static WORD Bits(const Fixup& fixup, const Symbol& symbol, uint64_t delta)
+    {
+        uint64_t address = symbol.offset + delta;
+        switch (fixup.kind)
+        {
+        case Fixup::Kind::Branch:
+        {
+            int64_t offset = static_cast<int64_t>(address) - static_cast<int64_t>(fixup.offset + sizeof(WORD));
+            if (offset < -(int64_t{ 1 } << 25) || offset >= (int64_t{ 1 } << 25) || (offset & 3) != 0)
+                throw std::runtime_error(std::string("Branch target out of range: ") + fixup.name);
 
+            return static_cast<WORD>(offset) & 0x3FFFFFF;
+        }
+        case Fixup::Kind::Jump:
+            if (address >= (uint64_t{ 1 } << 26) || (address & 3) != 0)
+                throw std::runtime_error(std::string("Jump target out of range: ") + fixup.name);
 
-private:
-    Instruction GetOpcode(WORD instruction)
+            return static_cast<WORD>(address);
+        case Fixup::Kind::High:
+            return static_cast<WORD>(address >> 16) & 0xFFFF;
+        case Fixup::Kind::Low:
+            return static_cast<WORD>(address) & 0xFFFF;
+        }
+        return 0;
+    }
+
+    Instruction ParseMnemonics(const std::string& mnemonics)
     {
-        return static_cast<Instruction>(instruction >> 26);
+        Instruction res;
+        if (!FindMnemonic(mnemonics, res))
+            throw std::runtime_error(std::string("Invalid mnemonics: ") + mnemonics);
+
+        return res;
     }
 
-    Register GetR1(WORD instruction)
+    // Any register, system ones included: a guest sets up VB, TIMER and PTB and reads
+    // ECAUSE, EADDR and EIP with plain instructions
+    Register ParseRegister(const std::string& reg)
     {
-        return static_cast<Register>((instruction >> 21) && 0x1F);
+        Register res;
+        if (!FindRegister(reg, res))
+            throw std::runtime_error(std::string("Invalid register: ") + reg);
+
+        return res;
     }
 
-    Register GetR2(WORD instruction)
+    // "R1,R4,RA" to the imm16 register list of PUSHM/POPM
+    uint16_t ParseRegisterList(const std::string& list)
     {
-        return static_cast<Register>((instruction >> 16) && 0x1F);
+        uint16_t res = 0;
+        size_t start = 0;
+        while (start <= list.size())
+        {
+            size_t end = list.find(',', start);
+            if (end == std::string::npos)
+                end = list.size();
+
+            WORD bit = RegisterBit(ParseRegister(list.substr(start, end - start)));
+            if ((bit & REGISTER_LIST) == 0 || (res & bit) != 0)
+                throw std::runtime_error(std::string("Invalid register list: ") + list);
+
+            res |= static_cast<uint16_t>(bit);
+            start = end + 1;
+        }
+
+        return res;
     }
 
-    Register GetR3(WORD instruction)
+    // A number, or %hi:label / %lo:label for the halves of an address
+    uint16_t ParseImmediate16(const std::string& imm)
     {
-        return static_cast<Register>((instruction >> 11) && 0x1F);
+        if (imm.compare(0, 4, "%hi:") == 0)
+            return static_cast<uint16_t>(Reference(Fixup::Kind::High, imm.substr(4)));
+        if (imm.compare(0, 4, "%lo:") == 0)
+            return static_cast<uint16_t>(Reference(Fixup::Kind::Low, imm.substr(4)));
+
+        return static_cast<uint16_t>(Image::ParseValue(imm, sizeof(HWORD)));
     }
 
-    uint16_t GetImm16(WORD instruction)
+    // [R2], [R2+4], [R2-4], [R2+R3], [R2+R3<<2], [R2],4 and [R2],-4
+    WORD ParseAddress(WORD word, const std::string& address)
     {
-        return static_cast<uint16_t>(instruction && 0xFFFF);
+        size_t close = address.find(']');
+        size_t sign = address.find_first_of("+-");
+        if (address.empty() || address[0] != '[' || close == std::string::npos)
+            throw std::runtime_error(std::string("Invalid address: ") + address);
+
+        size_t end = std::min(sign, close);
+        word |= static_cast<WORD>(ParseRegister(address.substr(1, end - 1))) << 16;
+
+        if (close + 1 < address.size())
+            return word | AddressPostIncrement(ParseOffset(address.substr(close + 2)));
+        if (sign > close)
+            return word | AddressOffset(0);
+
+        std::string rest = address.substr(sign + 1, close - sign - 1);
+        if (address[sign] == '-' || ::isdigit(static_cast<unsigned char>(rest[0])))
+            return word | AddressOffset(ParseOffset(address.substr(sign, close - sign)));
+
+        size_t shift = rest.find("<<");
+        WORD amount = shift == std::string::npos ? 0 : static_cast<WORD>(Image::ParseNumber(rest.substr(shift + 2)));
+        if (amount > 3)
+            throw std::runtime_error(std::string("Invalid address: ") + address);
+
+        return word | AddressIndexed(ParseRegister(rest.substr(0, shift)), amount);
     }
 
-    uint32_t GetImm26(WORD instruction)
+    // 14 bit signed
+    static int32_t ParseOffset(const std::string& text)
     {
-        return static_cast<uint16_t>(instruction && 0x3FFFFFF);
+        int64_t offset = Image::ParseSigned(text[0] == '+' ? text.substr(1) : text);
+        if (offset < -(1 << 13) || offset >= (1 << 13))
+            throw std::runtime_error(std::string("Address offset out of range: ") + text);
+
+        return static_cast<int32_t>(offset);
     }
 
+    Image&                                              _image;
+    std::unique_ptr<CodeLayout>                         _layout;
+    std::unordered_map<std::string, Symbol>             _symbols;
+    std::unordered_map<std::string, std::vector<Fixup>> _pending;
 };
@@ -0,0 +1,675 @@
+#pragma once
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "isa.h"
+
+//  Assembler output, a flat image. Sections are laid out in Section order: .text at
+//  address 0, every following section aligned to the largest .align used in it. .bss
+//  comes last and is not written, whoever loads the image clears it.
+//
+//  A section is a list of chunks in address order: bytes emitted by instructions and
+//  data directives, zero fill from .space, .align and .org, and files pulled in by
+//  .incbin. Zero fill is only a length and included files stay mapped until copied,
+//  so neither costs memory. The writer seeks over zero fill and copies included files
+//  file to file inside the kernel where it can, from their mapping where it can't.
+//
+//  Only the newest WINDOW bytes of a section stay in memory. Once a section holds more
+//  its chunks are written out to a spool, an unlinked temporary file, and the window
+//  starts over, so memory stays bounded however long the input is. Patch reaches words
+//  in both. Included files are not spooled but left as holes in it and kept mapped,
+//  up to FILES of them a section. The output is the spools, the files in their holes
+//  and the windows copied one after another.
+
+// Read only mapping of a whole file, the descriptor stays open for in kernel copies
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path)
+    {
+        _fd = ::open(path.c_str(), O_RDONLY);
+        if (_fd < 0)
+            throw std::runtime_error(path + ": " + ::strerror(errno));
+
+        struct stat st;
+        if (::fstat(_fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            ::close(_fd);
+            throw std::runtime_error(path + ": not a regular file");
+        }
+
+        _size = static_cast<size_t>(st.st_size);
+        if (_size != 0)
+        {
+            void* data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+            if (data == MAP_FAILED)
+            {
+                ::close(_fd);
+                throw std::runtime_error(path + ": " + ::strerror(errno));
+            }
+
+            ::madvise(data, _size, MADV_SEQUENTIAL);
+            _data = static_cast<const BYTE*>(data);
+        }
+    }
+
+    ~MappedFile()
+    {
+        if (_data)
+            ::munmap(const_cast<BYTE*>(_data), _size);
+        ::close(_fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    int Descriptor() const { return _fd; }
+    const BYTE* Data() const { return _data; }
+    size_t Size() const { return _size; }
+
+private:
+    int         _fd{ -1 };
+    const BYTE* _data{ nullptr };
+    size_t      _size{ 0 };
+};
+
+// Sequential writer that turns zero fill into holes when the output can seek
+class OutputFile
+{
+public:
+    explicit OutputFile(const std::string& path)
+    {
+        _fd = path == "-" ? STDOUT_FILENO : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (_fd < 0)
+            throw std::runtime_error(path + ": " + ::strerror(errno));
+
+        struct stat st;
+        _seekable = ::fstat(_fd, &st) == 0 && S_ISREG(st.st_mode);
+        _owned = _fd != STDOUT_FILENO;
+    }
+
+    ~OutputFile()
+    {
+        if (_owned)
+            ::close(_fd);
+    }
+
+    // Unlinked file in $TMPDIR, gone once closed
+    static std::unique_ptr<OutputFile> Temporary()
+    {
+        const char* dir = ::getenv("TMPDIR");
+        std::string path = std::string(dir && *dir ? dir : "/tmp") + "/as.XXXXXX";
+        int fd = ::mkstemp(&path[0]);
+        if (fd < 0)
+            throw std::runtime_error(path + ": " + ::strerror(errno));
+
+        ::unlink(path.c_str());
+        return std::unique_ptr<OutputFile>(new OutputFile(fd));
+    }
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    int Descriptor() const { return _fd; }
+    uint64_t Position() const { return _position + _zeros; }
+    uint64_t Written() const { return _position; }
+
+    void Write(const void* data, size_t size)
+    {
+        FlushZeros();
+
+        const BYTE* p = static_cast<const BYTE*>(data);
+        while (size != 0)
+        {
+            ssize_t n = ::write(_fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error(std::string("write: ") + ::strerror(errno));
+
+            p += n;
+            size -= static_cast<size_t>(n);
+            _position += static_cast<uint64_t>(n);
+        }
+    }
+
+    void Zero(uint64_t size)
+    {
+        _zeros += size;
+    }
+
+    void Copy(const MappedFile& file)
+    {
+        size_t done = CopyRange(file.Descriptor(), file.Size());
+        Write(file.Data() + done, file.Size() - done);
+    }
+
+    // size bytes of another file from offset from, read without moving its position
+    void Copy(int fd, uint64_t size, uint64_t from = 0)
+    {
+        uint64_t done = CopyRange(fd, size, from);
+
+        std::vector<BYTE> buffer(static_cast<size_t>(std::min<uint64_t>(size - done, 1 << 20)));
+        while (done < size)
+        {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(size - done, buffer.size()));
+            ssize_t n = ::pread(fd, buffer.data(), want, static_cast<off_t>(from + done));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error(std::string("read: ") + ::strerror(errno));
+
+            Write(buffer.data(), static_cast<size_t>(n));
+            done += static_cast<uint64_t>(n);
+        }
+    }
+
+    // Trailing zero fill only extends the file
+    void Finish()
+    {
+        if (_zeros != 0 && _seekable)
+        {
+            if (::ftruncate(_fd, static_cast<off_t>(_position + _zeros)) != 0)
+                throw std::runtime_error(std::string("ftruncate: ") + ::strerror(errno));
+
+            _position += _zeros;
+            _zeros = 0;
+        }
+
+        FlushZeros();
+    }
+
+private:
+    explicit OutputFile(int fd):
+    _fd(fd),
+    _owned(true),
+    _seekable(true)
+    {
+    }
+
+    // In kernel file to file copy from offset from, returns how much it managed. Falls
+    // back for pipes, across file systems and on old kernels.
+    uint64_t CopyRange(int fd, uint64_t size, uint64_t from = 0)
+    {
+        FlushZeros();
+
+        uint64_t done = 0;
+#if defined(__linux__)
+        if (_seekable)
+        {
+            off_t in = static_cast<off_t>(from);
+            while (done < size)
+            {
+                ssize_t n = ::copy_file_range(fd, &in, _fd, nullptr, static_cast<size_t>(size - done), 0);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+
+                done += static_cast<uint64_t>(n);
+                _position += static_cast<uint64_t>(n);
+            }
+        }
+#endif
+        return done;
+    }
+
+    void FlushZeros()
+    {
+        if (_zeros == 0)
+            return;
+
+        if (_seekable)
+        {
+            if (::lseek(_fd, static_cast<off_t>(_zeros), SEEK_CUR) < 0)
+                throw std::runtime_error(std::string("lseek: ") + ::strerror(errno));
+
+            _position += _zeros;
+            _zeros = 0;
+            return;
+        }
+
+        static const BYTE zeros[64 * 1024] = {};
+        uint64_t left = _zeros;
+        _zeros = 0;
+        while (left != 0)
+        {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(left, sizeof(zeros)));
+            Write(zeros, n);
+            left -= n;
+        }
+    }
+
+    int         _fd{ -1 };
+    bool        _owned{ false };
+    bool        _seekable{ false };
+    uint64_t    _position{ 0 };
+    uint64_t    _zeros{ 0 };
+};
+
+struct Chunk
+{
+    enum class Kind : BYTE { Bytes, Zero, File };
+
+    Kind                        kind{ Kind::Bytes };
+    uint64_t                    offset{ 0 };        // from the section start
+    uint64_t                    size{ 0 };
+    std::vector<BYTE>           bytes;
+    std::shared_ptr<MappedFile> file;
+};
+
+class SectionImage
+{
+public:
+    static constexpr uint64_t MAX_SIZE = uint64_t{ 1 } << 32;
+
+    // Bytes a section keeps in memory before it spills
+    static constexpr uint64_t WINDOW = 1 << 20;
+
+    // Included files a section keeps mapped, more get spooled so descriptors don't run out
+    static constexpr size_t FILES = 128;
+
+    explicit SectionImage(bool zero_only = false):
+    _zero_only(zero_only)
+    {
+    }
+
+    uint64_t Size() const { return _location; }
+    WORD Alignment() const { return _alignment; }
+
+    void Emit(const void* data, size_t size)
+    {
+        if (_zero_only)
+            throw std::runtime_error("only zero fill is allowed in .bss");
+        if (size == 0)
+            return;
+
+        Grow(size);
+        if (_chunks.empty() || _chunks.back().kind != Chunk::Kind::Bytes)
+            Start(Chunk::Kind::Bytes);
+
+        Chunk& chunk = _chunks.back();
+        const BYTE* p = static_cast<const BYTE*>(data);
+        chunk.bytes.insert(chunk.bytes.end(), p, p + size);
+        chunk.size += size;
+        _location += size;
+        Slide(size);
+    }
+
+    void Fill(uint64_t size)
+    {
+        if (size == 0)
+            return;
+
+        Grow(size);
+        if (_chunks.empty() || _chunks.back().kind != Chunk::Kind::Zero)
+            Start(Chunk::Kind::Zero);
+
+        _chunks.back().size += size;
+        _location += size;
+        Slide(0);
+    }
+
+    void Include(std::shared_ptr<MappedFile> file)
+    {
+        if (_zero_only)
+            throw std::runtime_error("only zero fill is allowed in .bss");
+        if (file->Size() == 0)
+            return;
+
+        Grow(file->Size());
+        uint64_t size = file->Size();
+        Start(Chunk::Kind::File);
+        _chunks.back().size = size;
+        _chunks.back().file = std::move(file);
+        _location += size;
+        ++_mapped;
+        Slide(0);
+    }
+
+    // Power of two boundary, relative to the section start
+    void Align(uint64_t boundary)
+    {
+        if (boundary == 0 || (boundary & (boundary - 1)) != 0 || boundary > MAX_SIZE / 2)
+            throw std::runtime_error("alignment must be a power of two: " + std::to_string(boundary));
+
+        _alignment = std::max(_alignment, static_cast<WORD>(boundary));
+        Fill((boundary - (_location & (boundary - 1))) & (boundary - 1));
+    }
+
+    void Org(uint64_t offset)
+    {
+        if (offset < _location)
+            throw std::runtime_error(".org cannot move backwards to " + std::to_string(offset));
+
+        Fill(offset - _location);
+    }
+
+    // Ors bits into an emitted word, still in the window or already spilled
+    void Patch(uint64_t offset, WORD bits)
+    {
+        if (offset >= _spilled)
+        {
+            auto it = std::upper_bound(_chunks.begin(), _chunks.end(), offset,
+                [](uint64_t o, const Chunk& chunk) { return o < chunk.offset; });
+            Chunk& chunk = *--it;
+            BYTE* p = chunk.bytes.data() + (offset - chunk.offset);
+
+            WORD word;
+            ::memcpy(&word, p, sizeof(WORD));
+            word |= bits;
+            ::memcpy(p, &word, sizeof(WORD));
+            return;
+        }
+
+        WORD word;
+        off_t at = static_cast<off_t>(offset);
+        if (::pread(_spool->Descriptor(), &word, sizeof(WORD), at) != sizeof(WORD))
+            throw std::runtime_error(std::string("spool read: ") + ::strerror(errno));
+
+        word |= bits;
+        if (::pwrite(_spool->Descriptor(), &word, sizeof(WORD), at) != sizeof(WORD))
+            throw std::runtime_error(std::string("spool write: ") + ::strerror(errno));
+    }
+
+    void Write(OutputFile& out, uint64_t base) const
+    {
+        out.Zero(base - out.Position());
+        uint64_t from = 0;
+        for (const Chunk& chunk : _files)
+        {
+            Unspool(out, from, chunk.offset);
+            out.Copy(*chunk.file);
+            from = chunk.offset + chunk.size;
+        }
+        Unspool(out, from, _spilled);
+
+        for (const Chunk& chunk : _chunks)
+        {
+            out.Zero(base + chunk.offset - out.Position());
+            switch (chunk.kind)
+            {
+            case Chunk::Kind::Bytes:    out.Write(chunk.bytes.data(), chunk.bytes.size());  break;
+            case Chunk::Kind::File:     out.Copy(*chunk.file);                              break;
+            case Chunk::Kind::Zero:     out.Zero(chunk.size);                               break;
+            }
+        }
+        out.Zero(base + _location - out.Position());
+    }
+
+private:
+    void Grow(uint64_t size)
+    {
+        if (size > MAX_SIZE - _location)
+            throw std::runtime_error("section larger than 4 GiB");
+    }
+
+    void Start(Chunk::Kind kind)
+    {
+        _chunks.push_back(Chunk{ kind, _location, 0, {}, {} });
+        _held += sizeof(Chunk);
+    }
+
+    void Slide(uint64_t size)
+    {
+        _held += size;
+        if (_held > WINDOW || _mapped > FILES)
+            Spill();
+    }
+
+    void Spill()
+    {
+        if (!_spool)
+            _spool = OutputFile::Temporary();
+
+        for (const Chunk& chunk : _chunks)
+        {
+            _spool->Zero(chunk.offset - _spool->Position());
+            switch (chunk.kind)
+            {
+            case Chunk::Kind::Bytes:    _spool->Write(chunk.bytes.data(), chunk.bytes.size());  break;
+            case Chunk::Kind::Zero:     _spool->Zero(chunk.size);                               break;
+            case Chunk::Kind::File:
+                if (_files.size() < FILES)
+                {
+                    _spool->Zero(chunk.size);
+                    _files.push_back(chunk);
+                }
+                else
+                    _spool->Copy(*chunk.file);
+                break;
+            }
+        }
+
+        _chunks.clear();
+        _spilled = _location;
+        _held = 0;
+        _mapped = _files.size();
+    }
+
+    // Spooled section offsets from up to to, zero past what the spool got
+    void Unspool(OutputFile& out, uint64_t from, uint64_t to) const
+    {
+        uint64_t written = _spool ? std::min(to, std::max(from, _spool->Written())) : from;
+        if (written != from)
+            out.Copy(_spool->Descriptor(), written - from, from);
+        out.Zero(to - written);
+    }
+
+    std::vector<Chunk>          _chunks;            // from _spilled on
+    std::unique_ptr<OutputFile> _spool;             // up to _spilled
+    std::vector<Chunk>          _files;             // included below _spilled, holes in the spool
+    uint64_t                    _spilled{ 0 };
+    uint64_t                    _held{ 0 };
+    size_t                      _mapped{ 0 };       // File chunks in _chunks and _files
+    uint64_t                    _location{ 0 };
+    WORD                        _alignment{ sizeof(WORD) };
+    bool                        _zero_only{ false };
+};
+
+class Image
+{
+public:
+    static constexpr size_t SECTIONS = static_cast<size_t>(Section::BSS) + 1;
+
+    Section CurrentSection() const { return _current; }
+    SectionImage& Current() { return Get(_current); }
+    SectionImage& Get(Section section) { return _sections[static_cast<size_t>(section)]; }
+    const SectionImage& Get(Section section) const { return _sections[static_cast<size_t>(section)]; }
+
+    void Switch(Section section)
+    {
+        _current = section;
+    }
+
+    //  ===================== DIRECTIVES ======================
+    //  Operands come as the parser's text, lists joined by commas.
+
+    // .byte, .hword and .word, width in bytes
+    void Data(WORD width, const std::string& values)
+    {
+        std::vector<BYTE> bytes;
+        size_t start = 0;
+        while (start <= values.size())
+        {
+            size_t end = values.find(',', start);
+            if (end == std::string::npos)
+                end = values.size();
+
+            uint64_t value = ParseValue(values.substr(start, end - start), width);
+            for (WORD i = 0; i < width; ++i)
+                bytes.push_back(static_cast<BYTE>(value >> (8 * i)));
+
+            start = end + 1;
+        }
+
+        Current().Emit(bytes.data(), bytes.size());
+    }
+
+    // .ascii and .asciz, text as written between the quotes
+    void Ascii(const std::string& text, bool terminate)
+    {
+        std::string bytes = Unescape(text);
+        if (terminate)
+            bytes.push_back('\0');
+
+        Current().Emit(bytes.data(), bytes.size());
+    }
+
+    void Space(const std::string& size)
+    {
+        Current().Fill(ParseNumber(size));
+    }
+
+    void Align(const std::string& boundary)
+    {
+        Current().Align(ParseNumber(boundary));
+    }
+
+    void Org(const std::string& offset)
+    {
+        Current().Org(ParseNumber(offset));
+    }
+
+    void IncludeBinary(const std::string& path)
+    {
+        Current().Include(std::make_shared<MappedFile>(Unescape(path)));
+    }
+
+    //  ======================= OUTPUT ========================
+
+    // Start address of every section
+    std::array<uint64_t, SECTIONS> Layout() const
+    {
+        std::array<uint64_t, SECTIONS> bases{};
+        uint64_t end = 0;
+        for (size_t s = 0; s < SECTIONS; ++s)
+        {
+            WORD alignment = _sections[s].Alignment();
+            bases[s] = (end + alignment - 1) & ~uint64_t{ alignment - 1 };
+            end = bases[s] + _sections[s].Size();
+        }
+
+        if (end > SectionImage::MAX_SIZE)
+            throw std::runtime_error("image larger than 4 GiB");
+
+        return bases;
+    }
+
+    void Write(OutputFile& out) const
+    {
+        std::array<uint64_t, SECTIONS> bases = Layout();
+        for (size_t s = 0; s < static_cast<size_t>(Section::BSS); ++s)
+            _sections[s].Write(out, bases[s]);
+
+        out.Finish();
+    }
+
+    void Write(const std::string& path) const
+    {
+        OutputFile out(path);
+        Write(out);
+    }
+
+    //  ======================= PARSING =======================
+
+    // Decimal or 0x hex, optionally negative
+    static int64_t ParseSigned(const std::string& text)
+    {
+        bool negative = !text.empty() && text[0] == '-';
+        std::string digits = negative ? text.substr(1) : text;
+        bool hex = digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X');
+
+        size_t used = 0;
+        uint64_t value = 0;
+        try
+        {
+            value = std::stoull(hex ? digits.substr(2) : digits, &used, hex ? 16 : 10);
+        }
+        catch (const std::exception&)
+        {
+            used = 0;
+        }
+
+        if (used == 0 || used != digits.size() - (hex ? 2 : 0) || value > SectionImage::MAX_SIZE)
+            throw std::runtime_error("Invalid number: " + text);
+
+        return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+    }
+
+    static uint64_t ParseNumber(const std::string& text)
+    {
+        int64_t value = ParseSigned(text);
+        if (value < 0)
+            throw std::runtime_error("Invalid size: " + text);
+
+        return static_cast<uint64_t>(value);
+    }
+
+    // Signed or unsigned, has to fit width bytes
+    static uint64_t ParseValue(const std::string& text, WORD width)
+    {
+        int64_t value = ParseSigned(text);
+        int64_t bits = 8 * static_cast<int64_t>(width);
+        if (value < -(int64_t{ 1 } << (bits - 1)) || value >= (int64_t{ 1 } << bits))
+            throw std::runtime_error("Value does not fit " + std::to_string(width) + " bytes: " + text);
+
+        return static_cast<uint64_t>(value);
+    }
+
+    // \n \t \r \0 \\ \" and \xHH
+    static std::string Unescape(const std::string& text)
+    {
+        std::string res;
+        res.reserve(text.size());
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            if (text[i] != '\\' || i + 1 == text.size())
+            {
+                res.push_back(text[i]);
+                continue;
+            }
+
+            char c = text[++i];
+            switch (c)
+            {
+            case 'n':   res.push_back('\n');    break;
+            case 't':   res.push_back('\t');    break;
+            case 'r':   res.push_back('\r');    break;
+            case '0':   res.push_back('\0');    break;
+            case 'x':
+            {
+                size_t used = 0;
+                std::string hex = text.substr(i + 1, 2);
+                int value = hex.empty() || !::isxdigit(static_cast<unsigned char>(hex[0])) ? -1 : std::stoi(hex, &used, 16);
+                if (value < 0)
+                    throw std::runtime_error("Invalid escape in: " + text);
+
+                res.push_back(static_cast<char>(value));
+                i += used;
+                break;
+            }
+            default:    res.push_back(c);       break;
+            }
+        }
+        return res;
+    }
+
+private:
+    std::array<SectionImage, SECTIONS> _sections{ SectionImage{}, SectionImage{}, SectionImage{}, SectionImage{ true } };
+    Section _current{ Section::TEXT };
+};
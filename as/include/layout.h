@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "isa.h"
+#include "encoding.h"
+#include "image.h"
+
+//  Profile guided layout of .text. The instructions and labels of .text are held back
+//  instead of encoded, split into basic blocks and given back in a new order once the
+//  whole program is read:
+//
+//  - Blocks that run one after the other are chained, the heaviest edge first, so the
+//    common direction of every forward branch falls through. A conditional branch whose
+//    taken side ends up next is inverted, one whose neither side does gets a B behind
+//    it, and a B or J to the block that ends up next is dropped.
+//  - The chain starting at the first block stays at address 0, then come the other
+//    chains that ran, hottest first, then the ones that never ran in source order.
+//
+//  Block counts come from a profile of the same source assembled without one, see
+//  BlockProfile in cpu/include/core_features.h, so a block is found by the address it
+//  had there. Edge weights are guessed from them: a branch to a block is taken at most
+//  as often as either of the two ran.
+//
+//  Code only moves as a whole block and every reference is to a label, so .text has to
+//  hold instructions and labels only, and branches can't take numeric targets.
+
+// Times every block ran, by start address. "address count" lines, as BlockProfile writes.
+class Profile
+{
+public:
+    Profile() = default;
+
+    static Profile Load(const std::string& path)
+    {
+        std::ifstream file(path);
+        if (!file)
+            throw std::runtime_error("Can't read profile " + path);
+
+        Profile profile;
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::istringstream fields(line);
+            std::string address, count;
+            if (!(fields >> address))
+                continue;
+
+            size_t used = 0;
+            try
+            {
+                fields >> count;
+                profile._counts[Image::ParseNumber(address)] += std::stoull(count, &used);
+            }
+            catch (const std::exception&)
+            {
+                used = 0;
+            }
+
+            if (used == 0 || used != count.size())
+                throw std::runtime_error("Invalid profile line: " + line);
+        }
+
+        return profile;
+    }
+
+    uint64_t Count(uint64_t address) const
+    {
+        auto it = _counts.find(address);
+        return it == _counts.end() ? 0 : it->second;
+    }
+
+private:
+    std::unordered_map<uint64_t, uint64_t> _counts;
+};
+
+// Operands as the parser has them, a label when there is no mnemonic
+struct Statement
+{
+    std::string mnemonic;
+    std::string op1;
+    std::string op2;
+    std::string op3;
+};
+
+class CodeLayout
+{
+public:
+    explicit CodeLayout(Profile profile):
+    _profile(std::move(profile))
+    {
+    }
+
+    void Label(const std::string& name)
+    {
+        if (_blocks.empty() || !_blocks.back().code.empty())
+            Start();
+
+        if (!_labels.emplace(name, _blocks.size() - 1).second)
+            throw std::runtime_error(std::string("Duplicate label: ") + name);
+        _blocks.back().labels.push_back(name);
+    }
+
+    void Emit(const std::string& mnemonic, const std::string& op1, const std::string& op2, const std::string& op3)
+    {
+        Instruction op;
+        if (!FindMnemonic(mnemonic, op))
+            throw std::runtime_error(std::string("Invalid mnemonics: ") + mnemonic);
+        if (GetInstructionType(op) == InstructionType::OP_J && !op1.empty() && ::isdigit(static_cast<unsigned char>(op1[0])))
+            throw std::runtime_error(std::string("Numeric target can't be laid out: ") + op1);
+
+        if (_blocks.empty() || _blocks.back().flow != Flow::Next)
+            Start();
+
+        Block& block = _blocks.back();
+        block.code.push_back(Statement{ mnemonic, op1, op2, op3 });
+        block.flow = FlowOf(op);
+        _address += sizeof(WORD);
+    }
+
+    // The held back code in its new order, labels included
+    std::vector<Statement> Order()
+    {
+        if (_blocks.empty())
+            return {};
+
+        // Whatever falls off the end of .text still has to, after the last block
+        Start();
+        size_t end = _blocks.size() - 1;
+
+        for (size_t i = 0; i < _blocks.size(); ++i)
+        {
+            _blocks[i].count = _profile.Count(_blocks[i].address);
+            if (i != 0 && _blocks[i - 1].flow == Flow::Next)
+                _blocks[i].count += _blocks[i - 1].count;
+        }
+
+        std::vector<std::vector<size_t>> chains(_blocks.size());
+        std::vector<size_t> chain_of(_blocks.size());
+        for (size_t i = 0; i < _blocks.size(); ++i)
+        {
+            chains[i].push_back(i);
+            chain_of[i] = i;
+        }
+
+        for (const Edge& edge : Edges())
+        {
+            size_t from = chain_of[edge.from];
+            size_t to = chain_of[edge.to];
+            if (edge.weight == 0 || from == to || edge.to == 0 || edge.to == end ||
+                chains[from].back() != edge.from || chains[to].front() != edge.to)
+                continue;
+
+            for (size_t block : chains[to])
+                chain_of[block] = from;
+            chains[from].insert(chains[from].end(), chains[to].begin(), chains[to].end());
+            chains[to].clear();
+        }
+
+        std::vector<size_t> hot, cold;
+        for (size_t c = 1; c < chains.size(); ++c)
+        {
+            if (chains[c].empty() || c == end)
+                continue;
+            (Heat(chains[c]) != 0 ? hot : cold).push_back(c);
+        }
+        std::stable_sort(hot.begin(), hot.end(), [&](size_t a, size_t b) { return Heat(chains[a]) > Heat(chains[b]); });
+
+        std::vector<size_t> order = chains[0];
+        for (const std::vector<size_t>* group : { &hot, &cold })
+        {
+            for (size_t c : *group)
+                order.insert(order.end(), chains[c].begin(), chains[c].end());
+        }
+        order.push_back(end);
+
+        std::vector<Statement> res;
+        for (size_t k = 0; k < order.size(); ++k)
+            Place(order[k], k + 1 < order.size() ? order[k + 1] : NONE, res);
+        return res;
+    }
+
+private:
+    static constexpr size_t NONE = ~size_t{ 0 };
+
+    enum class Flow : BYTE
+    {
+        Next = 0,   // falls through
+        Branch,     // conditional branch, falls through or goes to its target
+        Jump,       // B or J, goes to its target
+        Stop        // JR, RET, RETI or HALT, goes nowhere it can be told
+    };
+
+    struct Block
+    {
+        std::vector<std::string>    labels;
+        std::vector<Statement>      code;
+        uint64_t                    address{ 0 };   // without layout
+        uint64_t                    count{ 0 };
+        Flow                        flow{ Flow::Next };
+    };
+
+    struct Edge
+    {
+        size_t      from;
+        size_t      to;
+        uint64_t    weight;
+    };
+
+    static Flow FlowOf(Instruction op)
+    {
+        switch (op)
+        {
+        case Instruction::B:    case Instruction::J:
+            return Flow::Jump;
+        case Instruction::BEQ:  case Instruction::BNE:  case Instruction::BGT:  case Instruction::BGE:
+        case Instruction::BLT:  case Instruction::BLE:
+            return Flow::Branch;
+        case Instruction::JR:   case Instruction::RET:  case Instruction::RETI: case Instruction::HALT:
+            return Flow::Stop;
+        default:
+            return Flow::Next;
+        }
+    }
+
+    static const char* Inverse(const std::string& branch)
+    {
+        static const char* const PAIRS[][2] = {
+            { "BEQ", "BNE" }, { "BNE", "BEQ" }, { "BGT", "BLE" },
+            { "BLE", "BGT" }, { "BGE", "BLT" }, { "BLT", "BGE" },
+        };
+
+        for (const auto& pair : PAIRS)
+        {
+            if (branch == pair[0])
+                return pair[1];
+        }
+        throw std::runtime_error("Not a conditional branch: " + branch);
+    }
+
+    void Start()
+    {
+        Block block;
+        block.address = _address;
+        _blocks.push_back(std::move(block));
+    }
+
+    // Block a B, Bcc or J goes to, NONE for labels outside .text
+    size_t Target(const Block& block) const
+    {
+        auto it = _labels.find(block.code.back().op1);
+        return it == _labels.end() ? NONE : it->second;
+    }
+
+    std::string Name(size_t block) const
+    {
+        return _blocks[block].labels.empty() ? "@" + std::to_string(block) : _blocks[block].labels.front();
+    }
+
+    uint64_t Heat(const std::vector<size_t>& chain) const
+    {
+        uint64_t heat = 0;
+        for (size_t block : chain)
+            heat = std::max(heat, _blocks[block].count);
+        return heat;
+    }
+
+    // Heaviest first, in source order among equals. Back edges are left out: chaining one
+    // would rotate its loop, which costs a branch into it and gains nothing inside.
+    std::vector<Edge> Edges() const
+    {
+        std::vector<Edge> edges;
+        for (size_t i = 0; i + 1 < _blocks.size(); ++i)
+        {
+            const Block& block = _blocks[i];
+            size_t target = block.flow == Flow::Branch || block.flow == Flow::Jump ? Target(block) : NONE;
+
+            if (block.flow == Flow::Next)
+                edges.push_back(Edge{ i, i + 1, block.count });
+            if (block.flow == Flow::Branch)
+                edges.push_back(Edge{ i, i + 1, std::min(block.count, _blocks[i + 1].count) });
+            if (target != NONE && target > i)
+                edges.push_back(Edge{ i, target, block.flow == Flow::Jump ? block.count : std::min(block.count, _blocks[target].count) });
+        }
+
+        std::stable_sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) { return a.weight > b.weight; });
+        return edges;
+    }
+
+    // The block's labels and code with its end fixed up for the block placed after it
+    void Place(size_t index, size_t next, std::vector<Statement>& out) const
+    {
+        const Block& block = _blocks[index];
+        if (block.labels.empty())
+            out.push_back(Statement{ {}, Name(index), {}, {} });
+        for (const std::string& label : block.labels)
+            out.push_back(Statement{ {}, label, {}, {} });
+
+        out.insert(out.end(), block.code.begin(), block.code.end());
+        size_t follower = index + 1;
+        switch (block.flow)
+        {
+        case Flow::Next:
+            if (follower < _blocks.size() && follower != next)
+                out.push_back(Statement{ "B", Name(follower), {}, {} });
+            break;
+        case Flow::Branch:
+            if (follower == next)
+                break;
+            if (Target(block) == next)
+            {
+                out.back() = Statement{ Inverse(block.code.back().mnemonic), Name(follower), {}, {} };
+                break;
+            }
+            out.push_back(Statement{ "B", Name(follower), {}, {} });
+            break;
+        case Flow::Jump:
+            if (Target(block) == next)
+                out.pop_back();
+            break;
+        case Flow::Stop:
+            break;
+        }
+    }
+
+    Profile                                     _profile;
+    std::vector<Block>                          _blocks;
+    std::unordered_map<std::string, size_t>     _labels;
+    uint64_t                                    _address{ 0 };
+};
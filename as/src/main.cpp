@@ -1,19 +1,85 @@
-#include <iostream>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
+#include <iostream>
+#include <string>
+
+#include "as.h"
+#include "image.h"
 
 // Bison-generated interface
 int yyparse();
 extern int yydebug;
 
-int main(int argc, char** arcv) {
+// Flex-generated scanner state
+extern FILE* yyin;
+extern int yylineno;
 
-    if (argc > 1 && strcmp(arcv[1], "-d") == 0)
-        yydebug = 1;
+extern Image* g_image;
+extern Assembler* g_assembler;
 
-    if (yyparse() == 0) {
-        std::cout << "Done." << std::endl;
-    } else {
-        std::cout << "Parsing failed." << std::endl;
+//  as [-d] [-p profile] [-o image] [source]
+//
+//  Assembles source, stdin without one, into a flat image, a.bin unless -o names
+//  another file or - for stdout. Lines are encoded as they are read, so a pipe from a
+//  code generator is assembled while it is still being written, in bounded memory.
+//  -p lays .text out by a block profile from cpu --profile, see layout.h, and holds
+//  .text back until the end to do so.
+
+int main(int argc, char** argv) {
+
+    std::string output = "a.bin";
+    std::string profile;
+    const char* source = nullptr;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-d") == 0)
+            yydebug = 1;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            profile = argv[++i];
+        else if (!source && argv[i][0] != '-')
+            source = argv[i];
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [-d] [-p profile] [-o image] [source]" << std::endl;
+            return 2;
+        }
+    }
+
+    if (source && !(yyin = fopen(source, "r")))
+    {
+        std::cerr << source << ": " << strerror(errno) << std::endl;
+        return 1;
     }
+
+    Image image;
+    Assembler assembler(image);
+    g_image = &image;
+    g_assembler = &assembler;
+
+    try
+    {
+        if (!profile.empty())
+            assembler.UseProfile(Profile::Load(profile));
+
+        if (yyparse() != 0) {
+            std::cerr << "Parsing failed." << std::endl;
+            return 1;
+        }
+
+        assembler.Finish();
+        image.Write(output);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << (source ? source : "stdin") << ":" << yylineno << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    if (output != "-")
+        std::cout << "Done." << std::endl;
     return 0;
 }
@@ -13,8 +13,11 @@
 #include "parser.hpp"
 #include "isa.h"
 #include "as.h"
+#include "image.h"
 
 int yylex();
+Image* g_image = nullptr;
+Assembler* g_assembler = nullptr;
 extern char* yytext;
 void yyerror(const char* s) {
     std::cerr << "Parse error: " << s << " at token '" << yytext << "'" << std::endl;
@@ -23,32 +26,38 @@ void yyerror(const char* s) {
 
 // COMMON
 %token REGISTER NUMBER LABEL LOCAL_LABEL COLON
-%token COMMA LBRACK RBRACK LPARAN RPARAN
+%token COMMA LBRACK RBRACK LBRACE RBRACE LPARAN RPARAN PLUS MINUS SHIFT_LEFT
 %token INVALID
 // OPERATORS
 %token HI LO
 // DATA
-%token D_BYTE D_WORD D_HWORD STRING SPACE STR_VALUE
+%token D_BYTE D_WORD D_HWORD STRING STRINGZ SPACE STR_VALUE INCBIN ALIGN ORG
 // SECTIONS
 %token TEXT RODATA DATA BSS
 // VISIBILITY
 %token GLOBL EXTERN
 // ARITHMETIC
-%token ADD ADDI SUB SUBI LUI
+%token ADD ADDI SUB SUBI LUI ADC SBC
+// MULTIPLY/DIVIDE
+%token MUL MULH MULHU DIV DIVU REM
 // SHIFTS
 %token SHL SHLI SHR SHRI
 // LOGICAL
 %token OR ORI AND ANDI XOR XORI NOT
+// PACKED
+%token ADDUSB SUBUSB ADDUSH SUBUSH CMPEQB FFZB SHUFB
 // MEMORY
-%token LB LBU LH LHU LW SB SH SW
+%token LB LBU LH LHU LW SB SH SW MEMCPY MEMSET
 // COMPARE
 %token CMP CMPI
 // BRANCHES
 %token B BEQ BNE BGT BGE BLT BLE 
 // CONTROL FLOW
-%token J JR CALL CALLR RET 
+%token J JR CALL CALLR RET RETI
 // STACK
-%token PUSH POP
+%token PUSH POP PUSHM POPM
+// MISC
+%token HALT WAIT
 
 %%
 program:
@@ -63,123 +72,219 @@ line:
 
 directive:
     TEXT
+        { g_image->Switch(Section::TEXT); }
     | DATA
-        { std::cout << "section data" << std::endl; }
+        { g_image->Switch(Section::DATA); }
     | BSS
-        { std::cout << "section bss" << std::endl; }
+        { g_image->Switch(Section::BSS); }
     | RODATA
-        { std::cout << "section rodata" << std::endl; }
+        { g_image->Switch(Section::RODATA); }
     | GLOBL LABEL
-        { std::cout << "global" << std::endl; }
+        { /* a flat image has no symbol table */ }
     | EXTERN LABEL
-        { std::cout << "exterm" << std::endl; }
-    | D_BYTE NUMBER
-        { std::cout << "byte " << $2 << std::endl; }
-    | D_HWORD NUMBER
-        { std::cout << "hword " << $2 << std::endl; }
-    | D_WORD NUMBER
-        { std::cout << "word " << $2 << std::endl; }
+        { /* nor anything to link against */ }
+    | D_BYTE values
+        { g_image->Data(sizeof(BYTE), $2); }
+    | D_HWORD values
+        { g_image->Data(sizeof(HWORD), $2); }
+    | D_WORD values
+        { g_image->Data(sizeof(WORD), $2); }
     | SPACE NUMBER
-        { std::cout << "space " << $2 << std::endl; }
+        { g_image->Space($2); }
     | STRING STR_VALUE
-        { std::cout << "string: " << $2 << std::endl; }
+        { g_image->Ascii($2, false); }
+    | STRINGZ STR_VALUE
+        { g_image->Ascii($2, true); }
+    | INCBIN STR_VALUE
+        { g_image->IncludeBinary($2); }
+    | ALIGN NUMBER
+        { g_image->Align($2); }
+    | ORG NUMBER
+        { g_image->Org($2); }
+    ;
+
+value:
+    NUMBER
+    | MINUS NUMBER
+        { $$ = "-" + $2; }
+    ;
+
+values:
+    value
+    | values COMMA value
+        { $$ = $1 + "," + $3; }
     ;
 
 label:
-    LABEL COLON
-        { std::cout << "label: " << $1 << std::endl; }
-    | LOCAL_LABEL COLON
-        { std::cout << "local label: " << $1 << std::endl; }
+    symbol COLON
+        { g_assembler->Label($1); }
+    ;
+
+symbol:
+    LABEL
+    | LOCAL_LABEL
+    ;
+
+target:
+    symbol
+    | NUMBER
+    ;
+
+address:
+    LBRACK REGISTER RBRACK
+        { $$ = "[" + $2 + "]"; }
+    | LBRACK REGISTER PLUS NUMBER RBRACK
+        { $$ = "[" + $2 + "+" + $4 + "]"; }
+    | LBRACK REGISTER MINUS NUMBER RBRACK
+        { $$ = "[" + $2 + "-" + $4 + "]"; }
+    | LBRACK REGISTER PLUS REGISTER RBRACK
+        { $$ = "[" + $2 + "+" + $4 + "]"; }
+    | LBRACK REGISTER PLUS REGISTER SHIFT_LEFT NUMBER RBRACK
+        { $$ = "[" + $2 + "+" + $4 + "<<" + $6 + "]"; }
+    | LBRACK REGISTER RBRACK COMMA NUMBER
+        { $$ = "[" + $2 + "]," + $5; }
+    | LBRACK REGISTER RBRACK COMMA MINUS NUMBER
+        { $$ = "[" + $2 + "],-" + $6; }
+    ;
+
+registers:
+    REGISTER
+    | registers COMMA REGISTER
+        { $$ = $1 + "," + $3; }
     ;
 
 imm16: 
     NUMBER
-    | HI LBRACK LABEL RBRACK
-        { std::cout << "%hi[]" << $2 << "]" << std::endl; }
-    | LO LBRACK LABEL RBRACK
-        { std::cout << "%lo[" << $2 << "]" << std::endl; }
+    | HI LBRACK symbol RBRACK
+        { $$ = "%hi:" + $3; }
+    | LO LBRACK symbol RBRACK
+        { $$ = "%lo:" + $3; }
     ;
 
 instruction:
     ADD REGISTER COMMA REGISTER COMMA REGISTER
-        { std::cout << "ADD " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("ADD", $2, $4, $6); }
     | ADDI REGISTER COMMA REGISTER COMMA NUMBER
-        { std::cout << "ADDI " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("ADDI", $2, $4, $6); }
     | SUB REGISTER COMMA REGISTER COMMA REGISTER
-        { std::cout << "SUB " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("SUB", $2, $4, $6); }
     | SUBI REGISTER COMMA REGISTER COMMA NUMBER
-        { std::cout << "SUBI " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("SUBI", $2, $4, $6); }
     | LUI REGISTER COMMA imm16
-        { std::cout << "LUI " << $2 << "," << $4 << std::endl; }
+        { g_assembler->Emit("LUI", $2, $4); }
+    | ADC REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("ADC", $2, $4, $6); }
+    | SBC REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("SBC", $2, $4, $6); }
+    | MUL REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("MUL", $2, $4, $6); }
+    | MULH REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("MULH", $2, $4, $6); }
+    | MULHU REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("MULHU", $2, $4, $6); }
+    | DIV REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("DIV", $2, $4, $6); }
+    | DIVU REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("DIVU", $2, $4, $6); }
+    | REM REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("REM", $2, $4, $6); }
     | SHL REGISTER COMMA REGISTER COMMA REGISTER
-        { std::cout << "SHL " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("SHL", $2, $4, $6); }
     | SHLI REGISTER COMMA REGISTER COMMA NUMBER
-        { std::cout << "SHLI " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("SHLI", $2, $4, $6); }
     | SHR REGISTER COMMA REGISTER COMMA REGISTER
-        { std::cout << "SHR " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("SHR", $2, $4, $6); }
     | SHRI REGISTER COMMA REGISTER COMMA NUMBER
-        { std::cout << "SHRI " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("SHRI", $2, $4, $6); }
     | OR REGISTER COMMA REGISTER COMMA REGISTER
-        { std::cout << "OR " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("OR", $2, $4, $6); }
     | ORI REGISTER COMMA REGISTER COMMA imm16
-        { std::cout << "ORI " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("ORI", $2, $4, $6); }
     | AND REGISTER COMMA REGISTER COMMA REGISTER
-        { std::cout << "AND " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("AND", $2, $4, $6); }
     | ANDI REGISTER COMMA REGISTER COMMA NUMBER
-        { std::cout << "ANDI " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("ANDI", $2, $4, $6); }
     | XOR REGISTER COMMA REGISTER COMMA REGISTER
-        { std::cout << "XOR " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("XOR", $2, $4, $6); }
     | XORI REGISTER COMMA REGISTER COMMA NUMBER
-        { std::cout << "XORI " << $2 << "," << $4 << "," << $6 << std::endl; }
+        { g_assembler->Emit("XORI", $2, $4, $6); }
     | NOT REGISTER COMMA REGISTER
-        { std::cout << "NOT " << $2 << "," << $4 << std::endl; }
-    | LB REGISTER COMMA LBRACK REGISTER RBRACK
-        { std::cout << "LB " << $2 << ",[" << $5 << "]" << std::endl; }
-    | LBU REGISTER COMMA LBRACK REGISTER RBRACK
-        { std::cout << "LBU " << $2 << ",[" << $5 << "]" << std::endl; }
-    | LH REGISTER COMMA LBRACK REGISTER RBRACK
-        { std::cout << "LH " << $2 << ",[" << $5 << "]" << std::endl; }
-    | LHU REGISTER COMMA LBRACK REGISTER RBRACK
-        { std::cout << "LHU " << $2 << ",[" << $5 << "]" << std::endl; }
-    | LW REGISTER COMMA LBRACK REGISTER RBRACK
-        { std::cout << "LW " << $2 << ",[" << $5 << "]" << std::endl; }
-    | SB REGISTER COMMA LBRACK REGISTER RBRACK
-        { std::cout << "SB " << $2 << ",[" << $5 << "]" << std::endl; }
-    | SH REGISTER COMMA LBRACK REGISTER RBRACK
-        { std::cout << "SH " << $2 << ",[" << $5 << "]" << std::endl; }
-    | SW REGISTER COMMA LBRACK REGISTER RBRACK
-        { std::cout << "SW " << $2 << ",[" << $5 << "]" << std::endl; }
+        { g_assembler->Emit("NOT", $2, $4); }
+    | ADDUSB REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("ADDUSB", $2, $4, $6); }
+    | SUBUSB REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("SUBUSB", $2, $4, $6); }
+    | ADDUSH REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("ADDUSH", $2, $4, $6); }
+    | SUBUSH REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("SUBUSH", $2, $4, $6); }
+    | CMPEQB REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("CMPEQB", $2, $4, $6); }
+    | FFZB REGISTER COMMA REGISTER
+        { g_assembler->Emit("FFZB", $2, $4); }
+    | SHUFB REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("SHUFB", $2, $4, $6); }
+    | LB REGISTER COMMA address
+        { g_assembler->Emit("LB", $2, $4); }
+    | LBU REGISTER COMMA address
+        { g_assembler->Emit("LBU", $2, $4); }
+    | LH REGISTER COMMA address
+        { g_assembler->Emit("LH", $2, $4); }
+    | LHU REGISTER COMMA address
+        { g_assembler->Emit("LHU", $2, $4); }
+    | LW REGISTER COMMA address
+        { g_assembler->Emit("LW", $2, $4); }
+    | SB REGISTER COMMA address
+        { g_assembler->Emit("SB", $2, $4); }
+    | SH REGISTER COMMA address
+        { g_assembler->Emit("SH", $2, $4); }
+    | SW REGISTER COMMA address
+        { g_assembler->Emit("SW", $2, $4); }
+    | MEMCPY REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("MEMCPY", $2, $4, $6); }
+    | MEMSET REGISTER COMMA REGISTER COMMA REGISTER
+        { g_assembler->Emit("MEMSET", $2, $4, $6); }
     | CMP REGISTER COMMA REGISTER
-        { std::cout << "CMP " << $2 << "," << $4 << std::endl; }
+        { g_assembler->Emit("CMP", $2, $4); }
     | CMPI REGISTER COMMA NUMBER
-        { std::cout << "CMPI " << $2 << "," << $4 << std::endl; }
-    | B LABEL
-        { std::cout << "B " << $2 << std::endl; }
-    | BEQ LABEL
-        { std::cout << "BEQ " << $2 << std::endl; }
-    | BNE LABEL
-        { std::cout << "BNE " << $2 << std::endl; }
-    | BGT LABEL
-        { std::cout << "BGT " << $2 << std::endl; }
-    | BGE LABEL
-        { std::cout << "BGE " << $2 << std::endl; }
-    | BLT LABEL
-        { std::cout << "BLT " << $2 << std::endl; }
-    | BLE LABEL
-        { std::cout << "BLE " << $2 << std::endl; }
-    | J LABEL
-        { std::cout << "J " << $2 << std::endl; }
+        { g_assembler->Emit("CMPI", $2, $4); }
+    | B target
+        { g_assembler->Emit("B", $2); }
+    | BEQ target
+        { g_assembler->Emit("BEQ", $2); }
+    | BNE target
+        { g_assembler->Emit("BNE", $2); }
+    | BGT target
+        { g_assembler->Emit("BGT", $2); }
+    | BGE target
+        { g_assembler->Emit("BGE", $2); }
+    | BLT target
+        { g_assembler->Emit("BLT", $2); }
+    | BLE target
+        { g_assembler->Emit("BLE", $2); }
+    | J target
+        { g_assembler->Emit("J", $2); }
     | JR REGISTER
-        { std::cout << "JR " << $2 << std::endl; }
-    | CALL LABEL
-        { std::cout << "CALL " << $2 << std::endl; }
+        { g_assembler->Emit("JR", $2); }
+    | CALL target
+        { g_assembler->Emit("CALL", $2); }
     | CALLR REGISTER
-        { std::cout << "CALL " << $2 << std::endl; }
+        { g_assembler->Emit("CALLR", $2); }
     | RET
-        { std::cout << "RET" << std::endl; }
+        { g_assembler->Emit("RET"); }
+    | RETI
+        { g_assembler->Emit("RETI"); }
     | PUSH REGISTER
-        { std::cout << "PUSH " << $2 << std::endl; }
+        { g_assembler->Emit("PUSH", $2); }
     | POP REGISTER
-        { std::cout << "POP " << $2 << std::endl; }
+        { g_assembler->Emit("POP", $2); }
+    | PUSHM LBRACE registers RBRACE
+        { g_assembler->Emit("PUSHM", $3); }
+    | POPM LBRACE registers RBRACE
+        { g_assembler->Emit("POPM", $3); }
+    | HALT
+        { g_assembler->Emit("HALT"); }
+    | WAIT
+        { g_assembler->Emit("WAIT"); }
     ;
 %%
@@ -0,0 +1,520 @@
+#include <chrono>
+#include <cstdio>
+#include <initializer_list>
+
+#include "isa.h"
+#include "encoding.h"
+#include "ram.h"
+#include "core.h"
+#include "lockstep.h"
+
+static void LoadProgram(RAM& ram, WORD addr, std::initializer_list<WORD> program)
+{
+    for (WORD instruction : program)
+    {
+        ram.WriteWord(addr, instruction);
+        addr += sizeof(WORD);
+    }
+}
+
+static void Report(const char* name, uint64_t instructions, std::chrono::steady_clock::duration elapsed)
+{
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::printf("%-24s %12llu instr %8.3f s %8.1f MIPS\n", name,
+                static_cast<unsigned long long>(instructions), seconds, instructions / seconds / 1e6);
+}
+
+// ====================== MEMORY =============================
+
+// Sums a 16 KiB array with LW/ADD, then bumps every element with SW, forever. limited
+// sets limits that are never reached, which leaves the cost of checking them.
+template<typename CoreType>
+static void MemoryLoop(const char* name, bool paged, bool limited = false)
+{
+    static constexpr WORD kArray = 0x10000;
+    static constexpr WORD kWords = 4096;
+    static constexpr WORD kDir   = 0x40000;
+    static constexpr WORD kTable = 0x41000;
+
+    RAM ram{ 0x80000 };
+    CoreType core{ ram };
+
+    LoadProgram(ram, 0, {
+        EncodeImm16(Instruction::LUI,  Register::R5, Register::RZ, kArray >> 16),      // outer:
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::RZ, kWords),
+        Encode(Instruction::LW,   Register::R3, Register::R5),                          // inner:
+        Encode(Instruction::ADD,  Register::R1, Register::R1, Register::R3),
+        EncodeImm16(Instruction::ADDI, Register::R3, Register::R3, 1),
+        Encode(Instruction::SW,   Register::R3, Register::R5),
+        EncodeImm16(Instruction::ADDI, Register::R5, Register::R5, sizeof(WORD)),
+        EncodeImm16(Instruction::SUBI, Register::R2, Register::R2, 1),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-28)),
+        EncodeJ(Instruction::J, 0),
+    });
+
+    if (paged)
+    {
+        // Identity map the first 4 MiB
+        ram.WriteWord(kDir, kTable | Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+        for (WORD page = 0; page < ram.Size() / Mmu::PAGE_SIZE; ++page)
+            ram.WriteWord(kTable + page * sizeof(WORD), (page << Mmu::PAGE_SHIFT) | Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+
+        core.Reg(Register::PTB) = kDir;
+    }
+
+    static constexpr uint64_t kInstructions = 50'000'000;
+
+    if (limited)
+        core.SetLimits(Limits{ 2 * kInstructions, 3'600'000'000'000, 1024 });
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t retired = core.Run(kInstructions);
+    Report(name, retired, std::chrono::steady_clock::now() - start);
+}
+
+// ====================== MULTIPLY ===========================
+
+// Sums i * 0x9E3779B1 for i = kCount..1, with a shift-and-add multiply or with MUL.
+// traced = false runs predecoded blocks only, without hot loop traces.
+static void Multiply(const char* name, bool hardware, bool traced = true)
+{
+    static constexpr WORD kCount = 200'000;
+
+    RAM ram{ 4096 };
+    FlatCore core{ ram };
+    core.SetTracing(traced);
+
+    LoadProgram(ram, 0, {
+        EncodeImm16(Instruction::LUI,  Register::R1, Register::RZ, kCount >> 16),
+        EncodeImm16(Instruction::ORI,  Register::R1, Register::R1, kCount & 0xFFFF),
+        EncodeImm16(Instruction::LUI,  Register::R2, Register::RZ, 0x9E37),
+        EncodeImm16(Instruction::ORI,  Register::R2, Register::R2, 0x79B1),
+    });
+
+    if (hardware)
+    {
+        LoadProgram(ram, 16, {
+            Encode(Instruction::MUL,  Register::R3, Register::R1, Register::R2),           // loop:
+            Encode(Instruction::ADD,  Register::R8, Register::R8, Register::R3),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-16)),
+            Encode(Instruction::HALT),
+        });
+    }
+    else
+    {
+        LoadProgram(ram, 16, {
+            Encode(Instruction::OR,   Register::R4, Register::R1, Register::RZ),           // loop:
+            Encode(Instruction::OR,   Register::R5, Register::R2, Register::RZ),
+            Encode(Instruction::XOR,  Register::R3, Register::R3, Register::R3),
+            EncodeImm16(Instruction::ANDI, Register::R6, Register::R4, 1),                 // bit:
+            EncodeJ(Instruction::BEQ, 4),
+            Encode(Instruction::ADD,  Register::R3, Register::R3, Register::R5),
+            EncodeImm16(Instruction::SHLI, Register::R5, Register::R5, 1),                 // skip:
+            EncodeImm16(Instruction::SHRI, Register::R4, Register::R4, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-24)),
+            Encode(Instruction::ADD,  Register::R8, Register::R8, Register::R3),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-48)),
+            Encode(Instruction::HALT),
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t retired = core.Run(~uint64_t{ 0 });
+    Report(name, retired, std::chrono::steady_clock::now() - start);
+}
+
+// ====================== BYTE SCAN ==========================
+
+// strlen over a 32 KiB string kRounds times, a byte per LBU or four bytes per LW/FFZB
+static void ByteScan(const char* name, bool packed)
+{
+    static constexpr WORD kString = 0x10000;
+    static constexpr WORD kLength = 0x8000;
+    static constexpr WORD kRounds = 200;
+
+    RAM ram{ 0x20000 };
+    FlatCore core{ ram };
+
+    for (WORD i = 0; i < kLength; ++i)
+        ram.WriteByte(kString + i, 'a' + i % 26);
+
+    LoadProgram(ram, 0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, kRounds),
+        EncodeImm16(Instruction::LUI,  Register::R2, Register::RZ, kString >> 16),    // round:
+    });
+
+    if (packed)
+    {
+        LoadProgram(ram, 8, {
+            Encode(Instruction::LW,   Register::R3, Register::R2),                      // scan:
+            EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, sizeof(WORD)),
+            Encode(Instruction::FFZB, Register::R4, Register::R3),
+            EncodeImm16(Instruction::CMPI, Register::R4, Register::RZ, 4),
+            EncodeJ(Instruction::BEQ, static_cast<WORD>(-20)),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-32)),
+            Encode(Instruction::HALT),
+        });
+    }
+    else
+    {
+        LoadProgram(ram, 8, {
+            Encode(Instruction::LBU,  Register::R3, Register::R2),                      // scan:
+            EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, 1),
+            EncodeImm16(Instruction::CMPI, Register::R3, Register::RZ, 0),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-16)),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-28)),
+            Encode(Instruction::HALT),
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t retired = core.Run(~uint64_t{ 0 });
+    Report(name, retired, std::chrono::steady_clock::now() - start);
+}
+
+// ====================== BLOCK COPY =========================
+
+// Copies 64 KiB kRounds times, word by word with LW/SW or with MEMCPY
+static void BlockCopy(const char* name, bool native)
+{
+    static constexpr WORD kSource = 0x10000;
+    static constexpr WORD kDest   = 0x20000;
+    static constexpr WORD kBytes  = 0x10000;
+    static constexpr WORD kRounds = 100;
+
+    RAM ram{ 0x30000 };
+    FlatCore core{ ram };
+
+    for (WORD i = 0; i < kBytes; i += sizeof(WORD))
+        ram.WriteWord(kSource + i, i * 2654435761u);
+
+    LoadProgram(ram, 0, {
+        EncodeImm16(Instruction::ADDI, Register::R5, Register::RZ, kRounds),
+        EncodeImm16(Instruction::LUI,  Register::R1, Register::RZ, kDest >> 16),        // round:
+        EncodeImm16(Instruction::LUI,  Register::R2, Register::RZ, kSource >> 16),
+        EncodeImm16(Instruction::LUI,  Register::R3, Register::RZ, kBytes >> 16),
+    });
+
+    if (native)
+    {
+        LoadProgram(ram, 16, {
+            Encode(Instruction::MEMCPY, Register::R1, Register::R2, Register::R3),
+            EncodeImm16(Instruction::SUBI, Register::R5, Register::R5, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-24)),
+            Encode(Instruction::HALT),
+        });
+    }
+    else
+    {
+        LoadProgram(ram, 16, {
+            Encode(Instruction::LW,   Register::R4, Register::R2),                      // copy:
+            Encode(Instruction::SW,   Register::R4, Register::R1),
+            EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, sizeof(WORD)),
+            EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, sizeof(WORD)),
+            EncodeImm16(Instruction::SUBI, Register::R3, Register::R3, sizeof(WORD)),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-24)),
+            EncodeImm16(Instruction::SUBI, Register::R5, Register::R5, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-44)),
+            Encode(Instruction::HALT),
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t retired = core.Run(~uint64_t{ 0 });
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::printf("%-24s %12llu instr %8.3f s %8.1f MB/s\n", name, static_cast<unsigned long long>(retired),
+                seconds, static_cast<double>(kBytes) * kRounds / seconds / 1e6);
+}
+
+// ====================== VECTOR ADD =========================
+
+// c[i] = a[i] + b[i] over 16 Ki words, kRounds times, with bumped pointers,
+// a scaled index counting down, or post-incremented pointers
+static void VectorAdd(const char* name, AddressMode mode)
+{
+    static constexpr WORD kA      = 0x10000;
+    static constexpr WORD kB      = 0x20000;
+    static constexpr WORD kC      = 0x30000;
+    static constexpr WORD kWords  = 0x4000;
+    static constexpr WORD kRounds = 100;
+
+    RAM ram{ 0x40000 };
+    FlatCore core{ ram };
+
+    for (WORD i = 0; i < kWords; ++i)
+    {
+        ram.WriteWord(kA + i * sizeof(WORD), i);
+        ram.WriteWord(kB + i * sizeof(WORD), i * 2654435761u);
+    }
+
+    LoadProgram(ram, 0, {
+        EncodeImm16(Instruction::ADDI, Register::R5, Register::RZ, kRounds),
+        EncodeImm16(Instruction::LUI,  Register::R1, Register::RZ, kA >> 16),           // round:
+        EncodeImm16(Instruction::LUI,  Register::R2, Register::RZ, kB >> 16),
+        EncodeImm16(Instruction::LUI,  Register::R3, Register::RZ, kC >> 16),
+        EncodeImm16(Instruction::ADDI, Register::R7, Register::RZ, kWords),
+    });
+
+    switch (mode)
+    {
+    case AddressMode::Offset:
+        LoadProgram(ram, 20, {
+            Encode(Instruction::LW,   Register::R4, Register::R1),                      // loop:
+            Encode(Instruction::LW,   Register::R6, Register::R2),
+            Encode(Instruction::ADD,  Register::R6, Register::R4, Register::R6),
+            Encode(Instruction::SW,   Register::R6, Register::R3),
+            EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, sizeof(WORD)),
+            EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, sizeof(WORD)),
+            EncodeImm16(Instruction::ADDI, Register::R3, Register::R3, sizeof(WORD)),
+            EncodeImm16(Instruction::SUBI, Register::R7, Register::R7, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-36)),
+            EncodeImm16(Instruction::SUBI, Register::R5, Register::R5, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-60)),
+            Encode(Instruction::HALT),
+        });
+        break;
+    case AddressMode::Indexed:
+        LoadProgram(ram, 20, {
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, sizeof(WORD)),
+            EncodeImm16(Instruction::SUBI, Register::R2, Register::R2, sizeof(WORD)),
+            EncodeImm16(Instruction::SUBI, Register::R3, Register::R3, sizeof(WORD)),
+            EncodeImm16(Instruction::LW,   Register::R4, Register::R1, AddressIndexed(Register::R7, 2)),   // loop:
+            EncodeImm16(Instruction::LW,   Register::R6, Register::R2, AddressIndexed(Register::R7, 2)),
+            Encode(Instruction::ADD,  Register::R6, Register::R4, Register::R6),
+            EncodeImm16(Instruction::SW,   Register::R6, Register::R3, AddressIndexed(Register::R7, 2)),
+            EncodeImm16(Instruction::SUBI, Register::R7, Register::R7, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-24)),
+            EncodeImm16(Instruction::SUBI, Register::R5, Register::R5, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-60)),
+            Encode(Instruction::HALT),
+        });
+        break;
+    default:
+        LoadProgram(ram, 20, {
+            EncodeImm16(Instruction::LW,   Register::R4, Register::R1, AddressPostIncrement(sizeof(WORD))), // loop:
+            EncodeImm16(Instruction::LW,   Register::R6, Register::R2, AddressPostIncrement(sizeof(WORD))),
+            Encode(Instruction::ADD,  Register::R6, Register::R4, Register::R6),
+            EncodeImm16(Instruction::SW,   Register::R6, Register::R3, AddressPostIncrement(sizeof(WORD))),
+            EncodeImm16(Instruction::SUBI, Register::R7, Register::R7, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-24)),
+            EncodeImm16(Instruction::SUBI, Register::R5, Register::R5, 1),
+            EncodeJ(Instruction::BNE, static_cast<WORD>(-48)),
+            Encode(Instruction::HALT),
+        });
+        break;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t retired = core.Run(~uint64_t{ 0 });
+    Report(name, retired, std::chrono::steady_clock::now() - start);
+
+    if (ram.ReadWord(kC + 5 * sizeof(WORD)) != 5 + 5 * 2654435761u)
+        std::printf("%-24s wrong result\n", name);
+}
+
+// ====================== CALLS ==============================
+
+// Recursive fib(25), saving RA, R2 and R3 with three PUSH/POP pairs or one PUSHM/POPM
+static void Fibonacci(const char* name, bool multiple)
+{
+    static constexpr HWORD kSaved = RegisterBit(Register::R2) | RegisterBit(Register::R3) | RegisterBit(Register::RA);
+
+    RAM ram{ 0x10000 };
+    FlatCore core{ ram };
+    core.Reg(Register::SP) = 0x10000;
+
+    LoadProgram(ram, 0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 25),
+        EncodeJ(Instruction::CALL, 12),
+        Encode(Instruction::HALT),
+        EncodeImm16(Instruction::CMPI, Register::R1, Register::RZ, 2),                  // fib:
+    });
+
+    if (multiple)
+    {
+        LoadProgram(ram, 16, {
+            EncodeJ(Instruction::BLT, 36),
+            EncodeImm16(Instruction::PUSHM, Register::RZ, Register::RZ, kSaved),
+            EncodeImm16(Instruction::ADDI, Register::R3, Register::R1, 0),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R3, 1),
+            EncodeJ(Instruction::CALL, 12),
+            EncodeImm16(Instruction::ADDI, Register::R2, Register::R1, 0),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R3, 2),
+            EncodeJ(Instruction::CALL, 12),
+            Encode(Instruction::ADD,  Register::R1, Register::R1, Register::R2),
+            EncodeImm16(Instruction::POPM, Register::RZ, Register::RZ, kSaved),
+            Encode(Instruction::RET),                                                   // done:
+        });
+    }
+    else
+    {
+        LoadProgram(ram, 16, {
+            EncodeJ(Instruction::BLT, 52),
+            Encode(Instruction::PUSH, Register::RA),
+            Encode(Instruction::PUSH, Register::R3),
+            Encode(Instruction::PUSH, Register::R2),
+            EncodeImm16(Instruction::ADDI, Register::R3, Register::R1, 0),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R3, 1),
+            EncodeJ(Instruction::CALL, 12),
+            EncodeImm16(Instruction::ADDI, Register::R2, Register::R1, 0),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R3, 2),
+            EncodeJ(Instruction::CALL, 12),
+            Encode(Instruction::ADD,  Register::R1, Register::R1, Register::R2),
+            Encode(Instruction::POP,  Register::R2),
+            Encode(Instruction::POP,  Register::R3),
+            Encode(Instruction::POP,  Register::RA),
+            Encode(Instruction::RET),                                                   // done:
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t retired = core.Run(~uint64_t{ 0 });
+    Report(name, retired, std::chrono::steady_clock::now() - start);
+
+    if (core.Reg(Register::R1) != 75025)
+        std::printf("%-24s wrong result\n", name);
+}
+
+// Ackermann(3, 7), the non tail call saves R1 and RA with two PUSH/POP pairs or one PUSHM/POPM
+static void Ackermann(const char* name, bool multiple)
+{
+    static constexpr HWORD kSaved = RegisterBit(Register::R1) | RegisterBit(Register::RA);
+
+    RAM ram{ 0x10000 };
+    FlatCore core{ ram };
+    core.Reg(Register::SP) = 0x10000;
+
+    LoadProgram(ram, 0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 3),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::RZ, 7),
+        EncodeJ(Instruction::CALL, 16),
+        Encode(Instruction::HALT),
+        EncodeImm16(Instruction::CMPI, Register::R1, Register::RZ, 0),                  // ack:
+        EncodeJ(Instruction::BNE, 8),
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R2, 1),
+        Encode(Instruction::RET),
+        EncodeImm16(Instruction::CMPI, Register::R2, Register::RZ, 0),                  // m > 0:
+        EncodeJ(Instruction::BNE, 12),
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::RZ, 1),
+        EncodeJ(Instruction::J, 16),
+    });
+
+    if (multiple)
+    {
+        LoadProgram(ram, 52, {
+            EncodeImm16(Instruction::PUSHM, Register::RZ, Register::RZ, kSaved),        // n > 0:
+            EncodeImm16(Instruction::SUBI, Register::R2, Register::R2, 1),
+            EncodeJ(Instruction::CALL, 16),
+            EncodeImm16(Instruction::ADDI, Register::R2, Register::R1, 0),
+            EncodeImm16(Instruction::POPM, Register::RZ, Register::RZ, kSaved),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+            EncodeJ(Instruction::J, 16),
+        });
+    }
+    else
+    {
+        LoadProgram(ram, 52, {
+            Encode(Instruction::PUSH, Register::RA),                                    // n > 0:
+            Encode(Instruction::PUSH, Register::R1),
+            EncodeImm16(Instruction::SUBI, Register::R2, Register::R2, 1),
+            EncodeJ(Instruction::CALL, 16),
+            EncodeImm16(Instruction::ADDI, Register::R2, Register::R1, 0),
+            Encode(Instruction::POP,  Register::R1),
+            Encode(Instruction::POP,  Register::RA),
+            EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+            EncodeJ(Instruction::J, 16),
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t retired = core.Run(~uint64_t{ 0 });
+    Report(name, retired, std::chrono::steady_clock::now() - start);
+
+    if (core.Reg(Register::R1) != 1021)
+        std::printf("%-24s wrong result\n", name);
+}
+
+// ====================== LOCKSTEP ===========================
+
+// Mixes and accumulates a per guest seed for kIterations rounds
+static const WORD kKernel[] = {
+    EncodeImm16(Instruction::LUI,  Register::R1, Register::RZ, 0x8),
+    Encode(Instruction::ADD,  Register::R2, Register::R2, Register::R8),        // loop:
+    EncodeImm16(Instruction::SHLI, Register::R3, Register::R2, 5),
+    Encode(Instruction::XOR,  Register::R8, Register::R8, Register::R3),
+    EncodeImm16(Instruction::SHRI, Register::R3, Register::R8, 3),
+    Encode(Instruction::SUB,  Register::R2, Register::R2, Register::R3),
+    EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+    EncodeJ(Instruction::BNE, static_cast<WORD>(-28)),
+    Encode(Instruction::HALT),
+};
+
+template<size_t LANES>
+static void Lockstep(const char* name)
+{
+    LockstepCore<LANES> lanes{ 4096 };
+    lanes.Broadcast(0, kKernel, sizeof(kKernel));
+    for (size_t i = 0; i < LANES; ++i)
+        lanes.Reg(i, Register::R8) = static_cast<WORD>(i * 2654435761u);
+
+    auto start = std::chrono::steady_clock::now();
+    lanes.Run(~uint64_t{ 0 });
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    uint64_t retired = 0;
+    for (size_t i = 0; i < LANES; ++i)
+        retired += lanes.Retired(i);
+
+    Report(name, retired, elapsed);
+}
+
+template<size_t LANES>
+static void Scalar(const char* name)
+{
+    uint64_t retired = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < LANES; ++i)
+    {
+        RAM ram{ 4096 };
+        FlatCore core{ ram };
+        for (size_t k = 0; k < sizeof(kKernel) / sizeof(WORD); ++k)
+            ram.WriteWord(k * sizeof(WORD), kKernel[k]);
+        core.Reg(Register::R8) = static_cast<WORD>(i * 2654435761u);
+        retired += core.Run(~uint64_t{ 0 });
+    }
+
+    Report(name, retired, std::chrono::steady_clock::now() - start);
+}
+
+int main()
+{
+    MemoryLoop<FlatCore>("memory/flat", false);
+    MemoryLoop<Core>("memory/identity", false);
+    MemoryLoop<Core>("memory/paged", true);
+    MemoryLoop<Core>("memory/paged+limits", true, true);
+    MemoryLoop<ProfilingCore>("memory/paged+counters", true);
+    Multiply("multiply/shift-add", false);
+    Multiply("multiply/shift-add+blocks", false, false);
+    Multiply("multiply/mul", true);
+    ByteScan("strlen/lbu", false);
+    ByteScan("strlen/ffzb", true);
+    BlockCopy("memcpy/lw-sw", false);
+    BlockCopy("memcpy/native", true);
+    VectorAdd("vadd/indirect", AddressMode::Offset);
+    VectorAdd("vadd/indexed", AddressMode::Indexed);
+    VectorAdd("vadd/post-increment", AddressMode::PostIncrement);
+    Fibonacci("fib/push-pop", false);
+    Fibonacci("fib/pushm-popm", true);
+    Ackermann("ackermann/push-pop", false);
+    Ackermann("ackermann/pushm-popm", true);
+    Scalar<16>("kernel/scalar x16");
+    Lockstep<8>("kernel/lockstep x8");
+    Lockstep<16>("kernel/lockstep x16");
+}
@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "isa.h"
+#include "encoding.h"
+#include "ram.h"
+#include "core.h"
+
+//  Fleet benchmark: how far the emulator scales across host cores and NUMA nodes.
+//
+//  M guest jobs, all of one workload or mixed, are pulled from a shared queue by N
+//  worker threads, for N from 1 up to all cores. Workers are pinned, filling one node
+//  before the next (--spread deals them out across nodes instead), and every worker
+//  keeps its guest RAM on its own node: mbind to the local node where the kernel
+//  allows it, first touch from the pinned thread otherwise. Each thread count prints
+//  one JSON line with aggregate MIPS, p50/p99 job latency and the scaling efficiency
+//  against one thread. Between jobs a worker resets its machine in place, clearing only
+//  the pages the last job wrote; --fresh zeroes the whole RAM and builds a new core.
+//
+//      cpu_fleet [--jobs M] [--threads N] [--workload alu|memory|calls|mix]
+//                [--ram BYTES] [--scale X] [--spread] [--no-pin] [--fresh]
+
+static constexpr WORD kArray = 0x10000;
+
+// ====================== WORKLOADS ==========================
+
+struct Workload
+{
+    const char*         name;
+    std::vector<WORD>   code;
+};
+
+enum class Kind { Alu, Memory, Calls };
+
+static const Workload kWorkloads[] = {
+    // Mixes R8 into R2 R1 times, registers only
+    { "alu", {
+        Encode(Instruction::ADD,  Register::R2, Register::R2, Register::R8),            // loop:
+        EncodeImm16(Instruction::SHLI, Register::R3, Register::R2, 5),
+        Encode(Instruction::XOR,  Register::R8, Register::R8, Register::R3),
+        EncodeImm16(Instruction::SHRI, Register::R3, Register::R8, 3),
+        Encode(Instruction::SUB,  Register::R2, Register::R2, Register::R3),
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-28)),
+        Encode(Instruction::HALT),
+    } },
+    // Sums R6 words from kArray on and stores the running sum back, R7 rounds
+    { "memory", {
+        EncodeImm16(Instruction::LUI,  Register::R5, Register::RZ, kArray >> 16),       // round:
+        Encode(Instruction::OR,   Register::R2, Register::R6, Register::RZ),
+        EncodeImm16(Instruction::LW,   Register::R3, Register::R5, AddressPostIncrement(sizeof(WORD))), // loop:
+        Encode(Instruction::ADD,  Register::R1, Register::R1, Register::R3),
+        EncodeImm16(Instruction::SW,   Register::R1, Register::R5, AddressOffset(-4)),
+        EncodeImm16(Instruction::SUBI, Register::R2, Register::R2, 1),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-20)),
+        EncodeImm16(Instruction::SUBI, Register::R7, Register::R7, 1),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-36)),
+        Encode(Instruction::HALT),
+    } },
+    // Recursive fib(R1), calls and the stack
+    { "calls", {
+        EncodeJ(Instruction::CALL, 8),
+        Encode(Instruction::HALT),
+        EncodeImm16(Instruction::CMPI, Register::R1, Register::RZ, 2),                  // fib:
+        EncodeJ(Instruction::BLT, 36),
+        EncodeImm16(Instruction::PUSHM, Register::RZ, Register::RZ,
+                    RegisterBit(Register::R2) | RegisterBit(Register::R3) | RegisterBit(Register::RA)),
+        EncodeImm16(Instruction::ADDI, Register::R3, Register::R1, 0),
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R3, 1),
+        EncodeJ(Instruction::CALL, 8),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::R1, 0),
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R3, 2),
+        EncodeJ(Instruction::CALL, 8),
+        Encode(Instruction::ADD,  Register::R1, Register::R1, Register::R2),
+        EncodeImm16(Instruction::POPM, Register::RZ, Register::RZ,
+                    RegisterBit(Register::R2) | RegisterBit(Register::R3) | RegisterBit(Register::RA)),
+        Encode(Instruction::RET),                                                       // done:
+    } },
+};
+
+struct Options
+{
+    size_t      jobs{ 0 };                  // 0: four per thread at the largest count
+    unsigned    threads{ 0 };               // 0: every allowed core
+    int         workload{ -1 };             // -1: mix, job i runs workload i % 3
+    size_t      ram{ 4 << 20 };
+    double      scale{ 1.0 };
+    bool        spread{ false };
+    bool        pin{ true };
+    bool        fresh{ false };
+};
+
+static uint64_t Scaled(double value, double scale)
+{
+    return std::max<uint64_t>(1, static_cast<uint64_t>(value * scale));
+}
+
+// Loads job's program and its inputs into a cleared guest
+static void Prepare(Kind kind, const Options& options, RAM& ram, FlatCore& core, size_t job)
+{
+    const Workload& workload = kWorkloads[static_cast<size_t>(kind)];
+    for (size_t i = 0; i < workload.code.size(); ++i)
+        ram.WriteWord(static_cast<WORD>(i * sizeof(WORD)), workload.code[i]);
+
+    switch (kind)
+    {
+    case Kind::Alu:
+        core.Reg(Register::R1) = static_cast<WORD>(Scaled(1'500'000, options.scale));
+        core.Reg(Register::R8) = static_cast<WORD>(job * 2654435761u);
+        break;
+    case Kind::Memory:
+        core.Reg(Register::R6) = static_cast<WORD>((ram.Size() - kArray) / sizeof(WORD));
+        core.Reg(Register::R7) = static_cast<WORD>(Scaled(2'000'000.0 / core.Reg(Register::R6), options.scale));
+        break;
+    case Kind::Calls:
+        core.Reg(Register::R1) = static_cast<WORD>(std::clamp(std::lround(27 + std::log2(options.scale) / 0.694), 2l, 32l));
+        core.Reg(Register::SP) = static_cast<WORD>(ram.Size());
+        break;
+    }
+}
+
+// ====================== HOST ===============================
+
+struct Topology
+{
+    std::vector<unsigned>   cpus;           // allowed, in pinning order
+    std::vector<int>        node;           // by cpu number
+    int                     nodes{ 1 };
+};
+
+// "0-3,8,10-11"
+static std::vector<unsigned> ParseList(const std::string& list)
+{
+    std::vector<unsigned> res;
+    const char* p = list.c_str();
+    while (*p)
+    {
+        char* end;
+        unsigned first = static_cast<unsigned>(std::strtoul(p, &end, 10));
+        unsigned last = first;
+        if (*end == '-')
+            last = static_cast<unsigned>(std::strtoul(end + 1, &end, 10));
+        for (unsigned cpu = first; cpu <= last; ++cpu)
+            res.push_back(cpu);
+        if (end == p)
+            break;
+
+        p = *end == ',' ? end + 1 : end;
+        while (*p == '\n')
+            ++p;
+    }
+    return res;
+}
+
+static Topology Discover(bool spread)
+{
+    Topology topology;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (::sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+                topology.cpus.push_back(cpu);
+        }
+    }
+
+    // Nodes are numbered densely on every machine worth benchmarking
+    for (int n = 0;; ++n)
+    {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+        std::string list;
+        if (!std::getline(file, list))
+            break;
+
+        topology.nodes = n + 1;
+        for (unsigned cpu : ParseList(list))
+        {
+            if (cpu >= topology.node.size())
+                topology.node.resize(cpu + 1, 0);
+            topology.node[cpu] = n;
+        }
+    }
+#endif
+    if (topology.cpus.empty())
+    {
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+            topology.cpus.push_back(cpu);
+    }
+    topology.node.resize(std::max<size_t>(topology.node.size(), topology.cpus.back() + 1), 0);
+
+    // Compact fills node 0 first, spread takes one cpu from each node in turn
+    auto node = [&](unsigned cpu) { return topology.node[cpu]; };
+    std::stable_sort(topology.cpus.begin(), topology.cpus.end(), [&](unsigned a, unsigned b) { return node(a) < node(b); });
+    if (spread && topology.nodes > 1)
+    {
+        std::vector<unsigned> dealt;
+        std::vector<size_t> rank(topology.cpus.size());
+        std::vector<size_t> seen(static_cast<size_t>(topology.nodes), 0);
+        for (size_t i = 0; i < topology.cpus.size(); ++i)
+            rank[i] = seen[static_cast<size_t>(node(topology.cpus[i]))]++;
+
+        std::vector<size_t> order(topology.cpus.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return rank[a] < rank[b]; });
+        for (size_t i : order)
+            dealt.push_back(topology.cpus[i]);
+        topology.cpus = dealt;
+    }
+
+    return topology;
+}
+
+static bool Pin(unsigned cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// Anonymous memory preferring node, faulted in by the calling thread. local is false
+// when the policy could not be set and placement was left to first touch.
+class Arena
+{
+public:
+    Arena(size_t size, int node, bool bind):
+    _size(size)
+    {
+        void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            throw std::runtime_error("mmap failed");
+
+        _data = static_cast<BYTE*>(data);
+#if defined(__linux__) && defined(SYS_mbind)
+        if (bind && node < 64)
+        {
+            static constexpr int kPreferred = 1;        // MPOL_PREFERRED
+            unsigned long mask = 1ul << node;
+            _local = ::syscall(SYS_mbind, _data, size, kPreferred, &mask, 64, 0) == 0;
+        }
+#else
+        (void)node;
+        (void)bind;
+#endif
+        ::memset(_data, 0, size);
+    }
+
+    ~Arena()
+    {
+        ::munmap(_data, _size);
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    BYTE* Data() { return _data; }
+    size_t Size() const { return _size; }
+    bool Local() const { return _local; }
+
+private:
+    BYTE*   _data{ nullptr };
+    size_t  _size{ 0 };
+    bool    _local{ false };
+};
+
+// ====================== FLEET ==============================
+
+struct Result
+{
+    unsigned            threads{ 0 };
+    uint64_t            instructions{ 0 };
+    double              seconds{ 0 };
+    std::vector<double> latency;            // per job, seconds
+    bool                pinned{ true };
+    bool                local{ true };
+};
+
+static Result Run(const Options& options, const Topology& topology, unsigned threads, size_t jobs)
+{
+    Result result;
+    result.threads = threads;
+    result.latency.resize(jobs);
+
+    std::atomic<size_t> next{ 0 };
+    std::atomic<uint64_t> instructions{ 0 };
+    std::atomic<bool> pinned{ true };
+    std::atomic<bool> local{ true };
+    std::atomic<unsigned> ready{ 0 };
+    std::atomic<bool> go{ false };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        unsigned cpu = topology.cpus[t % topology.cpus.size()];
+        workers.emplace_back([&, cpu]() {
+            if (options.pin && !Pin(cpu))
+                pinned = false;
+
+            // Allocated after pinning, so first touch lands on the right node as well
+            Arena arena(options.ram, topology.node[cpu], options.pin);
+            if (!arena.Local())
+                local = false;
+
+            ++ready;
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+
+            RAM reused{ arena.Data(), arena.Size() };
+            FlatCore machine{ reused };
+            reused.SetDirtyTracking(!options.fresh);
+            const FlatCore::RegisterFile registers{};
+
+            uint64_t retired = 0;
+            for (size_t job = next++; job < jobs; job = next++)
+            {
+                auto start = std::chrono::steady_clock::now();
+                Kind kind = static_cast<Kind>(options.workload < 0 ? job % 3 : static_cast<size_t>(options.workload));
+
+                if (options.fresh)
+                {
+                    ::memset(arena.Data(), 0, arena.Size());
+                    RAM ram{ arena.Data(), arena.Size() };
+                    FlatCore core{ ram };
+                    Prepare(kind, options, ram, core, job);
+                    retired += core.Run(~uint64_t{ 0 });
+                }
+                else
+                {
+                    reused.ClearDirty();
+                    machine.Reset(registers);
+                    Prepare(kind, options, reused, machine, job);
+                    retired += machine.Run(~uint64_t{ 0 });
+                }
+
+                result.latency[job] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            instructions += retired;
+        });
+    }
+
+    while (ready.load() < threads)
+        std::this_thread::yield();
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (std::thread& worker : workers)
+        worker.join();
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.instructions = instructions;
+    result.pinned = options.pin && pinned;
+    result.local = options.pin && local;
+    return result;
+}
+
+// Nearest rank
+static double Percentile(std::vector<double> values, double q)
+{
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(std::ceil(q * static_cast<double>(values.size())));
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        bool value = i + 1 < argc;
+        bool ok = true;
+        if (option == "--jobs" && value)
+            options.jobs = std::strtoull(argv[++i], nullptr, 0);
+        else if (option == "--threads" && value)
+            options.threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 0));
+        else if (option == "--ram" && value)
+            options.ram = std::strtoull(argv[++i], nullptr, 0);
+        else if (option == "--scale" && value)
+            options.scale = std::strtod(argv[++i], nullptr);
+        else if (option == "--workload" && value)
+        {
+            std::string name = argv[++i];
+            auto it = std::find_if(std::begin(kWorkloads), std::end(kWorkloads), [&](const Workload& w) { return name == w.name; });
+            options.workload = it != std::end(kWorkloads) ? static_cast<int>(it - std::begin(kWorkloads)) : -1;
+            ok = name == "mix" || options.workload >= 0;
+        }
+        else if (option == "--spread")
+            options.spread = true;
+        else if (option == "--no-pin")
+            options.pin = false;
+        else if (option == "--fresh")
+            options.fresh = true;
+        else
+            ok = false;
+
+        if (!ok || options.scale <= 0 || options.ram < 2 * kArray || options.ram > (size_t{ 1 } << 31))
+        {
+            std::fprintf(stderr, "usage: %s [--jobs M] [--threads N] [--workload alu|memory|calls|mix]\n"
+                                 "       [--ram BYTES] [--scale X] [--spread] [--no-pin] [--fresh]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    options.ram &= ~size_t{ sizeof(WORD) - 1 };
+
+    Topology topology = Discover(options.spread);
+    unsigned most = options.threads ? options.threads : static_cast<unsigned>(topology.cpus.size());
+    size_t jobs = options.jobs ? options.jobs : size_t{ 4 } * most;
+
+    // 1, 2, 4, ... and the largest count
+    std::vector<unsigned> counts;
+    for (unsigned n = 1; n < most; n *= 2)
+        counts.push_back(n);
+    counts.push_back(most);
+
+    const char* workload = options.workload < 0 ? "mix" : kWorkloads[options.workload].name;
+    double single = 0;
+    for (unsigned threads : counts)
+    {
+        Result result = Run(options, topology, threads, jobs);
+        double mips = static_cast<double>(result.instructions) / result.seconds / 1e6;
+        if (threads == 1)
+            single = mips;
+
+        std::printf("{\"workload\":\"%s\",\"jobs\":%zu,\"threads\":%u,\"cpus\":%zu,\"nodes\":%d,"
+                    "\"placement\":\"%s\",\"pinned\":%s,\"numa\":\"%s\",\"ram\":%zu,\"reset\":\"%s\","
+                    "\"instructions\":%llu,\"seconds\":%.6f,\"mips\":%.1f,"
+                    "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"efficiency\":%.3f}\n",
+                    workload, jobs, threads, topology.cpus.size(), topology.nodes,
+                    options.spread ? "spread" : "compact", result.pinned ? "true" : "false",
+                    result.local ? "mbind" : "first-touch", options.ram, options.fresh ? "fresh" : "dirty",
+                    static_cast<unsigned long long>(result.instructions), result.seconds, mips,
+                    Percentile(result.latency, 0.50) * 1e3, Percentile(result.latency, 0.99) * 1e3,
+                    mips / (single * threads));
+        std::fflush(stdout);
+    }
+
+    return 0;
+}
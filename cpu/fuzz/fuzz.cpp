@@ -0,0 +1,809 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "isa.h"
+#include "encoding.h"
+#include "ram.h"
+#include "core.h"
+#include "lockstep.h"
+
+//  Differential fuzzer for the execution engines.
+//
+//  Every program is generated from a seed as a random but valid instruction stream: it
+//  never faults, so a reference model that calls the Core instruction methods directly
+//  (no Step, no predecoder) defines the expected result. The same program then runs on
+//
+//      step        FlatCore::Step, one instruction at a time
+//      flat        FlatCore::Run, predecoded blocks and hot loop traces
+//      paged       Core::Run with paging off
+//      lockstep    LockstepCore, one lane per initial register set
+//
+//  Scalar engines are compared with the reference (registers, FLAGS and RAM) after every
+//  chunk of a random length, lockstep lanes once the run ends. A mismatch is minimized by
+//  turning instructions into NOPs while it still fails, then printed with its seed.
+//
+//      cpu_fuzz [--programs N] [--seconds S] [--threads T] [--seed S]
+
+static constexpr WORD     kMemory     = 0x2000;
+static constexpr WORD     kData       = 0x000;         // LB/SB/... through R6 & 0x3FF
+static constexpr WORD     kStack      = 0x400;         // SP kept inside 0x400..0x7FF
+static constexpr WORD     kCode       = 0x1000;        // own page, so hot loops that store keep their traces
+static constexpr WORD     kMaxLength  = 512;
+static constexpr uint64_t kBudget     = 4000;
+static constexpr size_t   kLanes      = 8;
+static constexpr size_t   kRegs       = static_cast<size_t>(Register::__NUM);
+
+static const WORD kNop = Encode(Instruction::LUI);        // writes RZ, leaves FLAGS alone
+
+// ====================== PROGRAMS ===========================
+
+struct Program
+{
+    uint64_t                                seed{ 0 };
+    std::vector<WORD>                       code;           // ends with HALT
+    std::vector<BYTE>                       data;
+    std::array<std::array<WORD, 9>, kLanes> init{};         // RZ..R8 per lane, lane 0 for scalar engines
+};
+
+static Program Generate(uint64_t seed)
+{
+    std::mt19937_64 rng{ seed };
+    auto pick = [&](uint32_t n) { return static_cast<uint32_t>(rng() % n); };
+    auto dst = [&]() { return static_cast<Register>(1 + pick(8)); };
+    auto src = [&]() {
+        static const Register special[] = { Register::RZ, Register::SP, Register::RA, Register::FLAGS };
+        return pick(6) == 0 ? special[pick(4)] : static_cast<Register>(1 + pick(8));
+    };
+
+    static const Instruction alu[] = { Instruction::ADD, Instruction::SUB, Instruction::SHL, Instruction::SHR,
+                                       Instruction::OR, Instruction::AND, Instruction::XOR, Instruction::ADC,
+                                       Instruction::SBC, Instruction::MUL, Instruction::MULH, Instruction::MULHU,
+                                       Instruction::DIV, Instruction::DIVU, Instruction::REM, Instruction::ADDUSB,
+                                       Instruction::SUBUSB, Instruction::ADDUSH, Instruction::SUBUSH, Instruction::CMPEQB,
+                                       Instruction::SHUFB };
+    static const Instruction alui[] = { Instruction::ADDI, Instruction::SUBI, Instruction::SHLI, Instruction::SHRI,
+                                        Instruction::ORI, Instruction::ANDI, Instruction::XORI };
+    static const Instruction branch[] = { Instruction::B, Instruction::BEQ, Instruction::BNE, Instruction::BGT,
+                                          Instruction::BGE, Instruction::BLT, Instruction::BLE };
+    struct MemoryOp { Instruction op; HWORD mask; };
+    static const MemoryOp memory[] = {
+        { Instruction::LB, 0x3FF }, { Instruction::LBU, 0x3FF }, { Instruction::LH, 0x3FE }, { Instruction::LHU, 0x3FE },
+        { Instruction::LW, 0x3FC }, { Instruction::LWU, 0x3FC }, { Instruction::SB, 0x3FF }, { Instruction::SH, 0x3FE },
+        { Instruction::SW, 0x3FC },
+    };
+
+    Program program;
+    program.seed = seed;
+
+    // Control transfers are patched once the length is known. They only target the start
+    // of a generated sequence, never the access after its address masking.
+    std::vector<size_t> transfers;
+    std::vector<WORD> targets;
+    WORD length = 16 + pick(kMaxLength - 24);
+
+    while (program.code.size() < length)
+    {
+        targets.push_back(static_cast<WORD>(program.code.size()));
+
+        switch (pick(17))
+        {
+        case 0: case 1: case 2: case 3:
+            program.code.push_back(Encode(alu[pick(std::size(alu))], dst(), src(), src()));
+            break;
+        case 4: case 5: case 6:
+            program.code.push_back(EncodeImm16(alui[pick(7)], dst(), src(), static_cast<HWORD>(rng())));
+            break;
+        case 7:
+            if (pick(4) == 0)
+            {
+                // The pair hot loop traces fold into one constant load
+                Register r = dst();
+                program.code.push_back(EncodeImm16(Instruction::LUI, r, Register::RZ, static_cast<HWORD>(rng())));
+                program.code.push_back(EncodeImm16(Instruction::ORI, r, r, static_cast<HWORD>(rng())));
+                break;
+            }
+            program.code.push_back(pick(3) == 0 ? Encode(Instruction::NOT, dst(), src())
+                                 : pick(2) ? Encode(Instruction::FFZB, dst(), src())
+                                           : EncodeImm16(Instruction::LUI, dst(), Register::RZ, static_cast<HWORD>(rng())));
+            break;
+        case 8: case 9:
+            program.code.push_back(pick(2) ? Encode(Instruction::CMP, src(), src())
+                                           : EncodeImm16(Instruction::CMPI, src(), Register::RZ, static_cast<HWORD>(pick(16))));
+            break;
+        case 10: case 11:
+            transfers.push_back(program.code.size());
+            program.code.push_back(static_cast<WORD>(branch[pick(7)]));
+            break;
+        case 12:
+            transfers.push_back(program.code.size());
+            program.code.push_back(static_cast<WORD>(pick(2) ? Instruction::J : Instruction::CALL));
+            break;
+        case 13:
+        {
+            // Every form stays inside the data area: base 0..0x1FF, or 0x100..0x2FF with a
+            // displacement of -0x100..0xFF, or plus an index of at most 0x3F << 3
+            const MemoryOp& m = memory[pick(9)];
+            WORD align = ~static_cast<WORD>(AccessSize(m.op) - 1);
+            int32_t disp = static_cast<int32_t>(pick(0x200) & align) - 0x100;
+            program.code.push_back(EncodeImm16(Instruction::ANDI, Register::R6, src(), m.mask & 0x1FF));
+            switch (pick(4))
+            {
+            case 0:
+                program.code.push_back(Encode(m.op, dst(), Register::R6));
+                break;
+            case 1:
+                program.code.push_back(EncodeImm16(Instruction::ORI, Register::R6, Register::R6, 0x100));
+                program.code.push_back(EncodeImm16(m.op, dst(), Register::R6, static_cast<HWORD>(AddressOffset(disp))));
+                if (m.op == Instruction::SW && pick(2))
+                {
+                    // A load of the stored word, which traces forward from the store. The
+                    // op in between leaves R6 alone.
+                    if (pick(2))
+                        program.code.push_back(Encode(alu[pick(std::size(alu))], static_cast<Register>(1 + pick(5)), src(), src()));
+                    program.code.push_back(EncodeImm16(Instruction::LW, dst(), Register::R6, static_cast<HWORD>(AddressOffset(disp))));
+                }
+                break;
+            case 2:
+                program.code.push_back(EncodeImm16(Instruction::ANDI, Register::R7, src(), static_cast<HWORD>(0x3F & align)));
+                program.code.push_back(EncodeImm16(m.op, dst(), Register::R6, static_cast<HWORD>(AddressIndexed(Register::R7, pick(4)))));
+                break;
+            default:
+                program.code.push_back(EncodeImm16(m.op, dst(), Register::R6, static_cast<HWORD>(AddressPostIncrement(disp))));
+                break;
+            }
+            break;
+        }
+        case 14:
+        {
+            // POPM never lists RA, a RET through stack garbage would run the data area
+            HWORD list = static_cast<HWORD>(pick(256) << 1);
+            program.code.push_back(EncodeImm16(Instruction::ANDI, Register::SP, Register::SP, kStack - sizeof(WORD)));
+            program.code.push_back(EncodeImm16(Instruction::ORI, Register::SP, Register::SP, kStack));
+            switch (pick(4))
+            {
+            case 0:     program.code.push_back(Encode(Instruction::PUSH, src()));                                   break;
+            case 1:     program.code.push_back(Encode(Instruction::POP, dst()));                                    break;
+            case 2:     program.code.push_back(EncodeImm16(Instruction::PUSHM, Register::RZ, Register::RZ,
+                                                           static_cast<HWORD>(list | RegisterBit(Register::RA))));  break;
+            default:    program.code.push_back(EncodeImm16(Instruction::POPM, Register::RZ, Register::RZ, list));  break;
+            }
+            break;
+        }
+        case 15:
+            program.code.push_back(EncodeImm16(Instruction::ANDI, Register::R6, src(), 0x1FF));
+            program.code.push_back(EncodeImm16(Instruction::ANDI, Register::R7, src(), 0x1FF));
+            program.code.push_back(EncodeImm16(Instruction::ANDI, Register::R8, src(), 0xFF));
+            program.code.push_back(pick(2) ? Encode(Instruction::MEMCPY, Register::R6, Register::R7, Register::R8)
+                                           : Encode(Instruction::MEMSET, Register::R6, src(), Register::R8));
+            break;
+        default:
+            program.code.push_back(Encode(Instruction::RET));
+            break;
+        }
+    }
+
+    targets.push_back(static_cast<WORD>(program.code.size()));
+    program.code.push_back(Encode(Instruction::HALT));
+
+    for (size_t at : transfers)
+    {
+        Instruction op = static_cast<Instruction>(program.code[at]);
+        WORD target = targets[pick(static_cast<uint32_t>(targets.size()))];
+
+        if (op == Instruction::J || op == Instruction::CALL)
+            program.code[at] = EncodeJ(op, kCode + target * sizeof(WORD));
+        else
+            program.code[at] = EncodeJ(op, (target - static_cast<WORD>(at) - 1) * sizeof(WORD));
+    }
+
+    program.data.resize(kStack - kData);
+    for (BYTE& byte : program.data)
+        byte = static_cast<BYTE>(rng());
+
+    for (auto& regs : program.init)
+    {
+        for (size_t r = 1; r < regs.size(); ++r)
+            regs[r] = pick(4) == 0 ? pick(8) : static_cast<WORD>(rng());
+    }
+
+    return program;
+}
+
+// Registers every engine starts from, besides RZ..R8
+static void Initialize(const Program& program, WORD& sp, WORD& ra, WORD& ip)
+{
+    sp = kStack + 0x200;
+    ra = kCode + static_cast<WORD>(program.code.size() - 1) * sizeof(WORD);      // RET before any CALL halts
+    ip = kCode;
+}
+
+template<typename CoreType>
+static void Load(const Program& program, size_t lane, RAM& ram, CoreType& core)
+{
+    ::memcpy(ram.Data(kData, static_cast<WORD>(program.data.size())), program.data.data(), program.data.size());
+    for (size_t i = 0; i < program.code.size(); ++i)
+        ram.WriteWord(kCode + static_cast<WORD>(i * sizeof(WORD)), program.code[i]);
+
+    for (size_t r = 0; r < program.init[lane].size(); ++r)
+        core.Reg(static_cast<Register>(r)) = program.init[lane][r];
+    Initialize(program, core.Reg(Register::SP), core.Reg(Register::RA), core.Reg(Register::IP));
+}
+
+// ====================== REFERENCE ==========================
+
+// Decodes by hand and calls the public Core instruction methods, nothing else
+class Reference
+{
+public:
+    Reference(const Program& program, size_t lane):
+    _ram(kMemory),
+    _core(_ram)
+    {
+        Load(program, lane, _ram, _core);
+    }
+
+    RAM& Memory()
+    {
+        return _ram;
+    }
+
+    FlatCore& Cpu()
+    {
+        return _core;
+    }
+
+    uint64_t Retired() const
+    {
+        return _retired;
+    }
+
+    // Set when the program would trap, which a valid stream never does
+    bool Faulted() const
+    {
+        return _faulted;
+    }
+
+    WORD FaultAddress() const
+    {
+        return _fault_addr;
+    }
+
+    bool Step()
+    {
+        if (_core.Halted() || _faulted)
+            return false;
+
+        WORD ip = _core.Reg(Register::IP);
+        WORD instruction;
+        if (!Accessible(ip, sizeof(WORD)) || !_ram.TryRead(ip, instruction))
+            return false;
+
+        Instruction op      = static_cast<Instruction>(instruction >> 26);
+        Register    r1      = static_cast<Register>((instruction >> 21) & 0x1F);
+        Register    r2      = static_cast<Register>((instruction >> 16) & 0x1F);
+        Register    r3      = static_cast<Register>((instruction >> 11) & 0x1F);
+        WORD        imm16   = instruction & 0xFFFF;
+        WORD        imm26   = instruction & 0x3FFFFFF;
+        WORD        offset  = (imm26 & (1u << 25)) ? (imm26 | 0xFC000000u) : imm26;
+
+        // Load/store address forms: 00 [r2 + disp], 01 [r2 + index << scale], 10 [r2] then r2 += disp
+        WORD        mode    = imm16 >> 14;
+        WORD        disp    = (imm16 & 0x2000) ? (imm16 | 0xFFFFC000u) : (imm16 & 0x3FFF);
+        Register    index   = static_cast<Register>((imm16 >> 9) & 0x1F);
+        WORD        scale   = (imm16 >> 7) & 0x3;
+        bool        memory  = op >= Instruction::LB && op <= Instruction::SW;
+
+        if (RegisterOperands(op) < 0 || op == Instruction::RETI)
+            return Trap(ip);
+        if (memory && (mode == 3 || (mode == 1 && (index >= Register::__NUM || (imm16 & 0x7F) != 0))))
+            return Trap(ip);
+        if ((op == Instruction::PUSHM || op == Instruction::POPM) && (imm26 & ~0x3FEu) != 0)
+            return Trap(ip);
+
+        WORD addr = _core.Reg(r2);
+        if (memory && mode == 0)
+            addr += disp;
+        else if (memory && mode == 1)
+            addr += _core.Reg(index) << scale;
+
+        switch (op)
+        {
+        case Instruction::LB:   case Instruction::LBU:
+            if (!Accessible(addr, sizeof(BYTE)))
+                return false;
+            break;
+        case Instruction::LH:   case Instruction::LHU:
+            if (!Accessible(addr, sizeof(HWORD)))
+                return false;
+            break;
+        case Instruction::LW:   case Instruction::LWU:
+            if (!Accessible(addr, sizeof(WORD)))
+                return false;
+            break;
+        case Instruction::SB:
+            if (!Accessible(addr, sizeof(BYTE), true))
+                return false;
+            break;
+        case Instruction::SH:
+            if (!Accessible(addr, sizeof(HWORD), true))
+                return false;
+            break;
+        case Instruction::SW:
+            if (!Accessible(addr, sizeof(WORD), true))
+                return false;
+            break;
+        case Instruction::PUSH:
+            if (!Accessible(_core.Reg(Register::SP) - sizeof(WORD), sizeof(WORD), true))
+                return false;
+            break;
+        case Instruction::POP:
+            if (!Accessible(_core.Reg(Register::SP), sizeof(WORD)))
+                return false;
+            break;
+        case Instruction::PUSHM:
+            if (!Accessible(_core.Reg(Register::SP) - Frame(imm16), sizeof(WORD), true) ||
+                !Contains(_core.Reg(Register::SP) - Frame(imm16), Frame(imm16), true))
+                return false;
+            break;
+        case Instruction::POPM:
+            if (!Accessible(_core.Reg(Register::SP), sizeof(WORD)) || !Contains(_core.Reg(Register::SP), Frame(imm16)))
+                return false;
+            break;
+        case Instruction::MEMCPY:   case Instruction::MEMSET:
+        {
+            bool fill = op == Instruction::MEMSET;
+            WORD to = _core.Reg(r1);
+            WORD from = _core.Reg(r2);
+            WORD n = BlockChunk(to, fill ? to : from, _core.Reg(r3));
+            if (n != 0 && ((!fill && !Contains(from, n)) || !Contains(to, n, true)))
+                return false;
+            break;
+        }
+        default:
+            break;
+        }
+
+        _core.Reg(Register::IP) = ip + sizeof(WORD);
+
+        switch (op)
+        {
+        case Instruction::ADD:      _core.Add(r1, r2, r3);                          break;
+        case Instruction::ADDI:     _core.AddImmediate(r1, r2, imm16);              break;
+        case Instruction::SUB:      _core.Sub(r1, r2, r3);                          break;
+        case Instruction::SUBI:     _core.SubImmediate(r1, r2, imm16);              break;
+        case Instruction::LUI:      _core.LoadUpperImmediate(r1, imm16);            break;
+        case Instruction::SHL:      _core.ShiftLeft(r1, r2, r3);                    break;
+        case Instruction::SHLI:     _core.ShiftLeftImmediate(r1, r2, imm16);        break;
+        case Instruction::SHR:      _core.ShiftRight(r1, r2, r3);                   break;
+        case Instruction::SHRI:     _core.ShiftRightImmediate(r1, r2, imm16);       break;
+        case Instruction::OR:       _core.Or(r1, r2, r3);                           break;
+        case Instruction::ORI:      _core.OrImmediate(r1, r2, imm16);               break;
+        case Instruction::AND:      _core.And(r1, r2, r3);                          break;
+        case Instruction::ANDI:     _core.AndImmediate(r1, r2, imm16);              break;
+        case Instruction::XOR:      _core.Xor(r1, r2, r3);                          break;
+        case Instruction::XORI:     _core.XorImmediate(r1, r2, imm16);              break;
+        case Instruction::NOT:      _core.Not(r1, r2);                              break;
+        case Instruction::ADC:      _core.AddWithCarry(r1, r2, r3);                 break;
+        case Instruction::SBC:      _core.SubWithBorrow(r1, r2, r3);                break;
+        case Instruction::MUL:      _core.Mul(r1, r2, r3);                          break;
+        case Instruction::MULH:     _core.MulHigh(r1, r2, r3);                      break;
+        case Instruction::MULHU:    _core.MulHighUnsigned(r1, r2, r3);              break;
+        case Instruction::DIV:      _core.Div(r1, r2, r3);                          break;
+        case Instruction::DIVU:     _core.DivUnsigned(r1, r2, r3);                  break;
+        case Instruction::REM:      _core.Rem(r1, r2, r3);                          break;
+        case Instruction::ADDUSB:   _core.AddSaturateBytes(r1, r2, r3);             break;
+        case Instruction::SUBUSB:   _core.SubSaturateBytes(r1, r2, r3);             break;
+        case Instruction::ADDUSH:   _core.AddSaturateHalves(r1, r2, r3);            break;
+        case Instruction::SUBUSH:   _core.SubSaturateHalves(r1, r2, r3);            break;
+        case Instruction::CMPEQB:   _core.CompareBytes(r1, r2, r3);                 break;
+        case Instruction::FFZB:     _core.FindZeroByte(r1, r2);                     break;
+        case Instruction::SHUFB:    _core.Shuffle(r1, r2, r3);                      break;
+        case Instruction::LB:       case Instruction::LBU:      case Instruction::LH:
+        case Instruction::LHU:      case Instruction::LW:       case Instruction::LWU:
+        case Instruction::SB:       case Instruction::SH:       case Instruction::SW:
+            LoadStore(op, r1, r2, addr, mode == 2 ? _core.Reg(r2) + disp : _core.Reg(r2));
+            break;
+        case Instruction::MEMCPY:   BlockMemory(r1, r2, r3, false);                 break;
+        case Instruction::MEMSET:   BlockMemory(r1, r2, r3, true);                  break;
+        case Instruction::CMP:      _core.Cmp(r1, r2);                              break;
+        case Instruction::CMPI:     _core.CmpImmediate(r1, imm16);                  break;
+        case Instruction::B:        _core.Branch(offset);                           break;
+        case Instruction::BEQ:      _core.BranchEqual(offset);                      break;
+        case Instruction::BNE:      _core.BranchNotEqual(offset);                   break;
+        case Instruction::BGT:      _core.BranchGreaterThan(offset);                break;
+        case Instruction::BGE:      _core.BranchGreaterOrEqual(offset);             break;
+        case Instruction::BLT:      _core.BranchLessThan(offset);                   break;
+        case Instruction::BLE:      _core.BranchLessOrEqual(offset);                break;
+        case Instruction::J:        _core.Jump(imm26);                              break;
+        case Instruction::JR:       _core.JumpRegister(r1);                         break;
+        case Instruction::CALL:     _core.Call(imm26);                              break;
+        case Instruction::CALLR:    _core.CallRegister(r1);                         break;
+        case Instruction::RET:      _core.Ret();                                    break;
+        case Instruction::PUSH:     _core.Push(r1);                                 break;
+        case Instruction::POP:      _core.Pop(r1);                                  break;
+        case Instruction::PUSHM:    Multiple(imm16, true);                          break;
+        case Instruction::POPM:     Multiple(imm16, false);                         break;
+        case Instruction::HALT:     _core.Halt();                                   break;
+        default:                                                                    break;
+        }
+
+        _core.Reg(Register::RZ) = 0;
+        ++_retired;
+
+        return !_core.Halted();
+    }
+
+private:
+    RAM         _ram;
+    FlatCore    _core;
+    uint64_t    _retired{ 0 };
+    bool        _faulted{ false };
+    WORD        _fault_addr{ 0 };
+
+    // Generated streams never write their own code, lockstep lanes could not follow if they did
+    bool Accessible(WORD addr, WORD size, bool write = false)
+    {
+        return (addr % size == 0 || Trap(addr)) && Contains(addr, size, write);
+    }
+
+    bool Contains(WORD addr, WORD size, bool write = false)
+    {
+        return (_ram.Contains(addr, size) && (!write || addr + size <= kCode)) || Trap(addr);
+    }
+
+    // base is the value r2 holds afterwards, written before a loaded value
+    void LoadStore(Instruction op, Register r1, Register r2, WORD addr, WORD base)
+    {
+        WORD value = 0;
+        switch (op)
+        {
+        case Instruction::LB:   value = static_cast<WORD>(static_cast<int8_t>(_ram.ReadByte(addr)));     break;
+        case Instruction::LBU:  value = _ram.ReadByte(addr);                                            break;
+        case Instruction::LH:   value = static_cast<WORD>(static_cast<int16_t>(_ram.ReadHWord(addr)));   break;
+        case Instruction::LHU:  value = _ram.ReadHWord(addr);                                           break;
+        case Instruction::LW:   case Instruction::LWU:  value = _ram.ReadWord(addr);                    break;
+        case Instruction::SB:   _ram.WriteByte(addr, _core.Reg(r1));                                    break;
+        case Instruction::SH:   _ram.WriteHWord(addr, _core.Reg(r1));                                   break;
+        default:                _ram.WriteWord(addr, _core.Reg(r1));                                    break;
+        }
+
+        _core.Reg(r2) = base;
+        if (op != Instruction::SB && op != Instruction::SH && op != Instruction::SW)
+            _core.Reg(r1) = value;
+    }
+
+    static WORD Frame(WORD list)
+    {
+        WORD size = 0;
+        for (WORD r = 1; r <= 9; ++r)
+            size += ((list >> r) & 1) * sizeof(WORD);
+        return size;
+    }
+
+    // One PUSH/POP per listed register: PUSHM pushes from RA down, POPM pops from R1 up
+    void Multiple(WORD list, bool push)
+    {
+        for (WORD k = 1; k <= 9; ++k)
+        {
+            WORD r = push ? 10 - k : k;
+            if (!((list >> r) & 1))
+                continue;
+
+            if (push)
+                _ram.WriteWord(_core.Reg(Register::SP) -= sizeof(WORD), _core.Reg(static_cast<Register>(r)));
+            else
+            {
+                _core.Reg(static_cast<Register>(r)) = _ram.ReadWord(_core.Reg(Register::SP));
+                _core.Reg(Register::SP) += sizeof(WORD);
+            }
+        }
+    }
+
+    // One chunk as the ascending byte loop MEMCPY/MEMSET promise, not a host memmove
+    void BlockMemory(Register dst, Register src, Register len, bool fill)
+    {
+        WORD to = _core.Reg(dst);
+        WORD from = _core.Reg(src);
+        WORD n = BlockChunk(to, fill ? to : from, _core.Reg(len));
+
+        for (WORD k = 0; k < n; ++k)
+            _ram.WriteByte(to + k, fill ? from : _ram.ReadByte(from + k));
+
+        _core.Reg(dst) += n;
+        if (!fill)
+            _core.Reg(src) += n;
+        _core.Reg(len) -= n;
+
+        if (_core.Reg(len) != 0)
+            _core.Reg(Register::IP) -= sizeof(WORD);
+    }
+
+    bool Trap(WORD addr)
+    {
+        _faulted = true;
+        _fault_addr = addr;
+        return false;
+    }
+};
+
+// ====================== COMPARISON =========================
+
+static std::string Hex(WORD value)
+{
+    char buffer[16];
+    std::snprintf(buffer, sizeof(buffer), "%08x", value);
+    return buffer;
+}
+
+static bool IsReferenceFault(const std::string& failure)
+{
+    return failure.rfind("reference:", 0) == 0;
+}
+
+static std::string Diff(const char* engine, uint64_t retired, const WORD* expected, const BYTE* expected_memory,
+                        const WORD* actual, const BYTE* actual_memory)
+{
+    char buffer[160];
+
+    for (size_t r = 0; r < kRegs; ++r)
+    {
+        if (expected[r] != actual[r])
+        {
+            std::snprintf(buffer, sizeof(buffer), "%s: register %zu is 0x%08x, expected 0x%08x after %llu instructions",
+                          engine, r, actual[r], expected[r], static_cast<unsigned long long>(retired));
+            return buffer;
+        }
+    }
+
+    for (WORD addr = 0; addr < kMemory; ++addr)
+    {
+        if (expected_memory[addr] != actual_memory[addr])
+        {
+            std::snprintf(buffer, sizeof(buffer), "%s: RAM[0x%04x] is 0x%02x, expected 0x%02x after %llu instructions",
+                          engine, addr, actual_memory[addr], expected_memory[addr], static_cast<unsigned long long>(retired));
+            return buffer;
+        }
+    }
+
+    return {};
+}
+
+template<typename CoreType>
+static std::string Compare(const char* engine, Reference& ref, CoreType& core, RAM& ram)
+{
+    std::array<WORD, kRegs> expected, actual;
+    for (size_t r = 0; r < kRegs; ++r)
+    {
+        expected[r] = ref.Cpu().Reg(static_cast<Register>(r));
+        actual[r] = core.Reg(static_cast<Register>(r));
+    }
+
+    std::string diff = Diff(engine, ref.Retired(), expected.data(), ref.Memory().Data(0, kMemory),
+                            actual.data(), ram.Data(0, kMemory));
+    if (diff.empty() && core.Halted() != ref.Cpu().Halted())
+        diff = std::string(engine) + ": halt state differs";
+
+    return diff;
+}
+
+// Empty when every engine agrees with the reference
+static std::string Check(const Program& program)
+{
+    Reference ref{ program, 0 };
+
+    RAM step_ram{ kMemory }, flat_ram{ kMemory }, paged_ram{ kMemory };
+    FlatCore step{ step_ram }, flat{ flat_ram };
+    Core paged{ paged_ram };
+    Load(program, 0, step_ram, step);
+    Load(program, 0, flat_ram, flat);
+    Load(program, 0, paged_ram, paged);
+
+    std::mt19937_64 chunks{ program.seed };
+    while (ref.Retired() < kBudget)
+    {
+        uint64_t before = ref.Retired();
+        uint64_t chunk = 1 + chunks() % 64;
+        while (ref.Retired() - before < chunk && ref.Step())
+        {
+        }
+
+        if (ref.Faulted())
+            return "reference: program traps at 0x" + Hex(ref.FaultAddress());
+
+        uint64_t retired = ref.Retired() - before;
+        for (uint64_t i = 0; i < retired; ++i)
+            step.Step();
+
+        if (flat.Run(retired) != retired || paged.Run(retired) != retired)
+            return "Run retired a different number of instructions after " + std::to_string(before);
+
+        for (std::string diff : { Compare("step", ref, step, step_ram),
+                                  Compare("flat", ref, flat, flat_ram),
+                                  Compare("paged", ref, paged, paged_ram) })
+        {
+            if (!diff.empty())
+                return diff;
+        }
+
+        if (ref.Cpu().Halted())
+            break;
+    }
+
+    LockstepCore<kLanes> lanes{ kMemory };
+    for (size_t lane = 0; lane < kLanes; ++lane)
+    {
+        ::memcpy(lanes.Memory(lane) + kData, program.data.data(), program.data.size());
+        for (size_t i = 0; i < program.code.size(); ++i)
+            ::memcpy(lanes.Memory(lane) + kCode + i * sizeof(WORD), &program.code[i], sizeof(WORD));
+
+        for (size_t r = 0; r < program.init[lane].size(); ++r)
+            lanes.Reg(lane, static_cast<Register>(r)) = program.init[lane][r];
+        Initialize(program, lanes.Reg(lane, Register::SP), lanes.Reg(lane, Register::RA), lanes.Reg(lane, Register::IP));
+    }
+
+    lanes.Run(kBudget);
+
+    for (size_t lane = 0; lane < kLanes; ++lane)
+    {
+        Reference lane_ref{ program, lane };
+        while (lane_ref.Retired() < lanes.Retired(lane) && lane_ref.Step())
+        {
+        }
+
+        // A faulted lane stopped on the faulting instruction, which the reference has yet to try
+        bool faulted = lanes.State(lane) == LaneState::Faulted;
+        if (faulted)
+            lane_ref.Step();
+
+        if (lane_ref.Faulted())
+            return "reference: program traps at 0x" + Hex(lane_ref.FaultAddress()) + " in lane " + std::to_string(lane);
+        if (faulted)
+            return "lockstep: lane " + std::to_string(lane) + " faulted";
+
+        std::array<WORD, kRegs> expected, actual;
+        for (size_t r = 0; r < kRegs; ++r)
+        {
+            expected[r] = lane_ref.Cpu().Reg(static_cast<Register>(r));
+            actual[r] = lanes.Reg(lane, static_cast<Register>(r));
+        }
+
+        std::string engine = "lockstep lane " + std::to_string(lane);
+        std::string diff = Diff(engine.c_str(), lane_ref.Retired(), expected.data(), lane_ref.Memory().Data(0, kMemory),
+                                actual.data(), lanes.Memory(lane));
+        if (!diff.empty())
+            return diff;
+    }
+
+    return {};
+}
+
+// NOPs out every instruction the failure does not depend on
+static Program Minimize(Program program)
+{
+    bool progress = true;
+    while (progress)
+    {
+        progress = false;
+        for (size_t i = 0; i + 1 < program.code.size(); ++i)
+        {
+            if (program.code[i] == kNop)
+                continue;
+
+            WORD saved = program.code[i];
+            program.code[i] = kNop;
+
+            std::string failure = Check(program);
+            if (failure.empty() || IsReferenceFault(failure))
+                program.code[i] = saved;
+            else
+                progress = true;
+        }
+    }
+
+    return program;
+}
+
+static void Report(const Program& failing)
+{
+    std::string failure = Check(failing);
+    std::fprintf(stderr, "seed %llu: %s\n", static_cast<unsigned long long>(failing.seed), failure.c_str());
+
+    // A trapping program is a generator bug, there is nothing to minimize against
+    Program minimized = IsReferenceFault(failure) ? failing : Minimize(failing);
+
+    std::fprintf(stderr, "minimized: %s\n", Check(minimized).c_str());
+
+    for (size_t r = 1; r < minimized.init[0].size(); ++r)
+        std::fprintf(stderr, "    R%zu = 0x%08x\n", r, minimized.init[0][r]);
+
+    for (size_t i = 0; i < minimized.code.size(); ++i)
+    {
+        WORD instruction = minimized.code[i];
+        if (instruction == kNop)
+            continue;
+
+        std::fprintf(stderr, "    %04zx: %08x    op %2u  r1 %2u  r2 %2u  r3 %2u  imm 0x%04x\n",
+                     kCode + i * sizeof(WORD), instruction, instruction >> 26, (instruction >> 21) & 0x1F,
+                     (instruction >> 16) & 0x1F, (instruction >> 11) & 0x1F, instruction & 0xFFFF);
+    }
+}
+
+// ====================== DRIVER =============================
+
+int main(int argc, char** argv)
+{
+    uint64_t programs = 100'000;
+    double seconds = 0;
+    uint64_t first_seed = 1;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string option = argv[i];
+        if (option == "--programs")
+            programs = std::strtoull(argv[i + 1], nullptr, 0);
+        else if (option == "--seconds")
+            seconds = std::strtod(argv[i + 1], nullptr);
+        else if (option == "--threads")
+            threads = std::max(1ul, std::strtoul(argv[i + 1], nullptr, 0));
+        else if (option == "--seed")
+            first_seed = std::strtoull(argv[i + 1], nullptr, 0);
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--programs N] [--seconds S] [--threads T] [--seed S]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // --seconds runs until the deadline instead of a fixed count
+    if (seconds > 0)
+        programs = ~uint64_t{ 0 };
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+
+    std::atomic<uint64_t> next{ 0 };
+    std::atomic<bool> failed{ false };
+    std::mutex report;
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&]() {
+            for (uint64_t i = next++; i < programs && !failed; i = next++)
+            {
+                if (seconds > 0 && std::chrono::steady_clock::now() >= deadline)
+                    break;
+
+                Program program = Generate(first_seed + i);
+                if (Check(program).empty())
+                    continue;
+
+                if (!failed.exchange(true))
+                {
+                    std::lock_guard<std::mutex> lock(report);
+                    Report(program);
+                }
+            }
+        });
+    }
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t done = std::min(next.load(), programs);
+    std::printf("%llu programs, %u threads, %.1f s, %.0f programs/s\n", static_cast<unsigned long long>(done),
+                threads, elapsed, done / elapsed);
+
+    return failed ? 1 : 0;
+}
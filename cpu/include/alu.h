@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+
+#include "isa.h"
+
+//  Multiply/divide results shared by every engine. Division never traps:
+//
+//      DIV/DIVU    x / 0           = 0xFFFFFFFF
+//      REM         x % 0           = x
+//      DIV         INT_MIN / -1    = INT_MIN
+//      REM         INT_MIN % -1    = 0
+//
+//  Signed division truncates toward zero, the remainder takes the sign of the dividend.
+
+inline WORD MultiplyHigh(WORD op1, WORD op2)
+{
+    int64_t product = static_cast<int64_t>(static_cast<int32_t>(op1)) * static_cast<int32_t>(op2);
+    return static_cast<WORD>(static_cast<DWORD>(product) >> 32);
+}
+
+inline WORD MultiplyHighUnsigned(WORD op1, WORD op2)
+{
+    return static_cast<WORD>((static_cast<DWORD>(op1) * op2) >> 32);
+}
+
+inline bool DivisionOverflows(WORD op1, WORD op2)
+{
+    return op1 == static_cast<WORD>(std::numeric_limits<int32_t>::min()) && op2 == 0xFFFFFFFF;
+}
+
+inline WORD DivideSigned(WORD op1, WORD op2)
+{
+    if (op2 == 0)
+        return 0xFFFFFFFF;
+    if (DivisionOverflows(op1, op2))
+        return op1;
+
+    return static_cast<WORD>(static_cast<int32_t>(op1) / static_cast<int32_t>(op2));
+}
+
+inline WORD DivideUnsigned(WORD op1, WORD op2)
+{
+    return op2 == 0 ? 0xFFFFFFFF : op1 / op2;
+}
+
+inline WORD RemainderSigned(WORD op1, WORD op2)
+{
+    if (op2 == 0)
+        return op1;
+    if (DivisionOverflows(op1, op2))
+        return 0;
+
+    return static_cast<WORD>(static_cast<int32_t>(op1) % static_cast<int32_t>(op2));
+}
+
+//  Packed (SWAR) lanes: 4 x 8 bit or 2 x 16 bit, lane 0 is the least significant and
+//  so the lowest addressed byte of a loaded WORD. Saturating add/sub are unsigned.
+//  Carries are kept inside a lane by adding the low 7 (15) bits separately from the top bit.
+
+constexpr WORD LANE8_HIGH   = 0x80808080;
+constexpr WORD LANE8_LOW    = 0x7F7F7F7F;
+constexpr WORD LANE16_HIGH  = 0x80008000;
+constexpr WORD LANE16_LOW   = 0x7FFF7FFF;
+
+// Top bit of every lane that overflowed, to a full lane mask
+inline WORD LaneMask(WORD top_bits, WORD lane_bits)
+{
+    return (top_bits >> (lane_bits - 1)) * ((WORD{ 1 } << lane_bits) - 1);
+}
+
+inline WORD SaturatingAdd(WORD a, WORD b, WORD high, WORD low, WORD lane_bits)
+{
+    WORD sum = ((a & low) + (b & low)) ^ ((a ^ b) & high);
+    WORD carry = ((a & b) | ((a | b) & ~sum)) & high;
+    return sum | LaneMask(carry, lane_bits);
+}
+
+inline WORD SaturatingSub(WORD a, WORD b, WORD high, WORD low, WORD lane_bits)
+{
+    WORD diff = ((a | high) - (b & low)) ^ ((a ^ ~b) & high);
+    WORD borrow = ((~a & b) | ((~a | b) & diff)) & high;
+    return diff & ~LaneMask(borrow, lane_bits);
+}
+
+inline WORD SaturatingAdd8(WORD a, WORD b)
+{
+    return SaturatingAdd(a, b, LANE8_HIGH, LANE8_LOW, 8);
+}
+
+inline WORD SaturatingSub8(WORD a, WORD b)
+{
+    return SaturatingSub(a, b, LANE8_HIGH, LANE8_LOW, 8);
+}
+
+inline WORD SaturatingAdd16(WORD a, WORD b)
+{
+    return SaturatingAdd(a, b, LANE16_HIGH, LANE16_LOW, 16);
+}
+
+inline WORD SaturatingSub16(WORD a, WORD b)
+{
+    return SaturatingSub(a, b, LANE16_HIGH, LANE16_LOW, 16);
+}
+
+// Top bit set in every zero byte, exact (no false positives above a zero byte)
+inline WORD ZeroBytes(WORD value)
+{
+    return ~(((value & LANE8_LOW) + LANE8_LOW) | value | LANE8_LOW);
+}
+
+inline WORD EqualBytes(WORD a, WORD b)
+{
+    return LaneMask(ZeroBytes(a ^ b), 8);
+}
+
+// Index of the first zero byte, 4 if there is none
+inline WORD FirstZeroByte(WORD value)
+{
+    WORD zeros = ZeroBytes(value);
+    return zeros == 0 ? 4 : static_cast<WORD>(std::countr_zero(zeros)) / 8;
+}
+
+// Byte i of the result is byte (selector.byte[i] & 3) of value, or 0 when bit 7 of the selector byte is set
+inline WORD ShuffleBytes(WORD value, WORD selector)
+{
+    WORD res = 0;
+    for (WORD i = 0; i < 4; ++i)
+    {
+        WORD sel = (selector >> (8 * i)) & 0xFF;
+        WORD byte = (value >> (8 * (sel & 3))) & 0xFF;
+        res |= (sel & 0x80 ? 0 : byte) << (8 * i);
+    }
+
+    return res;
+}
+
+//  Block memory instructions move at most one page per retired instruction, and never more
+//  than dst - src bytes when the destination overlaps just above the source, so each chunk
+//  is a plain host copy with the result of an ascending byte loop.
+
+constexpr WORD BLOCK_CHUNK = 4096;
+
+inline WORD BlockChunk(WORD dst, WORD src, WORD len)
+{
+    WORD n = std::min({ len, BLOCK_CHUNK - dst % BLOCK_CHUNK, BLOCK_CHUNK - src % BLOCK_CHUNK });
+    if (dst > src && dst - src < n)
+        n = dst - src;
+
+    return n;
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdexcept>
+#include <string>
+
+#include "isa.h"
+#include "ram.h"
+#include "interrupts.h"
+
+//  Request ring, placed in guest RAM at ring_base (WORD aligned):
+//
+//      +0      WORD            avail_idx   # guest: number of requests submitted
+//      +4      WORD            used_idx    # device: number of requests completed
+//      +8      BlockRequest[N]             # request idx lives in slot idx % N
+//
+//  BlockRequest (16 bytes):
+//
+//      +0      HWORD           op          # BlockOp
+//      +2      HWORD           status      # BlockStatus, written on completion
+//      +4      WORD            sector      # file offset in SECTOR_SIZE units
+//      +8      WORD            addr        # guest buffer
+//      +12     WORD            len         # bytes to transfer
+//
+//  Every request is a single pread/pwrite between the backing file and the guest
+//  buffer inside RAM, no bounce buffer. The guest polls used_idx for completion, or
+//  takes Interrupt::Block when the device is connected to an interrupt controller.
+//  An avail_idx more than N requests ahead of used_idx is a broken ring, nothing is
+//  serviced until the guest puts it right.
+
+enum class BlockOp : HWORD
+{
+    READ = 0,
+    WRITE,
+    FLUSH
+};
+
+enum class BlockStatus : HWORD
+{
+    PENDING = 0,
+    OK,
+    IO_ERROR,
+    BAD_REQUEST
+};
+
+class BlockDevice
+{
+public:
+    static constexpr WORD SECTOR_SIZE  = 512;
+    static constexpr WORD HEADER_SIZE  = 2 * sizeof(WORD);
+    static constexpr WORD REQUEST_SIZE = 16;
+
+    BlockDevice(RAM& ram, const std::string& path, bool read_only = false):
+    _ram(ram),
+    _read_only(read_only)
+    {
+        _fd = ::open(path.c_str(), read_only ? O_RDONLY : O_RDWR);
+        if (_fd < 0)
+            throw std::runtime_error(std::string("Can't open block device image: ") + path);
+    }
+
+    ~BlockDevice()
+    {
+        ::close(_fd);
+    }
+
+    BlockDevice(const BlockDevice&) = delete;
+    BlockDevice& operator=(const BlockDevice&) = delete;
+
+    void Configure(WORD ring_base, WORD ring_size)
+    {
+        if (ring_size == 0 || (ring_size & (ring_size - 1)) != 0)
+            throw std::runtime_error("Block device ring size must be a power of two");
+
+        // In 64 bits, a big enough ring_size wraps the size in WORD around to next to nothing
+        uint64_t bytes = HEADER_SIZE + uint64_t{ ring_size } * REQUEST_SIZE;
+        if (ring_base % sizeof(WORD) != 0 || bytes > _ram.Size() || !_ram.Contains(ring_base, static_cast<WORD>(bytes)))
+            throw std::runtime_error("Invalid block device ring address");
+
+        _ring_base = ring_base;
+        _ring_size = ring_size;
+        _used = _ram.ReadWord(_ring_base + sizeof(WORD));
+    }
+
+    void ConnectInterrupt(InterruptController& interrupts)
+    {
+        _interrupts = &interrupts;
+    }
+
+    // Services every request submitted since the last call, returns how many completed
+    WORD Process()
+    {
+        WORD avail = _ram.ReadWord(_ring_base);
+        WORD done = 0;
+        if (avail - _used > _ring_size)
+            return 0;
+
+        for (; _used != avail; ++done)
+        {
+            WORD req = _ring_base + HEADER_SIZE + (_used & (_ring_size - 1)) * REQUEST_SIZE;
+
+            BlockOp op      = static_cast<BlockOp>(_ram.ReadHWord(req));
+            WORD    sector  = _ram.ReadWord(req + 4);
+            WORD    addr    = _ram.ReadWord(req + 8);
+            WORD    len     = _ram.ReadWord(req + 12);
+
+            _ram.WriteHWord(req + 2, static_cast<HWORD>(Execute(op, sector, addr, len)));
+            _ram.WriteWord(_ring_base + sizeof(WORD), ++_used);
+        }
+
+        if (done != 0 && _interrupts)
+            _interrupts->Raise(Interrupt::Block);
+
+        return done;
+    }
+
+    // Size of the backing file in sectors
+    uint64_t Capacity() const
+    {
+        struct stat st;
+        if (::fstat(_fd, &st) != 0)
+            return 0;
+
+        return static_cast<uint64_t>(st.st_size) / SECTOR_SIZE;
+    }
+
+private:
+    RAM&    _ram;
+    InterruptController* _interrupts{ nullptr };
+    int     _fd{ -1 };
+    bool    _read_only{ false };
+    WORD    _ring_base{ 0 };
+    WORD    _ring_size{ 1 };
+    WORD    _used{ 0 };
+
+    BlockStatus Execute(BlockOp op, WORD sector, WORD addr, WORD len)
+    {
+        off_t offset = static_cast<off_t>(sector) * SECTOR_SIZE;
+
+        switch (op)
+        {
+        case BlockOp::READ:
+            if (!_ram.Contains(addr, len))
+                return BlockStatus::BAD_REQUEST;
+            _ram.MarkDirty(addr, len);
+            return Transfer([](int fd, BYTE* buf, size_t n, off_t off) { return ::pread(fd, buf, n, off); },
+                            _ram.Data(addr, len), len, offset);
+        case BlockOp::WRITE:
+            if (_read_only || !_ram.Contains(addr, len))
+                return BlockStatus::BAD_REQUEST;
+            return Transfer([](int fd, BYTE* buf, size_t n, off_t off) { return ::pwrite(fd, buf, n, off); },
+                            _ram.Data(addr, len), len, offset);
+        case BlockOp::FLUSH:
+            return ::fdatasync(_fd) == 0 ? BlockStatus::OK : BlockStatus::IO_ERROR;
+        default:
+            return BlockStatus::BAD_REQUEST;
+        }
+    }
+
+    template<typename IO>
+    BlockStatus Transfer(IO io, BYTE* buf, WORD len, off_t offset)
+    {
+        while (len > 0)
+        {
+            ssize_t n = io(_fd, buf, len, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return BlockStatus::IO_ERROR;
+
+            buf += n;
+            len -= static_cast<WORD>(n);
+            offset += n;
+        }
+
+        return BlockStatus::OK;
+    }
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "isa.h"
+#include "mmu.h"
+
+//  Per machine resource limits for hosting untrusted guests. BasicCore::Run checks them
+//  between blocks and returns early once one is reached, the core stays resumable and runs
+//  on after the limit is raised. All counts are over the lifetime of the core.
+//
+//  Instructions are exact: no block or trace pass starts that would cross the limit.
+//  Wall time is sampled every CLOCK_INTERVAL blocks or traces and pages once per block or
+//  trace pass, so a run can pass either by what one interval or one pass takes.
+
+enum class Limit : uint8_t
+{
+    None = 0,
+    Instructions,
+    WallTime,
+    Pages
+};
+
+struct Limits
+{
+    static constexpr uint64_t UNLIMITED = std::numeric_limits<uint64_t>::max();
+
+    uint64_t    instructions{ UNLIMITED };
+    uint64_t    nanoseconds{ UNLIMITED };   // wall time spent inside Run
+    uint64_t    pages{ UNLIMITED };         // distinct guest pages loaded from or stored to
+};
+
+struct Usage
+{
+    uint64_t    instructions{ 0 };
+    uint64_t    nanoseconds{ 0 };
+    uint64_t    pages{ 0 };                 // counted only while a page limit is set
+};
+
+// Guest pages seen by loads and stores, by virtual address. One bit per page, allocated
+// on first use.
+class PageSet
+{
+public:
+
+    bool Tracking() const
+    {
+        return _tracking;
+    }
+
+    void SetTracking(bool tracking)
+    {
+        if (tracking && _bits.empty())
+            _bits.resize((size_t{ 1 } << (32 - Mmu::PAGE_SHIFT)) / 64, 0);
+        _tracking = tracking;
+    }
+
+    void Touch(WORD addr)
+    {
+        WORD page = addr >> Mmu::PAGE_SHIFT;
+        uint64_t& word = _bits[page / 64];
+        uint64_t bit = uint64_t{ 1 } << (page % 64);
+        if (!(word & bit))
+        {
+            word |= bit;
+            ++_count;
+        }
+    }
+
+    uint64_t Count() const
+    {
+        return _count;
+    }
+
+    void Clear()
+    {
+        std::fill(_bits.begin(), _bits.end(), 0);
+        _count = 0;
+    }
+
+private:
+    std::vector<uint64_t>   _bits;
+    uint64_t                _count{ 0 };
+    bool                    _tracking{ false };
+};
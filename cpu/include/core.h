@@ -1,18 +1,37 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <assert.h>
+#include <bit>
+#include <chrono>
 #include <limits>
+#include <string.h>
+#include <vector>
 
 #include <isa.h>
 #include <ram.h>
-
-class Core
+#include <interrupts.h>
+#include <memory_policy.h>
+#include <core_features.h>
+#include <predecode.h>
+#include <alu.h>
+#include <budget.h>
+#include <debug.h>
+
+// Memory is a policy from memory_policy.h, Features a FeatureSet from core_features.h.
+// Common combinations are instantiated once in core.cpp, see the aliases at the bottom.
+template<typename Memory, typename Features>
+class BasicCore
 {
+    static_assert(BLOCK_CHUNK == Mmu::PAGE_SIZE, "block memory chunks must not cross a page");
+    static_assert(DEVICE_BUSY > BREAKPOINT, "fault causes past the ISA interrupts must not collide");
+
 public:
+    using RegisterFile = std::array<WORD, static_cast<size_t>(Register::__NUM)>;
     
-    Core(RAM& ram):
-    _ram(ram)
+    BasicCore(RAM& ram):
+    _memory(ram)
     {
     }
 
@@ -42,6 +61,85 @@ public:
         Reg(reg1) = static_cast<WORD>(imm) << (sizeof(HWORD) * 8);
     }
 
+    void AddWithCarry(Register dst, Register reg1, Register reg2)
+    {
+        Reg(dst) = DoAdd(Reg(reg1), Reg(reg2), GetFlag(Flag::Carry));
+    }
+
+    void SubWithBorrow(Register dst, Register reg1, Register reg2)
+    {
+        Reg(dst) = DoSub(Reg(reg1), Reg(reg2), GetFlag(Flag::Carry));
+    }
+
+//  =================== MULTIPLY/DIVIDE =======================
+
+    void Mul(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, Reg(reg1) * Reg(reg2));
+    }
+
+    void MulHigh(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, MultiplyHigh(Reg(reg1), Reg(reg2)));
+    }
+
+    void MulHighUnsigned(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, MultiplyHighUnsigned(Reg(reg1), Reg(reg2)));
+    }
+
+    void Div(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, DivideSigned(Reg(reg1), Reg(reg2)));
+    }
+
+    void DivUnsigned(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, DivideUnsigned(Reg(reg1), Reg(reg2)));
+    }
+
+    void Rem(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, RemainderSigned(Reg(reg1), Reg(reg2)));
+    }
+
+//  ======================== PACKED ===========================
+
+    void AddSaturateBytes(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, SaturatingAdd8(Reg(reg1), Reg(reg2)));
+    }
+
+    void SubSaturateBytes(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, SaturatingSub8(Reg(reg1), Reg(reg2)));
+    }
+
+    void AddSaturateHalves(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, SaturatingAdd16(Reg(reg1), Reg(reg2)));
+    }
+
+    void SubSaturateHalves(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, SaturatingSub16(Reg(reg1), Reg(reg2)));
+    }
+
+    void CompareBytes(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, EqualBytes(Reg(reg1), Reg(reg2)));
+    }
+
+    void FindZeroByte(Register dst, Register reg)
+    {
+        SetResult(dst, FirstZeroByte(Reg(reg)));
+    }
+
+    void Shuffle(Register dst, Register reg1, Register reg2)
+    {
+        SetResult(dst, ShuffleBytes(Reg(reg1), Reg(reg2)));
+    }
+
 //  ======================== SHIFTS ===========================
 
     void ShiftLeft(Register dst, Register reg1, Register reg2)
@@ -51,7 +149,7 @@ public:
 
     void ShiftLeftImmediate(Register dst, Register reg1, WORD imm)
     {
-        WORD tmp = Reg(reg1) << imm;
+        WORD tmp = Reg(reg1) << (imm & 0x1F);
         UpdateZeroFlag(tmp);
         UpdateNegativeFlag(tmp);
         Reg(dst) = tmp;
@@ -64,7 +162,7 @@ public:
 
     void ShiftRightImmediate(Register dst, Register reg1, WORD imm)
     {
-        WORD tmp = Reg(reg1) >> imm;
+        WORD tmp = Reg(reg1) >> (imm & 0x1F);
         UpdateZeroFlag(tmp);
         UpdateNegativeFlag(tmp);
         Reg(dst) = tmp;
@@ -120,42 +218,91 @@ public:
 
     void LoadByte(Register reg1, Register addr)
     {
-        Reg(reg1) = ExtendSign(_ram.ReadByte(Reg(addr)));
+        BYTE tmp;
+        if (Load(Reg(addr), tmp))
+            Reg(reg1) = ExtendSign(tmp);
     }
 
     void LoadByteUnsigned(Register reg1, Register addr)
     {
-        Reg(reg1) = static_cast<WORD>(_ram.ReadByte(Reg(addr)));
+        BYTE tmp;
+        if (Load(Reg(addr), tmp))
+            Reg(reg1) = static_cast<WORD>(tmp);
     }
 
     void LoadHWord(Register reg1, Register addr)
     {
-        Reg(reg1) = ExtendSign(_ram.ReadHWord(Reg(addr)));
+        HWORD tmp;
+        if (Load(Reg(addr), tmp))
+            Reg(reg1) = ExtendSign(tmp);
     }
 
     void LoadHWordUnsigned(Register reg1, Register addr)
     {
-        Reg(reg1) = static_cast<WORD>(_ram.ReadHWord(Reg(addr)));
+        HWORD tmp;
+        if (Load(Reg(addr), tmp))
+            Reg(reg1) = static_cast<WORD>(tmp);
     }
 
     void LoadWord(Register reg1, Register addr)
     {
-        Reg(reg1) = _ram.ReadWord(Reg(addr));
+        WORD tmp;
+        if (Load(Reg(addr), tmp))
+            Reg(reg1) = tmp;
     }
 
     void StoreByte(Register reg1, Register addr)
     {
-        _ram.WriteByte(Reg(addr), Reg(reg1));
+        Store(Reg(addr), static_cast<BYTE>(Reg(reg1)));
     }
 
     void StoreHWord(Register reg1, Register addr)
     {
-        _ram.WriteHWord(Reg(addr), Reg(reg1));
+        Store(Reg(addr), static_cast<HWORD>(Reg(reg1)));
     }
 
     void StoreWord(Register reg1, Register addr)
     {
-        _ram.WriteWord(Reg(addr), Reg(reg1));
+        Store(Reg(addr), Reg(reg1));
+    }
+
+    // One chunk per call (see BlockChunk in alu.h), IP stays on the instruction until len is 0
+    void BlockCopy(Register dst, Register src, Register len)
+    {
+        WORD n = BlockChunk(Reg(dst), Reg(src), Reg(len));
+        if (n != 0)
+        {
+            const BYTE* from = Span(Reg(src), n, Access::Read);
+            if (!from)
+                return;
+            BYTE* to = Span(Reg(dst), n, Access::Write);
+            if (!to)
+                return;
+
+            ::memmove(to, from, n);
+            Reg(dst) += n;
+            Reg(src) += n;
+            Reg(len) -= n;
+        }
+
+        RepeatUntilDone(len);
+    }
+
+    void BlockSet(Register dst, Register value, Register len)
+    {
+        WORD n = BlockChunk(Reg(dst), Reg(dst), Reg(len));
+        if (n != 0)
+        {
+            BYTE* to = Span(Reg(dst), n, Access::Write);
+            if (!to)
+                return;
+
+            ::memset(to, static_cast<BYTE>(Reg(value)), n);
+            Reg(dst) += n;
+            Reg(len) -= n;
+        }
+
+        RepeatUntilDone(len);
     }
 
 //  ====================== COMPARE ============================
@@ -240,18 +387,92 @@ public:
         Reg(Register::IP) = Reg(Register::RA);
     }
 
+    void RetInterrupt()
+    {
+        Reg(Register::IP) = Reg(Register::EIP);
+        Reg(Register::FLAGS) = Reg(Register::EFLAGS);
+        Reg(Register::RA) = Reg(Register::ERA);
+    }
+
 // ====================== STACK ==============================
 
     void Push(Register src)
     {
-        Reg(Register::SP) -= sizeof(WORD);
-        _ram.WriteWord(Reg(Register::SP), Reg(src));
+        WORD sp = Reg(Register::SP) - sizeof(WORD);
+        if (Store(sp, Reg(src)))
+            Reg(Register::SP) = sp;
     }
 
     void Pop(Register dst)
     {
-        Reg(dst) = _ram.ReadWord(Reg(Register::SP));
+        WORD tmp;
+        if (!Load(Reg(Register::SP), tmp))
+            return;
+
         Reg(Register::SP) += sizeof(WORD);
+        Reg(dst) = tmp;
+    }
+
+    // Listed registers in ascending order from the lowest address, see isa.h
+    void PushMultiple(WORD list)
+    {
+        list &= REGISTER_LIST;
+        WORD size = ListSize(list);
+        WORD sp = Reg(Register::SP) - size;
+        BYTE* high;
+        WORD split;
+        BYTE* low = size != 0 ? Frame(sp, size, Access::Write, high, split) : nullptr;
+        if (!low)
+            return;
+
+        for (WORD bits = list, offset = 0; bits != 0; bits &= bits - 1, offset += sizeof(WORD))
+        {
+            BYTE* slot = offset < split ? low + offset : high + (offset - split);
+            ::memcpy(slot, &Reg(static_cast<Register>(std::countr_zero(bits))), sizeof(WORD));
+        }
+
+        Reg(Register::SP) = sp;
+    }
+
+    void PopMultiple(WORD list)
+    {
+        list &= REGISTER_LIST;
+        WORD size = ListSize(list);
+        WORD sp = Reg(Register::SP);
+        BYTE* high;
+        WORD split;
+        const BYTE* low = size != 0 ? Frame(sp, size, Access::Read, high, split) : nullptr;
+        if (!low)
+            return;
+
+        for (WORD bits = list, offset = 0; bits != 0; bits &= bits - 1, offset += sizeof(WORD))
+        {
+            const BYTE* slot = offset < split ? low + offset : high + (offset - split);
+            ::memcpy(&Reg(static_cast<Register>(std::countr_zero(bits))), slot, sizeof(WORD));
+        }
+
+        Reg(Register::SP) = sp + size;
+    }
+
+// ====================== MISC ===============================
+
+    void Halt()
+    {
+        _halted = true;
+    }
+
+    // Sleeps until an interrupt is pending, unless one already is. A sleeping core retires
+    // nothing for TIMER to count, so a running TIMER expires right away.
+    void WaitForInterrupt()
+    {
+        if (Reg(Register::TIMER) != 0)
+        {
+            Reg(Register::TIMER) = 0;
+            _interrupts.Raise(Interrupt::Timer);
+        }
+
+        if (!_interrupts.Pending())
+            _wait = Wait::Interrupt;
     }
 
 // ====================== PSEUDO ==============================
@@ -261,6 +482,296 @@ public:
         Reg(reg1) = op2;
     }
 
+// ===================== EXECUTION ===========================
+
+    // Executes one instruction at IP, then takes a pending fault or interrupt.
+    // Returns false once the core is halted.
+    bool Step()
+    {
+        if (_halted)
+            return false;
+
+        if (_stop != Stop::None && Resume())
+            return !_halted;
+
+        if (_wait != Wait::None && !Wake())
+            return true;
+
+        SyncPageTable();
+
+        WORD ip = Reg(Register::IP);
+        WORD instruction = 0;
+        DecodedInstruction decoded;
+
+        _fault = false;
+        if (Fetch(ip, instruction))
+        {
+            Reg(Register::IP) = ip + sizeof(WORD);
+            if (Decode(instruction, decoded))
+                Execute(decoded);
+            else
+                Fault(Interrupt::IllegalInstruction, ip);
+            Reg(Register::RZ) = 0;
+        }
+
+        InvalidateModifiedCode();
+
+        if (_fault)
+        {
+            TakeTrap(_fault_cause, ip);
+            return !_halted;
+        }
+
+        Retire(ip, instruction);
+        DeliverInterrupt();
+
+        return !_halted;
+    }
+
+    // Runs until halted, max_instructions retired, a limit reached (see budget.h), a debug
+    // stop (see debug.h) or a wait (see Waiting), returns the number retired. Whole
+    // predecoded blocks and hot loop traces (see predecode.h) run when nothing can
+    // interrupt them part way, Step covers the rest, so traps and interrupts land on the
+    // same instruction either way.
+    uint64_t Run(uint64_t max_instructions)
+    {
+        auto started = std::chrono::steady_clock::now();
+        uint64_t start = _retired;
+        uint64_t left = _limits.instructions > _retired ? _limits.instructions - _retired : 0;
+        uint64_t stop = start + std::min(max_instructions, left);
+        uint64_t time_left = _limits.nanoseconds > _nanoseconds ? _limits.nanoseconds - _nanoseconds : 0;
+        bool timed = _limits.nanoseconds != Limits::UNLIMITED;
+        unsigned clock = 1;
+
+        _limit_reached = Limit::None;
+        if (_stop != Stop::None && !_halted && _retired < stop)
+            Resume();
+        if (_wait != Wait::None && !_halted)
+            Wake();
+
+        while (!_halted && _stop == Stop::None && _wait == Wait::None && _retired < stop)
+        {
+            if (_pages.Count() > _limits.pages)
+            {
+                _limit_reached = Limit::Pages;
+                break;
+            }
+
+            if (timed && --clock == 0)
+            {
+                clock = CLOCK_INTERVAL;
+                if (Nanoseconds(started) >= time_left)
+                {
+                    _limit_reached = Limit::WallTime;
+                    break;
+                }
+            }
+
+            SyncPageTable();
+
+            Block* block = FindBlock(Reg(Register::IP));
+            if (!block || !CanRun(static_cast<WORD>(block->code.size()), stop - _retired))
+            {
+                StopRecording();
+                if (block && block->code.front().op == BREAK)
+                    ExecuteAt(block->code.front(), block->start);
+                else
+                    Step();
+                continue;
+            }
+
+            if (block->trace)
+            {
+                StopRecording();
+                if (RunTrace(*block->trace, stop))
+                    continue;
+            }
+
+            Record(*block);
+            if (!ExecuteBlock(*block))
+            {
+                StopRecording();
+                continue;
+            }
+
+            if (_recording_armed && Reg(Register::IP) == _recording_head)
+                FinishTrace();
+            else if (block->closes_loop && Reg(Register::IP) == block->loop_head && block->heat < _hot_loop &&
+                     ++block->heat == _hot_loop)
+                StartRecording(block->loop_head);
+        }
+
+        if (!_halted && _retired >= _limits.instructions)
+            _limit_reached = Limit::Instructions;
+
+        _nanoseconds += Nanoseconds(started);
+        return _retired - start;
+    }
+
+    // Page limits turn on page tracking, which costs a bitmap test per load and store
+    void SetLimits(const Limits& limits)
+    {
+        _limits = limits;
+        _pages.SetTracking(limits.pages != Limits::UNLIMITED);
+    }
+
+    const Limits& GetLimits() const
+    {
+        return _limits;
+    }
+
+    // Why the last Run returned early, Limit::None if it did not
+    Limit LimitReached() const
+    {
+        return _limit_reached;
+    }
+
+    Usage Accounting() const
+    {
+        return Usage{ _retired, _nanoseconds, _pages.Count() };
+    }
+
+    // Hot loop traces are on by default, off leaves blocks only
+    void SetTracing(bool enabled)
+    {
+        _hot_loop = enabled ? HOT_LOOP : 0;
+        FlushCodeCache();
+    }
+
+    // Back to a new core over the same memory and devices: registers from a template, no
+    // retired instructions, usage or pending interrupts and nothing predecoded. Limits and
+    // instrumentation are kept, RAM is the caller's (see RAM::ClearDirty).
+    void Reset(const RegisterFile& registers)
+    {
+        _reg_file = registers;
+        _reg_file[static_cast<size_t>(Register::RZ)] = 0;
+        _retired = 0;
+        _nanoseconds = 0;
+        _halted = false;
+        _trapped = false;
+        _fault = false;
+        _code_modified = false;
+        _limit_reached = Limit::None;
+        _stop = Stop::None;
+        _wait = Wait::None;
+        _pages.Clear();
+        _interrupts.Reset();
+        FlushCodeCache();
+
+        // Also drops TLB entries that could write without marking RAM dirty
+        if constexpr (Memory::PAGING)
+            _memory.MemoryManagement().SetBase(Reg(Register::PTB));
+    }
+
+    // Drops predecoded blocks, needed after the host writes guest code behind the core's back
+    void FlushCodeCache()
+    {
+        StopRecording();
+        _code.Clear();
+    }
+
+//  ===================== DEBUGGING ===========================
+
+    // Stops Run in front of the instruction at ip, false if there is one already
+    bool SetBreakpoint(WORD ip)
+    {
+        auto it = std::lower_bound(_breakpoints.begin(), _breakpoints.end(), ip);
+        if (it != _breakpoints.end() && *it == ip)
+            return false;
+
+        _breakpoints.insert(it, ip);
+        FlushCodeCache();
+        return true;
+    }
+
+    bool ClearBreakpoint(WORD ip)
+    {
+        auto it = std::lower_bound(_breakpoints.begin(), _breakpoints.end(), ip);
+        if (it == _breakpoints.end() || *it != ip)
+            return false;
+
+        _breakpoints.erase(it);
+        FlushCodeCache();
+        return true;
+    }
+
+    const std::vector<WORD>& Breakpoints() const
+    {
+        return _breakpoints;
+    }
+
+    // Stops Run and Step in front of guest loads (Access::Read) or stores (Access::Write)
+    // touching the physical range, see RAM::Watch. Cores sharing the RAM see the watch
+    // once they dropped their TLB and traces, which this does for this core only.
+    bool Watch(WORD addr, WORD size, Access access)
+    {
+        if (!_memory.Physical().Watch(addr, size, access))
+            return false;
+
+        WatchesChanged();
+        return true;
+    }
+
+    bool Unwatch(WORD addr, WORD size, Access access)
+    {
+        if (!_memory.Physical().Unwatch(addr, size, access))
+            return false;
+
+        WatchesChanged();
+        return true;
+    }
+
+    // Why the last Run or Step stopped in front of the instruction at IP, Stop::None if it didn't
+    Stop Stopped() const
+    {
+        return _stop;
+    }
+
+    // Guest address of the watched load or store, or the breakpoint
+    WORD StopAddress() const
+    {
+        return _stop_addr;
+    }
+
+    // Why the last Run or Step returned early without executing anything more, Wait::None
+    // if it did not. A core waiting for an interrupt continues once one is raised, one
+    // waiting on a busy device retries the access on the next Run or Step.
+    Wait Waiting() const
+    {
+        return _wait;
+    }
+
+    InterruptController& Interrupts()
+    {
+        return _interrupts;
+    }
+
+    Memory& MemorySystem()
+    {
+        return _memory;
+    }
+
+    Features& Instrumentation()
+    {
+        return _features;
+    }
+
+    bool Halted() const
+    {
+        return _halted;
+    }
+
+    // Halted by a trap nothing could take, ECAUSE and EADDR describe it
+    bool Trapped() const
+    {
+        return _trapped;
+    }
+
+    uint64_t Retired() const
+    {
+        return _retired;
+    }
+
 // ===========================================================
 
     WORD& Reg(Register reg)
@@ -284,10 +795,626 @@ public:
     }
 
 private:    
-    using RegisterFile = std::array<WORD, static_cast<size_t>(Register::__NUM)>;
-
     RegisterFile _reg_file{ 0 };
-    RAM& _ram;
+    Memory _memory;
+    [[no_unique_address]] Features _features;
+    InterruptController _interrupts;
+    CodeCache _code;
+    uint64_t _retired{ 0 };
+    bool _halted{ false };
+    bool _trapped{ false };
+    bool _fault{ false };
+    bool _code_modified{ false };
+    WORD _code_modified_addr{ 0 };
+    Interrupt _fault_cause{ Interrupt::MemoryFault };
+    Limits _limits;
+    Limit _limit_reached{ Limit::None };
+    PageSet _pages;
+    uint64_t _nanoseconds{ 0 };
+    std::vector<TraceOp> _recording;
+    WORD _recording_head{ 0 };
+    bool _recording_armed{ false };
+    std::vector<WORD> _breakpoints;     // sorted
+    Stop _stop{ Stop::None };
+    WORD _stop_ip{ 0 };
+    WORD _stop_addr{ 0 };
+    Wait _wait{ Wait::None };
+
+    static constexpr unsigned CLOCK_INTERVAL = 256;
+    static constexpr uint32_t HOT_LOOP = 32;
+    uint32_t _hot_loop{ HOT_LOOP };
+    static constexpr unsigned TRACE_PASSES = 64;
+
+    static uint64_t Nanoseconds(std::chrono::steady_clock::time_point since)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    bool Fetch(WORD addr, WORD& instruction)
+    {
+        Interrupt cause;
+        if (_memory.Fetch(addr, instruction, cause))
+            return true;
+
+        Fault(cause, addr);
+        return false;
+    }
+
+    template<typename T>
+    bool Load(WORD addr, T& out)
+    {
+        Interrupt cause;
+        if (!_memory.Read(addr, out, cause))
+        {
+            Fault(cause, addr);
+            return false;
+        }
+
+        Accessed(addr, Access::Read);
+        return true;
+    }
+
+    template<typename T>
+    bool Store(WORD addr, T data)
+    {
+        Interrupt cause;
+        if (!_memory.Write(addr, data, cause))
+        {
+            Fault(cause, addr);
+            return false;
+        }
+
+        Accessed(addr, Access::Write);
+
+        if (_code.IsCode(addr))
+        {
+            _code_modified = true;
+            _code_modified_addr = addr;
+        }
+
+        return true;
+    }
+
+    void Accessed(WORD addr, Access access)
+    {
+        _features.OnMemory(addr, access);
+        if (_pages.Tracking())
+            _pages.Touch(addr);
+    }
+
+    // Host pointer to a block memory chunk, faults like a load or store to its first byte
+    BYTE* Span(WORD addr, WORD size, Access access)
+    {
+        Interrupt cause{};
+        BYTE* host = _memory.Span(addr, size, access, cause);
+        if (!host)
+        {
+            Fault(cause, addr);
+            return nullptr;
+        }
+
+        Accessed(addr, access);
+
+        if (access == Access::Write && _code.IsCode(addr))
+        {
+            _code_modified = true;
+            _code_modified_addr = addr;
+        }
+
+        return host;
+    }
+
+    // std::popcount is a libgcc call on baseline x86-64
+    static WORD ListSize(WORD list)
+    {
+        WORD size = 0;
+        for (WORD bits = list; bits != 0; bits &= bits - 1)
+            size += sizeof(WORD);
+
+        return size;
+    }
+
+    // A PUSHM/POPM frame spans at most two pages, both are translated before anything moves
+    BYTE* Frame(WORD addr, WORD size, Access access, BYTE*& high, WORD& split)
+    {
+        if (addr % sizeof(WORD) != 0)
+        {
+            Fault(Interrupt::MemoryFault, addr);
+            return nullptr;
+        }
+
+        split = std::min(size, BLOCK_CHUNK - addr % BLOCK_CHUNK);
+        BYTE* low = Span(addr, split, access);
+        high = low;
+        if (low && split < size)
+            high = Span(addr + split, size - split, access);
+
+        return high ? low : nullptr;
+    }
+
+    void RepeatUntilDone(Register len)
+    {
+        if (Reg(len) != 0)
+            Reg(Register::IP) -= sizeof(WORD);
+    }
+
+    void Fault(Interrupt cause, WORD addr)
+    {
+        _fault = true;
+        _fault_cause = cause;
+        if (cause < Interrupt::__NUM)
+            Reg(Register::EADDR) = addr;
+        else
+            _stop_addr = addr;
+    }
+
+    void TakeTrap(Interrupt cause, WORD return_ip)
+    {
+        // Busy devices, watchpoints and breakpoints stop the core, the guest never sees them
+        if (cause == DEVICE_BUSY)
+        {
+            Reg(Register::IP) = return_ip;
+            _wait = Wait::Device;
+            return;
+        }
+
+        if (cause >= Interrupt::__NUM)
+        {
+            Reg(Register::IP) = return_ip;
+            _stop = cause == BREAKPOINT ? Stop::Breakpoint :
+                    cause == WatchCause(Access::Read) ? Stop::ReadWatchpoint : Stop::WriteWatchpoint;
+            _stop_ip = return_ip;
+            return;
+        }
+
+        // A fault inside a handler, or before the guest installed one, can't be recovered
+        if (!GetFlag(Flag::InterruptEnable))
+        {
+            Reg(Register::ECAUSE) = static_cast<WORD>(cause);
+            _halted = true;
+            _trapped = true;
+            return;
+        }
+
+        WORD handler;
+        if (!_memory.Physical().TryRead(Reg(Register::VB) + static_cast<WORD>(cause) * sizeof(WORD), handler))
+        {
+            Reg(Register::ECAUSE) = static_cast<WORD>(cause);
+            _halted = true;
+            _trapped = true;
+            return;
+        }
+
+        Reg(Register::EIP) = return_ip;
+        Reg(Register::EFLAGS) = Reg(Register::FLAGS);
+        Reg(Register::ERA) = Reg(Register::RA);
+        Reg(Register::ECAUSE) = static_cast<WORD>(cause);
+        ClearFlag(Flag::InterruptEnable);
+        Reg(Register::IP) = handler;
+    }
+
+    void Retire(WORD ip, WORD instruction)
+    {
+        ++_retired;
+        _features.OnRetire(ip, instruction);
+
+        if (Reg(Register::TIMER) != 0 && --Reg(Register::TIMER) == 0)
+            _interrupts.Raise(Interrupt::Timer);
+    }
+
+    bool DeliverInterrupt()
+    {
+        if (!_halted && _interrupts.Pending() && GetFlag(Flag::InterruptEnable) && _stop == Stop::None)
+        {
+            Interrupt irq = _interrupts.Next();
+            _interrupts.Clear(irq);
+            TakeTrap(irq, Reg(Register::IP));
+            _wait = Wait::None;
+            return true;
+        }
+
+        return false;
+    }
+
+    // Clears the last stop. If IP is still on its instruction runs that past the breakpoint
+    // or watchpoint and returns true.
+    bool Resume()
+    {
+        Stop stop = _stop;
+        _stop = Stop::None;
+        if (Reg(Register::IP) != _stop_ip)
+            return false;
+
+        if (stop == Stop::Breakpoint)
+        {
+            Step();
+            return true;
+        }
+
+        RAM& ram = _memory.Physical();
+        ram.SuspendWatches(true);
+        Step();
+        ram.SuspendWatches(false);
+        if constexpr (Memory::PAGING)
+            _memory.MemoryManagement().Flush();
+
+        return true;
+    }
+
+    // A core waiting for an interrupt continues once one is pending, one waiting on a busy
+    // device right away. False if it still waits.
+    bool Wake()
+    {
+        if (_wait == Wait::Interrupt && !_interrupts.Pending())
+            return false;
+
+        _wait = Wait::None;
+        DeliverInterrupt();
+        return true;
+    }
+
+    // Forwarded loads in traces would skip the watches, the TLB may hold newly watched pages
+    void WatchesChanged()
+    {
+        FlushCodeCache();
+        if constexpr (Memory::PAGING)
+            _memory.MemoryManagement().Flush();
+    }
+
+    void SyncPageTable()
+    {
+        if constexpr (Memory::PAGING)
+        {
+            if (Reg(Register::PTB) != _memory.MemoryManagement().Base())
+                SetPageTableBase(Reg(Register::PTB));
+        }
+    }
+
+    // Blocks are cached by virtual IP, so a new address space invalidates all of them
+    void SetPageTableBase(WORD base)
+    {
+        if constexpr (Memory::PAGING)
+        {
+            _memory.MemoryManagement().SetBase(base);
+            StopRecording();
+            _code.Clear();
+        }
+    }
+
+//  ===================== BLOCKS ==============================
+
+    Block* FindBlock(WORD ip)
+    {
+        if (Block* block = _code.Find(ip))
+            return block;
+
+        Block block{ ip, {} };
+        WORD addr = ip;
+        do
+        {
+            WORD instruction;
+            Interrupt cause;
+            DecodedInstruction decoded;
+
+            if (!_memory.Fetch(addr, instruction, cause) || !Decode(instruction, decoded))
+                break;
+
+            block.code.push_back(decoded);
+            addr += sizeof(WORD);
+
+            if (EndsBlock(decoded))
+                break;
+        }
+        while (block.code.size() < CodeCache::MAX_BLOCK && (addr & ~Mmu::PAGE_MASK) != 0);
+
+        if (block.code.empty())
+            return nullptr;
+
+        if (!_breakpoints.empty())
+            PatchBreakpoints(block);
+
+        ElideDeadFlags(block);
+        block.closes_loop = LoopTarget(block.code.back(), addr - sizeof(WORD), block.loop_head);
+        return &_code.Insert(std::move(block));
+    }
+
+    void PatchBreakpoints(Block& block)
+    {
+        auto it = std::lower_bound(_breakpoints.begin(), _breakpoints.end(), block.start);
+        for (; it != _breakpoints.end() && *it - block.start < block.code.size() * sizeof(WORD); ++it)
+        {
+            if ((*it - block.start) % sizeof(WORD) == 0)
+                block.code[(*it - block.start) / sizeof(WORD)].op = BREAK;
+        }
+    }
+
+    // A block or trace pass of size instructions may only run whole if Step would not
+    // deliver an interrupt before its last instruction
+    bool CanRun(WORD size, uint64_t budget)
+    {
+        WORD timer = Reg(Register::TIMER);
+
+        if (size > budget || (timer != 0 && timer < size))
+            return false;
+
+        return !(_interrupts.Pending() && GetFlag(Flag::InterruptEnable));
+    }
+
+    // False if the block did not run to its end and on to the next one, it may be gone then
+    bool ExecuteBlock(const Block& block)
+    {
+        WORD ip = block.start;
+
+        for (const DecodedInstruction& decoded : block.code)
+        {
+            if (!ExecuteAt(decoded, ip))
+            {
+                DeliverInterrupt();
+                return false;
+            }
+
+            ip += sizeof(WORD);
+        }
+
+        return !DeliverInterrupt();
+    }
+
+    // Executes and retires one predecoded instruction. False if it trapped, halted or
+    // stored into a code page, which frees the block or trace holding it.
+    bool ExecuteAt(const DecodedInstruction& decoded, WORD ip)
+    {
+        WORD instruction = decoded.raw;
+
+        _fault = false;
+        Reg(Register::IP) = ip + sizeof(WORD);
+        Execute(decoded);
+        Reg(Register::RZ) = 0;
+
+        bool modified = _code_modified;
+        InvalidateModifiedCode();
+
+        if (_fault)
+        {
+            TakeTrap(_fault_cause, ip);
+            return false;
+        }
+
+        Retire(ip, instruction);
+        return !_halted && !modified;
+    }
+
+//  ===================== TRACES ==============================
+
+    void StartRecording(WORD head)
+    {
+        _recording.clear();
+        _recording_head = head;
+        _recording_armed = true;
+    }
+
+    void StopRecording()
+    {
+        _recording.clear();
+        _recording_armed = false;
+    }
+
+    // Appends a block about to run to the trace being recorded
+    void Record(const Block& block)
+    {
+        if (!_recording_armed)
+            return;
+
+        if ((_recording.empty() && block.start != _recording_head) || !Traceable(block) ||
+            _recording.size() + block.code.size() > Trace::MAX_LENGTH)
+        {
+            StopRecording();
+            return;
+        }
+
+        WORD ip = block.start;
+        for (const DecodedInstruction& decoded : block.code)
+        {
+            _recording.push_back(TraceOp{ decoded, ip });
+            ip += sizeof(WORD);
+        }
+    }
+
+    // Loads forwarded from a store would skip the device a store may have gone to, or a watch
+    void FinishTrace()
+    {
+        bool forward = !Memory::DEVICES && !_memory.Physical().Watching();
+        _code.InsertTrace(BuildTrace(_recording_head, std::move(_recording), forward));
+        StopRecording();
+    }
+
+    // Runs passes over the trace while they can run whole, up to TRACE_PASSES so Run gets
+    // to check the clock. Returns false if not even one could start.
+    bool RunTrace(const Trace& trace, uint64_t stop)
+    {
+        if (!CanRun(trace.length, stop - _retired))
+            return false;
+
+        for (unsigned pass = 0; pass < TRACE_PASSES; ++pass)
+        {
+            bool looped = TracePass(trace);
+            DeliverInterrupt();
+
+            if (!looped || Reg(Register::IP) != trace.start || _pages.Count() > _limits.pages ||
+                !CanRun(trace.length, stop - _retired))
+                break;
+        }
+
+        return true;
+    }
+
+    // ExecuteBlock over a trace. False once the trace was left, it may be gone then.
+    bool TracePass(const Trace& trace)
+    {
+        for (const TraceOp& op : trace.code)
+        {
+            if (op.kind == TraceOp::Kind::Plain ? !ExecuteAt(op.d, op.ip) : !ExecuteSpecial(op))
+                return false;
+        }
+
+        return true;
+    }
+
+    // Ops that may leave the trace, and the optimized ones, which can neither trap nor leave
+    bool ExecuteSpecial(const TraceOp& op)
+    {
+        switch (op.kind)
+        {
+        case TraceOp::Kind::Folded:
+            Reg(Register::IP) = op.ip + sizeof(WORD);
+            Assign(op.d.r1, op.d.imm);
+            Reg(Register::RZ) = 0;
+            Retire(op.ip - sizeof(WORD), op.folded);
+            Retire(op.ip, op.d.raw);
+            return true;
+        case TraceOp::Kind::Forwarded:
+            Reg(Register::IP) = op.ip + sizeof(WORD);
+            Accessed(Reg(op.d.r2) + op.d.imm, Access::Read);
+            Assign(op.d.r1, Reg(op.d.r3));
+            Reg(Register::RZ) = 0;
+            Retire(op.ip, op.d.raw);
+            return true;
+        default:
+        {
+            WORD next = op.next;
+            return ExecuteAt(op.d, op.ip) && Reg(Register::IP) == next;
+        }
+        }
+    }
+
+    void InvalidateModifiedCode()
+    {
+        if (!_code_modified)
+            return;
+
+        _code.InvalidatePage(_code_modified_addr);
+        _code_modified = false;
+    }
+
+    void Assign(Register dst, WORD value)
+    {
+        Reg(dst) = value;
+    }
+
+    // Loads and stores in every address mode, see isa.h. The post-increment base is
+    // written before the loaded value so a load into the base register keeps the value.
+    void LoadStore(const DecodedInstruction& d)
+    {
+        WORD base = Reg(d.r2);
+        WORD addr = base;
+        if (d.mode == AddressMode::Offset)
+            addr += d.imm;
+        else if (d.mode == AddressMode::Indexed)
+            addr += Reg(d.r3) << d.shift;
+
+        WORD value = 0;
+        bool ok = false;
+        switch (d.op)
+        {
+        case Instruction::LB:   { BYTE tmp;  ok = Load(addr, tmp); value = ExtendSign(tmp);         break; }
+        case Instruction::LBU:  { BYTE tmp;  ok = Load(addr, tmp); value = tmp;                     break; }
+        case Instruction::LH:   { HWORD tmp; ok = Load(addr, tmp); value = ExtendSign(tmp);         break; }
+        case Instruction::LHU:  { HWORD tmp; ok = Load(addr, tmp); value = tmp;                     break; }
+        case Instruction::SB:   ok = Store(addr, static_cast<BYTE>(Reg(d.r1)));                     break;
+        case Instruction::SH:   ok = Store(addr, static_cast<HWORD>(Reg(d.r1)));                    break;
+        case Instruction::SW:   ok = Store(addr, Reg(d.r1));                                        break;
+        default:                ok = Load(addr, value);                                             break;
+        }
+
+        if (!ok)
+            return;
+
+        if (d.mode == AddressMode::PostIncrement)
+            Reg(d.r2) = base + d.imm;
+        if (!IsStore(d.op))
+            Reg(d.r1) = value;
+    }
+
+    // Instructions with dead flags (see predecode.h) skip the flag updates
+    void Execute(const DecodedInstruction& d)
+    {
+        Register r1 = d.r1;
+        Register r2 = d.r2;
+        Register r3 = d.r3;
+        WORD imm = d.imm;
+
+        switch (d.op)
+        {
+        case Instruction::ADD:      d.set_flags ? Add(r1, r2, r3)                   : Assign(r1, Reg(r2) + Reg(r3));            break;
+        case Instruction::ADDI:     d.set_flags ? AddImmediate(r1, r2, imm)         : Assign(r1, Reg(r2) + imm);                break;
+        case Instruction::SUB:      d.set_flags ? Sub(r1, r2, r3)                   : Assign(r1, Reg(r2) - Reg(r3));            break;
+        case Instruction::SUBI:     d.set_flags ? SubImmediate(r1, r2, imm)         : Assign(r1, Reg(r2) - imm);                break;
+        case Instruction::LUI:      LoadUpperImmediate(r1, imm);                                                                break;
+        case Instruction::SHL:      d.set_flags ? ShiftLeft(r1, r2, r3)             : Assign(r1, Reg(r2) << (Reg(r3) & 0x1F));  break;
+        case Instruction::SHLI:     d.set_flags ? ShiftLeftImmediate(r1, r2, imm)   : Assign(r1, Reg(r2) << (imm & 0x1F));      break;
+        case Instruction::SHR:      d.set_flags ? ShiftRight(r1, r2, r3)            : Assign(r1, Reg(r2) >> (Reg(r3) & 0x1F));  break;
+        case Instruction::SHRI:     d.set_flags ? ShiftRightImmediate(r1, r2, imm)  : Assign(r1, Reg(r2) >> (imm & 0x1F));      break;
+        case Instruction::OR:       d.set_flags ? Or(r1, r2, r3)                    : Assign(r1, Reg(r2) | Reg(r3));            break;
+        case Instruction::ORI:      d.set_flags ? OrImmediate(r1, r2, imm)          : Assign(r1, Reg(r2) | imm);                break;
+        case Instruction::AND:      d.set_flags ? And(r1, r2, r3)                   : Assign(r1, Reg(r2) & Reg(r3));            break;
+        case Instruction::ANDI:     d.set_flags ? AndImmediate(r1, r2, imm)         : Assign(r1, Reg(r2) & imm);                break;
+        case Instruction::XOR:      d.set_flags ? Xor(r1, r2, r3)                   : Assign(r1, Reg(r2) ^ Reg(r3));            break;
+        case Instruction::XORI:     d.set_flags ? XorImmediate(r1, r2, imm)         : Assign(r1, Reg(r2) ^ imm);                break;
+        case Instruction::NOT:      Not(r1, r2);                            break;
+        case Instruction::ADC:      AddWithCarry(r1, r2, r3);               break;
+        case Instruction::SBC:      SubWithBorrow(r1, r2, r3);              break;
+        case Instruction::MUL:      d.set_flags ? Mul(r1, r2, r3)                   : Assign(r1, Reg(r2) * Reg(r3));                        break;
+        case Instruction::MULH:     d.set_flags ? MulHigh(r1, r2, r3)               : Assign(r1, MultiplyHigh(Reg(r2), Reg(r3)));           break;
+        case Instruction::MULHU:    d.set_flags ? MulHighUnsigned(r1, r2, r3)       : Assign(r1, MultiplyHighUnsigned(Reg(r2), Reg(r3)));   break;
+        case Instruction::DIV:      d.set_flags ? Div(r1, r2, r3)                   : Assign(r1, DivideSigned(Reg(r2), Reg(r3)));           break;
+        case Instruction::DIVU:     d.set_flags ? DivUnsigned(r1, r2, r3)           : Assign(r1, DivideUnsigned(Reg(r2), Reg(r3)));         break;
+        case Instruction::REM:      d.set_flags ? Rem(r1, r2, r3)                   : Assign(r1, RemainderSigned(Reg(r2), Reg(r3)));        break;
+        case Instruction::ADDUSB:   d.set_flags ? AddSaturateBytes(r1, r2, r3)      : Assign(r1, SaturatingAdd8(Reg(r2), Reg(r3)));         break;
+        case Instruction::SUBUSB:   d.set_flags ? SubSaturateBytes(r1, r2, r3)      : Assign(r1, SaturatingSub8(Reg(r2), Reg(r3)));         break;
+        case Instruction::ADDUSH:   d.set_flags ? AddSaturateHalves(r1, r2, r3)     : Assign(r1, SaturatingAdd16(Reg(r2), Reg(r3)));        break;
+        case Instruction::SUBUSH:   d.set_flags ? SubSaturateHalves(r1, r2, r3)     : Assign(r1, SaturatingSub16(Reg(r2), Reg(r3)));        break;
+        case Instruction::CMPEQB:   d.set_flags ? CompareBytes(r1, r2, r3)          : Assign(r1, EqualBytes(Reg(r2), Reg(r3)));             break;
+        case Instruction::FFZB:     d.set_flags ? FindZeroByte(r1, r2)              : Assign(r1, FirstZeroByte(Reg(r2)));                   break;
+        case Instruction::SHUFB:    d.set_flags ? Shuffle(r1, r2, r3)               : Assign(r1, ShuffleBytes(Reg(r2), Reg(r3)));           break;
+        case Instruction::LB:       case Instruction::LBU:      case Instruction::LH:
+        case Instruction::LHU:      case Instruction::LW:       case Instruction::LWU:
+        case Instruction::SB:       case Instruction::SH:       case Instruction::SW:
+            LoadStore(d);
+            break;
+        case Instruction::MEMCPY:   BlockCopy(r1, r2, r3);                  break;
+        case Instruction::MEMSET:   BlockSet(r1, r2, r3);                   break;
+        case Instruction::CMP:      if (d.set_flags) Cmp(r1, r2);           break;
+        case Instruction::CMPI:     if (d.set_flags) CmpImmediate(r1, imm); break;
+        case Instruction::B:        Branch(imm);                            break;
+        case Instruction::BEQ:      BranchEqual(imm);                       break;
+        case Instruction::BNE:      BranchNotEqual(imm);                    break;
+        case Instruction::BGT:      BranchGreaterThan(imm);                 break;
+        case Instruction::BGE:      BranchGreaterOrEqual(imm);              break;
+        case Instruction::BLT:      BranchLessThan(imm);                    break;
+        case Instruction::BLE:      BranchLessOrEqual(imm);                 break;
+        case Instruction::J:        Jump(imm);                              break;
+        case Instruction::JR:       JumpRegister(r1);                       break;
+        case Instruction::CALL:     Call(imm);                              break;
+        case Instruction::CALLR:    CallRegister(r1);                       break;
+        case Instruction::RET:      Ret();                                  break;
+        case Instruction::PUSH:     Push(r1);                               break;
+        case Instruction::POP:      Pop(r1);                                break;
+        case Instruction::PUSHM:    PushMultiple(d.imm);                    break;
+        case Instruction::POPM:     PopMultiple(d.imm);                     break;
+        case Instruction::HALT:     Halt();                                 break;
+        case Instruction::WAIT:     WaitForInterrupt();                     break;
+        case Instruction::RETI:     RetInterrupt();                         break;
+        default:
+            if (d.op == BREAK)
+                Fault(BREAKPOINT, Reg(Register::IP) - sizeof(WORD));
+            break;
+        }
+
+        if constexpr (Memory::PAGING)
+        {
+            if (Writes(d, Register::PTB))
+                SetPageTableBase(Reg(Register::PTB));
+        }
+    }
 
     bool Equal()
     {
@@ -314,12 +1441,12 @@ private:
         return !LessThan();
     }
 
-    WORD DoAdd(WORD op1, WORD op2)
+    WORD DoAdd(WORD op1, WORD op2, WORD carry_in = 0)
     {
         DWORD wide_op1 = static_cast<DWORD>(op1);
         DWORD wide_op2 = static_cast<DWORD>(op2);
         
-        DWORD wide_res = wide_op1 + wide_op2;
+        DWORD wide_res = wide_op1 + wide_op2 + carry_in;
         WORD res = static_cast<WORD>(wide_res);
 
         UpdateZeroFlag(res);
@@ -335,11 +1462,12 @@ private:
         return res;
     }
 
-    WORD DoSub(WORD op1, WORD op2)
+    // op1 + ~op2 + carry_in, so C = 1 means no borrow, also for op2 == 0
+    WORD DoSub(WORD op1, WORD op2, WORD carry_in = 1)
     {
         DWORD wide_op1 = static_cast<DWORD>(op1);
-        DWORD wide_op2 = static_cast<DWORD>(~op2 + 1);
-        DWORD wide_res = wide_op1 + wide_op2;
+        DWORD wide_op2 = static_cast<DWORD>(~op2);
+        DWORD wide_res = wide_op1 + wide_op2 + carry_in;
         WORD res = static_cast<WORD>(wide_res);
 
         UpdateNegativeFlag(res);
@@ -355,6 +1483,13 @@ private:
         return res;
     }
 
+    void SetResult(Register dst, WORD value)
+    {
+        UpdateZeroFlag(value);
+        UpdateNegativeFlag(value);
+        Reg(dst) = value;
+    }
+
     void UpdateFlag(Flag flag, uint8_t state)
     {
         if (state)
@@ -400,6 +1535,20 @@ private:
         
         WORD tmp = std::numeric_limits<WORD>::max();
         tmp -= std::numeric_limits<T>::max();
-        return tmp & val;
+        return tmp | val;
     }
 };
+
+using Core             = BasicCore<PagedMemory, NoFeatures>;
+using FlatCore         = BasicCore<FlatMemory, NoFeatures>;
+using ProfilingCore    = BasicCore<PagedMemory, FeatureSet<Counters>>;
+using TracingCore      = BasicCore<PagedMemory, FeatureSet<Counters, Tracer>>;
+using BlockProfileCore = BasicCore<PagedMemory, FeatureSet<BlockProfile>>;
+using MmioCore         = BasicCore<MmioMemory<PagedMemory>, NoFeatures>;
+
+extern template class BasicCore<PagedMemory, NoFeatures>;
+extern template class BasicCore<FlatMemory, NoFeatures>;
+extern template class BasicCore<PagedMemory, FeatureSet<Counters>>;
+extern template class BasicCore<PagedMemory, FeatureSet<Counters, Tracer>>;
+extern template class BasicCore<PagedMemory, FeatureSet<BlockProfile>>;
+extern template class BasicCore<MmioMemory<PagedMemory>, NoFeatures>;
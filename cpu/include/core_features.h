@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <iomanip>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "isa.h"
+#include "encoding.h"
+#include "mmu.h"
+
+// Optional instrumentation compiled into BasicCore. The run loop calls every hook
+// unconditionally, so a feature that is not in the set costs nothing.
+//
+//  OnRetire(ip, instruction)   after an instruction retired
+//  OnMemory(addr, access)      after a successful guest load or store (not fetches)
+
+template<typename... Fs>
+class FeatureSet : public Fs...
+{
+public:
+    void OnRetire([[maybe_unused]] WORD ip, [[maybe_unused]] WORD instruction)
+    {
+        (Fs::OnRetire(ip, instruction), ...);
+    }
+
+    void OnMemory([[maybe_unused]] WORD addr, [[maybe_unused]] Access access)
+    {
+        (Fs::OnMemory(addr, access), ...);
+    }
+};
+
+using NoFeatures = FeatureSet<>;
+
+// Retired instructions per opcode and guest memory traffic
+class Counters
+{
+public:
+
+    void OnRetire(WORD, WORD instruction)
+    {
+        ++_retired[instruction >> 26];
+    }
+
+    void OnMemory(WORD, Access access)
+    {
+        ++_accesses[static_cast<size_t>(access)];
+    }
+
+    uint64_t Retired(Instruction op) const
+    {
+        return _retired[static_cast<size_t>(op)];
+    }
+
+    uint64_t Loads() const
+    {
+        return _accesses[static_cast<size_t>(Access::Read)];
+    }
+
+    uint64_t Stores() const
+    {
+        return _accesses[static_cast<size_t>(Access::Write)];
+    }
+
+private:
+    std::array<uint64_t, 64> _retired{};
+    std::array<uint64_t, 2> _accesses{};
+};
+
+// Prints "ip: instruction" for every retired instruction
+class Tracer
+{
+public:
+
+    void SetStream(std::ostream& out)
+    {
+        _out = &out;
+    }
+
+    void OnRetire(WORD ip, WORD instruction)
+    {
+        *_out << std::hex << std::setfill('0') << std::setw(8) << ip << ": " << std::setw(8) << instruction << std::dec << '\n';
+    }
+
+    void OnMemory(WORD, Access)
+    {
+    }
+
+private:
+    std::ostream* _out{ &std::clog };
+};
+
+// Times every basic block was entered, by start address. A block starts wherever
+// execution did not just fall through from the instruction before: at branch and call
+// targets, return addresses, vectors and after a branch that was not taken. A block
+// entered by falling through from one without a control transfer is counted only
+// when something jumps there. MEMCPY/MEMSET restarting on themselves count once.
+//
+// Write prints one "address count" line per block in address order, which is what
+// as -p reads back to lay out .text (see as/include/layout.h).
+class BlockProfile
+{
+public:
+
+    void OnRetire(WORD ip, WORD instruction)
+    {
+        if ((ip != _next && ip != _last) || _branch)
+            ++_counts[ip];
+
+        _last = ip;
+        _next = ip + sizeof(WORD);
+        _branch = IsBranch(GetOpcode(instruction));
+    }
+
+    void OnMemory(WORD, Access)
+    {
+    }
+
+    uint64_t Count(WORD start) const
+    {
+        auto it = _counts.find(start);
+        return it == _counts.end() ? 0 : it->second;
+    }
+
+    void Write(std::ostream& out) const
+    {
+        std::vector<std::pair<WORD, uint64_t>> blocks(_counts.begin(), _counts.end());
+        std::sort(blocks.begin(), blocks.end());
+        for (const auto& [start, count] : blocks)
+            out << "0x" << std::hex << std::setfill('0') << std::setw(8) << start << std::dec << ' ' << count << '\n';
+    }
+
+    void Clear()
+    {
+        _counts.clear();
+        _next = _last = 1;
+        _branch = false;
+    }
+
+private:
+    std::unordered_map<WORD, uint64_t>  _counts;
+    WORD                                _next{ 1 };     // never an instruction address
+    WORD                                _last{ 1 };
+    bool                                _branch{ false };
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "isa.h"
+#include "ram.h"
+
+//  Debugger support for BasicCore.
+//
+//  Breakpoints stop the core in front of the instruction at an IP. They live in the
+//  predecoded code (see predecode.h), so blocks without one run as fast as ever. Step
+//  decodes from memory and never stops on one, it is how a debugger single steps.
+//
+//  Watchpoints stop the core in front of a load or store touching a range of guest
+//  physical RAM, before anything changed. Fetches, DMA and host accesses don't count.
+//  RAM protects the pages holding watched ranges, only accesses to those pages are
+//  compared with the ranges: the TLB refuses them, flat memory tests one flag.
+//
+//  A stop is not a trap, the guest sees nothing of it. IP is left on the instruction,
+//  the next Run or Step executes it past its breakpoint or watchpoint, unless the host
+//  moved IP elsewhere.
+
+enum class Stop : uint8_t
+{
+    None = 0,
+    Breakpoint,
+    ReadWatchpoint,
+    WriteWatchpoint
+};
+
+// Fault cause of a BREAK, after the watch causes
+constexpr Interrupt BREAKPOINT = static_cast<Interrupt>(static_cast<int>(WatchCause(Access::Write)) + 1);
@@ -0,0 +1,598 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include <ctype.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "isa.h"
+#include "ram.h"
+#include "debug.h"
+
+//  GDB remote serial protocol stub for one core, on a TCP port of the loopback interface.
+//
+//  One debugger at a time, no threads and no acknowledgment-free mode. Supported:
+//
+//      ?  g  G  p  P           stop reason, registers in Register order, 32 bit little endian
+//      m  M                    memory, through the page table when paging is on
+//      c  s                    continue (from an address too), single step
+//      Z0..Z4  z0..z4          breakpoints (software and hardware are the same thing),
+//                              write, read and access watchpoints
+//      qSupported  qXfer:features:read:target.xml  qAttached  qfThreadInfo  H  T  D  k
+//
+//  Anything else gets the empty reply. Ctrl-C interrupts a continue, which runs SLICE
+//  instructions at a time and checks the socket in between. The core stops in front of a
+//  watched access (see debug.h), the stub steps over it before reporting, so the
+//  debugger sees the new value the way it would on hardware. Watchpoint addresses are
+//  translated when they are set, later page table changes don't move them.
+//
+//  There is no GDB architecture for this ISA, target.xml only names the registers. Tools
+//  that work from the description alone, or a GDB built with the architecture, can use
+//  everything else.
+
+template<typename CoreType>
+class GdbStub
+{
+public:
+    static constexpr uint64_t SLICE = 1 << 16;
+
+    explicit GdbStub(CoreType& core):
+    _core(core)
+    {
+    }
+
+    ~GdbStub()
+    {
+        Close(_client);
+        Close(_listener);
+    }
+
+    GdbStub(const GdbStub&) = delete;
+    GdbStub& operator=(const GdbStub&) = delete;
+
+    // Listens on 127.0.0.1, port 0 picks a free one. Returns the port.
+    uint16_t Listen(uint16_t port)
+    {
+        _listener = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (_listener < 0)
+            throw std::runtime_error("Failed to create the debugger socket");
+
+        int yes = 1;
+        ::setsockopt(_listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        socklen_t length = sizeof(address);
+        if (::bind(_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            ::listen(_listener, 1) != 0 ||
+            ::getsockname(_listener, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+            throw std::runtime_error("Failed to listen on port " + std::to_string(port));
+
+        return ntohs(address.sin_port);
+    }
+
+    // Accepts a debugger and serves it until it detaches, kills or hangs up. Returns false
+    // after a kill.
+    bool Serve()
+    {
+        _client = ::accept(_listener, nullptr, nullptr);
+        if (_client < 0)
+            throw std::runtime_error("Failed to accept a debugger");
+
+        // Packets are tiny and every one waits for an answer
+        int yes = 1;
+        ::setsockopt(_client, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+        _last = "S05";
+        _served = true;
+        std::string packet;
+        while (_served && Receive(packet))
+            Handle(packet);
+
+        // A debugger that hung up leaves its breakpoints behind too
+        Detach();
+        Close(_client);
+        return !_killed;
+    }
+
+private:
+    struct Watch
+    {
+        WORD    addr;
+        WORD    size;
+        Access  access;
+    };
+
+    CoreType&           _core;
+    int                 _listener{ -1 };
+    int                 _client{ -1 };
+    std::string         _input;
+    std::string         _last;              // stop reply for '?'
+    std::vector<WORD>   _breakpoints;
+    std::vector<Watch>  _watches;           // physical, as set on the core
+    bool                _served{ false };
+    bool                _killed{ false };
+
+    static void Close(int& fd)
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+
+//  ===================== PACKETS =============================
+
+    // Next byte from the debugger, false once it hung up
+    bool Byte(char& c)
+    {
+        if (_input.empty())
+        {
+            char buffer[4096];
+            ssize_t n = ::recv(_client, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                return false;
+            _input.assign(buffer, static_cast<size_t>(n));
+        }
+
+        c = _input.front();
+        _input.erase(0, 1);
+        return true;
+    }
+
+    // Payload of the next well formed packet, acknowledged. Stray Ctrl-C and acks are dropped.
+    bool Receive(std::string& packet)
+    {
+        char c;
+        while (Byte(c))
+        {
+            if (c != '$')
+                continue;
+
+            packet.clear();
+            uint8_t sum = 0;
+            while (Byte(c) && c != '#')
+            {
+                packet += c;
+                sum = static_cast<uint8_t>(sum + static_cast<uint8_t>(c));
+            }
+
+            char checksum[2];
+            if (c != '#' || !Byte(checksum[0]) || !Byte(checksum[1]))
+                return false;
+
+            bool ok = Hex(checksum[0]) * 16 + Hex(checksum[1]) == sum;
+            Write(ok ? "+" : "-");
+            if (ok)
+                return true;
+        }
+
+        return false;
+    }
+
+    void Send(const std::string& payload)
+    {
+        uint8_t sum = 0;
+        for (char c : payload)
+            sum = static_cast<uint8_t>(sum + static_cast<uint8_t>(c));
+
+        std::string packet = "$" + payload + "#";
+        AppendHex(packet, sum, 1);
+
+        // Resent until the debugger acknowledges it
+        char c = '-';
+        while (c == '-')
+        {
+            Write(packet);
+            if (!Byte(c))
+                return;
+            while (c != '+' && c != '-' && Byte(c))
+                ;
+        }
+    }
+
+    void Write(const std::string& data)
+    {
+        size_t sent = 0;
+        while (sent < data.size())
+        {
+            ssize_t n = ::send(_client, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                _served = false;
+                return;
+            }
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    static int Hex(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    // bytes of value, least significant first like guest memory
+    static void AppendHex(std::string& out, WORD value, int bytes)
+    {
+        static const char digits[] = "0123456789abcdef";
+        for (int i = 0; i < bytes; ++i, value >>= 8)
+        {
+            out += digits[(value >> 4) & 0xF];
+            out += digits[value & 0xF];
+        }
+    }
+
+    // Big endian hex number as in addresses and lengths, stops at the first non digit
+    static WORD Number(const std::string& text, size_t& pos)
+    {
+        WORD value = 0;
+        for (; pos < text.size() && Hex(text[pos]) >= 0; ++pos)
+            value = value << 4 | static_cast<WORD>(Hex(text[pos]));
+        return value;
+    }
+
+    // Little endian word of 8 hex digits at pos
+    static bool Word(const std::string& text, size_t pos, WORD& value)
+    {
+        if (pos + 8 > text.size())
+            return false;
+
+        value = 0;
+        for (int i = 3; i >= 0; --i)
+        {
+            int high = Hex(text[pos + 2 * i]);
+            int low = Hex(text[pos + 2 * i + 1]);
+            if (high < 0 || low < 0)
+                return false;
+            value = value << 8 | static_cast<WORD>(high << 4 | low);
+        }
+        return true;
+    }
+
+//  ===================== COMMANDS ============================
+
+    void Handle(const std::string& packet)
+    {
+        char command = packet.empty() ? '\0' : packet[0];
+        switch (command)
+        {
+        case '?':   Send(_last);                        break;
+        case 'g':   Send(ReadRegisters());              break;
+        case 'G':   Send(WriteRegisters(packet));       break;
+        case 'p':   Send(ReadRegister(packet));         break;
+        case 'P':   Send(WriteRegister(packet));        break;
+        case 'm':   Send(ReadMemory(packet));           break;
+        case 'M':   Send(WriteMemory(packet));          break;
+        case 'c':   Send(Continue(packet, false));      break;
+        case 's':   Send(Continue(packet, true));       break;
+        case 'Z':   Send(Point(packet, true));          break;
+        case 'z':   Send(Point(packet, false));         break;
+        case 'q':   Send(Query(packet));                break;
+        case 'H':   Send("OK");                         break;
+        case 'T':   Send("OK");                         break;
+        case 'D':
+            Send("OK");
+            Detach();
+            break;
+        case 'k':
+            Detach();
+            _killed = true;
+            break;
+        default:
+            Send("");
+            break;
+        }
+    }
+
+    // Takes out what the debugger put in
+    void Detach()
+    {
+        for (WORD ip : _breakpoints)
+            _core.ClearBreakpoint(ip);
+        _breakpoints.clear();
+        for (const Watch& watch : _watches)
+            _core.Unwatch(watch.addr, watch.size, watch.access);
+        _watches.clear();
+        _served = false;
+    }
+
+    std::string ReadRegisters()
+    {
+        std::string out;
+        for (size_t i = 0; i < static_cast<size_t>(Register::__NUM); ++i)
+            AppendHex(out, _core.Reg(static_cast<Register>(i)), sizeof(WORD));
+        return out;
+    }
+
+    std::string WriteRegisters(const std::string& packet)
+    {
+        WORD values[static_cast<size_t>(Register::__NUM)];
+        for (size_t i = 0; i < static_cast<size_t>(Register::__NUM); ++i)
+        {
+            if (!Word(packet, 1 + 8 * i, values[i]))
+                return "E01";
+        }
+
+        for (size_t i = 1; i < static_cast<size_t>(Register::__NUM); ++i)
+            _core.Reg(static_cast<Register>(i)) = values[i];
+        return "OK";
+    }
+
+    std::string ReadRegister(const std::string& packet)
+    {
+        size_t pos = 1;
+        WORD reg = Number(packet, pos);
+        if (reg >= static_cast<WORD>(Register::__NUM))
+            return "E01";
+
+        std::string out;
+        AppendHex(out, _core.Reg(static_cast<Register>(reg)), sizeof(WORD));
+        return out;
+    }
+
+    std::string WriteRegister(const std::string& packet)
+    {
+        size_t pos = 1;
+        WORD reg = Number(packet, pos);
+        WORD value;
+        if (reg >= static_cast<WORD>(Register::__NUM) || pos >= packet.size() || packet[pos] != '=' ||
+            !Word(packet, pos + 1, value))
+            return "E01";
+
+        if (static_cast<Register>(reg) != Register::RZ)
+            _core.Reg(static_cast<Register>(reg)) = value;
+        return "OK";
+    }
+
+    // Guest physical address behind a debugger address
+    bool Physical(WORD addr, WORD& paddr)
+    {
+        paddr = addr;
+        using Memory = std::remove_reference_t<decltype(_core.MemorySystem())>;
+        if constexpr (Memory::PAGING)
+        {
+            Mmu& mmu = _core.MemorySystem().MemoryManagement();
+            if (mmu.Enabled() && !mmu.Physical(addr, Access::Read, paddr))
+                return false;
+        }
+
+        return _core.MemorySystem().Physical().Contains(paddr, 1);
+    }
+
+    // "addr,length" at pos
+    static bool Range(const std::string& packet, size_t& pos, WORD& addr, WORD& length)
+    {
+        addr = Number(packet, pos);
+        if (pos >= packet.size() || packet[pos] != ',')
+            return false;
+
+        length = Number(packet, ++pos);
+        return true;
+    }
+
+    std::string ReadMemory(const std::string& packet)
+    {
+        size_t pos = 1;
+        WORD addr, length;
+        if (!Range(packet, pos, addr, length))
+            return "E01";
+
+        RAM& ram = _core.MemorySystem().Physical();
+        std::string out;
+        for (WORD i = 0; i < length; ++i)
+        {
+            WORD paddr;
+            if (!Physical(addr + i, paddr))
+                return i == 0 ? "E14" : out;
+            AppendHex(out, ram.ReadByte(paddr), 1);
+        }
+        return out;
+    }
+
+    std::string WriteMemory(const std::string& packet)
+    {
+        size_t pos = 1;
+        WORD addr, length;
+        if (!Range(packet, pos, addr, length) || pos >= packet.size() || packet[pos] != ':' ||
+            packet.size() - pos - 1 != size_t{ length } * 2)
+            return "E01";
+
+        RAM& ram = _core.MemorySystem().Physical();
+        for (WORD i = 0; i < length; ++i)
+        {
+            WORD paddr;
+            int high = Hex(packet[pos + 1 + 2 * i]);
+            int low = Hex(packet[pos + 2 + 2 * i]);
+            if (high < 0 || low < 0 || !Physical(addr + i, paddr))
+                return "E14";
+            ram.WriteByte(paddr, static_cast<WORD>(high << 4 | low));
+        }
+
+        _core.FlushCodeCache();
+        return "OK";
+    }
+
+    // Z/z type,addr,kind
+    std::string Point(const std::string& packet, bool insert)
+    {
+        size_t pos = 3;
+        WORD addr, size;
+        if (packet.size() < 3 || packet[2] != ',' || !Range(packet, pos, addr, size))
+            return "E01";
+
+        char type = packet[1];
+        if (type == '0' || type == '1')
+        {
+            auto it = std::find(_breakpoints.begin(), _breakpoints.end(), addr);
+            if (insert && it == _breakpoints.end() && _core.SetBreakpoint(addr))
+                _breakpoints.push_back(addr);
+            else if (!insert && it != _breakpoints.end())
+            {
+                _core.ClearBreakpoint(addr);
+                _breakpoints.erase(it);
+            }
+            return "OK";
+        }
+
+        if (type < '2' || type > '4')
+            return "";
+
+        WORD paddr;
+        if (!Physical(addr, paddr))
+            return "E14";
+
+        bool ok = true;
+        if (type != '3')
+            ok = Point(paddr, size, Access::Write, insert);
+        if (type != '2' && (ok || !insert))
+        {
+            bool read = Point(paddr, size, Access::Read, insert);
+            if (insert && !read && type == '4')
+                Point(paddr, size, Access::Write, false);
+            ok = read && ok;
+        }
+        return ok ? "OK" : "E01";
+    }
+
+    bool Point(WORD addr, WORD size, Access access, bool insert)
+    {
+        if (insert)
+        {
+            if (!_core.Watch(addr, size, access))
+                return false;
+            _watches.push_back(Watch{ addr, size, access });
+            return true;
+        }
+
+        for (auto it = _watches.begin(); it != _watches.end(); ++it)
+        {
+            if (it->addr == addr && it->size == size && it->access == access)
+            {
+                _watches.erase(it);
+                return _core.Unwatch(addr, size, access);
+            }
+        }
+        return false;
+    }
+
+    // A Ctrl-C from the debugger, checked without waiting
+    bool Interrupted()
+    {
+        pollfd fd{ _client, POLLIN, 0 };
+        if (_input.empty() && ::poll(&fd, 1, 0) <= 0)
+            return false;
+
+        char c;
+        return Byte(c) && c == 0x03;
+    }
+
+    std::string Continue(const std::string& packet, bool step)
+    {
+        if (packet.size() > 1)
+        {
+            size_t pos = 1;
+            _core.Reg(Register::IP) = Number(packet, pos);
+        }
+
+        if (step)
+            _core.Step();
+        else
+        {
+            do
+                _core.Run(SLICE);
+            while (!_core.Halted() && _core.Stopped() == Stop::None && _core.LimitReached() == Limit::None &&
+                   !Interrupted());
+        }
+
+        _last = StopReply(step);
+        return _last;
+    }
+
+    std::string StopReply(bool step)
+    {
+        if (_core.Trapped())
+            return "X0b";
+        if (_core.Halted())
+            return "W00";
+        if (_core.LimitReached() != Limit::None)
+            return "S18";
+
+        Stop stop = _core.Stopped();
+        if (stop == Stop::Breakpoint)
+            return "T05swbreak:;";
+        if (stop == Stop::None)
+            return step ? "S05" : "S02";
+
+        // Past the access, as the debugger expects
+        WORD addr = _core.StopAddress();
+        _core.Step();
+
+        std::string reply = stop == Stop::ReadWatchpoint ? "T05rwatch:" : "T05watch:";
+        for (int shift = 28; shift >= 0; shift -= 4)
+            reply += "0123456789abcdef"[(addr >> shift) & 0xF];
+        return reply + ";";
+    }
+
+    std::string Query(const std::string& packet)
+    {
+        static const std::string xfer = "qXfer:features:read:target.xml:";
+        if (packet.rfind("qSupported", 0) == 0)
+            return "PacketSize=4000;qXfer:features:read+;swbreak+;hwbreak+";
+        if (packet == "qAttached")
+            return "1";
+        if (packet == "qfThreadInfo")
+            return "m1";
+        if (packet == "qsThreadInfo")
+            return "l";
+        if (packet == "qC")
+            return "QC1";
+        if (packet.rfind(xfer, 0) == 0)
+        {
+            size_t pos = xfer.size();
+            WORD offset, length;
+            if (!Range(packet, pos, offset, length))
+                return "E01";
+
+            std::string description = TargetDescription();
+            if (offset >= description.size())
+                return "l";
+            std::string part = description.substr(offset, length);
+            return (offset + part.size() < description.size() ? "m" : "l") + part;
+        }
+        return "";
+    }
+
+    static std::string TargetDescription()
+    {
+        std::string xml = "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                          "<target version=\"1.0\"><feature name=\"org.shiv.cpu\">";
+        for (size_t i = 0; i < static_cast<size_t>(Register::__NUM); ++i)
+        {
+            Register reg = static_cast<Register>(i);
+            std::string name = REGISTER_NAMES[i];
+            for (char& c : name)
+                c = static_cast<char>(::tolower(static_cast<unsigned char>(c)));
+
+            const char* type = reg == Register::IP ? "code_ptr" : reg == Register::SP ? "data_ptr" : "uint32";
+            xml += "<reg name=\"" + name + "\" bitsize=\"32\" regnum=\"" + std::to_string(i) + "\" type=\"" + type + "\"/>";
+        }
+        return xml + "</feature></target>";
+    }
+};
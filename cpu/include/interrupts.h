@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+
+#include "isa.h"
+
+// Why a core is waiting instead of running, see BasicCore::Waiting
+enum class Wait : uint8_t
+{
+    None = 0,
+    Interrupt,      // executed WAIT, continues once an interrupt is pending
+    Device          // in front of a load or store to a busy MMIO window, retries it
+};
+
+// Pending external interrupt lines. Devices may raise from any thread, the core
+// polls between instructions and takes the lowest numbered pending line first.
+class InterruptController
+{
+public:
+
+    void Raise(Interrupt irq)
+    {
+        _pending.fetch_or(Bit(irq), std::memory_order_release);
+    }
+
+    void Clear(Interrupt irq)
+    {
+        _pending.fetch_and(~Bit(irq), std::memory_order_acq_rel);
+    }
+
+    bool Pending() const
+    {
+        return _pending.load(std::memory_order_relaxed) != 0;
+    }
+
+    bool IsPending(Interrupt irq) const
+    {
+        return (_pending.load(std::memory_order_acquire) & Bit(irq)) != 0;
+    }
+
+    void Reset()
+    {
+        _pending.store(0, std::memory_order_release);
+    }
+
+    Interrupt Next() const
+    {
+        return static_cast<Interrupt>(std::countr_zero(_pending.load(std::memory_order_acquire)));
+    }
+
+private:
+    std::atomic<WORD> _pending{ 0 };
+
+    static WORD Bit(Interrupt irq)
+    {
+        return WORD{ 1 } << static_cast<WORD>(irq);
+    }
+};
@@ -0,0 +1,598 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <vector>
+#include <string.h>
+
+#include "isa.h"
+#include "encoding.h"
+#include "alu.h"
+
+//  Runs one program on LANES guests at once. Every register is a column of LANES words
+//  (structure of arrays) and each instruction is applied to all lanes sitting at the
+//  current IP under a lane mask. Lane loops are written branch free, so the compiler
+//  vectorizes them for whatever the target supports: AVX2/AVX-512 with CPU_NATIVE,
+//  SSE2 or scalar code otherwise.
+//
+//  Divergent branches split the lanes. Every step executes the lanes with the lowest IP,
+//  so paths reconverge at the first instruction they share again.
+//
+//  Lane memory is a single arena, lane i owns [i * memory_size, (i + 1) * memory_size),
+//  which turns LW/SW into gathers/scatters of lane base + address. Code is fetched from
+//  the first lane of the group, so all lanes must hold the same text.
+//
+//  Semantics are those of FlatCore with interrupts disabled: no paging, no traps, a fault
+//  stops the lane with ECAUSE/EADDR set. Nothing raises interrupts, so WAIT halts a lane.
+
+enum class LaneState : uint8_t
+{
+    Running = 0,
+    Halted,
+    Faulted
+};
+
+template<size_t LANES>
+class LockstepCore
+{
+public:
+    using Column = std::array<WORD, LANES>;
+
+    LockstepCore(WORD memory_size):
+    _memory_size(memory_size),
+    _memory(static_cast<size_t>(memory_size) * LANES, 0)
+    {
+    }
+
+    WORD& Reg(size_t lane, Register reg)
+    {
+        return Col(reg)[lane];
+    }
+
+    BYTE* Memory(size_t lane)
+    {
+        return _memory.data() + lane * _memory_size;
+    }
+
+    // Copies data to the same address in every lane
+    void Broadcast(WORD addr, const void* data, WORD size)
+    {
+        for (size_t lane = 0; lane < LANES; ++lane)
+            ::memcpy(Memory(lane) + addr, data, size);
+    }
+
+    LaneState State(size_t lane) const
+    {
+        return _state[lane];
+    }
+
+    uint64_t Retired(size_t lane) const
+    {
+        return _retired[lane];
+    }
+
+    // Executes the instruction at the lowest IP for every lane sitting there.
+    // Returns false once no lane is running.
+    bool Step()
+    {
+        Column& ip = Col(Register::IP);
+
+        WORD current = 0;
+        size_t leader = LANES;
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            if (_state[i] == LaneState::Running && (leader == LANES || ip[i] < current))
+            {
+                current = ip[i];
+                leader = i;
+            }
+        }
+
+        if (leader == LANES)
+            return false;
+
+        Column mask;
+        for (size_t i = 0; i < LANES; ++i)
+            mask[i] = Bool(_state[i] == LaneState::Running && ip[i] == current);
+
+        if (!Accessible(current, sizeof(WORD)))
+        {
+            for (size_t i = 0; i < LANES; ++i)
+            {
+                if (mask[i])
+                    Fault(i, Interrupt::MemoryFault, current);
+            }
+            return true;
+        }
+
+        WORD instruction;
+        ::memcpy(&instruction, Memory(leader) + current, sizeof(WORD));
+
+        for (size_t i = 0; i < LANES; ++i)
+            ip[i] = Select(mask[i], current + sizeof(WORD), ip[i]);
+
+        Execute(mask, instruction);
+        Col(Register::RZ).fill(0);
+
+        Column& timer = Col(Register::TIMER);
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            WORD retired = mask[i] & Bool(_state[i] != LaneState::Faulted);
+            _retired[i] += retired & 1;
+            timer[i] -= retired & Bool(timer[i] != 0) & 1;
+        }
+
+        return true;
+    }
+
+    // Steps until every lane stopped or max_steps, returns the number of steps
+    uint64_t Run(uint64_t max_steps)
+    {
+        uint64_t steps = 0;
+        while (steps < max_steps && Step())
+            ++steps;
+
+        return steps;
+    }
+
+private:
+    static constexpr size_t REGS = static_cast<size_t>(Register::__NUM);
+
+    static constexpr WORD Z = 1u << static_cast<WORD>(Flag::Zero);
+    static constexpr WORD C = 1u << static_cast<WORD>(Flag::Carry);
+    static constexpr WORD V = 1u << static_cast<WORD>(Flag::Overflow);
+    static constexpr WORD N = 1u << static_cast<WORD>(Flag::Negative);
+
+    alignas(64) std::array<Column, REGS>    _regs{};
+    std::array<uint64_t, LANES>             _retired{};
+    std::array<LaneState, LANES>            _state{};
+    WORD                                    _memory_size;
+    std::vector<BYTE>                       _memory;
+
+    Column& Col(Register reg)
+    {
+        return _regs[static_cast<size_t>(reg)];
+    }
+
+    static WORD Bool(bool value)
+    {
+        return WORD{ 0 } - static_cast<WORD>(value);
+    }
+
+    static WORD Select(WORD mask, WORD a, WORD b)
+    {
+        return (a & mask) | (b & ~mask);
+    }
+
+    static Column Splat(WORD value)
+    {
+        Column c;
+        c.fill(value);
+        return c;
+    }
+
+    bool Accessible(WORD addr, WORD size) const
+    {
+        return addr % size == 0 && Contains(addr, size);
+    }
+
+    bool Contains(WORD addr, WORD size) const
+    {
+        return static_cast<DWORD>(addr) + size <= _memory_size;
+    }
+
+    void Fault(size_t lane, Interrupt cause, WORD addr)
+    {
+        _state[lane] = LaneState::Faulted;
+        Col(Register::ECAUSE)[lane] = static_cast<WORD>(cause);
+        Col(Register::EADDR)[lane] = addr;
+    }
+
+//  ======================= ARITHMETIC =======================
+
+    // DoAdd/DoSub of Core, one lane per element. Subtraction adds ~b, the carry in is
+    // 1 for SUB/CMP, 0 for ADD and FLAGS.C for ADC/SBC.
+    void Arith(const Column& mask, Register dst, const Column& a, const Column& b, bool subtract, bool write, bool with_carry = false)
+    {
+        Column& d = Col(dst);
+        Column& f = Col(Register::FLAGS);
+
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            WORD op1 = a[i];
+            WORD op2 = subtract ? ~b[i] : b[i];
+            WORD carry_in = with_carry ? (f[i] >> static_cast<WORD>(Flag::Carry)) & 1 : static_cast<WORD>(subtract);
+            DWORD wide = static_cast<DWORD>(op1) + op2 + carry_in;
+            WORD res = static_cast<WORD>(wide);
+
+            WORD carry = static_cast<WORD>(wide >> CB_I);
+            WORD s1 = op1 >> MSB_I;
+            WORD s2 = op2 >> MSB_I;
+            WORD sr = res >> MSB_I;
+            WORD overflow = ~(s1 ^ s2) & (s1 ^ sr) & 1;
+
+            WORD flags = (f[i] & ~(Z | N | C | V))
+                       | (static_cast<WORD>(res == 0) << static_cast<WORD>(Flag::Zero))
+                       | (sr << static_cast<WORD>(Flag::Negative))
+                       | (carry << static_cast<WORD>(Flag::Carry))
+                       | (overflow << static_cast<WORD>(Flag::Overflow));
+
+            f[i] = Select(mask[i], flags, f[i]);
+            if (write)
+                d[i] = Select(mask[i], res, d[i]);
+        }
+    }
+
+//  ================== LOGICAL AND SHIFTS =====================
+
+    template<typename Op>
+    void Logic(const Column& mask, Register dst, const Column& a, const Column& b, Op op)
+    {
+        Column& d = Col(dst);
+        Column& f = Col(Register::FLAGS);
+
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            WORD res = op(a[i], b[i]);
+            WORD flags = (f[i] & ~(Z | N))
+                       | (static_cast<WORD>(res == 0) << static_cast<WORD>(Flag::Zero))
+                       | ((res >> MSB_I) << static_cast<WORD>(Flag::Negative));
+
+            f[i] = Select(mask[i], flags, f[i]);
+            d[i] = Select(mask[i], res, d[i]);
+        }
+    }
+
+    void Assign(const Column& mask, Register dst, const Column& value)
+    {
+        Column& d = Col(dst);
+        for (size_t i = 0; i < LANES; ++i)
+            d[i] = Select(mask[i], value[i], d[i]);
+    }
+
+//  ====================== MEMORY =============================
+
+    // Lanes of mask that can access size bytes at addr, faults the others
+    Column CheckAccess(const Column& mask, const Column& addr, WORD size)
+    {
+        Column ok;
+        bool faulted = false;
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            ok[i] = mask[i] & Bool(Accessible(addr[i], size));
+            faulted |= (mask[i] & ~ok[i]) != 0;
+        }
+
+        if (faulted)
+        {
+            for (size_t i = 0; i < LANES; ++i)
+            {
+                if (mask[i] & ~ok[i])
+                    Fault(i, Interrupt::MemoryFault, addr[i]);
+            }
+        }
+
+        return ok;
+    }
+
+    template<typename T>
+    void Load(const Column& mask, Register dst, const Column& addr)
+    {
+        Column ok = CheckAccess(mask, addr, sizeof(T));
+        Column& d = Col(dst);
+
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            if (!ok[i])
+                continue;
+
+            T tmp;
+            ::memcpy(&tmp, Memory(i) + addr[i], sizeof(T));
+            d[i] = static_cast<WORD>(tmp);
+        }
+    }
+
+    template<typename T>
+    void Store(const Column& mask, const Column& value, const Column& addr)
+    {
+        Column ok = CheckAccess(mask, addr, sizeof(T));
+
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            if (!ok[i])
+                continue;
+
+            T tmp = static_cast<T>(value[i]);
+            ::memcpy(Memory(i) + addr[i], &tmp, sizeof(T));
+        }
+    }
+
+    // Address modes as in Core::LoadStore, the post-increment base is written before a load result
+    void LoadStore(const Column& mask, Instruction op, Register r1, Register r2, WORD instruction)
+    {
+        AddressMode mode = GetAddressMode(instruction);
+        WORD offset = GetAddressOffset(instruction);
+        Column base = Col(r2);
+        Column value = Col(r1);
+
+        Column addr = base;
+        if (mode == AddressMode::Offset)
+        {
+            for (size_t i = 0; i < LANES; ++i)
+                addr[i] = base[i] + offset;
+        }
+        else if (mode == AddressMode::Indexed)
+        {
+            const Column& index = Col(GetAddressIndex(instruction));
+            WORD shift = GetAddressShift(instruction);
+            for (size_t i = 0; i < LANES; ++i)
+                addr[i] = base[i] + (index[i] << shift);
+        }
+
+        Column ok = CheckAccess(mask, addr, AccessSize(op));
+        if (mode == AddressMode::PostIncrement)
+        {
+            Column next;
+            for (size_t i = 0; i < LANES; ++i)
+                next[i] = base[i] + offset;
+            Assign(ok, r2, next);
+        }
+
+        switch (op)
+        {
+        case Instruction::LB:   Load<int8_t>(ok, r1, addr);      break;
+        case Instruction::LBU:  Load<uint8_t>(ok, r1, addr);     break;
+        case Instruction::LH:   Load<int16_t>(ok, r1, addr);     break;
+        case Instruction::LHU:  Load<uint16_t>(ok, r1, addr);    break;
+        case Instruction::SB:   Store<BYTE>(ok, value, addr);    break;
+        case Instruction::SH:   Store<HWORD>(ok, value, addr);   break;
+        case Instruction::SW:   Store<WORD>(ok, value, addr);    break;
+        default:                Load<WORD>(ok, r1, addr);        break;
+        }
+    }
+
+    void Push(const Column& mask, Register src)
+    {
+        Column value = Col(src);
+        Column& sp = Col(Register::SP);
+        Column addr;
+        for (size_t i = 0; i < LANES; ++i)
+            addr[i] = sp[i] - sizeof(WORD);
+
+        Column ok = CheckAccess(mask, addr, sizeof(WORD));
+        Store<WORD>(ok, value, addr);
+        Assign(ok, Register::SP, addr);
+    }
+
+    void Pop(const Column& mask, Register dst)
+    {
+        Column addr = Col(Register::SP);
+        Column ok = CheckAccess(mask, addr, sizeof(WORD));
+
+        Column value{};
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            if (ok[i])
+                ::memcpy(&value[i], Memory(i) + addr[i], sizeof(WORD));
+        }
+
+        Column& sp = Col(Register::SP);
+        for (size_t i = 0; i < LANES; ++i)
+            sp[i] = Select(ok[i], addr[i] + sizeof(WORD), sp[i]);
+
+        Assign(ok, dst, value);
+    }
+
+    // PUSHM/POPM per lane, the frame is checked whole and faults where Core's page split would
+    void Multiple(const Column& mask, WORD list, bool push)
+    {
+        WORD size = static_cast<WORD>(std::popcount(list)) * sizeof(WORD);
+        if (size == 0)
+            return;
+
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            if (!mask[i])
+                continue;
+
+            WORD addr = push ? Reg(i, Register::SP) - size : Reg(i, Register::SP);
+            WORD split = BlockChunk(addr, addr, size);
+            if (addr % sizeof(WORD) != 0 || !Contains(addr, split))
+            {
+                Fault(i, Interrupt::MemoryFault, addr);
+                continue;
+            }
+            if (!Contains(addr + split, size - split))
+            {
+                Fault(i, Interrupt::MemoryFault, addr + split);
+                continue;
+            }
+
+            BYTE* frame = Memory(i) + addr;
+            for (WORD bits = list; bits != 0; bits &= bits - 1, frame += sizeof(WORD))
+            {
+                WORD& reg = Reg(i, static_cast<Register>(std::countr_zero(bits)));
+                if (push)
+                    ::memcpy(frame, &reg, sizeof(WORD));
+                else
+                    ::memcpy(&reg, frame, sizeof(WORD));
+            }
+
+            Reg(i, Register::SP) = push ? addr : addr + size;
+        }
+    }
+
+    // MEMCPY/MEMSET chunk per lane, a scalar loop since lengths diverge. fill selects
+    // MEMSET, where src holds the value.
+    void BlockMemory(const Column& mask, Register dst, Register src, Register len, bool fill)
+    {
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            if (!mask[i])
+                continue;
+
+            WORD to = Reg(i, dst);
+            WORD from = Reg(i, src);
+            WORD n = BlockChunk(to, fill ? to : from, Reg(i, len));
+
+            if (n != 0 && !fill && !Contains(from, n))
+            {
+                Fault(i, Interrupt::MemoryFault, from);
+                continue;
+            }
+            if (n != 0 && !Contains(to, n))
+            {
+                Fault(i, Interrupt::MemoryFault, to);
+                continue;
+            }
+
+            if (fill)
+                ::memset(Memory(i) + to, static_cast<BYTE>(from), n);
+            else
+                ::memmove(Memory(i) + to, Memory(i) + from, n);
+
+            Reg(i, dst) += n;
+            if (!fill)
+                Reg(i, src) += n;
+            Reg(i, len) -= n;
+
+            if (Reg(i, len) != 0)
+                Reg(i, Register::IP) -= sizeof(WORD);
+        }
+    }
+
+//  ====================== BRANCHES ===========================
+
+    template<typename Cond>
+    void Branch(const Column& mask, WORD offset, Cond cond)
+    {
+        Column& ip = Col(Register::IP);
+        const Column& f = Col(Register::FLAGS);
+
+        for (size_t i = 0; i < LANES; ++i)
+        {
+            WORD z = (f[i] >> static_cast<WORD>(Flag::Zero)) & 1;
+            WORD n = (f[i] >> static_cast<WORD>(Flag::Negative)) & 1;
+            WORD v = (f[i] >> static_cast<WORD>(Flag::Overflow)) & 1;
+            ip[i] = Select(mask[i] & Bool(cond(z, n, v)), ip[i] + offset, ip[i]);
+        }
+    }
+
+    void Execute(const Column& mask, WORD instruction)
+    {
+        Instruction op      = GetOpcode(instruction);
+        Register    r1      = GetR1(instruction);
+        Register    r2      = GetR2(instruction);
+        Register    r3      = GetR3(instruction);
+        WORD        imm16   = GetImm16(instruction);
+        WORD        imm26   = GetImm26(instruction);
+        WORD        offset  = GetBranchOffset(instruction);
+
+        if (!IsValidInstruction(instruction) || op == Instruction::RETI)
+        {
+            for (size_t i = 0; i < LANES; ++i)
+            {
+                if (mask[i])
+                    Fault(i, Interrupt::IllegalInstruction, Col(Register::IP)[i] - sizeof(WORD));
+            }
+            return;
+        }
+
+        // Operands are copied, an instruction may write the column it reads
+        auto R = [&](Register reg) { return Col(reg); };
+        auto shl = [](WORD a, WORD b) { return a << (b & 0x1F); };
+        auto shr = [](WORD a, WORD b) { return a >> (b & 0x1F); };
+        auto lor = [](WORD a, WORD b) { return a | b; };
+        auto land = [](WORD a, WORD b) { return a & b; };
+        auto lxor = [](WORD a, WORD b) { return a ^ b; };
+
+        switch (op)
+        {
+        case Instruction::ADD:  Arith(mask, r1, R(r2), R(r3), false, true);          break;
+        case Instruction::ADDI: Arith(mask, r1, R(r2), Splat(imm16), false, true);   break;
+        case Instruction::SUB:  Arith(mask, r1, R(r2), R(r3), true, true);           break;
+        case Instruction::SUBI: Arith(mask, r1, R(r2), Splat(imm16), true, true);    break;
+        case Instruction::CMP:  Arith(mask, r1, R(r1), R(r2), true, false);          break;
+        case Instruction::CMPI: Arith(mask, r1, R(r1), Splat(imm16), true, false);   break;
+        case Instruction::LUI:  Assign(mask, r1, Splat(imm16 << 16));                break;
+        case Instruction::SHL:  Logic(mask, r1, R(r2), R(r3), shl);                  break;
+        case Instruction::SHLI: Logic(mask, r1, R(r2), Splat(imm16), shl);           break;
+        case Instruction::SHR:  Logic(mask, r1, R(r2), R(r3), shr);                  break;
+        case Instruction::SHRI: Logic(mask, r1, R(r2), Splat(imm16), shr);           break;
+        case Instruction::OR:   Logic(mask, r1, R(r2), R(r3), lor);                  break;
+        case Instruction::ORI:  Logic(mask, r1, R(r2), Splat(imm16), lor);           break;
+        case Instruction::AND:  Logic(mask, r1, R(r2), R(r3), land);                 break;
+        case Instruction::ANDI: Logic(mask, r1, R(r2), Splat(imm16), land);          break;
+        case Instruction::XOR:  Logic(mask, r1, R(r2), R(r3), lxor);                 break;
+        case Instruction::XORI: Logic(mask, r1, R(r2), Splat(imm16), lxor);          break;
+        case Instruction::ADC:  Arith(mask, r1, R(r2), R(r3), false, true, true);    break;
+        case Instruction::SBC:  Arith(mask, r1, R(r2), R(r3), true, true, true);     break;
+        case Instruction::MUL:  Logic(mask, r1, R(r2), R(r3), [](WORD a, WORD b) { return a * b; });   break;
+        case Instruction::MULH: Logic(mask, r1, R(r2), R(r3), MultiplyHigh);         break;
+        case Instruction::MULHU: Logic(mask, r1, R(r2), R(r3), MultiplyHighUnsigned); break;
+        case Instruction::DIV:  Logic(mask, r1, R(r2), R(r3), DivideSigned);         break;
+        case Instruction::DIVU: Logic(mask, r1, R(r2), R(r3), DivideUnsigned);       break;
+        case Instruction::REM:  Logic(mask, r1, R(r2), R(r3), RemainderSigned);      break;
+        case Instruction::ADDUSB: Logic(mask, r1, R(r2), R(r3), SaturatingAdd8);     break;
+        case Instruction::SUBUSB: Logic(mask, r1, R(r2), R(r3), SaturatingSub8);     break;
+        case Instruction::ADDUSH: Logic(mask, r1, R(r2), R(r3), SaturatingAdd16);    break;
+        case Instruction::SUBUSH: Logic(mask, r1, R(r2), R(r3), SaturatingSub16);    break;
+        case Instruction::CMPEQB: Logic(mask, r1, R(r2), R(r3), EqualBytes);         break;
+        case Instruction::FFZB: Logic(mask, r1, R(r2), R(r2), [](WORD a, WORD) { return FirstZeroByte(a); });  break;
+        case Instruction::SHUFB: Logic(mask, r1, R(r2), R(r3), ShuffleBytes);        break;
+        case Instruction::NOT:
+        {
+            Column value = R(r2);
+            for (WORD& v : value)
+                v = ~v;
+            Assign(mask, r1, value);
+            break;
+        }
+        case Instruction::LB:   case Instruction::LBU:  case Instruction::LH:   case Instruction::LHU:
+        case Instruction::LW:   case Instruction::LWU:  case Instruction::SB:   case Instruction::SH:
+        case Instruction::SW:
+            LoadStore(mask, op, r1, r2, instruction);
+            break;
+        case Instruction::MEMCPY: BlockMemory(mask, r1, r2, r3, false);              break;
+        case Instruction::MEMSET: BlockMemory(mask, r1, r2, r3, true);               break;
+        case Instruction::B:    Branch(mask, offset, [](WORD, WORD, WORD) { return true; });                        break;
+        case Instruction::BEQ:  Branch(mask, offset, [](WORD z, WORD, WORD) { return z == 1; });                    break;
+        case Instruction::BNE:  Branch(mask, offset, [](WORD z, WORD, WORD) { return z == 0; });                    break;
+        case Instruction::BGT:  Branch(mask, offset, [](WORD z, WORD n, WORD v) { return !(z == 1 || n != v); });   break;
+        case Instruction::BGE:  Branch(mask, offset, [](WORD, WORD n, WORD v) { return n == v; });                  break;
+        case Instruction::BLT:  Branch(mask, offset, [](WORD, WORD n, WORD v) { return n != v; });                  break;
+        case Instruction::BLE:  Branch(mask, offset, [](WORD z, WORD n, WORD v) { return z == 1 || n != v; });      break;
+        case Instruction::J:    Assign(mask, Register::IP, Splat(imm26));            break;
+        case Instruction::JR:   Assign(mask, Register::IP, R(r1));                   break;
+        case Instruction::CALL:
+            Assign(mask, Register::RA, R(Register::IP));
+            Assign(mask, Register::IP, Splat(imm26));
+            break;
+        case Instruction::CALLR:
+        {
+            Column target = R(r1);
+            Assign(mask, Register::RA, R(Register::IP));
+            Assign(mask, Register::IP, target);
+            break;
+        }
+        case Instruction::RET:  Assign(mask, Register::IP, R(Register::RA));         break;
+        case Instruction::PUSH: Push(mask, r1);                                      break;
+        case Instruction::POP:  Pop(mask, r1);                                       break;
+        case Instruction::PUSHM: Multiple(mask, imm16, true);                        break;
+        case Instruction::POPM: Multiple(mask, imm16, false);                        break;
+        case Instruction::HALT:
+        case Instruction::WAIT:
+            for (size_t i = 0; i < LANES; ++i)
+            {
+                if (mask[i])
+                    _state[i] = LaneState::Halted;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+};
+
+extern template class LockstepCore<8>;
+extern template class LockstepCore<16>;
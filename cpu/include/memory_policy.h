@@ -0,0 +1,276 @@
+#pragma once
+
+#include <string.h>
+
+#include "isa.h"
+#include "ram.h"
+#include "mmu.h"
+#include "mmio.h"
+
+// Memory policies for BasicCore. Read/Write return false and report the trap cause on failure,
+// WatchCause for a watched range. Fetch is a Read that never reaches a device or a watch.
+// DEVICES policies may send loads and stores to devices, every one of them has to happen.
+
+// Physical addressing only, PTB is ignored
+class FlatMemory
+{
+public:
+    static constexpr bool PAGING = false;
+    static constexpr bool DEVICES = false;
+
+    FlatMemory(RAM& ram):
+    _ram(ram)
+    {
+    }
+
+    RAM& Physical()
+    {
+        return _ram;
+    }
+
+    template<typename T>
+    bool Read(WORD addr, T& out, Interrupt& fault)
+    {
+        if (_ram.TryLoad(addr, out))
+            return true;
+
+        return Refused(addr, reinterpret_cast<BYTE*>(&out), sizeof(T), Access::Read, fault);
+    }
+
+    template<typename T>
+    bool Write(WORD addr, T data, Interrupt& fault)
+    {
+        if (_ram.TryStore(addr, data))
+            return true;
+
+        return Refused(addr, reinterpret_cast<BYTE*>(&data), sizeof(T), Access::Write, fault);
+    }
+
+    bool Fetch(WORD addr, WORD& instruction, Interrupt& fault)
+    {
+        if (_ram.TryRead(addr, instruction))
+            return true;
+
+        fault = Interrupt::MemoryFault;
+        return false;
+    }
+
+    // Host pointer to size bytes at addr, the range must not cross a page
+    BYTE* Span(WORD addr, WORD size, Access access, Interrupt& fault)
+    {
+        if (_ram.Watched(addr, size, access))
+        {
+            fault = WatchCause(access);
+            return nullptr;
+        }
+
+        if (_ram.Contains(addr, size))
+        {
+            if (access == Access::Write)
+                _ram.MarkDirty(addr, size);
+            return _ram.Data(addr, size);
+        }
+
+        fault = Interrupt::MemoryFault;
+        return nullptr;
+    }
+
+private:
+    RAM& _ram;
+
+    // A load or store TryLoad/TryStore refused: outside RAM, unaligned or, while watching,
+    // anything. One untyped copy for all sizes keeps Read and Write small enough to inline.
+    bool Refused(WORD addr, BYTE* data, WORD size, Access access, Interrupt& fault)
+    {
+        fault = Interrupt::MemoryFault;
+        if (addr % size != 0 || !_ram.Contains(addr, size))
+            return false;
+
+        if (_ram.Watched(addr, size, access))
+        {
+            fault = WatchCause(access);
+            return false;
+        }
+
+        BYTE* host = _ram.Data(addr, size);
+        if (access == Access::Read)
+            ::memcpy(data, host, size);
+        else
+        {
+            ::memcpy(host, data, size);
+            _ram.MarkDirty(addr, size);
+        }
+        return true;
+    }
+};
+
+// Translates through the page table at PTB once it is non zero
+class PagedMemory
+{
+public:
+    static constexpr bool PAGING = true;
+    static constexpr bool DEVICES = false;
+
+    PagedMemory(RAM& ram):
+    _ram(ram),
+    _mmu(ram)
+    {
+    }
+
+    RAM& Physical()
+    {
+        return _ram;
+    }
+
+    Mmu& MemoryManagement()
+    {
+        return _mmu;
+    }
+
+    template<typename T>
+    bool Read(WORD addr, T& out, Interrupt& fault)
+    {
+        if (!_mmu.Enabled())
+            return Flat().Read(addr, out, fault);
+
+        BYTE* host = Translate<T>(addr, Access::Read, sizeof(T), fault);
+        if (!host)
+            return false;
+
+        ::memcpy(&out, host, sizeof(T));
+        return true;
+    }
+
+    template<typename T>
+    bool Write(WORD addr, T data, Interrupt& fault)
+    {
+        if (!_mmu.Enabled())
+            return Flat().Write(addr, data, fault);
+
+        BYTE* host = Translate<T>(addr, Access::Write, sizeof(T), fault);
+        if (!host)
+            return false;
+
+        ::memcpy(host, &data, sizeof(T));
+        return true;
+    }
+
+    bool Fetch(WORD addr, WORD& instruction, Interrupt& fault)
+    {
+        if (!_mmu.Enabled())
+            return Flat().Fetch(addr, instruction, fault);
+
+        BYTE* host = Translate<WORD>(addr, Access::Read, 0, fault);
+        if (!host)
+            return false;
+
+        ::memcpy(&instruction, host, sizeof(WORD));
+        return true;
+    }
+
+    BYTE* Span(WORD addr, WORD size, Access access, Interrupt& fault)
+    {
+        if (!_mmu.Enabled())
+            return Flat().Span(addr, size, access, fault);
+
+        return _mmu.Translate(addr, access, size, fault);
+    }
+
+private:
+    RAM& _ram;
+    Mmu _mmu;
+
+    FlatMemory Flat()
+    {
+        return FlatMemory{ _ram };
+    }
+
+    // watched is the access size checked against watches, 0 for fetches
+    template<typename T>
+    BYTE* Translate(WORD addr, Access access, WORD watched, Interrupt& fault)
+    {
+        if (addr % sizeof(T) != 0)
+        {
+            fault = Interrupt::MemoryFault;
+            return nullptr;
+        }
+
+        return _mmu.Translate(addr, access, watched, fault);
+    }
+};
+
+// Base plus MMIO: loads and stores that miss RAM go to the device bus, after translation
+// when Base pages. Fetches and Span (block memory, PUSHM/POPM) stay RAM only. Nothing is
+// added to accesses that hit RAM. An access to a busy window reports DEVICE_BUSY.
+template<typename Base>
+class MmioMemory : public Base
+{
+public:
+    static constexpr bool DEVICES = true;
+
+    using Base::Base;
+
+    MmioBus& Devices()
+    {
+        return _bus;
+    }
+
+    template<typename T>
+    bool Read(WORD addr, T& out, Interrupt& fault)
+    {
+        if (Base::Read(addr, out, fault))
+            return true;
+
+        WORD paddr;
+        WORD value;
+        if (!Device(addr, sizeof(T), Access::Read, paddr))
+            return false;
+
+        if (!_bus.Read(paddr, sizeof(T), value))
+        {
+            fault = _bus.Busy(paddr, sizeof(T)) ? DEVICE_BUSY : Interrupt::MemoryFault;
+            return false;
+        }
+
+        out = static_cast<T>(value);
+        return true;
+    }
+
+    template<typename T>
+    bool Write(WORD addr, T data, Interrupt& fault)
+    {
+        if (Base::Write(addr, data, fault))
+            return true;
+
+        WORD paddr;
+        if (!Device(addr, sizeof(T), Access::Write, paddr))
+            return false;
+
+        if (!_bus.Write(paddr, sizeof(T), data))
+        {
+            fault = _bus.Busy(paddr, sizeof(T)) ? DEVICE_BUSY : Interrupt::MemoryFault;
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    MmioBus _bus;
+
+    bool Device(WORD addr, WORD size, Access access, WORD& paddr)
+    {
+        if (_bus.Empty())
+            return false;
+
+        paddr = addr;
+        if constexpr (Base::PAGING)
+        {
+            Mmu& mmu = Base::MemoryManagement();
+            if (mmu.Enabled() && !mmu.Physical(addr, access, paddr))
+                return false;
+        }
+
+        return _bus.Contains(paddr, size);
+    }
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include "isa.h"
+
+//  Device windows in the guest physical address space. MmioMemory sends loads and stores
+//  that miss RAM here. An access must be naturally aligned and fall inside one window,
+//  the handlers get the offset from the window base and the access size in bytes. A
+//  missing handler or one returning false makes the access a MemoryFault.
+//
+//  A device with an operation in flight can mark its window busy. Guest accesses to a
+//  busy window reach no handler, the core waits in front of them until the host wakes it
+//  (see Wait in interrupts.h) and then retries.
+
+// Fault cause MmioMemory reports for an access to a busy window. Past the watch and
+// breakpoint causes (see debug.h), the core waits on it instead of trapping.
+constexpr Interrupt DEVICE_BUSY = static_cast<Interrupt>(static_cast<int>(Interrupt::__NUM) + 3);
+
+class MmioBus
+{
+public:
+    using ReadHandler  = std::function<bool(WORD offset, WORD size, WORD& value)>;
+    using WriteHandler = std::function<bool(WORD offset, WORD size, WORD value)>;
+
+    void Map(WORD base, WORD size, ReadHandler read, WriteHandler write)
+    {
+        if (size == 0 || base + size - 1 < base)
+            throw std::runtime_error("Invalid MMIO window");
+
+        for (const Window& window : _windows)
+        {
+            if (base <= window.base + (window.size - 1) && window.base <= base + (size - 1))
+                throw std::runtime_error("MMIO windows overlap");
+        }
+
+        _windows.push_back(Window{ base, size, std::move(read), std::move(write) });
+    }
+
+    bool Unmap(WORD base)
+    {
+        for (auto it = _windows.begin(); it != _windows.end(); ++it)
+        {
+            if (it->base == base)
+            {
+                _windows.erase(it);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool Empty() const
+    {
+        return _windows.empty();
+    }
+
+    bool Contains(WORD addr, WORD size) const
+    {
+        return Find(addr, size) != nullptr;
+    }
+
+    // False if no window starts at base
+    bool SetBusy(WORD base, bool busy)
+    {
+        for (Window& window : _windows)
+        {
+            if (window.base == base)
+            {
+                window.busy = busy;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool Busy(WORD addr, WORD size) const
+    {
+        const Window* window = Find(addr, size);
+        return window && window->busy;
+    }
+
+    bool Read(WORD addr, WORD size, WORD& value) const
+    {
+        const Window* window = Find(addr, size);
+        if (!window || addr % size != 0 || window->busy || !window->read)
+            return false;
+
+        return window->read(addr - window->base, size, value);
+    }
+
+    bool Write(WORD addr, WORD size, WORD value) const
+    {
+        const Window* window = Find(addr, size);
+        if (!window || addr % size != 0 || window->busy || !window->write)
+            return false;
+
+        return window->write(addr - window->base, size, value);
+    }
+
+private:
+    struct Window
+    {
+        WORD            base;
+        WORD            size;
+        ReadHandler     read;
+        WriteHandler    write;
+        bool            busy{ false };
+    };
+
+    std::vector<Window> _windows;
+
+    const Window* Find(WORD addr, WORD size) const
+    {
+        for (const Window& window : _windows)
+        {
+            if (addr >= window.base && size <= window.size && addr - window.base <= window.size - size)
+                return &window;
+        }
+
+        return nullptr;
+    }
+};
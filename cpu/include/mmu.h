@@ -0,0 +1,161 @@
+#pragma once
+
+#include <array>
+#include <string.h>
+
+#include "isa.h"
+#include "ram.h"
+
+//  Two level page table with 4 KiB pages. PTB holds the physical address of the page
+//  directory, PTB == 0 disables translation.
+//
+//      31                     22 21                   12 11                      0
+//      +------------------------+-----------------------+------------------------+
+//      |          dir           |         table         |         offset         |
+//      +------------------------+-----------------------+------------------------+
+//
+//  Directory and table entries hold a frame address in bits 31..12, bit 0 is Present and
+//  bit 1 is Writable. A page is writable only when both of its entries are.
+//
+//  Translations are cached in a direct-mapped TLB of host pointers, so a hit costs one tag
+//  compare. Any write to PTB flushes it, rewriting the same value is how the guest drops
+//  stale entries after editing its page tables. The TLB caches write access, so turning on
+//  dirty tracking in RAM needs a flush. Pages with a watched range (see RAM::Watch) never
+//  enter it in the watched direction, changing the watches needs a flush as well.
+
+class Mmu
+{
+public:
+    static constexpr WORD   PAGE_SHIFT      = 12;
+    static_assert(PAGE_SHIFT == RAM::PAGE_SHIFT, "dirty and watched pages are MMU pages");
+    static constexpr WORD   PAGE_SIZE       = 1 << PAGE_SHIFT;
+    static constexpr WORD   PAGE_MASK       = ~(PAGE_SIZE - 1);
+    static constexpr WORD   PTE_PRESENT     = 1 << 0;
+    static constexpr WORD   PTE_WRITABLE    = 1 << 1;
+    static constexpr size_t TLB_SIZE        = 256;
+
+    Mmu(RAM& ram):
+    _ram(ram)
+    {
+        Flush();
+    }
+
+    bool Enabled() const
+    {
+        return _base != 0;
+    }
+
+    WORD Base() const
+    {
+        return _base;
+    }
+
+    void SetBase(WORD base)
+    {
+        _base = base;
+        Flush();
+    }
+
+    void Flush()
+    {
+        _tlb.fill(Entry{ INVALID_TAG, INVALID_TAG, nullptr });
+    }
+
+    // Host pointer backing a guest virtual address. nullptr with the fault cause on a page
+    // fault or, unless size is 0, when the size bytes at vaddr are watched.
+    BYTE* Translate(WORD vaddr, Access access, WORD size, Interrupt& fault)
+    {
+        const Entry& entry = _tlb[(vaddr >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+        WORD tag = access == Access::Read ? entry.read_tag : entry.write_tag;
+
+        if (tag == (vaddr & PAGE_MASK))
+            return entry.host + (vaddr & ~PAGE_MASK);
+
+        return Refill(vaddr, access, size, fault);
+    }
+
+    // Guest physical address behind vaddr, for pages outside RAM that the TLB can't hold.
+    // Walks the tables on every call.
+    bool Physical(WORD vaddr, Access access, WORD& paddr)
+    {
+        WORD frame;
+        bool writable;
+        if (!Walk(vaddr, access, frame, writable))
+            return false;
+
+        paddr = frame | (vaddr & ~PAGE_MASK);
+        return true;
+    }
+
+    uint64_t Misses() const
+    {
+        return _misses;
+    }
+
+private:
+    // Never page aligned, so never matches a lookup
+    static constexpr WORD INVALID_TAG = 1;
+
+    struct Entry
+    {
+        WORD    read_tag;
+        WORD    write_tag;
+        BYTE*   host;
+    };
+
+    RAM&                            _ram;
+    WORD                            _base{ 0 };
+    std::array<Entry, TLB_SIZE>     _tlb;
+    uint64_t                        _misses{ 0 };
+
+    // Frame of a present, accessible page, it may lie outside RAM
+    bool Walk(WORD vaddr, Access access, WORD& frame, bool& writable)
+    {
+        WORD pde;
+        if (!_ram.TryRead(_base + (vaddr >> 22) * sizeof(WORD), pde) || !(pde & PTE_PRESENT))
+            return false;
+
+        WORD pte;
+        if (!_ram.TryRead((pde & PAGE_MASK) + ((vaddr >> PAGE_SHIFT) & 0x3FF) * sizeof(WORD), pte) || !(pte & PTE_PRESENT))
+            return false;
+
+        frame = pte & PAGE_MASK;
+        writable = (pde & pte & PTE_WRITABLE) != 0;
+        return access == Access::Read || writable;
+    }
+
+    BYTE* Refill(WORD vaddr, Access access, WORD size, Interrupt& fault)
+    {
+        ++_misses;
+
+        WORD frame;
+        bool writable;
+        if (!Walk(vaddr, access, frame, writable) || !_ram.Contains(frame, PAGE_SIZE))
+        {
+            fault = Interrupt::PageFault;
+            return nullptr;
+        }
+
+        if (size != 0 && _ram.Watched(frame | (vaddr & ~PAGE_MASK), size, access))
+        {
+            fault = WatchCause(access);
+            return nullptr;
+        }
+
+        // With dirty tracking a page becomes writable in the TLB only when it is written,
+        // that refill marks it
+        if (_ram.DirtyTracking())
+        {
+            writable = writable && access == Access::Write;
+            if (writable)
+                _ram.MarkDirty(frame, PAGE_SIZE);
+        }
+
+        Entry& entry = _tlb[(vaddr >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+        entry.read_tag = _ram.Protected(frame, Access::Read) ? INVALID_TAG : vaddr & PAGE_MASK;
+        entry.write_tag = writable && !_ram.Protected(frame, Access::Write) ? vaddr & PAGE_MASK : INVALID_TAG;
+        entry.host = _ram.Data(frame, PAGE_SIZE);
+
+        return entry.host + (vaddr & ~PAGE_MASK);
+    }
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "isa.h"
+#include "ram.h"
+#include "core.h"
+
+//  A fixed set of machines reused across jobs. Every machine is allocated and zeroed once,
+//  when the pool is built. Acquire hands one out and dropping the lease resets it in place
+//  before it goes back: RAM pages written since the last reset are zeroed, the rest still
+//  is, and the core restarts from the template registers with nothing predecoded. A reset
+//  costs a few microseconds plus a memset per dirty page, not a fresh allocation and
+//  zero fill of the whole RAM.
+//
+//  Acquire and the lease's release may be called from any thread.
+
+template<typename CoreType>
+class MachinePool
+{
+public:
+    using RegisterFile = typename CoreType::RegisterFile;
+
+    struct Machine
+    {
+        explicit Machine(size_t ram_size):
+        ram(ram_size),
+        core(ram)
+        {
+            ram.SetDirtyTracking(true);
+        }
+
+        RAM         ram;
+        CoreType    core;
+    };
+
+    // Returns its machine to the pool when destroyed, empty when the pool had none left
+    class Lease
+    {
+    public:
+        Lease() = default;
+
+        Lease(MachinePool* pool, Machine* machine):
+        _pool(pool),
+        _machine(machine)
+        {
+        }
+
+        Lease(Lease&& other) noexcept:
+        _pool(other._pool),
+        _machine(other._machine)
+        {
+            other._machine = nullptr;
+        }
+
+        Lease& operator=(Lease&& other) noexcept
+        {
+            if (this != &other)
+            {
+                Release();
+                _pool = other._pool;
+                _machine = other._machine;
+                other._machine = nullptr;
+            }
+            return *this;
+        }
+
+        ~Lease()
+        {
+            Release();
+        }
+
+        explicit operator bool() const { return _machine != nullptr; }
+        Machine& operator*() const { return *_machine; }
+        Machine* operator->() const { return _machine; }
+
+        void Release()
+        {
+            if (_machine)
+                _pool->Release(_machine);
+            _machine = nullptr;
+        }
+
+    private:
+        MachinePool*    _pool{ nullptr };
+        Machine*        _machine{ nullptr };
+    };
+
+    MachinePool(size_t machines, size_t ram_size, const RegisterFile& registers = RegisterFile{}):
+    _registers(registers)
+    {
+        _machines.reserve(machines);
+        _free.reserve(machines);
+        for (size_t i = 0; i < machines; ++i)
+        {
+            _machines.push_back(std::make_unique<Machine>(ram_size));
+            _machines.back()->core.Reset(_registers);
+            _free.push_back(_machines.back().get());
+        }
+    }
+
+    MachinePool(const MachinePool&) = delete;
+    MachinePool& operator=(const MachinePool&) = delete;
+
+    Lease Acquire()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        if (_free.empty())
+            return Lease{};
+
+        Machine* machine = _free.back();
+        _free.pop_back();
+        return Lease{ this, machine };
+    }
+
+    size_t Available()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        return _free.size();
+    }
+
+    size_t Size() const
+    {
+        return _machines.size();
+    }
+
+private:
+    std::vector<std::unique_ptr<Machine>>   _machines;
+    std::vector<Machine*>                   _free;          // never grows past _machines
+    RegisterFile                            _registers;
+    std::mutex                              _lock;
+
+    // Resets outside the lock, so releases on different threads overlap
+    void Release(Machine* machine)
+    {
+        machine->ram.ClearDirty();
+        machine->core.Reset(_registers);
+
+        std::lock_guard<std::mutex> lock(_lock);
+        _free.push_back(machine);
+    }
+};
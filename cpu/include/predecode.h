@@ -0,0 +1,508 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "isa.h"
+#include "encoding.h"
+#include "mmu.h"
+
+//  Predecoded basic blocks for the Core run loop.
+//
+//  A block starts at any IP and ends after a control transfer, after an instruction
+//  that names IP or a system register (FLAGS and up: interrupt enable, timer, paging), at
+//  a page boundary, or before an encoding that does not decode. Interrupts are only
+//  delivered between blocks, which is why system register writes close them.
+//  MEMCPY/MEMSET close blocks as well, they keep IP on themselves until done.
+//
+//  Each block gets a backward liveness pass over Z/N/C/V. An instruction whose flag
+//  results are overwritten before anything reads them executes without computing them.
+//  Loads, stores and stack operations may trap and expose FLAGS through EFLAGS, so they
+//  count as reading every flag.
+//
+//  Hot loops get a second tier. A block ending in a backward branch counts how often the
+//  branch is taken, at HOT_LOOP the blocks executed from the branch target until execution
+//  is back there are recorded as a Trace. The trace gets its own passes: store to load
+//  forwarding, flag liveness across the block boundaries inside it and LUI/ORI pairs
+//  folded into one constant load. Ops that end a block know the IP they should leave
+//  behind, a branch that went the other way or any other surprise exits to the blocks.
+//
+//  Breakpoints are patched into blocks as they are built: the instruction at one becomes
+//  a BREAK, which stops the core before it (see debug.h). Setting or clearing one drops
+//  every block, so code without breakpoints runs exactly as before.
+
+struct DecodedInstruction
+{
+    Instruction op{ Instruction::HALT };
+    Register    r1{ Register::RZ };
+    Register    r2{ Register::RZ };
+    Register    r3{ Register::RZ };
+    bool        set_flags{ true };
+    AddressMode mode{ AddressMode::Offset };    // loads/stores, r3 is the index and shift its scale
+    BYTE        shift{ 0 };
+    WORD        imm{ 0 };           // imm16, sign extended branch or address offset, or imm26 target
+    WORD        raw{ 0 };
+};
+
+// Patched over the predecoded instruction at a breakpoint, no encoding decodes to it
+constexpr Instruction BREAK = static_cast<Instruction>(0);
+
+// Splits an encoding into its fields, returns false for an illegal one
+inline bool Decode(WORD instruction, DecodedInstruction& out)
+{
+    out.op = GetOpcode(instruction);
+    out.r1 = GetR1(instruction);
+    out.r2 = GetR2(instruction);
+    out.r3 = GetR3(instruction);
+    out.set_flags = true;
+    out.mode = AddressMode::Offset;
+    out.shift = 0;
+    out.raw = instruction;
+
+    if (!IsValidInstruction(instruction))
+        return false;
+
+    switch (out.op)
+    {
+    case Instruction::B:    case Instruction::BEQ:  case Instruction::BNE:  case Instruction::BGT:
+    case Instruction::BGE:  case Instruction::BLT:  case Instruction::BLE:
+        out.imm = GetBranchOffset(instruction);
+        break;
+    case Instruction::J:    case Instruction::CALL:
+        out.imm = GetImm26(instruction);
+        break;
+    case Instruction::LB:   case Instruction::LBU:  case Instruction::LH:   case Instruction::LHU:
+    case Instruction::LW:   case Instruction::LWU:  case Instruction::SB:   case Instruction::SH:
+    case Instruction::SW:
+        out.mode = GetAddressMode(instruction);
+        out.r3 = GetAddressIndex(instruction);
+        out.shift = static_cast<BYTE>(GetAddressShift(instruction));
+        out.imm = GetAddressOffset(instruction);
+        break;
+    case Instruction::PUSHM: case Instruction::POPM:
+        out.imm = instruction & REGISTER_LIST;
+        break;
+    default:
+        out.imm = GetImm16(instruction);
+        break;
+    }
+
+    return true;
+}
+
+constexpr WORD FlagBit(Flag flag)
+{
+    return WORD{ 1 } << static_cast<WORD>(flag);
+}
+
+constexpr WORD LOGIC_FLAGS = FlagBit(Flag::Zero) | FlagBit(Flag::Negative);
+constexpr WORD ARITH_FLAGS = LOGIC_FLAGS | FlagBit(Flag::Carry) | FlagBit(Flag::Overflow);
+
+inline WORD FlagsWritten(Instruction op)
+{
+    switch (op)
+    {
+    case Instruction::ADD:  case Instruction::ADDI: case Instruction::SUB:  case Instruction::SUBI:
+    case Instruction::CMP:  case Instruction::CMPI: case Instruction::ADC:  case Instruction::SBC:
+        return ARITH_FLAGS;
+    case Instruction::MUL:  case Instruction::MULH: case Instruction::MULHU: case Instruction::DIV:
+    case Instruction::DIVU: case Instruction::REM:
+    case Instruction::ADDUSB: case Instruction::SUBUSB: case Instruction::ADDUSH: case Instruction::SUBUSH:
+    case Instruction::CMPEQB: case Instruction::FFZB: case Instruction::SHUFB:
+    case Instruction::SHL:  case Instruction::SHLI: case Instruction::SHR:  case Instruction::SHRI:
+    case Instruction::OR:   case Instruction::ORI:  case Instruction::AND:  case Instruction::ANDI:
+    case Instruction::XOR:  case Instruction::XORI:
+        return LOGIC_FLAGS;
+    default:
+        return 0;
+    }
+}
+
+inline WORD FlagsRead(const DecodedInstruction& d)
+{
+    int regs = RegisterOperands(d.op);
+    const Register operands[] = { d.r1, d.r2, d.r3 };
+    for (int i = 0; i < regs; ++i)
+    {
+        if (operands[i] == Register::FLAGS)
+            return ARITH_FLAGS;
+    }
+
+    switch (d.op)
+    {
+    case Instruction::ADC:  case Instruction::SBC:
+        return FlagBit(Flag::Carry);
+    case Instruction::BEQ:  case Instruction::BNE:
+        return FlagBit(Flag::Zero);
+    case Instruction::BLT:  case Instruction::BGE:
+        return FlagBit(Flag::Negative) | FlagBit(Flag::Overflow);
+    case Instruction::BGT:  case Instruction::BLE:
+        return FlagBit(Flag::Zero) | FlagBit(Flag::Negative) | FlagBit(Flag::Overflow);
+    case Instruction::LB:   case Instruction::LBU:  case Instruction::LH:   case Instruction::LHU:
+    case Instruction::LW:   case Instruction::LWU:  case Instruction::SB:   case Instruction::SH:
+    case Instruction::SW:   case Instruction::PUSH: case Instruction::POP:  case Instruction::MEMCPY:
+    case Instruction::MEMSET: case Instruction::PUSHM: case Instruction::POPM:
+        return ARITH_FLAGS;
+    default:
+        return d.op == BREAK ? ARITH_FLAGS : 0;
+    }
+}
+
+// Whether an instruction writes reg through its operands. Stack pointer, RA and IP
+// updates of stack, call and control flow ops don't count.
+inline bool Writes(const DecodedInstruction& d, Register reg)
+{
+    switch (d.op)
+    {
+    case Instruction::SB:   case Instruction::SH:   case Instruction::SW:
+        return d.mode == AddressMode::PostIncrement && d.r2 == reg;
+    case Instruction::CMP:  case Instruction::CMPI: case Instruction::B:    case Instruction::BEQ:
+    case Instruction::BNE:  case Instruction::BGT:  case Instruction::BGE:  case Instruction::BLT:
+    case Instruction::BLE:  case Instruction::J:    case Instruction::JR:   case Instruction::CALL:
+    case Instruction::CALLR: case Instruction::RET: case Instruction::RETI: case Instruction::PUSH:
+    case Instruction::PUSHM: case Instruction::POPM: case Instruction::HALT: case Instruction::WAIT:
+        return false;
+    case Instruction::MEMCPY:
+        return d.r1 == reg || d.r2 == reg || d.r3 == reg;
+    case Instruction::MEMSET:
+        return d.r1 == reg || d.r3 == reg;
+    default:
+        if (IsLoadStore(d.op))
+            return d.r1 == reg || (d.mode == AddressMode::PostIncrement && d.r2 == reg);
+        return RegisterOperands(d.op) > 0 && d.r1 == reg;
+    }
+}
+
+inline bool EndsBlock(const DecodedInstruction& d)
+{
+    switch (d.op)
+    {
+    case Instruction::B:    case Instruction::BEQ:  case Instruction::BNE:  case Instruction::BGT:
+    case Instruction::BGE:  case Instruction::BLT:  case Instruction::BLE:  case Instruction::J:
+    case Instruction::JR:   case Instruction::CALL: case Instruction::CALLR: case Instruction::RET:
+    case Instruction::RETI: case Instruction::HALT: case Instruction::MEMCPY: case Instruction::MEMSET:
+    case Instruction::WAIT:
+        return true;
+    default:
+        if (IsLoadStore(d.op) && d.mode == AddressMode::PostIncrement && (d.r2 == Register::IP || d.r2 >= Register::FLAGS))
+            return true;
+        return RegisterOperands(d.op) > 0 && (d.r1 == Register::IP || d.r1 >= Register::FLAGS);
+    }
+}
+
+struct Trace;
+
+struct Block
+{
+    WORD                            start{ 0 };
+    std::vector<DecodedInstruction> code;
+    bool                            closes_loop{ false };   // ends in a backward branch to loop_head
+    WORD                            loop_head{ 0 };
+    uint32_t                        heat{ 0 };              // times the backward branch was taken
+    Trace*                          trace{ nullptr };       // starting here, owned by the CodeCache
+};
+
+inline void ElideDeadFlags(Block& block)
+{
+    WORD live = ARITH_FLAGS;
+
+    for (auto it = block.code.rbegin(); it != block.code.rend(); ++it)
+    {
+        WORD written = FlagsWritten(it->op);
+        it->set_flags = (written & live) != 0;
+        live = (live & ~written) | FlagsRead(*it);
+    }
+}
+
+// Target of a B/Bcc/J at ip that jumps back to or before it
+inline bool LoopTarget(const DecodedInstruction& d, WORD ip, WORD& target)
+{
+    switch (d.op)
+    {
+    case Instruction::B:    case Instruction::BEQ:  case Instruction::BNE:  case Instruction::BGT:
+    case Instruction::BGE:  case Instruction::BLT:  case Instruction::BLE:
+        target = ip + sizeof(WORD) + d.imm;
+        break;
+    case Instruction::J:
+        target = d.imm;
+        break;
+    default:
+        return false;
+    }
+
+    return target <= ip;
+}
+
+//  ====================== TRACES =============================
+
+struct TraceOp
+{
+    enum class Kind : BYTE
+    {
+        Plain,
+        Exit,       // ends a block, the trace goes on only if IP is at next
+        Folded,     // LUI+ORI as one ORI from RZ, the LUI retires first at ip - 4
+        Forwarded   // LW of the word an earlier SW in the trace stored, from r3
+    };
+
+    DecodedInstruction  d;
+    WORD                ip{ 0 };
+    WORD                next{ 0 };      // IP after the op when the trace goes on
+    WORD                folded{ 0 };    // encoding of the folded LUI
+    Kind                kind{ Kind::Plain };
+};
+
+struct Trace
+{
+    static constexpr size_t MAX_LENGTH = 256;
+
+    WORD                    start{ 0 };
+    WORD                    length{ 0 };    // instructions retired by one pass
+    std::vector<TraceOp>    code;
+    std::vector<WORD>       pages;
+};
+
+// Blocks that end in anything but a plain control transfer (HALT, WAIT, RETI, block
+// memory operations, system register writes) can't be part of a trace
+inline bool Traceable(const Block& block)
+{
+    const DecodedInstruction& last = block.code.back();
+    switch (last.op)
+    {
+    case Instruction::HALT: case Instruction::RETI: case Instruction::MEMCPY: case Instruction::MEMSET:
+    case Instruction::WAIT:
+        return false;
+    default:
+        if (IsLoadStore(last.op) && last.mode == AddressMode::PostIncrement && last.r2 >= Register::FLAGS)
+            return false;
+        return !(RegisterOperands(last.op) > 0 && last.r1 >= Register::FLAGS);
+    }
+}
+
+// Register an op leaves written, for the ops forwarding can look past. Returns false for
+// anything else: stores, stack and block operations, calls, post-increment.
+inline bool SimpleWrite(const DecodedInstruction& d, Register& written)
+{
+    written = Register::RZ;
+    switch (d.op)
+    {
+    case Instruction::B:    case Instruction::BEQ:  case Instruction::BNE:  case Instruction::BGT:
+    case Instruction::BGE:  case Instruction::BLT:  case Instruction::BLE:  case Instruction::J:
+    case Instruction::CMP:  case Instruction::CMPI:
+        return true;
+    case Instruction::LUI:  case Instruction::NOT:
+        written = d.r1;
+        return true;
+    default:
+        if (IsLoadStore(d.op))
+        {
+            written = d.r1;
+            return !IsStore(d.op) && d.mode != AddressMode::PostIncrement;
+        }
+        written = d.r1;
+        return FlagsWritten(d.op) != 0;
+    }
+}
+
+// A LW/LWU from [base + offset] after a SW to the same place takes the stored register,
+// as long as nothing in between stores or writes either register. The SW would have
+// faulted or left the trace on a code page, so the load can't fault either. Only general
+// purpose registers, the others change without being written.
+inline void ForwardStores(std::vector<TraceOp>& code)
+{
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const DecodedInstruction& store = code[i].d;
+        if (store.op != Instruction::SW || store.mode != AddressMode::Offset ||
+            store.r1 >= Register::IP || store.r2 >= Register::IP)
+            continue;
+
+        for (size_t j = i + 1; j < code.size(); ++j)
+        {
+            DecodedInstruction& d = code[j].d;
+            Register written;
+            if (!SimpleWrite(d, written))
+                break;
+
+            if ((d.op == Instruction::LW || d.op == Instruction::LWU) && d.mode == AddressMode::Offset &&
+                d.r2 == store.r2 && d.imm == store.imm && d.r1 < Register::IP)
+            {
+                d.r3 = store.r1;
+                code[j].kind = TraceOp::Kind::Forwarded;
+            }
+
+            if (written == store.r1 || written == store.r2)
+                break;
+        }
+    }
+}
+
+// ElideDeadFlags over a whole trace. Flags are live wherever it may be left, which is after
+// any op that ends a block and at any op that may trap.
+inline void ElideDeadFlags(std::vector<TraceOp>& code)
+{
+    WORD live = ARITH_FLAGS;
+
+    for (auto it = code.rbegin(); it != code.rend(); ++it)
+    {
+        if (EndsBlock(it->d))
+            live = ARITH_FLAGS;
+
+        WORD written = FlagsWritten(it->d.op);
+        it->d.set_flags = (written & live) != 0;
+        WORD read = it->kind == TraceOp::Kind::Forwarded ? 0 : FlagsRead(it->d);
+        live = (live & ~written) | read;
+    }
+}
+
+// LUI r followed by ORI r, r, imm with dead flags loads one constant
+inline void FoldConstants(std::vector<TraceOp>& code)
+{
+    for (size_t i = 0; i + 1 < code.size(); ++i)
+    {
+        const DecodedInstruction& upper = code[i].d;
+        DecodedInstruction& lower = code[i + 1].d;
+        if (upper.op != Instruction::LUI || lower.op != Instruction::ORI || lower.set_flags ||
+            lower.r1 != upper.r1 || lower.r2 != upper.r1 || EndsBlock(upper) ||
+            code[i + 1].ip != code[i].ip + sizeof(WORD))
+            continue;
+
+        lower.r2 = Register::RZ;
+        lower.imm |= upper.imm << 16;
+        code[i + 1].kind = TraceOp::Kind::Folded;
+        code[i + 1].folded = upper.raw;
+        code.erase(code.begin() + i);
+    }
+}
+
+// Ops recorded from start until execution came back to it
+inline Trace BuildTrace(WORD start, std::vector<TraceOp> code, bool forward_stores)
+{
+    if (forward_stores)
+        ForwardStores(code);
+    ElideDeadFlags(code);
+    FoldConstants(code);
+
+    Trace trace{ start, 0, std::move(code), {} };
+    for (size_t i = 0; i < trace.code.size(); ++i)
+    {
+        TraceOp& op = trace.code[i];
+        op.next = i + 1 < trace.code.size() ? trace.code[i + 1].ip : start;
+        if (op.kind == TraceOp::Kind::Plain && (EndsBlock(op.d) || op.next != op.ip + sizeof(WORD)))
+            op.kind = TraceOp::Kind::Exit;
+        trace.length += op.kind == TraceOp::Kind::Folded ? 2 : 1;
+
+        WORD page = op.ip >> Mmu::PAGE_SHIFT;
+        if (std::find(trace.pages.begin(), trace.pages.end(), page) == trace.pages.end())
+            trace.pages.push_back(page);
+    }
+
+    return trace;
+}
+
+// Blocks and traces by start IP. Remembers which pages hold decoded code so stores into
+// them can drop the stale blocks and every trace running through them.
+class CodeCache
+{
+public:
+    static constexpr size_t MAX_BLOCK = 64;
+
+    Block* Find(WORD ip)
+    {
+        Slot& slot = _lookup[(ip >> 2) & (LOOKUP_SIZE - 1)];
+        if (slot.block && slot.ip == ip)
+            return slot.block;
+
+        auto it = _blocks.find(ip);
+        if (it == _blocks.end())
+            return nullptr;
+
+        slot = Slot{ ip, it->second.get() };
+        return slot.block;
+    }
+
+    Block& Insert(Block block)
+    {
+        WORD page = block.start >> Mmu::PAGE_SHIFT;
+        if (_pages.empty())
+            _pages.resize((size_t{ 1 } << (32 - Mmu::PAGE_SHIFT)) / 64, 0);
+        _pages[page / 64] |= uint64_t{ 1 } << (page % 64);
+
+        auto& owned = _blocks[block.start];
+        owned = std::make_unique<Block>(std::move(block));
+        return *owned;
+    }
+
+    // Runs from the head block on, dropped if that is no longer cached
+    void InsertTrace(Trace trace)
+    {
+        auto head = _blocks.find(trace.start);
+        if (head == _blocks.end())
+            return;
+
+        auto& owned = _traces[trace.start];
+        owned = std::make_unique<Trace>(std::move(trace));
+        head->second->trace = owned.get();
+    }
+
+    bool IsCode(WORD addr) const
+    {
+        WORD page = addr >> Mmu::PAGE_SHIFT;
+        return !_pages.empty() && ((_pages[page / 64] >> (page % 64)) & 1);
+    }
+
+    void InvalidatePage(WORD addr)
+    {
+        WORD page = addr >> Mmu::PAGE_SHIFT;
+        for (auto it = _traces.begin(); it != _traces.end();)
+        {
+            const std::vector<WORD>& pages = it->second->pages;
+            if (std::find(pages.begin(), pages.end(), page) == pages.end())
+            {
+                ++it;
+                continue;
+            }
+
+            auto head = _blocks.find(it->first);
+            if (head != _blocks.end())
+                head->second->trace = nullptr;
+            it = _traces.erase(it);
+        }
+
+        for (auto it = _blocks.begin(); it != _blocks.end();)
+        {
+            if ((it->first >> Mmu::PAGE_SHIFT) == page)
+                it = _blocks.erase(it);
+            else
+                ++it;
+        }
+
+        _pages[page / 64] &= ~(uint64_t{ 1 } << (page % 64));
+        _lookup.fill(Slot{});
+    }
+
+    void Clear()
+    {
+        _traces.clear();
+        _blocks.clear();
+        _lookup.fill(Slot{});
+        std::fill(_pages.begin(), _pages.end(), 0);
+    }
+
+private:
+    static constexpr size_t LOOKUP_SIZE = 1024;
+
+    struct Slot
+    {
+        WORD    ip{ 0 };
+        Block*  block{ nullptr };
+    };
+
+    std::unordered_map<WORD, std::unique_ptr<Block>>    _blocks;
+    std::unordered_map<WORD, std::unique_ptr<Trace>>    _traces;
+    std::array<Slot, LOOKUP_SIZE>                       _lookup{};
+    std::vector<uint64_t>                               _pages;
+};
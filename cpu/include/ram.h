@@ -1,20 +1,60 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <vector>
 #include <sstream>
 #include <string.h>
 
 #include "isa.h"
 
+enum class Access : uint8_t
+{
+    Read = 0,
+    Write
+};
+
+// Fault cause a memory policy reports for an access to a watched range (see RAM::Watch).
+// Past every ISA interrupt, the core stops on it instead of trapping.
+constexpr Interrupt WatchCause(Access access)
+{
+    return static_cast<Interrupt>(static_cast<int>(Interrupt::__NUM) + static_cast<int>(access));
+}
+
+// Guest physical memory starting at address 0. Either owns a zeroed buffer or borrows
+// one from the host, which must outlive the RAM and any core using it.
+//
+// With dirty tracking on, every write path (stores, host writes, block memory, DMA and
+// TLB refills for writing) marks the pages it touches, and ClearDirty zeroes just those.
+// Writes through a raw Data pointer must be marked by whoever makes them.
+//
+// Watched ranges protect the pages they touch, the MMU keeps those out of its TLB. Without
+// paging there is no page lookup to hook, TryLoad/TryStore fail everywhere while a watch
+// is set and the memory policy compares the access with the ranges.
 class RAM
 {
 public:
+static constexpr WORD PAGE_SHIFT = 12;      // Mmu::PAGE_SHIFT
 
 RAM(size_t size) :
-_mem(size, 0)
+_owned(size, 0),
+_data(_owned.data()),
+_size(size),
+_reach(size)
 {
 }
 
+RAM(BYTE* data, size_t size) :
+_data(data),
+_size(size),
+_reach(size)
+{
+}
+
+RAM(const RAM&) = delete;
+RAM& operator=(const RAM&) = delete;
+
 void WriteByte(WORD addr, WORD word)
 {
     BYTE tmp = static_cast<BYTE>(word);
@@ -53,34 +93,243 @@ WORD ReadWord(WORD addr)
     return tmp;
 }
 
+size_t Size() const
+{
+    return _size;
+}
+
+bool Contains(WORD addr, WORD size) const
+{
+    return addr <= _size && size <= _size - addr;
+}
+
+BYTE* Data(WORD addr, WORD size)
+{
+    if (!Contains(addr, size))
+        ThrowMemoryException("Invalid memory range", addr);
+
+    return _data + addr;
+}
+
+bool DirtyTracking() const
+{
+    return _tracking;
+}
+
+void SetDirtyTracking(bool tracking)
+{
+    if (tracking && _dirty.empty())
+        _dirty.resize((Pages() + 63) / 64, 0);
+    _tracking = tracking;
+}
+
+void MarkDirty(WORD addr, WORD size)
+{
+    if (!_tracking || size == 0)
+        return;
+
+    for (WORD page = addr >> PAGE_SHIFT; page <= (addr + size - 1) >> PAGE_SHIFT; ++page)
+        _dirty[page / 64] |= uint64_t{ 1 } << (page % 64);
+}
+
+size_t DirtyPages() const
+{
+    size_t count = 0;
+    for (uint64_t bits : _dirty)
+        count += static_cast<size_t>(std::popcount(bits));
+    return count;
+}
+
+// Zeroes the pages written since the last call, the rest is zero already if it started so
+void ClearDirty()
+{
+    for (size_t i = 0; i < _dirty.size(); ++i)
+    {
+        for (uint64_t bits = _dirty[i]; bits != 0; bits &= bits - 1)
+        {
+            size_t offset = (i * 64 + static_cast<size_t>(std::countr_zero(bits))) << PAGE_SHIFT;
+            ::memset(_data + offset, 0, std::min(size_t{ 1 } << PAGE_SHIFT, _size - offset));
+        }
+        _dirty[i] = 0;
+    }
+}
+
+// Guest loads (Access::Read) or stores (Access::Write) touching [addr, addr + size) stop
+// the core, see BasicCore::Watch. False if the range is outside RAM or already watched.
+bool Watch(WORD addr, WORD size, Access access)
+{
+    Watchpoint watch{ addr, size, access };
+    if (size == 0 || !Contains(addr, size) || std::find(_watches.begin(), _watches.end(), watch) != _watches.end())
+        return false;
+
+    _watches.push_back(watch);
+    Protect();
+    return true;
+}
+
+bool Unwatch(WORD addr, WORD size, Access access)
+{
+    auto it = std::find(_watches.begin(), _watches.end(), Watchpoint{ addr, size, access });
+    if (it == _watches.end())
+        return false;
+
+    _watches.erase(it);
+    Protect();
+    return true;
+}
+
+// Lets the core step over the access it stopped on
+void SuspendWatches(bool suspended)
+{
+    _suspended = suspended;
+    _watching = !_watches.empty() && !suspended;
+    _reach = _watching ? 0 : _size;
+}
+
+bool Watching() const
+{
+    return _watching;
+}
+
+// The page holding addr is watched for access
+bool Protected(WORD addr, Access access) const
+{
+    size_t page = addr >> PAGE_SHIFT;
+    const std::vector<uint64_t>& bits = _protected[static_cast<size_t>(access)];
+    return _watching && page / 64 < bits.size() && ((bits[page / 64] >> (page % 64)) & 1);
+}
+
+// [addr, addr + size) overlaps a range watched for access
+bool Watched(WORD addr, WORD size, Access access) const
+{
+    if (!_watching || !(Protected(addr, access) || Protected(addr + size - 1, access)))
+        return false;
+
+    uint64_t end = uint64_t{ addr } + size;
+    return std::any_of(_watches.begin(), _watches.end(), [&](const Watchpoint& watch) {
+        return watch.access == access && addr < uint64_t{ watch.addr } + watch.size && watch.addr < end;
+    });
+}
+
+// Non-throwing accessors: return false on an out of range or unaligned access
+template<typename T>
+bool TryRead(WORD addr, T& out)
+{
+    if (!Accessible(addr, sizeof(T)))
+        return false;
+
+    ::memcpy(&out, _data + addr, sizeof(T));
+    return true;
+}
+
+template<typename T>
+bool TryWrite(WORD addr, T data)
+{
+    if (!Accessible(addr, sizeof(T)))
+        return false;
+
+    ::memcpy(_data + addr, &data, sizeof(T));
+    if (_tracking)
+        _dirty[addr >> (PAGE_SHIFT + 6)] |= uint64_t{ 1 } << ((addr >> PAGE_SHIFT) % 64);
+    return true;
+}
+
+// TryRead/TryWrite for guest loads and stores, they fail while a watch is set
+template<typename T>
+bool TryLoad(WORD addr, T& out)
+{
+    if (addr % sizeof(T) != 0 || addr > _reach || sizeof(T) > _reach - addr)
+        return false;
+
+    ::memcpy(&out, _data + addr, sizeof(T));
+    return true;
+}
+
+template<typename T>
+bool TryStore(WORD addr, T data)
+{
+    if (addr % sizeof(T) != 0 || addr > _reach || sizeof(T) > _reach - addr)
+        return false;
+
+    ::memcpy(_data + addr, &data, sizeof(T));
+    if (_tracking)
+        _dirty[addr >> (PAGE_SHIFT + 6)] |= uint64_t{ 1 } << ((addr >> PAGE_SHIFT) % 64);
+    return true;
+}
+
 private:
-    std::vector<uint8_t> _mem;
+    std::vector<uint8_t> _owned;
+    BYTE* _data;
+    size_t _size;
+    size_t _reach;                      // of TryLoad/TryStore
+    std::vector<uint64_t> _dirty;       // one bit per page
+    bool _tracking{ false };
+
+    struct Watchpoint
+    {
+        WORD    addr;
+        WORD    size;
+        Access  access;
+
+        bool operator==(const Watchpoint&) const = default;
+    };
+
+    std::vector<Watchpoint> _watches;
+    std::array<std::vector<uint64_t>, 2> _protected;    // pages by Access
+    bool _watching{ false };
+    bool _suspended{ false };
+
+    void Protect()
+    {
+        for (std::vector<uint64_t>& bits : _protected)
+            bits.assign((Pages() + 63) / 64, 0);
+
+        for (const Watchpoint& watch : _watches)
+        {
+            std::vector<uint64_t>& bits = _protected[static_cast<size_t>(watch.access)];
+            for (WORD page = watch.addr >> PAGE_SHIFT; page <= (watch.addr + watch.size - 1) >> PAGE_SHIFT; ++page)
+                bits[page / 64] |= uint64_t{ 1 } << (page % 64);
+        }
+
+        SuspendWatches(_suspended);
+    }
+
+    size_t Pages() const
+    {
+        return (_size + (size_t{ 1 } << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+    }
 
     template<typename T>
     void Read(WORD addr, T* out)
     {
-        CheckMemoryBounds(addr);
+        CheckMemoryBounds(addr, sizeof(T));
 
         if (addr % sizeof(T) != 0)
             ThrowMemoryException("Unaligned read", addr);
 
-        ::memcpy(out, _mem.data() + addr, sizeof(T));
+        ::memcpy(out, _data + addr, sizeof(T));
     }
 
     template<typename T>
     void Write(WORD addr, T* data)
     {
-        CheckMemoryBounds(addr);
+        CheckMemoryBounds(addr, sizeof(T));
 
         if (addr % sizeof(T) != 0)
             ThrowMemoryException("Unaligned write", addr);
 
-        ::memcpy(_mem.data() + addr, data, sizeof(T));
+        ::memcpy(_data + addr, data, sizeof(T));
+        MarkDirty(addr, sizeof(T));
+    }
+
+    bool Accessible(WORD addr, WORD size) const
+    {
+        return addr % size == 0 && Contains(addr, size);
     }
 
-    void CheckMemoryBounds(WORD addr)
+    void CheckMemoryBounds(WORD addr, WORD size)
     {
-        if (addr >= _mem.size())
+        if (!Contains(addr, size))
             ThrowMemoryException("Invalid memory address", addr);
     }
 
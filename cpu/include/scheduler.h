@@ -0,0 +1,258 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "isa.h"
+#include "core.h"
+
+//  Runs many guests on one host thread. Every guest is a coroutine that runs its core a
+//  slice at a time and suspends after each slice: to the back of the ready queue while it
+//  can go on, asleep while the core waits (see BasicCore::Waiting) for an interrupt after
+//  WAIT or for a busy MMIO window. An asleep guest costs its coroutine frame and nothing
+//  else, no thread and no polling.
+//
+//  Devices finish their work through Post, from any thread. The completion runs on the
+//  loop thread between slices, so it may touch the guest's RAM, devices and interrupts
+//  freely, and then the guest runs again: it retries the access or finds its interrupt
+//  pending. A guest whose interrupt is raised on its controller directly, bypassing Post,
+//  sleeps on.
+//
+//  A guest is done once its core halted, reached a limit (see budget.h) or stopped for a
+//  debugger (see debug.h). The cores must outlive the scheduler.
+
+template<typename CoreType>
+class GuestScheduler
+{
+public:
+    using Id = size_t;
+    using Completion = std::function<void(CoreType&)>;
+
+    static constexpr uint64_t SLICE = 1 << 14;
+
+    explicit GuestScheduler(uint64_t slice = SLICE):
+    _slice(slice)
+    {
+    }
+
+    GuestScheduler(const GuestScheduler&) = delete;
+    GuestScheduler& operator=(const GuestScheduler&) = delete;
+
+    // Loop thread only, also from inside a completion
+    Id Spawn(CoreType& core)
+    {
+        Id id = _guests.size();
+        _guests.push_back(std::make_unique<Guest>(core));
+        _guests.back()->task = Drive(*_guests.back());
+        _ready.push_back(id);
+        ++_live;
+        return id;
+    }
+
+    // Any thread. Runs completion on the loop thread, then wakes the guest.
+    void Post(Id guest, Completion completion)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _inbox.emplace_back(guest, std::move(completion));
+            _posted.store(true, std::memory_order_release);
+        }
+        _arrived.notify_one();
+    }
+
+    // Any thread
+    void Raise(Id guest, Interrupt irq)
+    {
+        Post(guest, [irq](CoreType& core) { core.Interrupts().Raise(irq); });
+    }
+
+    // Runs guests until every one is done, sleeping while all of them wait
+    void Run()
+    {
+        while (_live != 0)
+        {
+            Deliver(_ready.empty());
+            RunReady();
+        }
+    }
+
+    // Runs the completions posted so far and one slice of every ready guest, returns how
+    // many guests are not done. For hosts with their own event loop.
+    size_t Poll()
+    {
+        Deliver(false);
+        RunReady();
+        return _live;
+    }
+
+    bool Asleep(Id guest) const
+    {
+        return _guests[guest]->state == State::Asleep;
+    }
+
+    bool Done(Id guest) const
+    {
+        return _guests[guest]->state == State::Done;
+    }
+
+private:
+    enum class State : uint8_t
+    {
+        Ready = 0,
+        Asleep,
+        Done
+    };
+
+    struct Task
+    {
+        struct promise_type
+        {
+            Task get_return_object()
+            {
+                return Task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { throw; }
+        };
+
+        Task() = default;
+
+        explicit Task(std::coroutine_handle<promise_type> handle):
+        _handle(handle)
+        {
+        }
+
+        Task(Task&& other) noexcept:
+        _handle(std::exchange(other._handle, {}))
+        {
+        }
+
+        Task& operator=(Task&& other) noexcept
+        {
+            if (this != &other)
+            {
+                if (_handle)
+                    _handle.destroy();
+                _handle = std::exchange(other._handle, {});
+            }
+            return *this;
+        }
+
+        ~Task()
+        {
+            if (_handle)
+                _handle.destroy();
+        }
+
+        // False once the coroutine returned
+        bool Resume()
+        {
+            _handle.resume();
+            return !_handle.done();
+        }
+
+    private:
+        std::coroutine_handle<promise_type> _handle;
+    };
+
+    struct Guest
+    {
+        explicit Guest(CoreType& core):
+        core(core)
+        {
+        }
+
+        CoreType&   core;
+        Task        task;
+        State       state{ State::Ready };
+    };
+
+    std::vector<std::unique_ptr<Guest>>         _guests;
+    std::deque<Id>                              _ready;
+    size_t                                      _live{ 0 };
+    uint64_t                                    _slice;
+
+    std::mutex                                  _lock;
+    std::condition_variable                     _arrived;
+    std::vector<std::pair<Id, Completion>>      _inbox;         // under _lock
+    std::atomic<bool>                           _posted{ false };
+
+    Task Drive(Guest& guest)
+    {
+        CoreType& core = guest.core;
+        for (;;)
+        {
+            core.Run(_slice);
+            if (core.Halted() || core.LimitReached() != Limit::None || core.Stopped() != Stop::None)
+                co_return;
+
+            guest.state = core.Waiting() != Wait::None ? State::Asleep : State::Ready;
+            co_await std::suspend_always{};
+        }
+    }
+
+    // One slice for every guest ready now
+    void RunReady()
+    {
+        for (size_t n = _ready.size(); n != 0; --n)
+        {
+            Id id = _ready.front();
+            _ready.pop_front();
+
+            Guest& guest = *_guests[id];
+            if (!guest.task.Resume())
+            {
+                guest.state = State::Done;
+                guest.task = Task{};
+                --_live;
+            }
+            else if (guest.state == State::Ready)
+            {
+                _ready.push_back(id);
+            }
+        }
+    }
+
+    // Runs the completions posted so far and readies their guests, waits for one first if
+    // block is set
+    void Deliver(bool block)
+    {
+        if (!block && !_posted.load(std::memory_order_acquire))
+            return;
+
+        std::vector<std::pair<Id, Completion>> inbox;
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            if (block)
+                _arrived.wait(lock, [&] { return !_inbox.empty(); });
+
+            inbox.swap(_inbox);
+            _posted.store(false, std::memory_order_relaxed);
+        }
+
+        for (auto& [id, completion] : inbox)
+        {
+            Guest& guest = *_guests[id];
+            if (guest.state == State::Done)
+                continue;
+
+            completion(guest.core);
+            if (guest.state == State::Asleep)
+            {
+                guest.state = State::Ready;
+                _ready.push_back(id);
+            }
+        }
+    }
+};
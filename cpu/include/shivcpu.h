@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//  C interface for hosting guests inside other programs, built as libshivcpu.so and
+//  libshivcpu.a. Only what is declared here is exported, the ABI changes only together
+//  with SHIV_API_VERSION.
+//
+//  A machine is a paging capable core over guest RAM at physical address 0. The RAM is
+//  allocated by the library or is a host buffer the guest runs on directly, without a
+//  copy. Physical addresses above RAM may be claimed by MMIO windows, guest loads and
+//  stores that land in one call back into the host.
+//
+//  Machines share no state, any number of them can run on different threads at once.
+//  Calls on one machine are serialized by a lock owned by that machine, a call made while
+//  another thread is inside shiv_run waits for it to return. MMIO callbacks run on the
+//  thread inside shiv_run and may call into the same machine, except shiv_run,
+//  shiv_map_mmio and shiv_unmap_mmio, which report SHIV_ERR_BUSY. shiv_raise_interrupt
+//  never waits. shiv_destroy must be the last call on a machine.
+//
+//  Nothing throws across this interface, failures are reported as shiv_status.
+
+#if defined(__GNUC__)
+#define SHIV_API __attribute__((visibility("default")))
+#else
+#define SHIV_API
+#endif
+
+#define SHIV_API_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct shiv_machine shiv_machine;
+
+typedef enum shiv_status
+{
+    SHIV_OK = 0,                // max_instructions retired, the machine can continue
+    SHIV_HALTED,                // the guest executed HALT
+    SHIV_TRAPPED,               // a trap the guest could not take, see SHIV_REG_ECAUSE/EADDR
+    SHIV_ERR_ARGUMENT,
+    SHIV_ERR_RANGE,             // address range outside RAM or overlapping a mapping
+    SHIV_ERR_BUSY,              // not allowed from inside an MMIO callback
+    SHIV_ERR_MEMORY,
+    SHIV_LIMIT_INSTRUCTIONS,    // a shiv_limits budget is used up, the machine continues
+    SHIV_LIMIT_TIME,            // once the limit is raised
+    SHIV_LIMIT_PAGES,
+    SHIV_WAITING                // the guest executed WAIT, shiv_run continues once an interrupt is raised
+} shiv_status;
+
+// Same numbering as the ISA registers
+typedef enum shiv_register
+{
+    SHIV_REG_RZ = 0,
+    SHIV_REG_R1,
+    SHIV_REG_R2,
+    SHIV_REG_R3,
+    SHIV_REG_R4,
+    SHIV_REG_R5,
+    SHIV_REG_R6,
+    SHIV_REG_R7,
+    SHIV_REG_R8,
+    SHIV_REG_RA,
+    SHIV_REG_IP,
+    SHIV_REG_SP,
+    SHIV_REG_FLAGS,
+    SHIV_REG_EIP,
+    SHIV_REG_EFLAGS,
+    SHIV_REG_ERA,
+    SHIV_REG_ECAUSE,
+    SHIV_REG_EADDR,
+    SHIV_REG_VB,
+    SHIV_REG_TIMER,
+    SHIV_REG_PTB,
+    SHIV_REG_COUNT
+} shiv_register;
+
+// Trap causes as found in ECAUSE, the external ones can be raised by the host
+typedef enum shiv_interrupt
+{
+    SHIV_INT_MEMORY_FAULT = 0,
+    SHIV_INT_ILLEGAL_INSTRUCTION,
+    SHIV_INT_PAGE_FAULT,
+    SHIV_INT_TIMER,
+    SHIV_INT_BLOCK,
+    SHIV_INT_COUNT
+} shiv_interrupt;
+
+#define SHIV_UNLIMITED UINT64_MAX
+
+// Lifetime budget of a machine, checked by shiv_run between basic blocks. Wall time counts
+// time spent inside shiv_run. Pages are distinct guest pages loaded from or stored to,
+// counted only while a page limit is set.
+typedef struct shiv_limits
+{
+    uint64_t    instructions;
+    uint64_t    nanoseconds;
+    uint64_t    pages;
+} shiv_limits;
+
+typedef struct shiv_usage
+{
+    uint64_t    instructions;
+    uint64_t    nanoseconds;
+    uint64_t    pages;
+} shiv_usage;
+
+// offset is relative to the window base, size is 1, 2 or 4 and the access is aligned to
+// it. Narrow reads use the low bits of *value. A non zero return makes the guest access
+// a memory fault.
+typedef int (*shiv_mmio_read)(void* context, uint32_t offset, uint32_t size, uint32_t* value);
+typedef int (*shiv_mmio_write)(void* context, uint32_t offset, uint32_t size, uint32_t value);
+
+SHIV_API uint32_t shiv_api_version(void);
+
+// ram == NULL allocates ram_size zeroed bytes, anything else is used as guest RAM until
+// shiv_destroy. ram_size is at most 4 GiB. Returns NULL on failure.
+SHIV_API shiv_machine* shiv_create(void* ram, size_t ram_size);
+SHIV_API void shiv_destroy(shiv_machine* machine);
+
+// Guest RAM, the host may access it whenever no shiv_run is in progress. Call
+// shiv_flush_code after changing guest code through this pointer.
+SHIV_API void* shiv_memory(shiv_machine* machine, size_t* size);
+SHIV_API void shiv_flush_code(shiv_machine* machine);
+
+// Locked copies into and out of guest RAM, writes flush predecoded code
+SHIV_API shiv_status shiv_write_memory(shiv_machine* machine, uint32_t addr, const void* data, size_t size);
+SHIV_API shiv_status shiv_read_memory(shiv_machine* machine, uint32_t addr, void* data, size_t size);
+
+// The window must lie above RAM and not overlap another one. Either callback may be NULL,
+// accesses it would serve fault.
+SHIV_API shiv_status shiv_map_mmio(shiv_machine* machine, uint32_t base, uint32_t size,
+                                   shiv_mmio_read read, shiv_mmio_write write, void* context);
+SHIV_API shiv_status shiv_unmap_mmio(shiv_machine* machine, uint32_t base);
+
+// Runs until HALT, WAIT with no interrupt pending, an untakeable trap, max_instructions
+// retired or a limit is reached. retired may be NULL.
+SHIV_API shiv_status shiv_run(shiv_machine* machine, uint64_t max_instructions, uint64_t* retired);
+
+// New machines are unlimited, fields set to SHIV_UNLIMITED don't limit
+SHIV_API shiv_status shiv_set_limits(shiv_machine* machine, const shiv_limits* limits);
+SHIV_API shiv_status shiv_get_usage(shiv_machine* machine, shiv_usage* usage);
+
+SHIV_API shiv_status shiv_get_register(shiv_machine* machine, shiv_register reg, uint32_t* value);
+SHIV_API shiv_status shiv_set_register(shiv_machine* machine, shiv_register reg, uint32_t value);
+
+// Taken between instructions once the guest enables interrupts, safe from any thread
+SHIV_API shiv_status shiv_raise_interrupt(shiv_machine* machine, shiv_interrupt line);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,8 @@
+#include "core.h"
+
+template class BasicCore<PagedMemory, NoFeatures>;
+template class BasicCore<FlatMemory, NoFeatures>;
+template class BasicCore<PagedMemory, FeatureSet<Counters>>;
+template class BasicCore<PagedMemory, FeatureSet<Counters, Tracer>>;
+template class BasicCore<PagedMemory, FeatureSet<BlockProfile>>;
+template class BasicCore<MmioMemory<PagedMemory>, NoFeatures>;
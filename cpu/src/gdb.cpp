@@ -0,0 +1,73 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "isa.h"
+#include "ram.h"
+#include "core.h"
+#include "gdb_stub.h"
+
+//  Loads a flat image, as written by the assembler, at address 0 and serves it to a
+//  debugger on the loopback interface. SP starts at the top of RAM.
+//
+//      cpu_gdb [--port N] [--ram BYTES] image
+
+int main(int argc, char** argv)
+{
+    uint16_t port = 1234;
+    size_t size = 16 << 20;
+    std::string path;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        if (option == "--port" && i + 1 < argc)
+            port = static_cast<uint16_t>(std::strtoul(argv[++i], nullptr, 0));
+        else if (option == "--ram" && i + 1 < argc)
+            size = std::strtoull(argv[++i], nullptr, 0) & ~size_t{ sizeof(WORD) - 1 };
+        else if (path.empty() && option[0] != '-')
+            path = option;
+        else
+        {
+            path.clear();
+            break;
+        }
+    }
+
+    if (path.empty() || size == 0 || size > (size_t{ 1 } << 31))
+    {
+        std::fprintf(stderr, "usage: %s [--port N] [--ram BYTES] image\n", argv[0]);
+        return 2;
+    }
+
+    try
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<char> image{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+        if (!file || image.size() > size)
+            throw std::runtime_error("Can't load " + path);
+
+        RAM ram{ size };
+        if (!image.empty())
+            ::memcpy(ram.Data(0, static_cast<WORD>(image.size())), image.data(), image.size());
+
+        Core core{ ram };
+        core.Reg(Register::SP) = static_cast<WORD>(size);
+
+        GdbStub<Core> stub{ core };
+        std::cerr << "Listening on 127.0.0.1:" << stub.Listen(port) << std::endl;
+        while (stub.Serve())
+            ;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,4 @@
+#include "lockstep.h"
+
+template class LockstepCore<8>;
+template class LockstepCore<16>;
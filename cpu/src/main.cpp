@@ -1,6 +1,108 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
 
-int main()
+#include "isa.h"
+#include "ram.h"
+#include "core.h"
+
+//  Loads a flat image, as written by the assembler, at address 0 and runs it until it
+//  halts, sleeps with nothing to wake it or has retired --limit instructions. SP starts
+//  at the top of RAM. --profile writes how often every basic block ran, for as -p.
+//
+//      cpu [--ram BYTES] [--limit N] [--profile FILE] image
+
+template<typename CoreType>
+static uint64_t Execute(CoreType& core, uint64_t limit)
 {
-    std::cout << "hello cpu" << std::endl;
-}
\ No newline at end of file
+    uint64_t retired = 0;
+    while (retired < limit && !core.Halted() && core.Waiting() == Wait::None)
+    {
+        uint64_t ran = core.Run(limit - retired);
+        if (ran == 0)
+            break;
+        retired += ran;
+    }
+
+    return retired;
+}
+
+int main(int argc, char** argv)
+{
+    size_t size = 16 << 20;
+    uint64_t limit = ~uint64_t{ 0 };
+    std::string profile;
+    std::string path;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        if (option == "--ram" && i + 1 < argc)
+            size = std::strtoull(argv[++i], nullptr, 0) & ~size_t{ sizeof(WORD) - 1 };
+        else if (option == "--limit" && i + 1 < argc)
+            limit = std::strtoull(argv[++i], nullptr, 0);
+        else if (option == "--profile" && i + 1 < argc)
+            profile = argv[++i];
+        else if (path.empty() && option[0] != '-')
+            path = option;
+        else
+        {
+            path.clear();
+            break;
+        }
+    }
+
+    if (path.empty() || size == 0 || size > (size_t{ 1 } << 31))
+    {
+        std::fprintf(stderr, "usage: %s [--ram BYTES] [--limit N] [--profile FILE] image\n", argv[0]);
+        return 2;
+    }
+
+    try
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<char> image{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+        if (!file || image.size() > size)
+            throw std::runtime_error("Can't load " + path);
+
+        RAM ram{ size };
+        if (!image.empty())
+            ::memcpy(ram.Data(0, static_cast<WORD>(image.size())), image.data(), image.size());
+
+        uint64_t retired = 0;
+        bool halted = false;
+        if (profile.empty())
+        {
+            Core core{ ram };
+            core.Reg(Register::SP) = static_cast<WORD>(size);
+            retired = Execute(core, limit);
+            halted = core.Halted();
+        }
+        else
+        {
+            BlockProfileCore core{ ram };
+            core.Reg(Register::SP) = static_cast<WORD>(size);
+            retired = Execute(core, limit);
+            halted = core.Halted();
+
+            std::ofstream out(profile);
+            core.Instrumentation().Write(out);
+            if (!out.flush())
+                throw std::runtime_error("Can't write " + profile);
+        }
+
+        std::cerr << retired << " instructions, " << (halted ? "halted" : "still running") << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,302 @@
+#include <mutex>
+#include <new>
+
+#include "shivcpu.h"
+#include "core.h"
+
+static_assert(SHIV_REG_COUNT == static_cast<int>(Register::__NUM), "shiv_register must follow Register");
+static_assert(SHIV_INT_COUNT == static_cast<int>(Interrupt::__NUM), "shiv_interrupt must follow Interrupt");
+static_assert(SHIV_UNLIMITED == Limits::UNLIMITED, "SHIV_UNLIMITED must match Limits::UNLIMITED");
+
+struct shiv_machine
+{
+    shiv_machine(size_t size):
+    ram(size),
+    core(ram)
+    {
+    }
+
+    shiv_machine(BYTE* data, size_t size):
+    ram(data, size),
+    core(ram)
+    {
+    }
+
+    // Recursive so MMIO callbacks can call back into their machine
+    std::recursive_mutex    lock;
+    RAM                     ram;
+    MmioCore                core;
+    bool                    running{ false };
+};
+
+namespace
+{
+    // Locks the machine and turns exceptions into status codes
+    template<typename F>
+    shiv_status Locked(shiv_machine* machine, F&& body)
+    {
+        if (!machine)
+            return SHIV_ERR_ARGUMENT;
+
+        try
+        {
+            std::lock_guard<std::recursive_mutex> guard(machine->lock);
+            return body(*machine);
+        }
+        catch (const std::bad_alloc&)
+        {
+            return SHIV_ERR_MEMORY;
+        }
+        catch (...)
+        {
+            return SHIV_ERR_ARGUMENT;
+        }
+    }
+
+    shiv_status RunStatus(const MmioCore& core)
+    {
+        if (core.Trapped())
+            return SHIV_TRAPPED;
+
+        if (core.Halted())
+            return SHIV_HALTED;
+
+        switch (core.LimitReached())
+        {
+        case Limit::Instructions:   return SHIV_LIMIT_INSTRUCTIONS;
+        case Limit::WallTime:       return SHIV_LIMIT_TIME;
+        case Limit::Pages:          return SHIV_LIMIT_PAGES;
+        default:                    return core.Waiting() != Wait::None ? SHIV_WAITING : SHIV_OK;
+        }
+    }
+
+    bool ValidRegister(shiv_register reg)
+    {
+        return reg >= SHIV_REG_RZ && reg < SHIV_REG_COUNT;
+    }
+
+    bool InRam(const RAM& ram, uint32_t addr, size_t size)
+    {
+        return addr <= ram.Size() && size <= ram.Size() - addr;
+    }
+}
+
+extern "C" {
+
+uint32_t shiv_api_version(void)
+{
+    return SHIV_API_VERSION;
+}
+
+shiv_machine* shiv_create(void* ram, size_t ram_size)
+{
+    if (ram_size > (size_t{ 1 } << 32))
+        return nullptr;
+
+    try
+    {
+        if (ram)
+            return new shiv_machine(static_cast<BYTE*>(ram), ram_size);
+
+        return new shiv_machine(ram_size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void shiv_destroy(shiv_machine* machine)
+{
+    delete machine;
+}
+
+void* shiv_memory(shiv_machine* machine, size_t* size)
+{
+    if (!machine)
+        return nullptr;
+
+    if (size)
+        *size = machine->ram.Size();
+
+    return machine->ram.Size() != 0 ? machine->ram.Data(0, 0) : nullptr;
+}
+
+void shiv_flush_code(shiv_machine* machine)
+{
+    Locked(machine, [](shiv_machine& m)
+    {
+        m.core.FlushCodeCache();
+        return SHIV_OK;
+    });
+}
+
+shiv_status shiv_write_memory(shiv_machine* machine, uint32_t addr, const void* data, size_t size)
+{
+    return Locked(machine, [=](shiv_machine& m)
+    {
+        if (!InRam(m.ram, addr, size))
+            return SHIV_ERR_RANGE;
+
+        if (size != 0)
+        {
+            ::memcpy(m.ram.Data(addr, static_cast<WORD>(size)), data, size);
+            m.core.FlushCodeCache();
+        }
+
+        return SHIV_OK;
+    });
+}
+
+shiv_status shiv_read_memory(shiv_machine* machine, uint32_t addr, void* data, size_t size)
+{
+    return Locked(machine, [=](shiv_machine& m)
+    {
+        if (!InRam(m.ram, addr, size))
+            return SHIV_ERR_RANGE;
+
+        if (size != 0)
+            ::memcpy(data, m.ram.Data(addr, static_cast<WORD>(size)), size);
+
+        return SHIV_OK;
+    });
+}
+
+shiv_status shiv_map_mmio(shiv_machine* machine, uint32_t base, uint32_t size,
+                          shiv_mmio_read read, shiv_mmio_write write, void* context)
+{
+    return Locked(machine, [=](shiv_machine& m)
+    {
+        if (m.running)
+            return SHIV_ERR_BUSY;
+
+        if (base < m.ram.Size())
+            return SHIV_ERR_RANGE;
+
+        MmioBus::ReadHandler on_read;
+        if (read)
+        {
+            on_read = [read, context](WORD offset, WORD width, WORD& value)
+            {
+                uint32_t tmp = 0;
+                if (read(context, offset, width, &tmp) != 0)
+                    return false;
+
+                value = tmp;
+                return true;
+            };
+        }
+
+        MmioBus::WriteHandler on_write;
+        if (write)
+        {
+            on_write = [write, context](WORD offset, WORD width, WORD value)
+            {
+                return write(context, offset, width, value) == 0;
+            };
+        }
+
+        try
+        {
+            m.core.MemorySystem().Devices().Map(base, size, std::move(on_read), std::move(on_write));
+        }
+        catch (const std::runtime_error&)
+        {
+            return SHIV_ERR_RANGE;
+        }
+
+        return SHIV_OK;
+    });
+}
+
+shiv_status shiv_unmap_mmio(shiv_machine* machine, uint32_t base)
+{
+    return Locked(machine, [=](shiv_machine& m)
+    {
+        if (m.running)
+            return SHIV_ERR_BUSY;
+
+        return m.core.MemorySystem().Devices().Unmap(base) ? SHIV_OK : SHIV_ERR_RANGE;
+    });
+}
+
+shiv_status shiv_run(shiv_machine* machine, uint64_t max_instructions, uint64_t* retired)
+{
+    return Locked(machine, [=](shiv_machine& m)
+    {
+        if (m.running)
+            return SHIV_ERR_BUSY;
+
+        m.running = true;
+        uint64_t count = m.core.Run(max_instructions);
+        m.running = false;
+
+        if (retired)
+            *retired = count;
+
+        return RunStatus(m.core);
+    });
+}
+
+shiv_status shiv_set_limits(shiv_machine* machine, const shiv_limits* limits)
+{
+    return Locked(machine, [=](shiv_machine& m)
+    {
+        if (!limits)
+            return SHIV_ERR_ARGUMENT;
+
+        m.core.SetLimits(Limits{ limits->instructions, limits->nanoseconds, limits->pages });
+        return SHIV_OK;
+    });
+}
+
+shiv_status shiv_get_usage(shiv_machine* machine, shiv_usage* usage)
+{
+    return Locked(machine, [=](shiv_machine& m)
+    {
+        if (!usage)
+            return SHIV_ERR_ARGUMENT;
+
+        Usage used = m.core.Accounting();
+        *usage = shiv_usage{ used.instructions, used.nanoseconds, used.pages };
+        return SHIV_OK;
+    });
+}
+
+shiv_status shiv_get_register(shiv_machine* machine, shiv_register reg, uint32_t* value)
+{
+    return Locked(machine, [=](shiv_machine& m)
+    {
+        if (!ValidRegister(reg) || !value)
+            return SHIV_ERR_ARGUMENT;
+
+        *value = m.core.Reg(static_cast<Register>(reg));
+        return SHIV_OK;
+    });
+}
+
+shiv_status shiv_set_register(shiv_machine* machine, shiv_register reg, uint32_t value)
+{
+    return Locked(machine, [=](shiv_machine& m)
+    {
+        if (!ValidRegister(reg))
+            return SHIV_ERR_ARGUMENT;
+
+        // RZ reads as zero no matter what is written, as in the guest
+        if (reg != SHIV_REG_RZ)
+            m.core.Reg(static_cast<Register>(reg)) = value;
+
+        return SHIV_OK;
+    });
+}
+
+shiv_status shiv_raise_interrupt(shiv_machine* machine, shiv_interrupt line)
+{
+    if (!machine || line < SHIV_INT_TIMER || line >= SHIV_INT_COUNT)
+        return SHIV_ERR_ARGUMENT;
+
+    machine->core.Interrupts().Raise(static_cast<Interrupt>(line));
+    return SHIV_OK;
+}
+
+}
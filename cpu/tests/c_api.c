@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "shivcpu.h"
+
+//  Runs a guest in a host buffer through the C interface: the guest stores to and loads
+//  from a device window, the device counts the accesses.
+
+#define DEVICE_BASE 0x10000u
+
+struct device
+{
+    uint32_t    stored;
+    int         accesses;
+};
+
+static int device_read(void* context, uint32_t offset, uint32_t size, uint32_t* value)
+{
+    struct device* device = (struct device*)context;
+    ++device->accesses;
+    *value = offset == 4 && size == 4 ? device->stored + 1 : 0;
+    return 0;
+}
+
+static int device_write(void* context, uint32_t offset, uint32_t size, uint32_t value)
+{
+    struct device* device = (struct device*)context;
+    ++device->accesses;
+    if (offset != 0 || size != 4)
+        return 1;
+
+    device->stored = value;
+    return 0;
+}
+
+static int check(int ok, const char* what)
+{
+    if (!ok)
+        fprintf(stderr, "c_api: %s\n", what);
+    return ok;
+}
+
+int main(void)
+{
+    static const uint32_t program[] = {
+        0x0820002a,     // ADDI R1, RZ, 42
+        0x14400001,     // LUI  R2, 1
+        0x64220000,     // SW   R1, [R2]
+        0x54620004,     // LW   R3, [R2 + 4]
+        0xa8000000,     // HALT
+    };
+
+    static uint8_t ram[4096];
+    struct device device = { 0, 0 };
+    uint64_t retired = 0;
+    uint32_t r3 = 0;
+    int ok = 1;
+
+    memcpy(ram, program, sizeof(program));
+
+    shiv_machine* machine = shiv_create(ram, sizeof(ram));
+    if (!check(machine != NULL, "shiv_create failed"))
+        return 1;
+
+    ok &= check(shiv_api_version() == SHIV_API_VERSION, "unexpected API version");
+    ok &= check(shiv_map_mmio(machine, DEVICE_BASE, 16, device_read, device_write, &device) == SHIV_OK, "shiv_map_mmio failed");
+    ok &= check(shiv_map_mmio(machine, 0x800, 16, device_read, device_write, &device) == SHIV_ERR_RANGE, "window inside RAM accepted");
+    ok &= check(shiv_run(machine, 100, &retired) == SHIV_HALTED, "guest did not halt");
+    ok &= check(retired == 5, "wrong retired count");
+    ok &= check(shiv_get_register(machine, SHIV_REG_R3, &r3) == SHIV_OK && r3 == 43, "wrong R3");
+    ok &= check(device.stored == 42 && device.accesses == 2, "device missed an access");
+    ok &= check(shiv_memory(machine, NULL) == ram, "RAM is not the host buffer");
+
+    shiv_destroy(machine);
+    return ok ? 0 : 1;
+}
@@ -2,6 +2,24 @@
 #include "ram.h"
 #include "core.h"
 #include "isa.h"
+#include "encoding.h"
+#include "block_device.h"
+#include "lockstep.h"
+#include "shivcpu.h"
+#include "pool.h"
+#include "gdb_stub.h"
+#include "scheduler.h"
+#include "image.h"
+#include "layout.h"
+#include "as.h"
+
+#include <random>
+#include <thread>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
 TEST(CPUTest, AddTest)
 {
@@ -383,3 +401,2482 @@ TEST_F(CpuTest, LoadImmediate_and_LoadUpperImmediate) {
     // Upper immediate uses HWORD shifted by 16 bits for WORD
     EXPECT_EQ(R(Register::R2), 0xABCD'0000u);
 }
+
+TEST_F(CpuTest, Mul_low_and_high_halves) {
+    R(Register::R1) = 0xFFFF'FFFEu;     // -2
+    R(Register::R2) = 3;
+    cpu.Mul(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0xFFFF'FFFAu);
+    cpu.MulHigh(Register::R4, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R4), 0xFFFF'FFFFu);
+    cpu.MulHighUnsigned(Register::R5, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R5), 2u);
+    EXPECT_EQ(N(), 0);
+
+    R(Register::R2) = 0;
+    cpu.Mul(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(Z(), 1);
+}
+
+TEST_F(CpuTest, Div_and_rem_truncate_and_never_trap) {
+    R(Register::R1) = static_cast<WORD>(-7);
+    R(Register::R2) = 2;
+    cpu.Div(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), static_cast<WORD>(-3));
+    cpu.Rem(Register::R4, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R4), static_cast<WORD>(-1));
+    cpu.DivUnsigned(Register::R5, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R5), 0x7FFF'FFFCu);
+
+    R(Register::R2) = 0;
+    cpu.Div(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0xFFFF'FFFFu);
+    cpu.DivUnsigned(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0xFFFF'FFFFu);
+    cpu.Rem(Register::R4, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R4), R(Register::R1));
+
+    R(Register::R1) = 0x8000'0000u;
+    R(Register::R2) = 0xFFFF'FFFFu;
+    cpu.Div(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0x8000'0000u);
+    cpu.Rem(Register::R4, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R4), 0u);
+    EXPECT_EQ(Z(), 1);
+}
+
+TEST_F(CpuTest, Packed_lanes_saturate_independently) {
+    R(Register::R1) = 0x10FF'F080u;
+    R(Register::R2) = 0x0102'2080u;
+    cpu.AddSaturateBytes(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0x11FF'FFFFu);
+    cpu.SubSaturateBytes(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0x0FFD'D000u);
+    cpu.AddSaturateHalves(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0x1201'FFFFu);
+    cpu.SubSaturateHalves(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0x0FFD'D000u);
+
+    cpu.SubSaturateBytes(Register::R3, Register::R2, Register::R1);
+    EXPECT_EQ(R(Register::R3), 0u);
+    EXPECT_EQ(Z(), 1);
+}
+
+TEST_F(CpuTest, Packed_byte_compare_find_and_shuffle) {
+    R(Register::R1) = 0x4400'2241u;
+    R(Register::R2) = 0x4401'2200u;
+    cpu.CompareBytes(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0xFF00'FF00u);
+    EXPECT_EQ(N(), 1);
+
+    cpu.FindZeroByte(Register::R3, Register::R1);
+    EXPECT_EQ(R(Register::R3), 2u);
+    cpu.FindZeroByte(Register::R3, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0u);
+    EXPECT_EQ(Z(), 1);
+    R(Register::R4) = 0x0100'0101u;     // a zero above a 0x01 must not be reported early
+    cpu.FindZeroByte(Register::R3, Register::R4);
+    EXPECT_EQ(R(Register::R3), 2u);
+    R(Register::R4) = 0x0101'0101u;
+    cpu.FindZeroByte(Register::R3, Register::R4);
+    EXPECT_EQ(R(Register::R3), 4u);
+
+    R(Register::R4) = 0x0001'0203u;     // byte reverse
+    cpu.Shuffle(Register::R3, Register::R1, Register::R4);
+    EXPECT_EQ(R(Register::R3), 0x4122'0044u);
+    R(Register::R4) = 0x8080'8000u;     // zero extend byte 0
+    cpu.Shuffle(Register::R3, Register::R1, Register::R4);
+    EXPECT_EQ(R(Register::R3), 0x41u);
+}
+
+TEST_F(CpuTest, Adc_and_Sbc_chain_64_bit_arithmetic) {
+    // 0x00000001'FFFFFFFF + 0x00000000'00000001 = 0x00000002'00000000
+    R(Register::R1) = 0xFFFF'FFFFu;  R(Register::R2) = 1;
+    R(Register::R3) = 1;             R(Register::R4) = 0;
+    cpu.Add(Register::R5, Register::R1, Register::R3);
+    cpu.AddWithCarry(Register::R6, Register::R2, Register::R4);
+    EXPECT_EQ(R(Register::R5), 0u);
+    EXPECT_EQ(R(Register::R6), 2u);
+    ExpectFlags(/*Z*/0, /*N*/0, /*C*/0, /*V*/0);
+
+    // ...and back, including a low word subtrahend of 0 which must not borrow
+    cpu.Sub(Register::R7, Register::R5, Register::R3);
+    cpu.SubWithBorrow(Register::R8, Register::R6, Register::R4);
+    EXPECT_EQ(R(Register::R7), 0xFFFF'FFFFu);
+    EXPECT_EQ(R(Register::R8), 1u);
+    ExpectFlags(/*Z*/0, /*N*/0, /*C*/1, /*V*/0);
+
+    cpu.Sub(Register::R7, Register::R1, Register::R4);
+    EXPECT_EQ(C(), 1);
+    cpu.SubWithBorrow(Register::R8, Register::R2, Register::R4);
+    EXPECT_EQ(R(Register::R8), 1u);
+}
+
+struct BlockDeviceTest : ::testing::Test {
+    static constexpr WORD kRing = 0;
+    static constexpr WORD kBuf  = 512;
+
+    RAM ram{ 4096 };
+    std::string path;
+
+    void SetUp() override {
+        char tmpl[] = "/tmp/shiv_blkXXXXXX";
+        int fd = mkstemp(tmpl);
+        ASSERT_GE(fd, 0);
+        path = tmpl;
+
+        BYTE sectors[2 * BlockDevice::SECTOR_SIZE];
+        for (size_t i = 0; i < sizeof(sectors); ++i)
+            sectors[i] = static_cast<BYTE>(i * 7);
+        ASSERT_EQ(write(fd, sectors, sizeof(sectors)), static_cast<ssize_t>(sizeof(sectors)));
+        close(fd);
+    }
+
+    void TearDown() override { unlink(path.c_str()); }
+
+    void Submit(WORD idx, BlockOp op, WORD sector, WORD addr, WORD len) {
+        WORD req = kRing + BlockDevice::HEADER_SIZE + (idx % 4) * BlockDevice::REQUEST_SIZE;
+        ram.WriteHWord(req, static_cast<HWORD>(op));
+        ram.WriteHWord(req + 2, static_cast<HWORD>(BlockStatus::PENDING));
+        ram.WriteWord(req + 4, sector);
+        ram.WriteWord(req + 8, addr);
+        ram.WriteWord(req + 12, len);
+        ram.WriteWord(kRing, idx + 1);
+    }
+
+    BlockStatus Status(WORD idx) {
+        WORD req = kRing + BlockDevice::HEADER_SIZE + (idx % 4) * BlockDevice::REQUEST_SIZE;
+        return static_cast<BlockStatus>(ram.ReadHWord(req + 2));
+    }
+};
+
+TEST_F(BlockDeviceTest, Read_lands_in_guest_ram) {
+    InterruptController interrupts;
+    BlockDevice dev{ ram, path };
+    dev.Configure(kRing, 4);
+    dev.ConnectInterrupt(interrupts);
+    EXPECT_EQ(dev.Capacity(), 2u);
+
+    Submit(0, BlockOp::READ, 1, kBuf, BlockDevice::SECTOR_SIZE);
+    EXPECT_FALSE(interrupts.Pending());
+    EXPECT_EQ(dev.Process(), 1u);
+    EXPECT_EQ(ram.ReadWord(kRing + 4), 1u);
+    EXPECT_EQ(Status(0), BlockStatus::OK);
+    EXPECT_TRUE(interrupts.IsPending(Interrupt::Block));
+
+    for (WORD i = 0; i < BlockDevice::SECTOR_SIZE; ++i)
+        EXPECT_EQ(ram.ReadByte(kBuf + i), static_cast<BYTE>((BlockDevice::SECTOR_SIZE + i) * 7));
+
+    EXPECT_EQ(dev.Process(), 0u);
+}
+
+TEST_F(BlockDeviceTest, Write_then_read_back_wraps_ring) {
+    BlockDevice dev{ ram, path };
+    dev.Configure(kRing, 4);
+
+    ram.WriteWord(kBuf, 0xDEAD'BEEFu);
+    for (WORD i = 0; i < 5; ++i)
+    {
+        Submit(i, BlockOp::WRITE, 0, kBuf, sizeof(WORD));
+        EXPECT_EQ(dev.Process(), 1u);
+        EXPECT_EQ(Status(i), BlockStatus::OK);
+    }
+
+    Submit(5, BlockOp::READ, 0, kBuf + 64, sizeof(WORD));
+    dev.Process();
+    EXPECT_EQ(ram.ReadWord(kBuf + 64), 0xDEAD'BEEFu);
+    EXPECT_EQ(ram.ReadWord(kRing + 4), 6u);
+}
+
+TEST_F(BlockDeviceTest, Bad_requests_complete_with_error_status) {
+    BlockDevice dev{ ram, path, true };
+    dev.Configure(kRing, 4);
+
+    Submit(0, BlockOp::READ, 0, 4000, 512);     // buffer runs past RAM
+    Submit(1, BlockOp::WRITE, 0, kBuf, 4);      // read-only image
+    Submit(2, BlockOp::READ, 8, kBuf, 4);       // past end of file
+    EXPECT_EQ(dev.Process(), 3u);
+
+    EXPECT_EQ(Status(0), BlockStatus::BAD_REQUEST);
+    EXPECT_EQ(Status(1), BlockStatus::BAD_REQUEST);
+    EXPECT_EQ(Status(2), BlockStatus::IO_ERROR);
+
+    EXPECT_THROW(dev.Configure(kRing, 3), std::runtime_error);
+    EXPECT_THROW(dev.Configure(4090, 4), std::runtime_error);
+}
+
+// 1 << 28 requests of 16 bytes are 4 GiB, a size that wraps to 0 in 32 bits
+TEST_F(BlockDeviceTest, Ring_larger_than_ram_is_rejected) {
+    BlockDevice dev{ ram, path };
+    EXPECT_THROW(dev.Configure(kRing, WORD{ 1 } << 28), std::runtime_error);
+    EXPECT_THROW(dev.Configure(kRing, WORD{ 1 } << 31), std::runtime_error);
+    EXPECT_THROW(dev.Configure(kRing, static_cast<WORD>(ram.Size())), std::runtime_error);
+}
+
+TEST_F(BlockDeviceTest, Avail_index_past_the_ring_is_ignored) {
+    BlockDevice dev{ ram, path };
+    dev.Configure(kRing, 4);
+
+    Submit(0, BlockOp::READ, 0, kBuf, sizeof(WORD));
+    EXPECT_EQ(dev.Process(), 1u);
+
+    ram.WriteWord(kRing, 0);                    // used - 1, 2^32 - 1 requests ahead
+    EXPECT_EQ(dev.Process(), 0u);
+    ram.WriteWord(kRing, 6);                    // more than the 4 slots
+    EXPECT_EQ(dev.Process(), 0u);
+    EXPECT_EQ(ram.ReadWord(kRing + 4), 1u);
+
+    Submit(1, BlockOp::READ, 0, kBuf, sizeof(WORD));
+    EXPECT_EQ(dev.Process(), 1u);
+    EXPECT_EQ(Status(1), BlockStatus::OK);
+}
+
+struct MachineTest : ::testing::Test {
+    static constexpr WORD kVectors = 0x200;
+
+    RAM ram{ 4096 };
+    Core cpu{ ram };
+
+    WORD& R(Register r) { return cpu.Reg(r); }
+
+    void Load(WORD addr, std::initializer_list<WORD> program) {
+        for (WORD instruction : program)
+        {
+            ram.WriteWord(addr, instruction);
+            addr += sizeof(WORD);
+        }
+    }
+
+    void InstallHandler(Interrupt irq, WORD handler) {
+        R(Register::VB) = kVectors;
+        ram.WriteWord(kVectors + static_cast<WORD>(irq) * sizeof(WORD), handler);
+        cpu.SetFlag(Flag::InterruptEnable);
+    }
+};
+
+TEST_F(MachineTest, Run_executes_until_halt) {
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 5),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::RZ, 7),
+        Encode(Instruction::ADD, Register::R3, Register::R1, Register::R2),
+        EncodeImm16(Instruction::ADDI, Register::RZ, Register::R3, 1),
+        Encode(Instruction::HALT),
+    });
+
+    EXPECT_EQ(cpu.Run(100), 5u);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(R(Register::R3), 12u);
+    EXPECT_EQ(R(Register::RZ), 0u);
+    EXPECT_FALSE(cpu.Step());
+}
+
+TEST_F(MachineTest, Multiply_divide_run_end_to_end) {
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 1000),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::RZ, 37),
+        Encode(Instruction::MUL, Register::R3, Register::R1, Register::R2),
+        Encode(Instruction::MULHU, Register::R4, Register::R3, Register::R3),
+        Encode(Instruction::DIVU, Register::R5, Register::R3, Register::R2),
+        Encode(Instruction::REM, Register::R6, Register::R3, Register::R1),
+        Encode(Instruction::HALT),
+    });
+
+    EXPECT_EQ(cpu.Run(100), 7u);
+    EXPECT_EQ(R(Register::R3), 37000u);
+    EXPECT_EQ(R(Register::R4), 0u);
+    EXPECT_EQ(R(Register::R5), 1000u);
+    EXPECT_EQ(R(Register::R6), 0u);
+    EXPECT_EQ(cpu.GetFlag(Flag::Zero), 1);
+}
+
+TEST_F(MachineTest, Packed_strlen_scans_a_word_at_a_time) {
+    const char text[] = "hello, packed world";
+    for (WORD i = 0; i < sizeof(text); ++i)
+        ram.WriteByte(0x400 + i, static_cast<BYTE>(text[i]));
+
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::RZ, 0x400),
+        Encode(Instruction::LW, Register::R3, Register::R2),                // loop:
+        Encode(Instruction::FFZB, Register::R4, Register::R3),
+        EncodeImm16(Instruction::CMPI, Register::R4, Register::RZ, 4),
+        EncodeJ(Instruction::BNE, 8),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, 4),
+        EncodeJ(Instruction::B, static_cast<WORD>(-24)),
+        Encode(Instruction::ADD, Register::R2, Register::R2, Register::R4), // found:
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R2, 0x400),
+        Encode(Instruction::HALT),
+    });
+
+    cpu.Run(1000);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(R(Register::R1), sizeof(text) - 1);
+}
+
+TEST_F(MachineTest, Memset_and_memcpy_move_whole_ranges) {
+    R(Register::R1) = 0x400;
+    R(Register::R2) = 0xAB;
+    R(Register::R3) = 0x100;
+    R(Register::R4) = 0x600;
+    R(Register::R5) = 0x3FE;
+    R(Register::R6) = 0x104;
+
+    Load(0, {
+        Encode(Instruction::MEMSET, Register::R1, Register::R2, Register::R3),
+        Encode(Instruction::MEMCPY, Register::R4, Register::R5, Register::R6),
+        Encode(Instruction::HALT),
+    });
+
+    EXPECT_EQ(cpu.Run(100), 3u);
+    EXPECT_EQ(R(Register::R1), 0x500u);
+    EXPECT_EQ(R(Register::R3), 0u);
+    EXPECT_EQ(R(Register::R4), 0x704u);
+    EXPECT_EQ(R(Register::R5), 0x502u);
+    EXPECT_EQ(R(Register::R6), 0u);
+    EXPECT_EQ(ram.ReadHWord(0x600), 0u);
+    EXPECT_EQ(ram.ReadWord(0x604), 0xABAB'ABABu);
+    EXPECT_EQ(ram.ReadHWord(0x702), 0u);
+}
+
+TEST_F(MachineTest, Overlapping_memcpy_is_preemptible) {
+    InstallHandler(Interrupt::Timer, 0x100);
+    R(Register::TIMER) = 3;
+    R(Register::R1) = 0x410;
+    R(Register::R2) = 0x400;
+    R(Register::R3) = 0x100;
+    for (WORD i = 0; i < 0x10; ++i)
+        ram.WriteByte(0x400 + i, i);
+
+    Load(0, {
+        Encode(Instruction::MEMCPY, Register::R1, Register::R2, Register::R3),
+        Encode(Instruction::HALT),
+    });
+    Load(0x100, {
+        EncodeImm16(Instruction::ADDI, Register::R4, Register::R4, 1),
+        EncodeImm16(Instruction::ADDI, Register::TIMER, Register::RZ, 3),
+        Encode(Instruction::RETI),
+    });
+
+    cpu.Run(1000);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_GE(R(Register::R4), 5u);
+    EXPECT_EQ(R(Register::R3), 0u);
+    for (WORD i = 0; i < 0x110; ++i)
+        EXPECT_EQ(ram.ReadByte(0x400 + i), i % 0x10);
+}
+
+TEST_F(MachineTest, Address_modes_offset_indexed_and_post_increment) {
+    for (WORD i = 0; i < 8; ++i)
+        ram.WriteWord(0x400 + i * sizeof(WORD), 0x100 + i);
+
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::RZ, 0x400),
+        EncodeImm16(Instruction::LW, Register::R1, Register::R2, AddressOffset(8)),
+        EncodeImm16(Instruction::ADDI, Register::R3, Register::RZ, 3),
+        EncodeImm16(Instruction::LW, Register::R4, Register::R2, AddressIndexed(Register::R3, 2)),
+        EncodeImm16(Instruction::SW, Register::R4, Register::R2, AddressOffset(-4)),
+        EncodeImm16(Instruction::LHU, Register::R5, Register::R2, AddressPostIncrement(4)),
+        EncodeImm16(Instruction::LW, Register::R6, Register::R2, AddressPostIncrement(-8)),
+        EncodeImm16(Instruction::LW, Register::R2, Register::R2, AddressPostIncrement(4)),
+        Encode(Instruction::HALT),
+    });
+
+    EXPECT_EQ(cpu.Run(100), 9u);
+    EXPECT_EQ(R(Register::R1), 0x102u);
+    EXPECT_EQ(R(Register::R4), 0x103u);
+    EXPECT_EQ(ram.ReadWord(0x3FC), 0x103u);
+    EXPECT_EQ(R(Register::R5), 0x100u);
+    EXPECT_EQ(R(Register::R6), 0x101u);
+    EXPECT_EQ(R(Register::R2), 0x103u);     // the loaded value wins over the increment
+}
+
+TEST_F(MachineTest, Faulting_post_increment_keeps_base) {
+    R(Register::R2) = 0x10000;
+    Load(0, {
+        EncodeImm16(Instruction::LW, Register::R1, Register::R2, AddressPostIncrement(4)),
+        Encode(Instruction::HALT),
+    });
+
+    cpu.Run(100);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(R(Register::R2), 0x10000u);
+    EXPECT_EQ(R(Register::ECAUSE), static_cast<WORD>(Interrupt::MemoryFault));
+}
+
+TEST_F(MachineTest, Stack_frame_with_sp_relative_stores) {
+    R(Register::SP) = 0x800;
+    R(Register::R1) = 20;
+    R(Register::R4) = 7;
+    Load(0, {
+        EncodeJ(Instruction::CALL, 12),
+        Encode(Instruction::HALT),
+        Encode(Instruction::HALT),
+        EncodeImm16(Instruction::SUBI, Register::SP, Register::SP, 8),                  // twice_plus_one:
+        EncodeImm16(Instruction::SW, Register::RA, Register::SP, AddressOffset(4)),
+        EncodeImm16(Instruction::SW, Register::R4, Register::SP, AddressOffset(0)),
+        Encode(Instruction::ADD, Register::R4, Register::R1, Register::R1),
+        EncodeJ(Instruction::CALL, 52),
+        Encode(Instruction::ADD, Register::R1, Register::R4, Register::R1),
+        EncodeImm16(Instruction::LW, Register::R4, Register::SP, AddressOffset(0)),
+        EncodeImm16(Instruction::LW, Register::RA, Register::SP, AddressOffset(4)),
+        EncodeImm16(Instruction::ADDI, Register::SP, Register::SP, 8),
+        Encode(Instruction::RET),
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 1),                  // inc:
+        EncodeImm16(Instruction::ADDI, Register::IP, Register::RA, 0),
+    });
+
+    EXPECT_EQ(cpu.Run(100), 14u);
+    EXPECT_EQ(R(Register::R1), 41u);
+    EXPECT_EQ(R(Register::R4), 7u);
+    EXPECT_EQ(R(Register::SP), 0x800u);
+    EXPECT_EQ(ram.ReadWord(0x7FC), 4u);
+}
+
+TEST_F(MachineTest, Pushm_and_popm_move_a_register_list) {
+    const HWORD list = RegisterBit(Register::R1) | RegisterBit(Register::R2) | RegisterBit(Register::R5) | RegisterBit(Register::RA);
+    R(Register::SP) = 0x800;
+    R(Register::R1) = 1;
+    R(Register::R2) = 2;
+    R(Register::R5) = 5;
+    R(Register::RA) = 0x44;
+    Load(0, {
+        EncodeImm16(Instruction::PUSHM, Register::RZ, Register::RZ, list),
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 0),
+        EncodeImm16(Instruction::ADDI, Register::R5, Register::RZ, 0),
+        EncodeImm16(Instruction::ADDI, Register::RA, Register::RZ, 0),
+        EncodeImm16(Instruction::POPM, Register::RZ, Register::RZ, list),
+        Encode(Instruction::HALT),
+    });
+
+    EXPECT_EQ(cpu.Run(100), 6u);
+    EXPECT_EQ(ram.ReadWord(0x7F0), 1u);
+    EXPECT_EQ(ram.ReadWord(0x7F4), 2u);
+    EXPECT_EQ(ram.ReadWord(0x7F8), 5u);
+    EXPECT_EQ(ram.ReadWord(0x7FC), 0x44u);
+    EXPECT_EQ(R(Register::SP), 0x800u);
+    EXPECT_EQ(R(Register::R1), 1u);
+    EXPECT_EQ(R(Register::R5), 5u);
+    EXPECT_EQ(R(Register::RA), 0x44u);
+}
+
+TEST_F(MachineTest, Faulting_popm_changes_nothing) {
+    R(Register::SP) = 0xFF8;
+    R(Register::R1) = 1;
+    Load(0, {
+        EncodeImm16(Instruction::POPM, Register::RZ, Register::RZ, RegisterBit(Register::R1) | RegisterBit(Register::R2) | RegisterBit(Register::R3)),
+        Encode(Instruction::HALT),
+    });
+
+    cpu.Run(100);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(R(Register::ECAUSE), static_cast<WORD>(Interrupt::MemoryFault));
+    EXPECT_EQ(R(Register::SP), 0xFF8u);
+    EXPECT_EQ(R(Register::R1), 1u);
+}
+
+TEST_F(MachineTest, Register_list_outside_r1_to_ra_is_illegal) {
+    Load(0, {
+        EncodeImm16(Instruction::PUSHM, Register::RZ, Register::RZ, RegisterBit(Register::SP)),
+    });
+
+    cpu.Run(100);
+    EXPECT_EQ(R(Register::ECAUSE), static_cast<WORD>(Interrupt::IllegalInstruction));
+}
+
+TEST_F(MachineTest, Reserved_address_mode_is_illegal) {
+    Load(0, {
+        EncodeImm16(Instruction::LW, Register::R1, Register::R2, 0xC000),
+    });
+    cpu.Run(100);
+    EXPECT_EQ(R(Register::ECAUSE), static_cast<WORD>(Interrupt::IllegalInstruction));
+}
+
+TEST_F(MachineTest, Backward_branch_loop) {
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 10),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, 3),      // loop:
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+        EncodeImm16(Instruction::CMPI, Register::R1, Register::RZ, 0),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-16)),
+        Encode(Instruction::HALT),
+    });
+
+    cpu.Run(1000);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(R(Register::R1), 0u);
+    EXPECT_EQ(R(Register::R2), 30u);
+}
+
+TEST_F(MachineTest, Memory_fault_traps_and_restarts_instruction) {
+    InstallHandler(Interrupt::MemoryFault, 0x100);
+    R(Register::R2) = 0x10000;
+    R(Register::RA) = 0x44;
+    ram.WriteWord(0x40, 0x1234u);
+
+    Load(0, {
+        Encode(Instruction::LW, Register::R1, Register::R2),
+        Encode(Instruction::HALT),
+    });
+    Load(0x100, {
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::RZ, 0x40),
+        EncodeImm16(Instruction::ADDI, Register::RA, Register::RZ, 0),
+        Encode(Instruction::RETI),
+    });
+
+    EXPECT_NO_THROW(cpu.Run(100));
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(R(Register::R1), 0x1234u);
+    EXPECT_EQ(R(Register::EIP), 0u);
+    EXPECT_EQ(R(Register::EADDR), 0x10000u);
+    EXPECT_EQ(R(Register::ECAUSE), static_cast<WORD>(Interrupt::MemoryFault));
+    EXPECT_EQ(R(Register::RA), 0x44u);
+    EXPECT_EQ(cpu.GetFlag(Flag::InterruptEnable), 1);
+}
+
+TEST_F(MachineTest, Fault_without_handler_halts_without_throwing) {
+    R(Register::SP) = 2;
+    Load(0, {
+        Encode(Instruction::PUSH, Register::R1),
+        Encode(Instruction::HALT),
+    });
+
+    EXPECT_NO_THROW(cpu.Run(100));
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(cpu.Retired(), 0u);
+    EXPECT_EQ(R(Register::SP), 2u);
+    EXPECT_EQ(R(Register::ECAUSE), static_cast<WORD>(Interrupt::MemoryFault));
+}
+
+TEST_F(MachineTest, Illegal_instruction_traps) {
+    InstallHandler(Interrupt::IllegalInstruction, 0x100);
+    Load(0, {
+        Encode(Instruction::__NUM),
+        Encode(Instruction::ADD, static_cast<Register>(31), Register::R1, Register::R1),
+    });
+    Load(0x100, {
+        Encode(Instruction::HALT),
+    });
+
+    cpu.Run(100);
+    EXPECT_EQ(R(Register::ECAUSE), static_cast<WORD>(Interrupt::IllegalInstruction));
+    EXPECT_EQ(R(Register::EIP), 0u);
+}
+
+TEST_F(MachineTest, Timer_preempts_endless_loop) {
+    InstallHandler(Interrupt::Timer, 0x100);
+    R(Register::TIMER) = 5;
+
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),      // loop:
+        EncodeJ(Instruction::B, static_cast<WORD>(-8)),
+    });
+    Load(0x100, {
+        EncodeImm16(Instruction::ADDI, Register::R4, Register::R4, 1),
+        EncodeImm16(Instruction::ADDI, Register::TIMER, Register::RZ, 5),
+        Encode(Instruction::RETI),
+    });
+
+    EXPECT_EQ(cpu.Run(700), 700u);
+    EXPECT_FALSE(cpu.Halted());
+    EXPECT_GE(R(Register::R4), 90u);
+    EXPECT_GE(R(Register::R1), 150u);
+    EXPECT_LT(R(Register::EIP), 8u);
+}
+
+TEST_F(MachineTest, External_interrupt_waits_for_enable) {
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),
+        EncodeImm16(Instruction::ORI, Register::FLAGS, Register::FLAGS, 1 << static_cast<int>(Flag::InterruptEnable)),
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),
+    });
+    Load(0x100, {
+        Encode(Instruction::HALT),
+    });
+    R(Register::VB) = kVectors;
+    ram.WriteWord(kVectors + static_cast<WORD>(Interrupt::Block) * sizeof(WORD), 0x100);
+
+    cpu.Interrupts().Raise(Interrupt::Block);
+    cpu.Run(100);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(R(Register::R1), 1u);
+    EXPECT_EQ(R(Register::EIP), 8u);
+    EXPECT_FALSE(cpu.Interrupts().Pending());
+}
+
+TEST_F(MachineTest, Instruction_limit_is_exact_and_resumable) {
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, 1),
+        EncodeImm16(Instruction::ADDI, Register::R3, Register::R3, 1),
+        EncodeJ(Instruction::B, static_cast<WORD>(-16)),
+    });
+
+    cpu.SetLimits(Limits{ 1001, Limits::UNLIMITED, Limits::UNLIMITED });
+    EXPECT_EQ(cpu.Run(Limits::UNLIMITED), 1001u);
+    EXPECT_EQ(cpu.LimitReached(), Limit::Instructions);
+    EXPECT_EQ(cpu.Run(Limits::UNLIMITED), 0u);
+    EXPECT_FALSE(cpu.Halted());
+
+    cpu.SetLimits(Limits{ 1500, Limits::UNLIMITED, Limits::UNLIMITED });
+    EXPECT_EQ(cpu.Run(100), 100u);
+    EXPECT_EQ(cpu.LimitReached(), Limit::None);
+    EXPECT_EQ(cpu.Run(Limits::UNLIMITED), 399u);
+    EXPECT_EQ(cpu.Accounting().instructions, 1500u);
+    EXPECT_EQ(R(Register::R1) + R(Register::R2) + R(Register::R3), 1125u);
+}
+
+TEST_F(MachineTest, Wall_time_limit_stops_an_endless_loop) {
+    Load(0, { EncodeJ(Instruction::B, static_cast<WORD>(-4)) });
+
+    cpu.SetLimits(Limits{ Limits::UNLIMITED, 2'000'000, Limits::UNLIMITED });
+    EXPECT_GT(cpu.Run(Limits::UNLIMITED), 0u);
+    EXPECT_EQ(cpu.LimitReached(), Limit::WallTime);
+    EXPECT_GE(cpu.Accounting().nanoseconds, 2'000'000u);
+    EXPECT_EQ(cpu.Run(Limits::UNLIMITED), 0u);
+}
+
+TEST_F(MachineTest, Wait_sleeps_until_an_interrupt_is_raised) {
+    InstallHandler(Interrupt::Block, 0x100);
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),
+        Encode(Instruction::WAIT),
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),
+        Encode(Instruction::HALT),
+    });
+    Load(0x100, {
+        EncodeImm16(Instruction::ADDI, Register::R4, Register::R4, 1),
+        Encode(Instruction::RETI),
+    });
+
+    EXPECT_EQ(cpu.Run(100), 2u);
+    EXPECT_EQ(cpu.Waiting(), Wait::Interrupt);
+    EXPECT_EQ(cpu.Run(100), 0u);
+    EXPECT_TRUE(cpu.Step());
+    EXPECT_EQ(cpu.Retired(), 2u);
+
+    cpu.Interrupts().Raise(Interrupt::Block);
+    EXPECT_EQ(cpu.Run(100), 4u);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(cpu.Waiting(), Wait::None);
+    EXPECT_EQ(R(Register::R4), 1u);
+    EXPECT_EQ(R(Register::R1), 2u);
+    EXPECT_EQ(R(Register::EIP), 8u);
+
+    // A running TIMER can't count down while nothing retires, WAIT expires it
+    cpu.Reset(Core::RegisterFile{});
+    InstallHandler(Interrupt::Timer, 0x100);
+    R(Register::TIMER) = 1000;
+    EXPECT_EQ(cpu.Run(100), 6u);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(R(Register::R4), 1u);
+}
+
+TEST_F(MachineTest, Store_into_a_traced_loop_drops_the_trace) {
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 100),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, 3),      // loop:
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-12)),
+        EncodeImm16(Instruction::ADDI, Register::R3, Register::R3, 1),
+        EncodeImm16(Instruction::CMPI, Register::R3, Register::RZ, 2),
+        EncodeJ(Instruction::BEQ, 8),
+        EncodeImm16(Instruction::SW, Register::R4, Register::RZ, static_cast<HWORD>(AddressOffset(4))),
+        EncodeJ(Instruction::J, 0),
+        Encode(Instruction::HALT),
+    });
+    R(Register::R4) = EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, 5);
+
+    cpu.Run(10000);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(R(Register::R2), 800u);
+    EXPECT_EQ(cpu.Retired(), 306u + 305u);
+}
+
+TEST_F(MachineTest, Breakpoint_stops_every_pass_of_a_hot_loop) {
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 50),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, 3),      // loop:
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),      // breakpoint
+        EncodeImm16(Instruction::CMPI, Register::R1, Register::RZ, 0),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-16)),
+        Encode(Instruction::HALT),
+    });
+    ASSERT_TRUE(cpu.SetBreakpoint(8));
+    EXPECT_FALSE(cpu.SetBreakpoint(8));
+
+    WORD stops = 0;
+    for (cpu.Run(1000); cpu.Stopped() == Stop::Breakpoint; cpu.Run(1000))
+    {
+        ++stops;
+        EXPECT_EQ(R(Register::IP), 8u);
+        EXPECT_EQ(cpu.StopAddress(), 8u);
+        EXPECT_EQ(R(Register::R2), 3 * stops);
+        EXPECT_EQ(R(Register::R1), 51 - stops);
+    }
+
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(stops, 50u);
+    EXPECT_EQ(cpu.Retired(), 1u + 4 * 50 + 1);
+    EXPECT_TRUE(cpu.ClearBreakpoint(8));
+    EXPECT_FALSE(cpu.ClearBreakpoint(8));
+}
+
+TEST_F(MachineTest, Watchpoints_stop_before_the_access) {
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 7),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::RZ, 0x800),
+        Encode(Instruction::LW, Register::R3, Register::R2),
+        Encode(Instruction::SW, Register::R1, Register::R2),
+        Encode(Instruction::HALT),
+    });
+    ram.WriteWord(0x800, 5);
+    R(Register::EADDR) = 0x1234;
+    ASSERT_TRUE(cpu.Watch(0x800, 4, Access::Write));
+    ASSERT_TRUE(cpu.Watch(0x803, 1, Access::Read));
+    EXPECT_FALSE(cpu.Watch(0x1000, 4, Access::Read));
+
+    cpu.Run(100);
+    EXPECT_EQ(cpu.Stopped(), Stop::ReadWatchpoint);
+    EXPECT_EQ(cpu.StopAddress(), 0x800u);
+    EXPECT_EQ(R(Register::IP), 8u);
+    EXPECT_EQ(R(Register::R3), 0u);
+    EXPECT_EQ(cpu.Retired(), 2u);
+
+    cpu.Run(100);
+    EXPECT_EQ(cpu.Stopped(), Stop::WriteWatchpoint);
+    EXPECT_EQ(R(Register::IP), 12u);
+    EXPECT_EQ(R(Register::R3), 5u);
+    EXPECT_EQ(ram.ReadWord(0x800), 5u);
+
+    cpu.Run(100);
+    EXPECT_TRUE(cpu.Halted());
+    EXPECT_EQ(cpu.Stopped(), Stop::None);
+    EXPECT_EQ(ram.ReadWord(0x800), 7u);
+    EXPECT_EQ(R(Register::EADDR), 0x1234u);
+    EXPECT_TRUE(cpu.Unwatch(0x800, 4, Access::Write));
+    EXPECT_FALSE(cpu.Unwatch(0x800, 4, Access::Write));
+}
+
+struct PagingTest : ::testing::Test {
+    static constexpr WORD kDir   = 0x1000;
+    static constexpr WORD kTable = 0x2000;
+
+    RAM big{ 0x8000 };
+    Core vm{ big };
+
+    void Map(WORD vaddr, WORD frame, WORD flags) {
+        big.WriteWord(kDir + (vaddr >> 22) * 4, kTable | Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+        big.WriteWord(kTable + ((vaddr >> 12) & 0x3FF) * 4, frame | flags);
+    }
+
+    void LoadCode(WORD paddr, std::initializer_list<WORD> program) {
+        for (WORD instruction : program)
+        {
+            big.WriteWord(paddr, instruction);
+            paddr += sizeof(WORD);
+        }
+    }
+};
+
+TEST_F(PagingTest, Loads_and_stores_are_translated) {
+    Map(0x0000, 0x3000, Mmu::PTE_PRESENT);
+    Map(0x1000, 0x4000, Mmu::PTE_PRESENT);
+    Map(0x2000, 0x5000, Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+    big.WriteWord(0x4010, 0xCAFE'F00Du);
+
+    LoadCode(0x3000, {
+        Encode(Instruction::LW, Register::R1, Register::R2),
+        Encode(Instruction::SW, Register::R1, Register::R3),
+        Encode(Instruction::HALT),
+    });
+
+    vm.Reg(Register::R2) = 0x1010;
+    vm.Reg(Register::R3) = 0x2020;
+    vm.Reg(Register::PTB) = kDir;
+
+    vm.Run(100);
+    EXPECT_TRUE(vm.Halted());
+    EXPECT_EQ(vm.Retired(), 3u);
+    EXPECT_EQ(vm.Reg(Register::R1), 0xCAFE'F00Du);
+    EXPECT_EQ(big.ReadWord(0x5020), 0xCAFE'F00Du);
+}
+
+TEST_F(PagingTest, Write_to_read_only_page_faults) {
+    Map(0x0000, 0x3000, Mmu::PTE_PRESENT);
+    LoadCode(0x3000, {
+        Encode(Instruction::LW, Register::R1, Register::R2),
+        Encode(Instruction::SW, Register::R1, Register::R2),
+        Encode(Instruction::HALT),
+    });
+
+    vm.Reg(Register::R2) = 0x0008;
+    vm.Reg(Register::PTB) = kDir;
+
+    vm.Run(100);
+    EXPECT_TRUE(vm.Halted());
+    EXPECT_EQ(vm.Retired(), 1u);
+    EXPECT_EQ(vm.Reg(Register::ECAUSE), static_cast<WORD>(Interrupt::PageFault));
+    EXPECT_EQ(vm.Reg(Register::EADDR), 0x0008u);
+}
+
+TEST_F(PagingTest, Unmapped_page_traps_to_handler) {
+    Map(0x0000, 0x3000, Mmu::PTE_PRESENT);
+    big.WriteWord(0x6000 + static_cast<WORD>(Interrupt::PageFault) * 4, 0x100);
+    vm.Reg(Register::VB) = 0x6000;
+    vm.SetFlag(Flag::InterruptEnable);
+
+    LoadCode(0x3000, {
+        Encode(Instruction::LW, Register::R1, Register::R2),
+    });
+    LoadCode(0x3100, {
+        Encode(Instruction::HALT),
+    });
+
+    vm.Reg(Register::R2) = 0x7000'0000;
+    vm.Reg(Register::PTB) = kDir;
+
+    vm.Run(100);
+    EXPECT_EQ(vm.Reg(Register::EIP), 0u);
+    EXPECT_EQ(vm.Reg(Register::EADDR), 0x7000'0000u);
+    EXPECT_EQ(vm.Reg(Register::IP), 0x104u);
+}
+
+TEST_F(PagingTest, Block_copy_fault_keeps_finished_pages) {
+    Map(0x0000, 0x3000, Mmu::PTE_PRESENT);
+    Map(0x1000, 0x4000, Mmu::PTE_PRESENT);
+    Map(0x2000, 0x5000, Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+    big.WriteWord(0x4000, 0x1234'5678u);
+
+    LoadCode(0x3000, {
+        Encode(Instruction::MEMCPY, Register::R1, Register::R2, Register::R3),
+        Encode(Instruction::HALT),
+    });
+
+    vm.Reg(Register::R1) = 0x2800;
+    vm.Reg(Register::R2) = 0x1000;
+    vm.Reg(Register::R3) = 0x1000;
+    vm.Reg(Register::PTB) = kDir;
+
+    vm.Run(100);
+    EXPECT_TRUE(vm.Halted());
+    EXPECT_EQ(vm.Retired(), 1u);
+    EXPECT_EQ(vm.Reg(Register::ECAUSE), static_cast<WORD>(Interrupt::PageFault));
+    EXPECT_EQ(vm.Reg(Register::EADDR), 0x3000u);
+    EXPECT_EQ(vm.Reg(Register::R1), 0x3000u);
+    EXPECT_EQ(vm.Reg(Register::R2), 0x1800u);
+    EXPECT_EQ(vm.Reg(Register::R3), 0x800u);
+    EXPECT_EQ(big.ReadWord(0x5800), 0x1234'5678u);
+}
+
+TEST_F(PagingTest, Pushm_frame_may_straddle_pages) {
+    Map(0x0000, 0x3000, Mmu::PTE_PRESENT);
+    Map(0x1000, 0x4000, Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+    Map(0x2000, 0x5000, Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+
+    LoadCode(0x3000, {
+        EncodeImm16(Instruction::PUSHM, Register::RZ, Register::RZ, RegisterBit(Register::R1) | RegisterBit(Register::R2) | RegisterBit(Register::R3)),
+        Encode(Instruction::HALT),
+    });
+
+    vm.Reg(Register::R1) = 1;
+    vm.Reg(Register::R2) = 2;
+    vm.Reg(Register::R3) = 3;
+    vm.Reg(Register::SP) = 0x2008;
+    vm.Reg(Register::PTB) = kDir;
+
+    EXPECT_EQ(vm.Run(100), 2u);
+    EXPECT_EQ(vm.Reg(Register::SP), 0x1FFCu);
+    EXPECT_EQ(big.ReadWord(0x4FFC), 1u);
+    EXPECT_EQ(big.ReadWord(0x5000), 2u);
+    EXPECT_EQ(big.ReadWord(0x5004), 3u);
+}
+
+TEST_F(PagingTest, Pushm_fault_writes_no_part_of_the_frame) {
+    Map(0x0000, 0x3000, Mmu::PTE_PRESENT);
+    Map(0x1000, 0x4000, Mmu::PTE_PRESENT);
+    Map(0x2000, 0x5000, Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+
+    LoadCode(0x3000, {
+        EncodeImm16(Instruction::PUSHM, Register::RZ, Register::RZ, RegisterBit(Register::R1) | RegisterBit(Register::R2) | RegisterBit(Register::R3)),
+        Encode(Instruction::HALT),
+    });
+
+    vm.Reg(Register::R2) = 2;
+    vm.Reg(Register::SP) = 0x2008;
+    vm.Reg(Register::PTB) = kDir;
+
+    vm.Run(100);
+    EXPECT_TRUE(vm.Halted());
+    EXPECT_EQ(vm.Reg(Register::ECAUSE), static_cast<WORD>(Interrupt::PageFault));
+    EXPECT_EQ(vm.Reg(Register::EADDR), 0x1FFCu);
+    EXPECT_EQ(vm.Reg(Register::SP), 0x2008u);
+    EXPECT_EQ(big.ReadWord(0x5000), 0u);
+}
+
+TEST_F(PagingTest, Tlb_is_flushed_on_ptb_write) {
+    Map(0x0000, 0x3000, Mmu::PTE_PRESENT);
+    Map(0x1000, 0x4000, Mmu::PTE_PRESENT);
+    big.WriteWord(0x4000, 1);
+    big.WriteWord(0x5000, 2);
+
+    LoadCode(0x3000, {
+        Encode(Instruction::LW, Register::R1, Register::R2),
+        Encode(Instruction::LW, Register::R3, Register::R2),
+        EncodeImm16(Instruction::ORI, Register::PTB, Register::PTB, 0),
+        Encode(Instruction::LW, Register::R4, Register::R2),
+    });
+
+    vm.Reg(Register::R2) = 0x1000;
+    vm.Reg(Register::PTB) = kDir;
+
+    vm.Step();
+    Map(0x1000, 0x5000, Mmu::PTE_PRESENT);
+    vm.Step();
+    vm.Step();
+    vm.Step();
+
+    EXPECT_EQ(vm.Reg(Register::R1), 1u);
+    EXPECT_EQ(vm.Reg(Register::R3), 1u);
+    EXPECT_EQ(vm.Reg(Register::R4), 2u);
+}
+
+TEST_F(PagingTest, Reading_ptb_keeps_the_tlb) {
+    Map(0x0000, 0x3000, Mmu::PTE_PRESENT);
+    Map(0x1000, 0x4000, Mmu::PTE_PRESENT);
+    big.WriteWord(0x4000, 1);
+    big.WriteWord(0x5000, 2);
+
+    LoadCode(0x3000, {
+        Encode(Instruction::LW, Register::R1, Register::R2),
+        EncodeImm16(Instruction::CMPI, Register::PTB, Register::RZ, 0),
+        Encode(Instruction::LW, Register::R4, Register::R2),
+    });
+
+    vm.Reg(Register::R2) = 0x1000;
+    vm.Reg(Register::PTB) = kDir;
+
+    vm.Step();
+    Map(0x1000, 0x5000, Mmu::PTE_PRESENT);
+    vm.Step();
+    vm.Step();
+
+    EXPECT_EQ(vm.Reg(Register::R1), 1u);
+    EXPECT_EQ(vm.Reg(Register::R4), 1u);       // still the stale translation
+}
+
+TEST_F(PagingTest, Page_limit_stops_after_the_block_that_crossed_it) {
+    LoadCode(0, {
+        Encode(Instruction::SW, Register::R1, Register::R2),
+        EncodeImm16(Instruction::LW, Register::R3, Register::R2, AddressOffset(4)),
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, Mmu::PAGE_SIZE),
+        EncodeJ(Instruction::B, static_cast<WORD>(-16)),
+    });
+    vm.Reg(Register::R2) = 0x3000;
+
+    vm.SetLimits(Limits{ Limits::UNLIMITED, Limits::UNLIMITED, 2 });
+    EXPECT_EQ(vm.Run(1000), 12u);
+    EXPECT_EQ(vm.LimitReached(), Limit::Pages);
+    EXPECT_EQ(vm.Accounting().pages, 3u);
+    EXPECT_EQ(vm.Reg(Register::R2), 0x6000u);
+}
+
+TEST_F(PagingTest, Watched_page_leaves_the_tlb) {
+    Map(0x0000, 0x3000, Mmu::PTE_PRESENT);
+    Map(0x1000, 0x5000, Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+    LoadCode(0x3000, {
+        Encode(Instruction::SW, Register::R1, Register::R2),
+        EncodeImm16(Instruction::SW, Register::R1, Register::R2, AddressOffset(0x10)),
+        Encode(Instruction::HALT),
+    });
+    vm.Reg(Register::R1) = 0xAB;
+    vm.Reg(Register::R2) = 0x1000;
+    vm.Reg(Register::PTB) = kDir;
+
+    vm.Step();
+    ASSERT_TRUE(vm.Watch(0x5010, 4, Access::Write));
+
+    vm.Run(100);
+    EXPECT_EQ(vm.Stopped(), Stop::WriteWatchpoint);
+    EXPECT_EQ(vm.StopAddress(), 0x1010u);
+    EXPECT_EQ(big.ReadWord(0x5000), 0xABu);
+    EXPECT_EQ(big.ReadWord(0x5010), 0u);
+
+    vm.Run(100);
+    EXPECT_TRUE(vm.Halted());
+    EXPECT_EQ(big.ReadWord(0x5010), 0xABu);
+}
+
+TEST(CoreConfigTest, Profiling_core_counts_retired_and_memory) {
+    RAM ram{ 1024 };
+    ProfilingCore core{ ram };
+
+    ram.WriteWord(0, Encode(Instruction::SW, Register::R1, Register::R2));
+    ram.WriteWord(4, Encode(Instruction::LW, Register::R3, Register::R2));
+    ram.WriteWord(8, Encode(Instruction::LW, Register::R4, Register::R2));
+    ram.WriteWord(12, Encode(Instruction::HALT));
+    core.Reg(Register::R1) = 77;
+    core.Reg(Register::R2) = 512;
+
+    core.Run(100);
+    const Counters& counters = core.Instrumentation();
+    EXPECT_EQ(core.Reg(Register::R4), 77u);
+    EXPECT_EQ(counters.Retired(Instruction::LW), 2u);
+    EXPECT_EQ(counters.Retired(Instruction::SW), 1u);
+    EXPECT_EQ(counters.Retired(Instruction::HALT), 1u);
+    EXPECT_EQ(counters.Loads(), 2u);
+    EXPECT_EQ(counters.Stores(), 1u);
+}
+
+TEST(CoreConfigTest, Tracing_core_prints_retired_instructions) {
+    RAM ram{ 1024 };
+    TracingCore core{ ram };
+    std::ostringstream trace;
+    core.Instrumentation().SetStream(trace);
+
+    ram.WriteWord(0, EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 1));
+    ram.WriteWord(4, Encode(Instruction::HALT));
+
+    core.Run(100);
+    std::ostringstream expected;
+    expected << "00000000: " << std::hex << std::setfill('0') << std::setw(8) << EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 1) << "\n"
+             << "00000004: " << std::setw(8) << Encode(Instruction::HALT) << "\n";
+    EXPECT_EQ(trace.str(), expected.str());
+}
+
+TEST(CoreConfigTest, Block_profile_counts_block_entries) {
+    RAM ram{ 1024 };
+    BlockProfileCore core{ ram };
+
+    ram.WriteWord(0, EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 3));
+    ram.WriteWord(4, EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1));      // loop:
+    ram.WriteWord(8, EncodeJ(Instruction::BNE, static_cast<WORD>(-8)));
+    ram.WriteWord(12, Encode(Instruction::HALT));
+
+    core.Run(100);
+    const BlockProfile& profile = core.Instrumentation();
+    EXPECT_TRUE(core.Halted());
+    EXPECT_EQ(profile.Count(0), 1u);
+    EXPECT_EQ(profile.Count(4), 2u);        // entered by falling through the first time
+    EXPECT_EQ(profile.Count(8), 0u);
+    EXPECT_EQ(profile.Count(12), 1u);       // BNE not taken
+
+    std::ostringstream out;
+    profile.Write(out);
+    EXPECT_EQ(out.str(), "0x00000000 1\n0x00000004 2\n0x0000000c 1\n");
+}
+
+TEST(CoreConfigTest, Flat_core_ignores_ptb) {
+    RAM ram{ 1024 };
+    FlatCore core{ ram };
+
+    ram.WriteWord(0, Encode(Instruction::LW, Register::R1, Register::R2));
+    ram.WriteWord(4, Encode(Instruction::HALT));
+    ram.WriteWord(256, 0x55u);
+    core.Reg(Register::R2) = 256;
+    core.Reg(Register::PTB) = 512;
+
+    core.Run(100);
+    EXPECT_EQ(core.Reg(Register::R1), 0x55u);
+    EXPECT_EQ(sizeof(FlatCore), sizeof(BasicCore<FlatMemory, FeatureSet<>>));
+}
+
+TEST_F(CpuTest, LoadByte_sign_extends_and_shifts_use_low_five_bits) {
+    R(Register::R1) = 0x80;
+    R(Register::R2) = 64;
+    cpu.StoreByte(Register::R1, Register::R2);
+    cpu.LoadByte(Register::R3, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0xFFFF'FF80u);
+    cpu.LoadByteUnsigned(Register::R3, Register::R2);
+    EXPECT_EQ(R(Register::R3), 0x80u);
+
+    R(Register::R1) = 1;
+    R(Register::R2) = 33;
+    cpu.ShiftLeft(Register::R3, Register::R1, Register::R2);
+    EXPECT_EQ(R(Register::R3), 2u);
+}
+
+static bool AllZero(RAM& ram)
+{
+    const BYTE* data = ram.Data(0, static_cast<WORD>(ram.Size()));
+    return std::all_of(data, data + ram.Size(), [](BYTE b) { return b == 0; });
+}
+
+TEST(PoolTest, Released_machine_comes_back_clean) {
+    FlatCore::RegisterFile registers{};
+    registers[static_cast<size_t>(Register::SP)] = 0x10000;
+    MachinePool<FlatCore> pool{ 1, 0x10000, registers };
+
+    {
+        auto machine = pool.Acquire();
+        ASSERT_TRUE(machine);
+        EXPECT_FALSE(pool.Acquire());
+
+        const WORD program[] = {
+            EncodeImm16(Instruction::LUI,  Register::R2, Register::RZ, 0x0000),
+            EncodeImm16(Instruction::ORI,  Register::R2, Register::R2, 0x3000),
+            EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 0x77),
+            Encode(Instruction::SW,   Register::R1, Register::R2),
+            EncodeImm16(Instruction::ORI,  Register::R2, Register::RZ, 0x5000),
+            EncodeImm16(Instruction::ADDI, Register::R3, Register::RZ, 64),
+            Encode(Instruction::MEMSET, Register::R2, Register::R1, Register::R3),
+            Encode(Instruction::PUSH, Register::R1),
+            Encode(Instruction::HALT),
+        };
+        for (size_t i = 0; i < std::size(program); ++i)
+            machine->ram.WriteWord(static_cast<WORD>(i * sizeof(WORD)), program[i]);
+
+        machine->core.Run(100);
+        EXPECT_TRUE(machine->core.Halted());
+        EXPECT_EQ(machine->ram.ReadWord(0x3000), 0x77u);
+        EXPECT_EQ(machine->ram.ReadWord(0xFFFC), 0x77u);
+        EXPECT_EQ(machine->ram.DirtyPages(), 4u);       // code, 0x3000, 0x5000 and the stack
+    }
+
+    EXPECT_EQ(pool.Available(), 1u);
+    auto machine = pool.Acquire();
+    ASSERT_TRUE(machine);
+    EXPECT_TRUE(AllZero(machine->ram));
+    EXPECT_EQ(machine->ram.DirtyPages(), 0u);
+    EXPECT_FALSE(machine->core.Halted());
+    EXPECT_EQ(machine->core.Retired(), 0u);
+    EXPECT_EQ(machine->core.Reg(Register::SP), 0x10000u);
+    EXPECT_EQ(machine->core.Reg(Register::R1), 0u);
+    EXPECT_EQ(machine->core.Reg(Register::IP), 0u);
+}
+
+// A page read before it is written must still be marked when the write hits the TLB
+TEST(PoolTest, Writes_through_page_tables_are_tracked) {
+    static constexpr WORD kDir   = 0x1000;
+    static constexpr WORD kTable = 0x2000;
+
+    Core::RegisterFile registers{};
+    registers[static_cast<size_t>(Register::PTB)] = kDir;
+    MachinePool<Core> pool{ 1, 0x8000, registers };
+
+    for (int job = 0; job < 2; ++job)
+    {
+        auto machine = pool.Acquire();
+        RAM& ram = machine->ram;
+        ram.WriteWord(kDir, kTable | Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+        ram.WriteWord(kTable + 0 * 4, 0x3000 | Mmu::PTE_PRESENT);
+        ram.WriteWord(kTable + 1 * 4, 0x6000 | Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE);
+        ram.WriteWord(0x3000, Encode(Instruction::LW, Register::R1, Register::R2));
+        ram.WriteWord(0x3004, EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1));
+        ram.WriteWord(0x3008, Encode(Instruction::SW, Register::R1, Register::R2));
+        ram.WriteWord(0x300C, Encode(Instruction::HALT));
+        machine->core.Reg(Register::R2) = 0x1010;
+
+        machine->core.Run(100);
+        EXPECT_TRUE(machine->core.Halted());
+        EXPECT_EQ(ram.ReadWord(0x6010), 1u) << "job " << job;
+    }
+
+    auto machine = pool.Acquire();
+    EXPECT_TRUE(AllZero(machine->ram));
+}
+
+// One packet to the stub and its reply, both acknowledged
+static std::string Exchange(int fd, const std::string& payload)
+{
+    uint8_t sum = 0;
+    for (char c : payload)
+        sum = static_cast<uint8_t>(sum + c);
+    char checksum[3];
+    snprintf(checksum, sizeof(checksum), "%02x", sum);
+    std::string packet = "$" + payload + "#" + checksum;
+    send(fd, packet.data(), packet.size(), 0);
+
+    std::string reply;
+    char c;
+    while (recv(fd, &c, 1, 0) == 1 && c != '$')
+        ;
+    while (recv(fd, &c, 1, 0) == 1 && c != '#')
+        reply += c;
+    recv(fd, checksum, 2, MSG_WAITALL);
+    send(fd, "+", 1, 0);
+    return reply;
+}
+
+TEST(GdbStubTest, Breakpoints_registers_and_memory_over_the_wire) {
+    RAM ram{ 4096 };
+    Core core{ ram };
+    const WORD program[] = {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 5),
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),
+        Encode(Instruction::HALT),
+    };
+    for (size_t i = 0; i < std::size(program); ++i)
+        ram.WriteWord(static_cast<WORD>(i * sizeof(WORD)), program[i]);
+
+    GdbStub<Core> stub{ core };
+    uint16_t port = stub.Listen(0);
+    bool served = false;
+    std::thread server([&]() { served = stub.Serve(); });
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)), 0);
+
+    EXPECT_NE(Exchange(fd, "qSupported:swbreak+").find("swbreak+"), std::string::npos);
+    EXPECT_EQ(Exchange(fd, "?"), "S05");
+    EXPECT_EQ(Exchange(fd, "Z0,4,4"), "OK");
+    EXPECT_EQ(Exchange(fd, "c"), "T05swbreak:;");
+    EXPECT_EQ(Exchange(fd, "p1"), "05000000");
+    EXPECT_EQ(Exchange(fd, "pa"), "04000000");
+    EXPECT_EQ(Exchange(fd, "g").substr(8, 8), "05000000");
+    EXPECT_EQ(Exchange(fd, "M800,4:2a000000"), "OK");
+    EXPECT_EQ(Exchange(fd, "m800,4"), "2a000000");
+    EXPECT_EQ(Exchange(fd, "s"), "S05");
+    EXPECT_EQ(Exchange(fd, "p1"), "06000000");
+    EXPECT_EQ(Exchange(fd, "c"), "W00");
+    EXPECT_EQ(Exchange(fd, "D"), "OK");
+
+    server.join();
+    close(fd);
+    EXPECT_TRUE(served);
+    EXPECT_TRUE(core.Breakpoints().empty());
+}
+
+TEST(GdbStubTest, Hang_up_takes_out_breakpoints_and_watches) {
+    RAM ram{ 4096 };
+    Core core{ ram };
+    GdbStub<Core> stub{ core };
+    uint16_t port = stub.Listen(0);
+    bool served = false;
+    std::thread server([&]() { served = stub.Serve(); });
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)), 0);
+
+    EXPECT_EQ(Exchange(fd, "Z0,4,4"), "OK");
+    EXPECT_EQ(Exchange(fd, "Z3,800,4"), "OK");
+    EXPECT_EQ(Exchange(fd, "Z4,800,4"), "E01");      // the read half is already set
+    EXPECT_EQ(Exchange(fd, "Z2,800,4"), "OK");       // so the write half was taken back
+    EXPECT_TRUE(ram.Watching());
+
+    close(fd);
+    server.join();
+    EXPECT_TRUE(served);
+    EXPECT_TRUE(core.Breakpoints().empty());
+    EXPECT_FALSE(ram.Watching());
+}
+
+// Every guest rings its device and sleeps on the busy result register, then in WAIT until
+// the completion interrupt. A host thread completes the requests newest first.
+TEST(SchedulerTest, Thousand_guests_sleep_on_one_thread) {
+    static constexpr size_t kGuests = 1000;
+    static constexpr WORD kDevice = 0x10000;
+
+    struct Guest
+    {
+        Guest():
+        core(ram)
+        {
+        }
+
+        RAM     ram{ 4096 };
+        MmioCore core;
+        WORD    result{ 0 };
+    };
+
+    const WORD program[] = {
+        EncodeImm16(Instruction::LUI, Register::R2, Register::RZ, kDevice >> 16),
+        Encode(Instruction::SW, Register::R1, Register::R2),                            // doorbell
+        EncodeImm16(Instruction::LW, Register::R3, Register::R2, AddressOffset(4)),     // busy until done
+        Encode(Instruction::WAIT),
+        EncodeImm16(Instruction::SW, Register::R3, Register::RZ, AddressOffset(0x800)),
+        Encode(Instruction::HALT),
+    };
+
+    GuestScheduler<MmioCore> scheduler;
+    std::vector<std::unique_ptr<Guest>> guests;
+    std::vector<std::pair<size_t, WORD>> requests;
+
+    for (size_t i = 0; i < kGuests; ++i)
+    {
+        guests.push_back(std::make_unique<Guest>());
+        Guest& guest = *guests.back();
+        for (size_t k = 0; k < std::size(program); ++k)
+            guest.ram.WriteWord(static_cast<WORD>(k * sizeof(WORD)), program[k]);
+        guest.core.Reg(Register::R1) = static_cast<WORD>(i + 1);
+
+        MmioBus& bus = guest.core.MemorySystem().Devices();
+        bus.Map(kDevice, 8,
+            [&guest](WORD offset, WORD, WORD& value) { value = guest.result; return offset == 4; },
+            [&bus, &requests, i](WORD offset, WORD, WORD value) {
+                bus.SetBusy(kDevice, true);
+                requests.emplace_back(i, value);
+                return offset == 0;
+            });
+
+        EXPECT_EQ(scheduler.Spawn(guest.core), i);
+    }
+
+    EXPECT_EQ(scheduler.Poll(), kGuests);
+    ASSERT_EQ(requests.size(), kGuests);
+    for (size_t i = 0; i < kGuests; ++i)
+    {
+        EXPECT_TRUE(scheduler.Asleep(i));
+        EXPECT_EQ(guests[i]->core.Waiting(), Wait::Device);
+    }
+
+    std::thread device([&] {
+        for (size_t k = requests.size(); k-- > 0;)
+        {
+            auto [i, value] = requests[k];
+            scheduler.Post(i, [&guest = *guests[i], value](MmioCore& core) {
+                guest.result = value * 3;
+                core.MemorySystem().Devices().SetBusy(kDevice, false);
+            });
+            scheduler.Raise(i, Interrupt::Block);
+        }
+    });
+    scheduler.Run();
+    device.join();
+
+    for (size_t i = 0; i < kGuests; ++i)
+    {
+        EXPECT_TRUE(scheduler.Done(i));
+        EXPECT_TRUE(guests[i]->core.Halted());
+        EXPECT_EQ(guests[i]->ram.ReadWord(0x800), (i + 1) * 3) << "guest " << i;
+    }
+}
+
+// Sums 1..n for a per lane n, stores the sum and a sign extended byte of it
+static const std::vector<WORD> kLockstepProgram = {
+    EncodeImm16(Instruction::ADDI, Register::R5, Register::RZ, 0x100),
+    Encode(Instruction::ADD, Register::R2, Register::R2, Register::R1),        // loop:
+    EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+    EncodeImm16(Instruction::CMPI, Register::R1, Register::RZ, 0),
+    EncodeJ(Instruction::BGT, static_cast<WORD>(-16)),
+    Encode(Instruction::SW, Register::R2, Register::R5),
+    Encode(Instruction::LB, Register::R3, Register::R5),
+    Encode(Instruction::PUSH, Register::R3),
+    Encode(Instruction::POP, Register::R4),
+    EncodeImm16(Instruction::SHLI, Register::R6, Register::R2, 3),
+    Encode(Instruction::XOR, Register::R7, Register::R6, Register::R4),
+    Encode(Instruction::LW, Register::R8, Register::R7),                       // faults for some lanes
+    Encode(Instruction::HALT),
+};
+
+TEST(LockstepTest, Matches_scalar_core_on_divergent_lanes) {
+    static constexpr WORD kMem = 1024;
+    static constexpr size_t kLanes = 8;
+    const WORD inputs[kLanes] = { 1, 2, 3, 5, 8, 15, 16, 0 };
+
+    LockstepCore<kLanes> lanes{ kMem };
+    lanes.Broadcast(0, kLockstepProgram.data(), kLockstepProgram.size() * sizeof(WORD));
+    for (size_t i = 0; i < kLanes; ++i)
+    {
+        lanes.Reg(i, Register::R1) = inputs[i];
+        lanes.Reg(i, Register::SP) = kMem;
+        lanes.Reg(i, Register::TIMER) = 7;
+    }
+
+    lanes.Run(10'000);
+
+    for (size_t i = 0; i < kLanes; ++i)
+    {
+        RAM ram{ kMem };
+        FlatCore core{ ram };
+        for (size_t k = 0; k < kLockstepProgram.size(); ++k)
+            ram.WriteWord(k * sizeof(WORD), kLockstepProgram[k]);
+        core.Reg(Register::R1) = inputs[i];
+        core.Reg(Register::SP) = kMem;
+        core.Reg(Register::TIMER) = 7;
+        core.Run(10'000);
+
+        for (size_t r = 0; r < static_cast<size_t>(Register::__NUM); ++r)
+            EXPECT_EQ(lanes.Reg(i, static_cast<Register>(r)), core.Reg(static_cast<Register>(r))) << "lane " << i << " register " << r;
+
+        EXPECT_EQ(lanes.Retired(i), core.Retired()) << "lane " << i;
+        EXPECT_EQ(::memcmp(lanes.Memory(i), ram.Data(0, kMem), kMem), 0) << "lane " << i;
+    }
+
+    EXPECT_EQ(lanes.State(0), LaneState::Faulted);
+    EXPECT_EQ(lanes.Reg(0, Register::ECAUSE), static_cast<WORD>(Interrupt::MemoryFault));
+    EXPECT_EQ(lanes.State(7), LaneState::Halted);
+}
+
+TEST(LockstepTest, Illegal_instruction_stops_lanes) {
+    LockstepCore<16> lanes{ 64 };
+    WORD program[] = { Encode(Instruction::RETI) };
+    lanes.Broadcast(0, program, sizeof(program));
+
+    EXPECT_EQ(lanes.Run(100), 1u);
+    for (size_t i = 0; i < 16; ++i)
+    {
+        EXPECT_EQ(lanes.State(i), LaneState::Faulted);
+        EXPECT_EQ(lanes.Reg(i, Register::ECAUSE), static_cast<WORD>(Interrupt::IllegalInstruction));
+        EXPECT_EQ(lanes.Retired(i), 0u);
+    }
+}
+
+static std::string DisassembleText(WORD instruction, WORD ip = 0)
+{
+    char text[DISASSEMBLY_MAX];
+    return std::string(text, Disassemble(instruction, ip, text));
+}
+
+TEST(EncodingTest, Fields_round_trip) {
+    WORD add = Encode(Instruction::SHUFB, Register::R8, Register::PTB, Register::RA);
+    EXPECT_EQ(GetOpcode(add), Instruction::SHUFB);
+    EXPECT_EQ(GetR1(add), Register::R8);
+    EXPECT_EQ(GetR2(add), Register::PTB);
+    EXPECT_EQ(GetR3(add), Register::RA);
+
+    WORD ori = EncodeImm16(Instruction::ORI, Register::R1, Register::R2, 0xBEEF);
+    EXPECT_EQ(GetImm16(ori), 0xBEEF);
+    EXPECT_EQ(GetR2(ori), Register::R2);
+
+    EXPECT_EQ(GetBranchOffset(EncodeJ(Instruction::BNE, static_cast<WORD>(-48))), static_cast<WORD>(-48));
+    EXPECT_EQ(GetImm26(EncodeJ(Instruction::CALL, 0x3FFFFFC)), 0x3FFFFFCu);
+
+    EXPECT_EQ(GetInstructionType(Instruction::NOT), InstructionType::OP_R2);
+    EXPECT_EQ(GetInstructionType(Instruction::JR), InstructionType::OP_R1);
+    EXPECT_STREQ(Mnemonic(Instruction::MEMCPY), "MEMCPY");
+    EXPECT_EQ(Mnemonic(static_cast<Instruction>(0)), nullptr);
+    EXPECT_EQ(RegisterOperands(static_cast<Instruction>(0)), -1);
+    EXPECT_EQ(static_cast<WORD>(Instruction::__NUM), OPCODE_COUNT);
+}
+
+TEST(EncodingTest, Tables_cover_every_instruction) {
+    for (WORD i = 1; i < static_cast<WORD>(Instruction::__NUM); ++i)
+    {
+        Instruction op = static_cast<Instruction>(i);
+        ASSERT_TRUE(IsDefined(op)) << "opcode " << i;
+        ASSERT_NE(Mnemonic(op), nullptr) << "opcode " << i;
+        EXPECT_EQ(RegisterOperands(op), TypeRegisters(GetInstructionType(op))) << Mnemonic(op);
+
+        Instruction found = Instruction::__NUM;
+        EXPECT_TRUE(FindMnemonic(Mnemonic(op), found)) << Mnemonic(op);
+        EXPECT_EQ(found, op) << Mnemonic(op);
+    }
+
+    EXPECT_FALSE(IsDefined(static_cast<Instruction>(0)));
+    for (WORD i = static_cast<WORD>(Instruction::__NUM); i < 256; ++i)
+    {
+        EXPECT_FALSE(IsDefined(static_cast<Instruction>(i))) << "opcode " << i;
+        EXPECT_EQ(RegisterOperands(static_cast<Instruction>(i)), -1) << "opcode " << i;
+    }
+
+    for (WORD r = 0; r < static_cast<WORD>(Register::__NUM); ++r)
+    {
+        Register found = Register::__NUM;
+        EXPECT_TRUE(FindRegister(REGISTER_NAMES[r], found)) << REGISTER_NAMES[r];
+        EXPECT_EQ(found, static_cast<Register>(r)) << REGISTER_NAMES[r];
+    }
+
+    Instruction op;
+    Register reg;
+    for (const char* name : { "", "add", "ADDX", "ADDUSBXYZ", "R9", "R1 ", "PUSHMPOPM" })
+    {
+        EXPECT_FALSE(FindMnemonic(name, op)) << name;
+        EXPECT_FALSE(FindRegister(name, reg)) << name;
+    }
+}
+
+TEST(EncodingTest, Disassembles_every_format) {
+    EXPECT_EQ(DisassembleText(Encode(Instruction::ADD, Register::R1, Register::R2, Register::R3)), "ADD R1, R2, R3");
+    EXPECT_EQ(DisassembleText(EncodeImm16(Instruction::ADDI, Register::SP, Register::SP, 65535)), "ADDI SP, SP, 65535");
+    EXPECT_EQ(DisassembleText(Encode(Instruction::NOT, Register::R4, Register::FLAGS)), "NOT R4, FLAGS");
+    EXPECT_EQ(DisassembleText(EncodeImm16(Instruction::LUI, Register::R7, Register::RZ, 0x1234)), "LUI R7, 4660");
+    EXPECT_EQ(DisassembleText(Encode(Instruction::CALLR, Register::RA)), "CALLR RA");
+    EXPECT_EQ(DisassembleText(Encode(Instruction::RETI)), "RETI");
+    EXPECT_EQ(DisassembleText(Encode(Instruction::WAIT)), "WAIT");
+    EXPECT_EQ(DisassembleText(EncodeJ(Instruction::BEQ, static_cast<WORD>(-8)), 0x100), "BEQ 0x000000fc");
+    EXPECT_EQ(DisassembleText(EncodeJ(Instruction::J, 0x2000), 0x100), "J 0x00002000");
+    EXPECT_EQ(DisassembleText(EncodeImm16(Instruction::PUSHM, Register::RZ, Register::RZ,
+                                          RegisterBit(Register::R1) | RegisterBit(Register::R8) | RegisterBit(Register::RA))),
+              "PUSHM {R1, R8, RA}");
+
+    EXPECT_EQ(DisassembleText(Encode(Instruction::LW, Register::R1, Register::R2)), "LW R1, [R2]");
+    EXPECT_EQ(DisassembleText(EncodeImm16(Instruction::SW, Register::R1, Register::R2, static_cast<HWORD>(AddressOffset(-12)))),
+              "SW R1, [R2-12]");
+    EXPECT_EQ(DisassembleText(EncodeImm16(Instruction::LBU, Register::R1, Register::R2, static_cast<HWORD>(AddressIndexed(Register::R3, 2)))),
+              "LBU R1, [R2+R3<<2]");
+    EXPECT_EQ(DisassembleText(EncodeImm16(Instruction::LH, Register::R1, Register::R2, static_cast<HWORD>(AddressPostIncrement(-2)))),
+              "LH R1, [R2], -2");
+}
+
+TEST(EncodingTest, Words_that_do_not_decode_are_data) {
+    EXPECT_FALSE(IsValidInstruction(0));
+    EXPECT_FALSE(IsValidInstruction(Encode(Instruction::ADD, Register::R1, Register::R2, static_cast<Register>(31))));
+    EXPECT_FALSE(IsValidInstruction(Encode(Instruction::LW, Register::R1, Register::R2) | 0xC000));
+    EXPECT_FALSE(IsValidInstruction(EncodeImm16(Instruction::POPM, Register::RZ, Register::RZ, 1)));
+    EXPECT_TRUE(IsValidInstruction(Encode(Instruction::JR, Register::R1, static_cast<Register>(31))));
+
+    EXPECT_EQ(DisassembleText(0x00000001), ".word 0x00000001");
+    EXPECT_EQ(DisassembleText(0), ".word 0x00000000");
+}
+
+// A file in /tmp holding contents, for the test to unlink
+static std::string ScratchFile(const std::string& contents = {})
+{
+    char tmpl[] = "/tmp/shiv_asXXXXXX";
+    int fd = mkstemp(tmpl);
+    EXPECT_GE(fd, 0);
+    EXPECT_EQ(write(fd, contents.data(), contents.size()), static_cast<ssize_t>(contents.size()));
+    close(fd);
+    return tmpl;
+}
+
+static std::string ReadAll(int fd)
+{
+    std::string res;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        res.append(buffer, static_cast<size_t>(n));
+    return res;
+}
+
+static std::string ReadFile(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    std::string res = ReadAll(fd);
+    close(fd);
+    return res;
+}
+
+TEST(ImageTest, Directives_fill_aligned_sections) {
+    Image image;
+    image.Data(sizeof(WORD), "0x11223344");
+    image.Switch(Section::DATA);
+    image.Align("16");
+    image.Data(sizeof(BYTE), "1,-1,255");
+    image.Ascii("a\\tb\\x41", true);
+    image.Data(sizeof(HWORD), "-32768");
+    image.Space("3");
+    image.Org("32");
+    image.Data(sizeof(BYTE), "7");
+    image.Switch(Section::BSS);
+    image.Space("100");
+
+    std::array<uint64_t, Image::SECTIONS> bases = image.Layout();
+    EXPECT_EQ(bases[static_cast<size_t>(Section::TEXT)], 0u);
+    EXPECT_EQ(bases[static_cast<size_t>(Section::DATA)], 16u);
+    EXPECT_EQ(bases[static_cast<size_t>(Section::BSS)], 52u);     // 16 + 33, word aligned
+
+    std::string path = ScratchFile();
+    image.Write(path);
+    std::string expected("\x44\x33\x22\x11", 4);
+    expected += std::string(12, '\0');
+    expected += std::string("\x01\xFF\xFF" "a\tbA" "\0" "\x00\x80", 10);
+    expected += std::string(32 - 10, '\0');
+    expected += '\x07';
+    EXPECT_EQ(ReadFile(path), expected);                            // .bss is not written
+    unlink(path.c_str());
+}
+
+TEST(ImageTest, Directive_errors_are_reported) {
+    Image image;
+    EXPECT_THROW(image.Data(sizeof(BYTE), "256"), std::runtime_error);
+    EXPECT_THROW(image.Data(sizeof(BYTE), "-129"), std::runtime_error);
+    EXPECT_NO_THROW(image.Data(sizeof(BYTE), "-128"));
+    EXPECT_THROW(image.Data(sizeof(HWORD), "65536"), std::runtime_error);
+    EXPECT_THROW(image.Data(sizeof(WORD), "12x"), std::runtime_error);
+    EXPECT_THROW(image.Align("12"), std::runtime_error);
+    EXPECT_THROW(image.Ascii("\\xZZ", false), std::runtime_error);
+    EXPECT_THROW(image.IncludeBinary("/nonexistent/blob"), std::runtime_error);
+
+    image.Org("8");
+    EXPECT_THROW(image.Org("4"), std::runtime_error);
+    EXPECT_EQ(image.Current().Size(), 8u);
+
+    std::string blob = ScratchFile("blob");
+    image.Switch(Section::BSS);
+    EXPECT_THROW(image.Data(sizeof(BYTE), "1"), std::runtime_error);
+    EXPECT_THROW(image.Ascii("x", false), std::runtime_error);
+    EXPECT_THROW(image.IncludeBinary(blob), std::runtime_error);
+    EXPECT_NO_THROW(image.Space("4"));
+    EXPECT_NO_THROW(image.Align("8"));
+    unlink(blob.c_str());
+}
+
+// Copied inside the kernel with holes for zero fill into a file, written from the mapping
+// with zero bytes into a pipe
+TEST(ImageTest, Incbin_reaches_files_and_pipes) {
+    std::string blob = ScratchFile("blob!");
+    Image image;
+    image.Data(sizeof(BYTE), "1");
+    image.IncludeBinary(blob);
+    image.Space("2");
+    image.Data(sizeof(BYTE), "2");
+    image.Space("3");
+    std::string expected("\x01" "blob!" "\0\0" "\x02" "\0\0\0", 12);
+
+    std::string path = ScratchFile("stale contents, longer than the image");
+    image.Write(path);
+    EXPECT_EQ(ReadFile(path), expected);
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    image.Write("/dev/fd/" + std::to_string(fds[1]));
+    close(fds[1]);
+    EXPECT_EQ(ReadAll(fds[0]), expected);
+    close(fds[0]);
+
+    unlink(path.c_str());
+    unlink(blob.c_str());
+}
+
+// Three halves of a window: the first window spills, zero fill and a word get patched on
+// both sides of it
+TEST(ImageTest, Spilled_words_are_patched_and_written) {
+    SectionImage section;
+    std::string expected;
+    auto emit = [&](WORD value) {
+        section.Emit(&value, sizeof(value));
+        expected.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+
+    const WORD words = SectionImage::WINDOW / sizeof(WORD) * 3 / 2;
+    for (WORD i = 0; i < words; ++i)
+    {
+        emit(i * 2654435761u & 0xFFFF0000u);
+        if (i == 1000)
+        {
+            section.Fill(4096);
+            expected.append(4096, '\0');
+        }
+    }
+    ASSERT_EQ(section.Size(), expected.size());
+
+    auto patch = [&](uint64_t offset, WORD bits) {
+        section.Patch(offset, bits);
+        WORD word;
+        memcpy(&word, &expected[offset], sizeof(word));
+        word |= bits;
+        memcpy(&expected[offset], &word, sizeof(word));
+    };
+    patch(4, 0x1234);                                   // spilled
+    patch(expected.size() - sizeof(WORD), 0xABCD);      // still in the window
+
+    std::string path = ScratchFile();
+    {
+        OutputFile out(path);
+        section.Write(out, 0);
+        out.Finish();
+    }
+    EXPECT_EQ(ReadFile(path), expected);
+    unlink(path.c_str());
+}
+
+// Overwrites a file in place, its inode and so its mappings stay the same
+static void Rewrite(const std::string& path, const std::string& contents)
+{
+    int fd = open(path.c_str(), O_WRONLY);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(pwrite(fd, contents.data(), contents.size(), 0), static_cast<ssize_t>(contents.size()));
+    close(fd);
+}
+
+// A file larger than the window neither spills the section by itself nor is copied into
+// the spool when the words after it do: rewritten after that, the output has the new
+// contents. The word before it still gets patched.
+TEST(ImageTest, Large_incbin_stays_out_of_the_spool) {
+    const size_t size = SectionImage::WINDOW * 3 / 2;
+    std::string blob = ScratchFile(std::string(size, 'a'));
+    SectionImage section;
+    const WORD word = 0x11223300;
+    section.Emit(&word, sizeof(word));
+    section.Include(std::make_shared<MappedFile>(blob));
+    for (WORD i = 0; i < SectionImage::WINDOW / sizeof(WORD) + 1; ++i)
+        section.Emit(&word, sizeof(word));
+    section.Patch(0, 0x44);
+
+    Rewrite(blob, std::string(size, 'b'));
+    std::string path = ScratchFile();
+    {
+        OutputFile out(path);
+        section.Write(out, 0);
+        out.Finish();
+    }
+
+    const WORD patched = word | 0x44;
+    std::string expected(reinterpret_cast<const char*>(&patched), sizeof(patched));
+    expected.append(size, 'b');
+    for (WORD i = 0; i < SectionImage::WINDOW / sizeof(WORD) + 1; ++i)
+        expected.append(reinterpret_cast<const char*>(&word), sizeof(word));
+    EXPECT_EQ(ReadFile(path), expected);
+    unlink(path.c_str());
+    unlink(blob.c_str());
+}
+
+// Past FILES included files a section spools the rest instead of keeping them open
+TEST(ImageTest, Incbin_past_the_file_limit_is_spooled) {
+    std::string blob = ScratchFile("old!");
+    SectionImage section;
+    for (size_t i = 0; i < SectionImage::FILES + 8; ++i)
+        section.Include(std::make_shared<MappedFile>(blob));
+
+    Rewrite(blob, "new!");
+    std::string path = ScratchFile();
+    {
+        OutputFile out(path);
+        section.Write(out, 0);
+        out.Finish();
+    }
+
+    std::string expected;
+    for (size_t i = 0; i < SectionImage::FILES + 8; ++i)
+        expected += i < SectionImage::FILES ? "new!" : "old!";
+    EXPECT_EQ(ReadFile(path), expected);
+    unlink(path.c_str());
+    unlink(blob.c_str());
+}
+
+static Statement Mark(const std::string& label)
+{
+    return Statement{ {}, label, {}, {} };
+}
+
+static Statement Op(const std::string& mnemonic, const std::string& op1 = {}, const std::string& op2 = {}, const std::string& op3 = {})
+{
+    return Statement{ mnemonic, op1, op2, op3 };
+}
+
+// Labels as "name:", instructions as their mnemonic and first operand
+static std::vector<std::string> LaidOut(const std::vector<Statement>& program, const std::string& profile)
+{
+    std::string path = ScratchFile(profile);
+    CodeLayout layout{ Profile::Load(path) };
+    unlink(path.c_str());
+
+    for (const Statement& statement : program)
+    {
+        if (statement.mnemonic.empty())
+            layout.Label(statement.op1);
+        else
+            layout.Emit(statement.mnemonic, statement.op1, statement.op2, statement.op3);
+    }
+
+    std::vector<std::string> res;
+    for (const Statement& statement : layout.Order())
+    {
+        if (statement.mnemonic.empty())
+            res.push_back(statement.op1 + ":");
+        else
+            res.push_back(statement.op1.empty() ? statement.mnemonic : statement.mnemonic + " " + statement.op1);
+    }
+    return res;
+}
+
+// A loop around an if/else whose else side is the common one
+TEST(LayoutTest, Common_side_falls_through_and_rare_code_moves_last) {
+    const std::vector<Statement> program = {
+        Mark("start"),
+        Op("ADDI", "R1", "RZ", "0"),        // 0x00
+        Mark("loop"),
+        Op("CMPI", "R1", "7"),              // 0x04
+        Op("BNE", "common"),
+        Mark("rare"),
+        Op("ADDI", "R3", "R3", "1"),        // 0x0C
+        Op("B", "join"),
+        Mark("common"),
+        Op("ADDI", "R2", "R2", "1"),        // 0x14
+        Mark("join"),
+        Op("ADDI", "R1", "R1", "1"),        // 0x18
+        Op("CMPI", "R1", "100"),
+        Op("BNE", "loop"),
+        Op("HALT"),                         // 0x24
+    };
+    const std::string profile =
+        "0x00000000 1\n0x00000004 99\n0x0000000c 1\n0x00000014 99\n0x00000018 1\n0x00000024 1\n";
+
+    const std::vector<std::string> expected = {
+        "start:", "ADDI R1",
+        "loop:", "CMPI R1", "BEQ rare",         // inverted, common is next
+        "common:", "ADDI R2",
+        "join:", "ADDI R1", "CMPI R1", "BNE loop",
+        "@5:", "HALT",
+        "rare:", "ADDI R3", "B join",
+        "@6:",
+    };
+    EXPECT_EQ(LaidOut(program, profile), expected);
+}
+
+TEST(LayoutTest, Moved_fall_through_gets_a_branch_and_jump_to_next_is_dropped) {
+    const std::vector<Statement> program = {
+        Mark("start"),
+        Op("CMPI", "R1", "0"),              // 0x00
+        Op("BEQ", "hot"),
+        Op("ADDI", "R3", "R3", "1"),        // 0x08, never runs and falls into hot
+        Mark("hot"),
+        Op("ADDI", "R2", "R2", "1"),        // 0x0C
+        Op("J", "done"),
+        Mark("other"),
+        Op("ADDI", "R4", "R4", "1"),        // 0x14, never runs and falls into done
+        Mark("done"),
+        Op("HALT"),                         // 0x18
+    };
+    const std::string profile = "0x00000000 1\n0x0000000c 1\n0x00000018 1\n";
+
+    const std::vector<std::string> expected = {
+        "start:", "CMPI R1", "BNE @1",
+        "hot:", "ADDI R2",                      // J done dropped
+        "done:", "HALT",
+        "@1:", "ADDI R3", "B hot",
+        "other:", "ADDI R4", "B done",
+        "@5:",
+    };
+    EXPECT_EQ(LaidOut(program, profile), expected);
+}
+
+TEST(LayoutTest, Profile_and_program_errors_are_reported) {
+    EXPECT_THROW(LaidOut({}, "0x0 many\n"), std::runtime_error);
+    EXPECT_THROW(LaidOut({}, "0x0 1 \nzero 1\n"), std::runtime_error);
+    EXPECT_THROW(LaidOut({ Op("B", "16") }, ""), std::runtime_error);
+    EXPECT_THROW(LaidOut({ Mark("a"), Op("HALT"), Mark("a") }, ""), std::runtime_error);
+    EXPECT_TRUE(LaidOut({}, "\n0x10 5\n").empty());
+}
+
+// The image as written, in words
+static std::vector<WORD> Words(const Image& image)
+{
+    std::string path = ScratchFile();
+    image.Write(path);
+    std::string bytes = ReadFile(path);
+    unlink(path.c_str());
+
+    std::vector<WORD> words(bytes.size() / sizeof(WORD));
+    memcpy(words.data(), bytes.data(), words.size() * sizeof(WORD));
+    return words;
+}
+
+TEST(AssemblerTest, Branches_resolve_backward_and_forward) {
+    Image image;
+    Assembler as(image);
+    as.Label("start");
+    as.Emit("ADDI", "R1", "RZ", "2");           // 0x00
+    as.Label("back");
+    as.Emit("SUBI", "R1", "R1", "1");           // 0x04
+    as.Emit("BNE", "back");                     // 0x08
+    as.Emit("BEQ", "done");                     // 0x0C
+    as.Emit("J", "done");                       // 0x10
+    as.Emit("B", "start");                      // 0x14
+    as.Label("done");
+    as.Emit("HALT");                            // 0x18
+    as.Finish();
+
+    const std::vector<WORD> expected = {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 2),
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-8)),
+        EncodeJ(Instruction::BEQ, 8),
+        EncodeJ(Instruction::J, 0x18),
+        EncodeJ(Instruction::B, static_cast<WORD>(-0x18)),
+        Encode(Instruction::HALT),
+    };
+    EXPECT_EQ(Words(image), expected);
+}
+
+// Branches and %hi/%lo between sections only resolve once Finish has the layout:
+// .text is 12 bytes, .rodata starts at 0xC and .data at 0x10010
+TEST(AssemblerTest, References_across_sections_resolve_after_layout) {
+    Image image;
+    Assembler as(image);
+    as.Label("start");
+    as.Emit("LUI", "R1", "%hi:value");          // 0x00
+    as.Emit("ORI", "R1", "R1", "%lo:value");    // 0x04
+    as.Emit("B", "far");                        // 0x08
+
+    image.Switch(Section::RODATA);
+    image.Space("0x10000");
+    as.Label("far");
+    as.Emit("HALT");                            // 0x1000C
+
+    image.Switch(Section::DATA);
+    as.Label("value");
+    image.Data(sizeof(WORD), "7");              // 0x10010
+    as.Emit("B", "start");                      // 0x10014
+    as.Finish();
+
+    std::vector<WORD> words = Words(image);
+    ASSERT_EQ(words.size(), 0x10018u / sizeof(WORD));
+    EXPECT_EQ(words[0], EncodeImm16(Instruction::LUI, Register::R1, Register::RZ, 0x0001));
+    EXPECT_EQ(words[1], EncodeImm16(Instruction::ORI, Register::R1, Register::R1, 0x0010));
+    EXPECT_EQ(words[2], EncodeJ(Instruction::B, 0x10000));
+    EXPECT_EQ(words[0x1000C / sizeof(WORD)], Encode(Instruction::HALT));
+    EXPECT_EQ(words[0x10010 / sizeof(WORD)], 7u);
+    EXPECT_EQ(words[0x10014 / sizeof(WORD)], EncodeJ(Instruction::B, static_cast<WORD>(-0x10018)));
+}
+
+TEST(AssemblerTest, Out_of_range_targets_are_reported) {
+    {
+        Image image;
+        Assembler as(image);
+        as.Emit("B", "far");
+        image.Space(std::to_string(1 << 25));
+        EXPECT_THROW(as.Label("far"), std::runtime_error);         // 1 << 25 ahead
+    }
+    {
+        Image image;
+        Assembler as(image);
+        as.Label("back");
+        image.Space(std::to_string((1 << 25) - 4));
+        EXPECT_NO_THROW(as.Emit("B", "back"));                      // 1 << 25 behind
+        EXPECT_THROW(as.Emit("B", "back"), std::runtime_error);
+    }
+    {
+        Image image;
+        Assembler as(image);
+        image.Space(std::to_string(1 << 26));
+        as.Label("high");
+        EXPECT_THROW(as.Emit("J", "high"), std::runtime_error);
+        EXPECT_THROW(as.Emit("J", "6"), std::runtime_error);
+    }
+    {
+        Image image;
+        Assembler as(image);
+        image.Switch(Section::DATA);
+        image.Data(sizeof(BYTE), "1");
+        as.Label("odd");
+        image.Switch(Section::TEXT);
+        as.Emit("J", "odd");
+        EXPECT_THROW(as.Finish(), std::runtime_error);
+    }
+    {
+        Image image;
+        Assembler as(image);
+        as.Emit("B", "nowhere");
+        EXPECT_THROW(as.Finish(), std::runtime_error);
+    }
+}
+
+TEST(AssemblerTest, Address_forms_encode) {
+    Image image;
+    Assembler as(image);
+    as.Emit("LB", "R1", "[R2]");
+    as.Emit("LW", "R1", "[SP+8]");
+    as.Emit("SB", "R1", "[R2-4]");
+    as.Emit("LW", "R1", "[R2+8191]");
+    as.Emit("LW", "R1", "[R2-8192]");
+    as.Emit("LW", "R1", "[R2+R4]");
+    as.Emit("LW", "R1", "[R2+R4<<2]");
+    as.Emit("LHU", "R5", "[R2],4");
+    as.Emit("SW", "R1", "[R2],-4");
+    as.Finish();
+
+    const std::vector<WORD> expected = {
+        EncodeImm16(Instruction::LB, Register::R1, Register::R2, AddressOffset(0)),
+        EncodeImm16(Instruction::LW, Register::R1, Register::SP, AddressOffset(8)),
+        EncodeImm16(Instruction::SB, Register::R1, Register::R2, AddressOffset(-4)),
+        EncodeImm16(Instruction::LW, Register::R1, Register::R2, AddressOffset(8191)),
+        EncodeImm16(Instruction::LW, Register::R1, Register::R2, AddressOffset(-8192)),
+        EncodeImm16(Instruction::LW, Register::R1, Register::R2, AddressIndexed(Register::R4, 0)),
+        EncodeImm16(Instruction::LW, Register::R1, Register::R2, AddressIndexed(Register::R4, 2)),
+        EncodeImm16(Instruction::LHU, Register::R5, Register::R2, AddressPostIncrement(4)),
+        EncodeImm16(Instruction::SW, Register::R1, Register::R2, AddressPostIncrement(-4)),
+    };
+    EXPECT_EQ(Words(image), expected);
+
+    for (const char* address : { "[R2+R4<<4]", "[R2+8192]", "[R2-8193]", "[R2],8192", "[R9]", "R2" })
+        EXPECT_THROW(as.Emit("LW", "R1", address), std::runtime_error) << address;
+}
+
+// The guest sets up its own vector table and timer and the handler reads its cause, all
+// through system register operands
+TEST(AssemblerTest, System_registers_run_a_timer_handler) {
+    Image image;
+    Assembler as(image);
+    as.Emit("ADDI", "VB", "RZ", "0x400");
+    as.Emit("ADDI", "R1", "RZ", "%lo:handler");
+    as.Emit("SW", "R1", "[VB+12]");             // Interrupt::Timer
+    as.Emit("ORI", "FLAGS", "FLAGS", "16");     // Flag::InterruptEnable
+    as.Emit("ADDI", "TIMER", "RZ", "3");
+    as.Label("loop");
+    as.Emit("CMPI", "R2", "3");
+    as.Emit("BNE", "loop");
+    as.Emit("HALT");
+    as.Label("handler");
+    as.Emit("ADDI", "R2", "R2", "1");
+    as.Emit("ADDI", "R3", "ECAUSE", "0");
+    as.Emit("ADDI", "TIMER", "RZ", "3");
+    as.Emit("RETI");
+    as.Finish();
+
+    std::vector<WORD> words = Words(image);
+    RAM ram{ 4096 };
+    memcpy(ram.Data(0, static_cast<WORD>(words.size() * sizeof(WORD))), words.data(), words.size() * sizeof(WORD));
+    Core core{ ram };
+    core.Run(1000);
+
+    EXPECT_TRUE(core.Halted());
+    EXPECT_GE(core.Reg(Register::R2), 3u);     // the last tick may land after the compare
+    EXPECT_EQ(core.Reg(Register::R3), static_cast<WORD>(Interrupt::Timer));
+    EXPECT_EQ(core.Reg(Register::VB), 0x400u);
+    EXPECT_EQ(ram.ReadWord(0x400 + 12), 0x20u);
+}
+
+TEST(PredecodeTest, Flags_overwritten_before_use_are_dead) {
+    Block block{ 0, {} };
+    for (WORD instruction : {
+        Encode(Instruction::ADD, Register::R1, Register::R2, Register::R3),         // dead, rewritten by ORI and ADDI
+        EncodeImm16(Instruction::ORI, Register::R1, Register::R1, 1),               // dead
+        EncodeImm16(Instruction::ADDI, Register::R2, Register::R2, 1),              // C and V survive SHLI
+        EncodeImm16(Instruction::SHLI, Register::R2, Register::R2, 1),
+        Encode(Instruction::SW, Register::R1, Register::R2),                        // may trap, reads all flags
+        EncodeImm16(Instruction::XORI, Register::R3, Register::R1, 1),              // dead, rewritten by CMPI
+        EncodeImm16(Instruction::CMPI, Register::R1, Register::RZ, 3),
+        EncodeJ(Instruction::BEQ, 8),
+    })
+    {
+        DecodedInstruction decoded;
+        ASSERT_TRUE(Decode(instruction, decoded));
+        block.code.push_back(decoded);
+    }
+
+    ElideDeadFlags(block);
+
+    const bool expected[] = { false, false, true, true, false, false, true, false };
+    for (size_t i = 0; i < block.code.size(); ++i)
+        EXPECT_EQ(block.code[i].set_flags, expected[i]) << "instruction " << i;
+    EXPECT_TRUE(EndsBlock(block.code[7]));
+    EXPECT_FALSE(EndsBlock(block.code[4]));
+}
+
+// Random programs with loops, traps, timer interrupts and self modifying stores.
+// Run (predecoded blocks, dead flags elided) must match stepping one instruction at a time.
+template<typename CoreType>
+static void RunDifferential(uint32_t seed)
+{
+    static constexpr WORD kMem      = 4096;
+    static constexpr WORD kHandler  = 0x800;
+    static constexpr WORD kVectors  = 0xC00;
+    static constexpr uint64_t kBudget = 3000;
+
+    std::mt19937 rng{ seed };
+    auto pick = [&](uint32_t n) { return static_cast<uint32_t>(rng() % n); };
+    auto reg = [&]() { return static_cast<Register>(1 + pick(6)); };
+    auto src = [&]() { return pick(8) == 0 ? Register::FLAGS : static_cast<Register>(pick(7)); };
+
+    const Instruction alu[] = { Instruction::ADD, Instruction::SUB, Instruction::SHL, Instruction::SHR,
+                                Instruction::OR, Instruction::AND, Instruction::XOR };
+    const Instruction alui[] = { Instruction::ADDI, Instruction::SUBI, Instruction::SHLI, Instruction::SHRI,
+                                 Instruction::ORI, Instruction::ANDI, Instruction::XORI };
+    const Instruction branch[] = { Instruction::B, Instruction::BEQ, Instruction::BNE, Instruction::BGT,
+                                   Instruction::BGE, Instruction::BLT, Instruction::BLE };
+    const Instruction memory[] = { Instruction::LB, Instruction::LBU, Instruction::LH, Instruction::LW,
+                                   Instruction::SB, Instruction::SH, Instruction::SW };
+
+    std::vector<WORD> program;
+    WORD length = 32 + pick(160);
+    while (program.size() < length)
+    {
+        switch (pick(10))
+        {
+        case 0: case 1: case 2:
+            program.push_back(Encode(alu[pick(7)], reg(), src(), src()));
+            break;
+        case 3: case 4:
+            program.push_back(EncodeImm16(alui[pick(7)], reg(), src(), static_cast<HWORD>(rng())));
+            break;
+        case 5:
+            program.push_back(pick(2) ? Encode(Instruction::CMP, src(), src())
+                                      : EncodeImm16(Instruction::CMPI, src(), Register::RZ, static_cast<HWORD>(pick(8))));
+            break;
+        case 6:
+            program.push_back(EncodeJ(branch[pick(7)], static_cast<WORD>((static_cast<int>(pick(17)) - 8) * 4)));
+            break;
+        case 7: case 8:
+            program.push_back(EncodeImm16(Instruction::ANDI, Register::R6, src(), 0x7FC));
+            program.push_back(Encode(memory[pick(7)], reg(), Register::R6));
+            break;
+        default:
+            program.push_back(Encode(pick(2) ? Instruction::PUSH : Instruction::POP, reg()));
+            break;
+        }
+    }
+    program.push_back(Encode(Instruction::HALT));
+
+    auto setup = [&](RAM& ram, CoreType& core) {
+        for (size_t i = 0; i < program.size(); ++i)
+            ram.WriteWord(i * sizeof(WORD), program[i]);
+        for (WORD i = 0; i < static_cast<WORD>(Interrupt::__NUM); ++i)
+            ram.WriteWord(kVectors + i * sizeof(WORD), kHandler);
+        ram.WriteWord(kHandler, EncodeImm16(Instruction::ADDI, Register::R5, Register::R5, 1));
+        ram.WriteWord(kHandler + 4, EncodeImm16(Instruction::ADDI, Register::TIMER, Register::RZ, 37));
+        ram.WriteWord(kHandler + 8, EncodeImm16(Instruction::ADDI, Register::RA, Register::RZ, 0));
+        ram.WriteWord(kHandler + 12, Encode(Instruction::RETI));
+
+        core.Reg(Register::SP) = 0x800;
+        core.Reg(Register::VB) = kVectors;
+        core.Reg(Register::TIMER) = 1 + pick(50);
+        core.SetFlag(Flag::InterruptEnable);
+    };
+
+    uint32_t state = rng();
+    RAM ram{ kMem }, ref_ram{ kMem };
+    CoreType core{ ram }, ref{ ref_ram };
+    rng.seed(state);
+    setup(ram, core);
+    rng.seed(state);
+    setup(ref_ram, ref);
+
+    EXPECT_EQ(core.Run(kBudget), [&] {
+        while (ref.Retired() < kBudget && ref.Step() && ref.Waiting() == Wait::None) {}
+        return ref.Retired();
+    }());
+
+    for (size_t r = 0; r < static_cast<size_t>(Register::__NUM); ++r)
+        EXPECT_EQ(core.Reg(static_cast<Register>(r)), ref.Reg(static_cast<Register>(r))) << "seed " << seed << " register " << r;
+    EXPECT_EQ(core.Halted(), ref.Halted()) << "seed " << seed;
+    EXPECT_EQ(core.Waiting(), ref.Waiting()) << "seed " << seed;
+    EXPECT_EQ(::memcmp(ram.Data(0, kMem), ref_ram.Data(0, kMem), kMem), 0) << "seed " << seed;
+}
+
+TEST(PredecodeTest, Block_engine_matches_single_step) {
+    for (uint32_t seed = 1; seed <= 300; ++seed)
+    {
+        RunDifferential<FlatCore>(seed);
+        RunDifferential<Core>(seed);
+    }
+}
+
+TEST(PredecodeTest, Trace_forwards_stores_and_folds_constants) {
+    std::vector<TraceOp> code;
+    WORD ip = 0x100;
+    for (WORD instruction : {
+        EncodeImm16(Instruction::LUI, Register::R1, Register::RZ, 0x1234),
+        EncodeImm16(Instruction::ORI, Register::R1, Register::R1, 0x5678),                         // dead, ADD rewrites
+        Encode(Instruction::ADD, Register::R2, Register::R2, Register::R1),
+        EncodeImm16(Instruction::SW, Register::R2, Register::R3, static_cast<HWORD>(AddressOffset(8))),
+        EncodeImm16(Instruction::LW, Register::R4, Register::R3, static_cast<HWORD>(AddressOffset(8))),  // from R2
+        EncodeImm16(Instruction::LW, Register::R5, Register::R3, static_cast<HWORD>(AddressOffset(12))),
+        EncodeImm16(Instruction::ADDI, Register::R3, Register::R3, 4),                             // live, the LW may trap
+        EncodeImm16(Instruction::LW, Register::R6, Register::R3, static_cast<HWORD>(AddressOffset(8))),  // base moved
+        EncodeImm16(Instruction::CMPI, Register::R3, Register::RZ, 64),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-40)),
+    })
+    {
+        DecodedInstruction decoded;
+        ASSERT_TRUE(Decode(instruction, decoded));
+        code.push_back(TraceOp{ decoded, ip });
+        ip += sizeof(WORD);
+    }
+    WORD lui = code[0].d.raw;
+
+    Trace trace = BuildTrace(0x100, std::move(code), true);
+
+    ASSERT_EQ(trace.code.size(), 9u);
+    EXPECT_EQ(trace.length, 10u);
+    EXPECT_EQ(trace.pages, std::vector<WORD>{ 0 });
+
+    const TraceOp& constant = trace.code[0];
+    EXPECT_EQ(constant.kind, TraceOp::Kind::Folded);
+    EXPECT_EQ(constant.ip, 0x104u);
+    EXPECT_EQ(constant.folded, lui);
+    EXPECT_EQ(constant.d.r2, Register::RZ);
+    EXPECT_EQ(constant.d.imm, 0x12345678u);
+    EXPECT_EQ(constant.next, 0x108u);
+
+    EXPECT_EQ(trace.code[3].kind, TraceOp::Kind::Forwarded);
+    EXPECT_EQ(trace.code[3].d.r3, Register::R2);
+    EXPECT_EQ(trace.code[4].kind, TraceOp::Kind::Plain);
+    EXPECT_EQ(trace.code[6].kind, TraceOp::Kind::Plain);
+    EXPECT_FALSE(constant.d.set_flags);
+    EXPECT_TRUE(trace.code[5].d.set_flags);
+    EXPECT_EQ(trace.code[8].next, 0x100u);
+
+    Trace device = BuildTrace(0x100, trace.code, false);
+    EXPECT_EQ(device.code[3].kind, TraceOp::Kind::Forwarded) << "already forwarded ops stay so";
+}
+
+// A hot loop whose inner branch alternates leaves its trace every other pass, and a timer
+// interrupt cuts into it. Run must still match stepping, down to the memory counters.
+TEST(PredecodeTest, Hot_loop_trace_matches_single_step) {
+    static constexpr WORD kMem = 0x3000;
+    const std::vector<WORD> program = {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::RZ, 300),
+        EncodeImm16(Instruction::LUI, Register::R2, Register::RZ, 0x1234),                          // loop:
+        EncodeImm16(Instruction::ORI, Register::R2, Register::R2, 0x5678),
+        Encode(Instruction::ADD, Register::R3, Register::R3, Register::R2),
+        EncodeImm16(Instruction::SW, Register::R3, Register::R7, static_cast<HWORD>(AddressOffset(0x40))),
+        EncodeImm16(Instruction::ANDI, Register::R4, Register::R1, 1),
+        EncodeJ(Instruction::BEQ, 8),
+        EncodeImm16(Instruction::ADDI, Register::R5, Register::R5, 1),
+        Encode(Instruction::XOR, Register::R6, Register::R6, Register::R3),
+        EncodeImm16(Instruction::LW, Register::R8, Register::R7, static_cast<HWORD>(AddressOffset(0x40))),
+        Encode(Instruction::ADD, Register::R6, Register::R6, Register::R8),
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-48)),
+        Encode(Instruction::HALT),
+    };
+
+    auto setup = [&](RAM& ram, ProfilingCore& core) {
+        for (size_t i = 0; i < program.size(); ++i)
+            ram.WriteWord(i * sizeof(WORD), program[i]);
+        ram.WriteWord(0xC00 + static_cast<WORD>(Interrupt::Timer) * sizeof(WORD), 0x800);
+        ram.WriteWord(0x800, EncodeImm16(Instruction::ADDI, Register::SP, Register::SP, 1));
+        ram.WriteWord(0x804, EncodeImm16(Instruction::ADDI, Register::TIMER, Register::RZ, 97));
+        ram.WriteWord(0x808, Encode(Instruction::RETI));
+
+        core.Reg(Register::R7) = 0x2000;         // off the code page, stores there drop no blocks
+        core.Reg(Register::VB) = 0xC00;
+        core.Reg(Register::TIMER) = 97;
+        core.SetFlag(Flag::InterruptEnable);
+    };
+
+    RAM ram{ kMem }, ref_ram{ kMem };
+    ProfilingCore core{ ram }, ref{ ref_ram };
+    setup(ram, core);
+    setup(ref_ram, ref);
+
+    core.Run(100000);
+    while (ref.Step()) {}
+
+    EXPECT_TRUE(core.Halted());
+    EXPECT_EQ(core.Retired(), ref.Retired());
+    for (size_t r = 0; r < static_cast<size_t>(Register::__NUM); ++r)
+        EXPECT_EQ(core.Reg(static_cast<Register>(r)), ref.Reg(static_cast<Register>(r))) << "register " << r;
+    EXPECT_GT(core.Reg(Register::SP), 30u);
+    EXPECT_EQ(::memcmp(ram.Data(0, kMem), ref_ram.Data(0, kMem), kMem), 0);
+    EXPECT_EQ(core.Instrumentation().Loads(), ref.Instrumentation().Loads());
+    EXPECT_EQ(core.Instrumentation().Stores(), ref.Instrumentation().Stores());
+    EXPECT_EQ(core.Instrumentation().Retired(Instruction::LUI), ref.Instrumentation().Retired(Instruction::LUI));
+}
+
+struct ShivApiTest : ::testing::Test {
+    static constexpr WORD kDevice = 0x10000;
+
+    std::vector<uint8_t> host = std::vector<uint8_t>(0x8000);
+    shiv_machine* machine = shiv_create(host.data(), host.size());
+
+    ~ShivApiTest() override { shiv_destroy(machine); }
+
+    void Load(WORD addr, std::initializer_list<WORD> program) {
+        for (WORD instruction : program)
+        {
+            ::memcpy(host.data() + addr, &instruction, sizeof(WORD));
+            addr += sizeof(WORD);
+        }
+        shiv_flush_code(machine);
+    }
+
+    WORD Get(shiv_register reg) {
+        uint32_t value = 0;
+        EXPECT_EQ(shiv_get_register(machine, reg, &value), SHIV_OK);
+        return value;
+    }
+};
+
+// Records stores, loads return the offset. Offset 0xC fails, offset 0x8 calls back into
+// the machine.
+struct TestDevice {
+    shiv_machine* machine{ nullptr };
+    WORD last_offset{ 0 };
+    WORD last_value{ 0 };
+    shiv_status nested{ SHIV_OK };
+
+    static int Read(void*, uint32_t offset, uint32_t, uint32_t* value) {
+        *value = offset;
+        return offset == 0xC ? 1 : 0;
+    }
+
+    static int Write(void* context, uint32_t offset, uint32_t, uint32_t value) {
+        auto* device = static_cast<TestDevice*>(context);
+        device->last_offset = offset;
+        device->last_value = value;
+        if (offset == 0x8)
+        {
+            device->nested = shiv_run(device->machine, 1, nullptr);
+            shiv_set_register(device->machine, SHIV_REG_R8, 99);
+        }
+        return 0;
+    }
+};
+
+TEST_F(ShivApiTest, Guest_runs_in_the_host_buffer) {
+    ASSERT_NE(machine, nullptr);
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),
+        EncodeImm16(Instruction::SW, Register::R1, Register::RZ, AddressOffset(0x100)),
+        Encode(Instruction::HALT),
+    });
+    ASSERT_EQ(shiv_set_register(machine, SHIV_REG_R1, 41), SHIV_OK);
+
+    uint64_t retired = 0;
+    EXPECT_EQ(shiv_run(machine, 100, &retired), SHIV_HALTED);
+    EXPECT_EQ(retired, 3u);
+    EXPECT_EQ(host[0x100], 42);
+    EXPECT_EQ(shiv_run(machine, 100, &retired), SHIV_HALTED);
+    EXPECT_EQ(retired, 0u);
+
+    size_t size = 0;
+    EXPECT_EQ(shiv_memory(machine, &size), host.data());
+    EXPECT_EQ(size, host.size());
+}
+
+TEST_F(ShivApiTest, Run_stops_at_budget_or_trap) {
+    Load(0, {
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),
+        EncodeJ(Instruction::B, static_cast<WORD>(-8)),
+    });
+
+    uint64_t retired = 0;
+    EXPECT_EQ(shiv_run(machine, 1001, &retired), SHIV_OK);
+    EXPECT_EQ(retired, 1001u);
+    EXPECT_EQ(Get(SHIV_REG_R1), 501u);
+
+    Load(0, { EncodeImm16(Instruction::LW, Register::R1, Register::RZ, AddressOffset(-4)) });
+    ASSERT_EQ(shiv_set_register(machine, SHIV_REG_IP, 0), SHIV_OK);
+    EXPECT_EQ(shiv_run(machine, 100, &retired), SHIV_TRAPPED);
+    EXPECT_EQ(retired, 0u);
+    EXPECT_EQ(Get(SHIV_REG_ECAUSE), static_cast<WORD>(Interrupt::MemoryFault));
+    EXPECT_EQ(Get(SHIV_REG_EADDR), 0xFFFF'FFFCu);
+}
+
+TEST_F(ShivApiTest, Mmio_loads_and_stores_reach_the_device) {
+    TestDevice device{ machine };
+    ASSERT_EQ(shiv_map_mmio(machine, kDevice, 0x10, TestDevice::Read, TestDevice::Write, &device), SHIV_OK);
+    Load(0, {
+        EncodeImm16(Instruction::LUI, Register::R2, Register::RZ, kDevice >> 16),
+        EncodeImm16(Instruction::SH, Register::R1, Register::R2, AddressOffset(6)),
+        EncodeImm16(Instruction::LW, Register::R3, Register::R2, AddressOffset(4)),
+        EncodeImm16(Instruction::LBU, Register::R4, Register::R2, AddressOffset(3)),
+        EncodeImm16(Instruction::SW, Register::R1, Register::R2, AddressOffset(8)),
+        EncodeImm16(Instruction::LW, Register::R5, Register::R2, AddressOffset(0x10)),
+    });
+    ASSERT_EQ(shiv_set_register(machine, SHIV_REG_R1, 0x1234), SHIV_OK);
+
+    EXPECT_EQ(shiv_run(machine, 100, nullptr), SHIV_TRAPPED);
+    EXPECT_EQ(Get(SHIV_REG_R3), 4u);
+    EXPECT_EQ(Get(SHIV_REG_R4), 3u);
+    EXPECT_EQ(device.last_offset, 8u);
+    EXPECT_EQ(device.last_value, 0x1234u);
+    EXPECT_EQ(device.nested, SHIV_ERR_BUSY);
+    EXPECT_EQ(Get(SHIV_REG_R8), 99u);
+    EXPECT_EQ(Get(SHIV_REG_EADDR), kDevice + 0x10);
+}
+
+TEST_F(ShivApiTest, Failing_device_access_is_a_memory_fault) {
+    TestDevice device{ machine };
+    ASSERT_EQ(shiv_map_mmio(machine, kDevice, 0x10, TestDevice::Read, nullptr, &device), SHIV_OK);
+    Load(0, {
+        EncodeImm16(Instruction::LUI, Register::R2, Register::RZ, kDevice >> 16),
+        EncodeImm16(Instruction::LW, Register::R3, Register::R2, AddressOffset(0xC)),
+    });
+
+    EXPECT_EQ(shiv_run(machine, 100, nullptr), SHIV_TRAPPED);
+    EXPECT_EQ(Get(SHIV_REG_ECAUSE), static_cast<WORD>(Interrupt::MemoryFault));
+    EXPECT_EQ(Get(SHIV_REG_EADDR), kDevice + 0xC);
+}
+
+TEST_F(ShivApiTest, Mmio_is_reached_through_page_tables) {
+    static constexpr WORD kDir = 0x1000, kTable = 0x2000;
+    TestDevice device{ machine };
+    ASSERT_EQ(shiv_map_mmio(machine, kDevice, 0x1000, TestDevice::Read, TestDevice::Write, &device), SHIV_OK);
+
+    const WORD tables[][2] = {
+        { kDir, kTable | Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE },
+        { kTable + 0 * 4, 0x3000 | Mmu::PTE_PRESENT },
+        { kTable + 5 * 4, kDevice | Mmu::PTE_PRESENT | Mmu::PTE_WRITABLE },
+        { kTable + 6 * 4, kDevice | Mmu::PTE_PRESENT },
+    };
+    for (const auto& entry : tables)
+        ASSERT_EQ(shiv_write_memory(machine, entry[0], &entry[1], sizeof(WORD)), SHIV_OK);
+
+    Load(0x3000, {
+        EncodeImm16(Instruction::SW, Register::R1, Register::R2, AddressOffset(0x20)),
+        EncodeImm16(Instruction::LW, Register::R3, Register::R2, AddressOffset(0x24)),
+        EncodeImm16(Instruction::SW, Register::R1, Register::R2, AddressOffset(0x1000)),
+    });
+    shiv_set_register(machine, SHIV_REG_R1, 7);
+    shiv_set_register(machine, SHIV_REG_R2, 0x5000);
+    shiv_set_register(machine, SHIV_REG_PTB, kDir);
+
+    EXPECT_EQ(shiv_run(machine, 100, nullptr), SHIV_TRAPPED);
+    EXPECT_EQ(device.last_offset, 0x20u);
+    EXPECT_EQ(device.last_value, 7u);
+    EXPECT_EQ(Get(SHIV_REG_R3), 0x24u);
+    EXPECT_EQ(Get(SHIV_REG_ECAUSE), static_cast<WORD>(Interrupt::PageFault));
+    EXPECT_EQ(Get(SHIV_REG_EADDR), 0x6000u);
+}
+
+TEST_F(ShivApiTest, Limits_stop_run_with_a_status) {
+    Load(0, {
+        EncodeImm16(Instruction::SW, Register::R1, Register::RZ, AddressOffset(0x100)),
+        EncodeImm16(Instruction::ADDI, Register::R1, Register::R1, 1),
+        EncodeImm16(Instruction::CMPI, Register::R1, Register::RZ, 100),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-16)),
+        Encode(Instruction::HALT),
+    });
+
+    shiv_limits limits{ 40, SHIV_UNLIMITED, 4 };
+    ASSERT_EQ(shiv_set_limits(machine, &limits), SHIV_OK);
+
+    uint64_t retired = 0;
+    shiv_usage usage{};
+    EXPECT_EQ(shiv_run(machine, 1000, &retired), SHIV_LIMIT_INSTRUCTIONS);
+    EXPECT_EQ(retired, 40u);
+    ASSERT_EQ(shiv_get_usage(machine, &usage), SHIV_OK);
+    EXPECT_EQ(usage.instructions, 40u);
+    EXPECT_EQ(usage.pages, 1u);
+
+    limits.instructions = SHIV_UNLIMITED;
+    ASSERT_EQ(shiv_set_limits(machine, &limits), SHIV_OK);
+    EXPECT_EQ(shiv_run(machine, 1000, &retired), SHIV_HALTED);
+    EXPECT_EQ(retired, 361u);
+    EXPECT_EQ(shiv_get_usage(machine, &usage), SHIV_OK);
+    EXPECT_EQ(usage.pages, 1u);
+    EXPECT_GT(usage.nanoseconds, 0u);
+    EXPECT_EQ(shiv_set_limits(machine, nullptr), SHIV_ERR_ARGUMENT);
+}
+
+TEST_F(ShivApiTest, Bad_arguments_are_reported) {
+    uint32_t value;
+    EXPECT_EQ(shiv_get_register(machine, SHIV_REG_COUNT, &value), SHIV_ERR_ARGUMENT);
+    EXPECT_EQ(shiv_get_register(nullptr, SHIV_REG_R1, &value), SHIV_ERR_ARGUMENT);
+    EXPECT_EQ(shiv_raise_interrupt(machine, SHIV_INT_PAGE_FAULT), SHIV_ERR_ARGUMENT);
+    EXPECT_EQ(shiv_write_memory(machine, 0x7FFE, &value, sizeof(value)), SHIV_ERR_RANGE);
+    EXPECT_EQ(shiv_map_mmio(machine, 0x4000, 0x10, nullptr, nullptr, nullptr), SHIV_ERR_RANGE);
+    EXPECT_EQ(shiv_map_mmio(machine, kDevice, 0, nullptr, nullptr, nullptr), SHIV_ERR_RANGE);
+    EXPECT_EQ(shiv_map_mmio(machine, kDevice, 0x100, nullptr, nullptr, nullptr), SHIV_OK);
+    EXPECT_EQ(shiv_map_mmio(machine, kDevice - 0x10, 0x200, nullptr, nullptr, nullptr), SHIV_ERR_RANGE);
+    EXPECT_EQ(shiv_unmap_mmio(machine, kDevice), SHIV_OK);
+    EXPECT_EQ(shiv_unmap_mmio(machine, kDevice), SHIV_ERR_RANGE);
+    EXPECT_EQ(shiv_create(nullptr, (size_t{ 1 } << 32) + 1), nullptr);
+}
+
+TEST(ShivApiThreadTest, Machines_run_concurrently) {
+    static constexpr size_t kMachines = 16;
+    const WORD program[] = {
+        Encode(Instruction::ADD, Register::R2, Register::R2, Register::R1),
+        EncodeImm16(Instruction::SUBI, Register::R1, Register::R1, 1),
+        EncodeJ(Instruction::BNE, static_cast<WORD>(-12)),
+        Encode(Instruction::HALT),
+    };
+
+    std::vector<shiv_machine*> machines;
+    for (size_t i = 0; i < kMachines; ++i)
+    {
+        machines.push_back(shiv_create(nullptr, 4096));
+        ASSERT_EQ(shiv_write_memory(machines.back(), 0, program, sizeof(program)), SHIV_OK);
+        shiv_set_register(machines.back(), SHIV_REG_R1, static_cast<uint32_t>(1000 + i));
+    }
+
+    std::vector<std::thread> threads;
+    for (shiv_machine* machine : machines)
+        threads.emplace_back([machine] { while (shiv_run(machine, 100, nullptr) == SHIV_OK) {} });
+    for (std::thread& thread : threads)
+        thread.join();
+
+    for (size_t i = 0; i < kMachines; ++i)
+    {
+        uint32_t sum = 0;
+        WORD n = static_cast<WORD>(1000 + i);
+        shiv_get_register(machines[i], SHIV_REG_R2, &sum);
+        EXPECT_EQ(sum, n * (n + 1) / 2);
+        shiv_destroy(machines[i]);
+    }
+}
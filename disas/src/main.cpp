@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "encoding.h"
+
+//  Streams an image of instruction words to text, one line per word:
+//
+//      00000100:  04221800  ADD R1, R2, R3
+//
+//  The image is read and written in large chunks and every line is formatted in place,
+//  so memory use stays fixed however big the image is. Trailing bytes short of a word
+//  come out as .byte.
+//
+//      disas [--base ADDR] [image]         # stdin without an image
+
+static constexpr size_t kChunk = 256 * 1024;
+static constexpr size_t kLineMax = 8 + 3 + 8 + 2 + DISASSEMBLY_MAX + 1;
+
+static bool WriteAll(const char* data, size_t size)
+{
+    while (size != 0)
+    {
+        ssize_t n = ::write(STDOUT_FILENO, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Fills buffer unless the input ends first, returns the bytes read or -1
+static ssize_t ReadFull(int fd, BYTE* buffer, size_t size)
+{
+    size_t filled = 0;
+    while (filled < size)
+    {
+        ssize_t n = ::read(fd, buffer + filled, size - filled);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+
+        filled += static_cast<size_t>(n);
+    }
+    return static_cast<ssize_t>(filled);
+}
+
+static char* Line(char* out, WORD addr, WORD instruction)
+{
+    out = disassembly::Hex(out, addr);
+    out = disassembly::Text(out, ":  ");
+    out = disassembly::Hex(out, instruction);
+    out = disassembly::Text(out, "  ");
+    out += Disassemble(instruction, addr, out);
+    *out++ = '\n';
+    return out;
+}
+
+int main(int argc, char** argv)
+{
+    WORD base = 0;
+    const char* path = nullptr;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        if (option == "--base" && i + 1 < argc)
+            base = static_cast<WORD>(std::strtoul(argv[++i], nullptr, 0));
+        else if (!path && option[0] != '-')
+            path = argv[i];
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--base ADDR] [image]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    int fd = path ? ::open(path, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0)
+    {
+        std::fprintf(stderr, "%s: %s\n", path, std::strerror(errno));
+        return 1;
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    std::vector<BYTE> input(kChunk);
+    std::vector<char> output(kChunk / sizeof(WORD) * kLineMax);
+    WORD addr = base;
+
+    for (;;)
+    {
+        ssize_t n = ReadFull(fd, input.data(), input.size());
+        if (n < 0)
+        {
+            std::fprintf(stderr, "%s: %s\n", path ? path : "stdin", std::strerror(errno));
+            return 1;
+        }
+
+        size_t size = static_cast<size_t>(n);
+        char* out = output.data();
+        size_t i = 0;
+        for (; i + sizeof(WORD) <= size; i += sizeof(WORD), addr += sizeof(WORD))
+        {
+            WORD instruction;
+            ::memcpy(&instruction, input.data() + i, sizeof(WORD));
+            out = Line(out, addr, instruction);
+        }
+
+        // Only the last chunk can end inside a word
+        for (; i < size; ++i, ++addr)
+        {
+            out = disassembly::Hex(out, addr);
+            out = disassembly::Text(out, ":  ");
+            out = disassembly::Hex(out, input[i], 2);
+            out = disassembly::Text(out, "        .byte 0x");
+            out = disassembly::Hex(out, input[i], 2);
+            *out++ = '\n';
+        }
+
+        if (!WriteAll(output.data(), static_cast<size_t>(out - output.data())))
+        {
+            std::fprintf(stderr, "write: %s\n", std::strerror(errno));
+            return 1;
+        }
+
+        if (size < input.size())
+            break;
+    }
+
+    return 0;
+}
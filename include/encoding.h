@@ -0,0 +1,437 @@
+#pragma once
+
+#include <array>
+#include <stddef.h>
+#include <string_view>
+
+#include "isa.h"
+
+//  Encoding and decoding of instruction words, shared by the assembler, the cores and
+//  disas. Everything is constexpr and driven by INSTRUCTION_SET, see isa.h for the
+//  formats.
+
+//  ======================= FIELDS ============================
+
+constexpr Instruction GetOpcode(WORD instruction)
+{
+    return static_cast<Instruction>(instruction >> 26);
+}
+
+constexpr Register GetR1(WORD instruction)
+{
+    return static_cast<Register>((instruction >> 21) & 0x1F);
+}
+
+constexpr Register GetR2(WORD instruction)
+{
+    return static_cast<Register>((instruction >> 16) & 0x1F);
+}
+
+constexpr Register GetR3(WORD instruction)
+{
+    return static_cast<Register>((instruction >> 11) & 0x1F);
+}
+
+constexpr HWORD GetImm16(WORD instruction)
+{
+    return static_cast<HWORD>(instruction & 0xFFFF);
+}
+
+constexpr WORD GetImm26(WORD instruction)
+{
+    return instruction & 0x3FFFFFF;
+}
+
+// Sign extended offset26 of a branch, relative to the next instruction
+constexpr WORD GetBranchOffset(WORD instruction)
+{
+    WORD imm26 = GetImm26(instruction);
+    return (imm26 & (1u << 25)) ? (imm26 | 0xFC000000u) : imm26;
+}
+
+constexpr bool IsBranch(Instruction op)
+{
+    return op >= Instruction::B && op <= Instruction::BLE;
+}
+
+// Whether an instruction word decodes: a defined opcode, register fields naming
+// registers, a legal address form and a legal register list
+constexpr bool IsValidInstruction(WORD instruction)
+{
+    Instruction op = GetOpcode(instruction);
+    int regs = RegisterOperands(op);
+    if (regs < 0)
+        return false;
+
+    const Register operands[] = { GetR1(instruction), GetR2(instruction), GetR3(instruction) };
+    for (int i = 0; i < regs; ++i)
+    {
+        if (operands[i] >= Register::__NUM)
+            return false;
+    }
+
+    if (IsLoadStore(op))
+        return IsValidAddress(instruction);
+    if (IsRegisterList(op))
+        return IsValidRegisterList(instruction);
+
+    return true;
+}
+
+//  ======================= ENCODING ==========================
+
+constexpr WORD Encode(Instruction op, Register r1 = Register::RZ, Register r2 = Register::RZ, Register r3 = Register::RZ)
+{
+    return (static_cast<WORD>(op) << 26) | (static_cast<WORD>(r1) << 21) | (static_cast<WORD>(r2) << 16) | (static_cast<WORD>(r3) << 11);
+}
+
+constexpr WORD EncodeImm16(Instruction op, Register r1, Register r2, HWORD imm)
+{
+    return Encode(op, r1, r2) | imm;
+}
+
+constexpr WORD EncodeJ(Instruction op, WORD offset)
+{
+    return (static_cast<WORD>(op) << 26) | (offset & 0x3FFFFFF);
+}
+
+//  ======================== NAMES ============================
+//  Mnemonics and register names are found through perfect hashes built at compile time.
+//  A name of up to eight characters is packed into a 64 bit key, one multiply and shift
+//  picks its slot and one compare confirms it. There is nothing to initialize at startup.
+
+constexpr uint64_t NameKey(std::string_view name)
+{
+    if (name.empty() || name.size() > sizeof(uint64_t))
+        return 0;
+
+    uint64_t key = 0;
+    for (size_t i = 0; i < name.size(); ++i)
+        key |= uint64_t{ static_cast<BYTE>(name[i]) } << (8 * i);
+    return key;
+}
+
+template<size_t BITS>
+struct NameTable
+{
+    static constexpr size_t SIZE = size_t{ 1 } << BITS;
+
+    uint64_t                    seed{ 0 };
+    std::array<uint64_t, SIZE>  keys{};
+    std::array<BYTE, SIZE>      values{};
+
+    constexpr size_t Slot(uint64_t key) const
+    {
+        return static_cast<size_t>((key * seed) >> (64 - BITS));
+    }
+
+    constexpr bool Find(std::string_view name, BYTE& value) const
+    {
+        uint64_t key = NameKey(name);
+        size_t slot = Slot(key);
+        value = values[slot];
+        return key != 0 && keys[slot] == key;
+    }
+};
+
+// Tries odd multipliers until every name lands in its own slot, seed stays 0 if none does
+template<size_t BITS, size_t N>
+constexpr NameTable<BITS> MakeNameTable(const std::array<const char*, N>& names, const std::array<BYTE, N>& values)
+{
+    NameTable<BITS> table;
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    for (int attempt = 0; attempt < 4096; ++attempt, seed += 0xD1B54A32D192ED04ull)
+    {
+        table = NameTable<BITS>{};
+        table.seed = seed | 1;
+
+        bool collided = false;
+        for (size_t i = 0; i < N && !collided; ++i)
+        {
+            uint64_t key = NameKey(names[i]);
+            size_t slot = table.Slot(key);
+            collided = table.keys[slot] != 0;
+            table.keys[slot] = key;
+            table.values[slot] = values[i];
+        }
+
+        if (!collided)
+            return table;
+    }
+    return NameTable<BITS>{};
+}
+
+namespace names
+{
+    constexpr size_t INSTRUCTIONS = sizeof(INSTRUCTION_SET) / sizeof(INSTRUCTION_SET[0]);
+    constexpr size_t REGISTERS = static_cast<size_t>(Register::__NUM);
+
+    constexpr std::array<const char*, INSTRUCTIONS> Mnemonics()
+    {
+        std::array<const char*, INSTRUCTIONS> names{};
+        for (size_t i = 0; i < INSTRUCTIONS; ++i)
+            names[i] = INSTRUCTION_SET[i].mnemonic;
+        return names;
+    }
+
+    constexpr std::array<BYTE, INSTRUCTIONS> Opcodes()
+    {
+        std::array<BYTE, INSTRUCTIONS> opcodes{};
+        for (size_t i = 0; i < INSTRUCTIONS; ++i)
+            opcodes[i] = static_cast<BYTE>(INSTRUCTION_SET[i].op);
+        return opcodes;
+    }
+
+    constexpr std::array<const char*, REGISTERS> Registers()
+    {
+        std::array<const char*, REGISTERS> names{};
+        for (size_t r = 0; r < REGISTERS; ++r)
+            names[r] = REGISTER_NAMES[r];
+        return names;
+    }
+
+    constexpr std::array<BYTE, REGISTERS> RegisterNumbers()
+    {
+        std::array<BYTE, REGISTERS> numbers{};
+        for (size_t r = 0; r < REGISTERS; ++r)
+            numbers[r] = static_cast<BYTE>(r);
+        return numbers;
+    }
+
+    inline constexpr NameTable<9> MNEMONIC_TABLE = MakeNameTable<9>(Mnemonics(), Opcodes());
+    inline constexpr NameTable<6> REGISTER_TABLE = MakeNameTable<6>(Registers(), RegisterNumbers());
+
+    static_assert(MNEMONIC_TABLE.seed != 0, "no perfect hash for the mnemonics, grow MNEMONIC_TABLE");
+    static_assert(REGISTER_TABLE.seed != 0, "no perfect hash for the registers, grow REGISTER_TABLE");
+}
+
+constexpr bool FindMnemonic(std::string_view name, Instruction& op)
+{
+    BYTE value = 0;
+    bool found = names::MNEMONIC_TABLE.Find(name, value);
+    op = static_cast<Instruction>(value);
+    return found;
+}
+
+constexpr bool FindRegister(std::string_view name, Register& reg)
+{
+    BYTE value = 0;
+    bool found = names::REGISTER_TABLE.Find(name, value);
+    reg = static_cast<Register>(value);
+    return found;
+}
+
+//  ===================== DISASSEMBLY =========================
+
+// Room Disassemble needs in its output, the longest text (PUSHM with all nine registers)
+// plus slack for the fixed width copies it formats with
+constexpr size_t DISASSEMBLY_MAX = 64;
+
+namespace disassembly
+{
+    // Names padded to a fixed width so they are copied with one store
+    struct Name
+    {
+        char    text[8]{};
+        size_t  length{ 0 };
+    };
+
+    constexpr Name MakeName(const char* text)
+    {
+        Name name;
+        while (text[name.length])
+        {
+            name.text[name.length] = text[name.length];
+            ++name.length;
+        }
+        return name;
+    }
+
+    constexpr std::array<Name, static_cast<size_t>(Register::__NUM)> MakeRegisterNames()
+    {
+        std::array<Name, static_cast<size_t>(Register::__NUM)> names{};
+        for (size_t r = 0; r < names.size(); ++r)
+            names[r] = MakeName(REGISTER_NAMES[r]);
+        return names;
+    }
+
+    constexpr std::array<Name, OPCODE_COUNT> MakeMnemonics()
+    {
+        std::array<Name, OPCODE_COUNT> names{};
+        for (const InstructionDefinition& def : INSTRUCTION_SET)
+            names[static_cast<size_t>(def.op)] = MakeName(def.mnemonic);
+        return names;
+    }
+
+    inline constexpr std::array<Name, static_cast<size_t>(Register::__NUM)> REGISTERS = MakeRegisterNames();
+    inline constexpr std::array<Name, OPCODE_COUNT> MNEMONICS = MakeMnemonics();
+
+    constexpr std::array<char, 512> MakeHexPairs()
+    {
+        std::array<char, 512> pairs{};
+        for (size_t i = 0; i < 256; ++i)
+        {
+            pairs[2 * i] = "0123456789abcdef"[i >> 4];
+            pairs[2 * i + 1] = "0123456789abcdef"[i & 0xF];
+        }
+        return pairs;
+    }
+
+    inline constexpr std::array<char, 512> HEX_PAIRS = MakeHexPairs();
+
+    template<size_t N>
+    constexpr char* Text(char* out, const char (&text)[N])
+    {
+        for (size_t i = 0; i + 1 < N; ++i)
+            out[i] = text[i];
+        return out + N - 1;
+    }
+
+    // Writes all eight bytes, advances by the name only
+    constexpr char* Copy(char* out, const Name& name)
+    {
+        for (size_t i = 0; i < sizeof(name.text); ++i)
+            out[i] = name.text[i];
+        return out + name.length;
+    }
+
+    constexpr char* Reg(char* out, Register reg)
+    {
+        return Copy(out, REGISTERS[static_cast<size_t>(reg)]);
+    }
+
+    constexpr char* Decimal(char* out, WORD value)
+    {
+        char digits[10] = {};
+        int n = 0;
+        do
+        {
+            digits[n++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+
+        while (n > 0)
+            *out++ = digits[--n];
+        return out;
+    }
+
+    constexpr char* Signed(char* out, WORD value)
+    {
+        if (value & 0x80000000u)
+        {
+            *out++ = '-';
+            value = 0u - value;
+        }
+        return Decimal(out, value);
+    }
+
+    // digits is even
+    constexpr char* Hex(char* out, WORD value, int digits = 8)
+    {
+        for (int shift = (digits - 2) * 4; shift >= 0; shift -= 8)
+        {
+            size_t byte = (value >> shift) & 0xFF;
+            *out++ = HEX_PAIRS[2 * byte];
+            *out++ = HEX_PAIRS[2 * byte + 1];
+        }
+        return out;
+    }
+
+    constexpr char* Address(char* out, WORD instruction)
+    {
+        out = Text(out, "[");
+        out = Reg(out, GetR2(instruction));
+
+        WORD offset = GetAddressOffset(instruction);
+        switch (GetAddressMode(instruction))
+        {
+        case AddressMode::Offset:
+            if (offset != 0)
+            {
+                *out++ = (offset & 0x80000000u) ? '-' : '+';
+                out = Decimal(out, (offset & 0x80000000u) ? 0u - offset : offset);
+            }
+            return Text(out, "]");
+        case AddressMode::Indexed:
+            out = Text(out, "+");
+            out = Reg(out, GetAddressIndex(instruction));
+            if (GetAddressShift(instruction) != 0)
+            {
+                out = Text(out, "<<");
+                out = Decimal(out, GetAddressShift(instruction));
+            }
+            return Text(out, "]");
+        default:
+            out = Text(out, "], ");
+            return Signed(out, offset);
+        }
+    }
+}
+
+// Assembler text of the instruction at ip into out, which must have room for
+// DISASSEMBLY_MAX bytes. The text is not terminated, returns its length. Words that do
+// not decode come out as .word.
+constexpr size_t Disassemble(WORD instruction, WORD ip, char* out)
+{
+    using namespace disassembly;
+
+    char* p = out;
+    if (!IsValidInstruction(instruction))
+    {
+        p = Text(p, ".word 0x");
+        p = Hex(p, instruction);
+        return static_cast<size_t>(p - out);
+    }
+
+    Instruction op = GetOpcode(instruction);
+    p = Copy(p, MNEMONICS[static_cast<size_t>(op)]);
+
+    switch (GetInstructionType(op))
+    {
+    case InstructionType::OP_R3:
+        p = Reg(Text(p, " "), GetR1(instruction));
+        p = Reg(Text(p, ", "), GetR2(instruction));
+        p = Reg(Text(p, ", "), GetR3(instruction));
+        break;
+    case InstructionType::OP_R2_IMM16:
+        p = Reg(Text(p, " "), GetR1(instruction));
+        p = Reg(Text(p, ", "), GetR2(instruction));
+        p = Decimal(Text(p, ", "), GetImm16(instruction));
+        break;
+    case InstructionType::OP_R2:
+        p = Reg(Text(p, " "), GetR1(instruction));
+        p = Text(p, ", ");
+        p = IsLoadStore(op) ? Address(p, instruction) : Reg(p, GetR2(instruction));
+        break;
+    case InstructionType::OP_R1_IMM16:
+        p = Reg(Text(p, " "), GetR1(instruction));
+        p = Decimal(Text(p, ", "), GetImm16(instruction));
+        break;
+    case InstructionType::OP_R1:
+        p = Reg(Text(p, " "), GetR1(instruction));
+        break;
+    case InstructionType::OP_J:
+        p = Text(p, " 0x");
+        p = Hex(p, IsBranch(op) ? ip + sizeof(WORD) + GetBranchOffset(instruction) : GetImm26(instruction));
+        break;
+    case InstructionType::OP_LIST:
+    {
+        p = Text(p, " {");
+        bool first = true;
+        for (WORD r = 0; r < static_cast<WORD>(Register::__NUM); ++r)
+        {
+            if (instruction & REGISTER_LIST & RegisterBit(static_cast<Register>(r)))
+            {
+                p = Reg(first ? p : Text(p, ", "), static_cast<Register>(r));
+                first = false;
+            }
+        }
+        p = Text(p, "}");
+        break;
+    }
+    default:
+        break;
+    }
+
+    return static_cast<size_t>(p - out);
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <array>
 #include <inttypes.h>
+#include <stddef.h>
 
 //  ======================= ARITHMETIC =======================
 //  ADD     R1, R2, R3          # R1 = R2 + R3
@@ -9,6 +11,28 @@
 //  SUBI    R1, R2, imm16       # R1 = R2 - imm16
 //  LUI     R1, imm16           # R1 = R2 - imm16
 //          R1, %hi(label)      # R1 = (address_of(label) << 16)
+//  ADC     R1, R2, R3          # R1 = R2 + R3 + C
+//  SBC     R1, R2, R3          # R1 = R2 - R3 - !C     # C = 1 means no borrow
+//
+//  =================== MULTIPLY/DIVIDE =======================
+//  MUL     R1, R2, R3          # R1 = (R2 * R3){31:0}
+//  MULH    R1, R2, R3          # R1 = (R2 * R3){63:32}  # Signed
+//  MULHU   R1, R2, R3          # R1 = (R2 * R3){63:32}  # Unsigned
+//  DIV     R1, R2, R3          # R1 = R2 / R3          # Signed, R2 / 0 = 0xFFFFFFFF
+//  DIVU    R1, R2, R3          # R1 = R2 / R3          # Unsigned, R2 / 0 = 0xFFFFFFFF
+//  REM     R1, R2, R3          # R1 = R2 % R3          # Signed, R2 % 0 = R2
+//  Multiply/divide update Z and N only, see cpu/include/alu.h for the corner cases.
+//
+//  ======================== PACKED ===========================
+//  ADDUSB  R1, R2, R3          # R1.b[i] = min(R2.b[i] + R3.b[i], 0xFF)
+//  SUBUSB  R1, R2, R3          # R1.b[i] = max(R2.b[i] - R3.b[i], 0)
+//  ADDUSH  R1, R2, R3          # R1.h[i] = min(R2.h[i] + R3.h[i], 0xFFFF)
+//  SUBUSH  R1, R2, R3          # R1.h[i] = max(R2.h[i] - R3.h[i], 0)
+//  CMPEQB  R1, R2, R3          # R1.b[i] = R2.b[i] == R3.b[i] ? 0xFF : 0
+//  FFZB    R1, R2              # R1 = index of the first zero byte of R2, 4 if none
+//  SHUFB   R1, R2, R3          # R1.b[i] = R3.b[i]{7} ? 0 : R2.b[R3.b[i]{1:0}]
+//  Lane 0 (b[0], h[0]) is the least significant, i.e. the lowest address of a LW.
+//  Packed instructions update Z and N from the whole result.
 //
 //  ======================== SHIFTS ===========================
 //  SHL     R1, R2, R3          # R1 = R2 << R3{4:0}
@@ -35,6 +59,19 @@
 //  SB      R1, [R2]            # RAM[R4] = R2  # Store byte
 //  SH      R1, [R2]            # RAM[R4] = R2  # Store half
 //  SW      R1, [R2]            # RAM[R4] = R2  # Store word
+//  Every load and store also takes the other address forms, bits 15..0 select which:
+//
+//          R1, [R2 + offset]   # 00 | offset{13:0}         # [R2] is offset 0
+//          R1, [R2 + R3 << s]  # 01 | R3{13:9} s{8:7} 0    # s = 0..3
+//          R1, [R2], offset    # 10 | offset{13:0}         # access [R2], then R2 += offset
+//                              # 11 is illegal
+//  offset is signed. A load whose post-increment base is also its destination keeps
+//  the loaded value. A faulting access changes no register.
+//  MEMCPY  R1, R2, R3          # RAM[R1 .. R1+R3) = RAM[R2 .. R2+R3), R1 += R3, R2 += R3, R3 = 0
+//  MEMSET  R1, R2, R3          # RAM[R1 .. R1+R3) = R2{7:0}, R1 += R3, R3 = 0
+//  MEMCPY copies in ascending order like a byte loop, so a destination just above the
+//  source repeats the pattern. Both run a page at a time and restart at the same IP
+//  until R3 is 0, every chunk retires once and may be interrupted or fault.
 //
 //  ====================== COMPARE ============================
 //  CMP     R1, R2              # R1 - R2, update flags
@@ -55,12 +92,35 @@
 //  CALL    label               # RA = IP; IP = IP + offset
 //  CALLR   R1                  # RA = IP; IP = R1
 //  RET                         # IP = RA
+//  RETI                        # IP = EIP; FLAGS = EFLAGS; RA = ERA  # Return from interrupt
 //
 // ====================== STACK ==============================
 //  PUSH    R1                  # SP = SP + 4; RAM[SP] = R1
 //  POP     R1                  # R1 = RAM[SP]; SP = SP - 4
+//  PUSHM   {R1, .., RA}        # SP = SP - 4 * n; RAM[SP + 4 * k] = k-th listed register
+//  POPM    {R1, .., RA}        # k-th listed register = RAM[SP + 4 * k]; SP = SP + 4 * n
+//  imm16 bit i lists register i, only R1..R8 and RA (bits 9..1) can be listed and registers
+//  go in ascending order, so PUSHM and POPM of the same list pair up. The whole frame is
+//  checked before anything moves, a faulting PUSHM/POPM changes nothing.
 //======================= MISC ===============================
 //  HALT                        # Stops execution
+//  WAIT                        # Sleeps until an interrupt is pending, then takes it if FLAGS.IE == 1
+//  WAIT retires before it sleeps and is a no-op when an interrupt is already pending, so a
+//  handler runs with EIP past it. A running TIMER expires at WAIT, the idle time is skipped.
+//
+//  ==================== INTERRUPTS ===========================
+//  Taking interrupt N:  EIP = IP; EFLAGS = FLAGS; ERA = RA; ECAUSE = N; FLAGS.IE = 0; IP = RAM[VB + 4 * N]
+//  Faults (MemoryFault, IllegalInstruction, PageFault) are taken before the faulting instruction retires, EIP points to it
+//  and EADDR holds the faulting address. A fault with FLAGS.IE == 0 halts the core.
+//  External interrupts are taken between instructions while FLAGS.IE == 1, EIP points to the next instruction.
+//  TIMER counts down once per retired instruction while non zero and raises Interrupt::Timer when it reaches 0.
+//  VB is a physical address. Handlers run in the address space of the interrupted code.
+//
+//  ====================== PAGING =============================
+//  PTB != 0 enables translation through the page directory at physical address PTB (see mmu.h).
+//  Any instruction writing PTB flushes the TLB. A missing or read-only mapping raises PageFault.
+//
+//  Branch offset26 is a signed byte offset from the next instruction, J/CALL offset26 is an absolute address.
 //
 //
 //               32 | 31| 30| 29| 28| 27| 26| 25| 24| 23| 22| 21| 20| 19| 18| 17| 16| 15| 14| 13| 12| 11| 10| 09| 08| 07| 06| 05| 04| 03| 02| 01| 00|
@@ -78,7 +138,9 @@
 //    OP_J          |                Opcode |                                                                                              offset26 |
 //                  +-----------------------+-------------------------------------------------------------------------------------------------------+
 //    OP            |                Opcode |-------------------------------------------------------------------------------------------------------|
-//                  +-----------------------+-------------------------------------------------------------------------------------------------------+
+//                  +-----------------------+---------------------------------------+---------------------------------------------------------------+
+//    OP_LIST       |                Opcode |---------------------------------------|                                                       reglist |
+//                  +-----------------------+---------------------------------------+---------------------------------------------------------------+
 //
 
 enum class Instruction : uint8_t
@@ -125,6 +187,27 @@ enum class Instruction : uint8_t
     PUSH,
     POP,
     HALT,
+    RETI,
+    MUL,
+    MULH,
+    MULHU,
+    DIV,
+    DIVU,
+    REM,
+    ADC,
+    SBC,
+    ADDUSB,
+    SUBUSB,
+    ADDUSH,
+    SUBUSH,
+    CMPEQB,
+    FFZB,
+    SHUFB,
+    MEMCPY,
+    MEMSET,
+    PUSHM,
+    POPM,
+    WAIT,
     __NUM
 };
 
@@ -136,7 +219,8 @@ enum class InstructionType : uint8_t
     OP_R1_IMM16,
     OP_R1,
     OP_J,
-    OP
+    OP,
+    OP_LIST
 };
 
 enum class Register: uint8_t
@@ -154,15 +238,43 @@ enum class Register: uint8_t
     IP,
     SP,
     FLAGS,
+    EIP,
+    EFLAGS,
+    ERA,
+    ECAUSE,
+    EADDR,
+    VB,
+    TIMER,
+    PTB,
     __NUM
 };
 
+constexpr const char* REGISTER_NAMES[] =
+{
+    "RZ", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "RA", "IP", "SP", "FLAGS",
+    "EIP", "EFLAGS", "ERA", "ECAUSE", "EADDR", "VB", "TIMER", "PTB"
+};
+
+static_assert(sizeof(REGISTER_NAMES) / sizeof(REGISTER_NAMES[0]) == static_cast<size_t>(Register::__NUM),
+              "REGISTER_NAMES must follow Register");
+
 enum class Flag: uint8_t
 {
     Zero = 0,
     Carry,
     Overflow,
-    Negative
+    Negative,
+    InterruptEnable
+};
+
+enum class Interrupt: uint8_t
+{
+    MemoryFault = 0,
+    IllegalInstruction,
+    PageFault,
+    Timer,
+    Block,
+    __NUM
 };
 
 enum class Section: uint8_t
@@ -178,5 +290,279 @@ using HWORD = uint16_t;
 using WORD  = uint32_t;
 using DWORD = uint64_t;
 
+enum class AddressMode : uint8_t
+{
+    Offset = 0,
+    Indexed,
+    PostIncrement,
+    __NUM
+};
+
 const static WORD MSB_I = ((sizeof(WORD) * 8) - 1);
 const static WORD CB_I = ((sizeof(WORD) * 8));
+
+//  ==================== INSTRUCTION SET ======================
+//  One entry per instruction. The assembler, the decoders and the disassembler are all
+//  built from this table, a new instruction only has to be added here and to Instruction.
+//  Loads and stores are OP_R2 with the address form in bits 15..0.
+
+struct InstructionDefinition
+{
+    Instruction     op;
+    const char*     mnemonic;
+    InstructionType type;
+};
+
+constexpr InstructionDefinition INSTRUCTION_SET[] =
+{
+    { Instruction::ADD,       "ADD",    InstructionType::OP_R3       },
+    { Instruction::ADDI,      "ADDI",   InstructionType::OP_R2_IMM16 },
+    { Instruction::SUB,       "SUB",    InstructionType::OP_R3       },
+    { Instruction::SUBI,      "SUBI",   InstructionType::OP_R2_IMM16 },
+    { Instruction::LUI,       "LUI",    InstructionType::OP_R1_IMM16 },
+    { Instruction::SHL,       "SHL",    InstructionType::OP_R3       },
+    { Instruction::SHLI,      "SHLI",   InstructionType::OP_R2_IMM16 },
+    { Instruction::SHR,       "SHR",    InstructionType::OP_R3       },
+    { Instruction::SHRI,      "SHRI",   InstructionType::OP_R2_IMM16 },
+    { Instruction::OR,        "OR",     InstructionType::OP_R3       },
+    { Instruction::ORI,       "ORI",    InstructionType::OP_R2_IMM16 },
+    { Instruction::AND,       "AND",    InstructionType::OP_R3       },
+    { Instruction::ANDI,      "ANDI",   InstructionType::OP_R2_IMM16 },
+    { Instruction::XOR,       "XOR",    InstructionType::OP_R3       },
+    { Instruction::XORI,      "XORI",   InstructionType::OP_R2_IMM16 },
+    { Instruction::NOT,       "NOT",    InstructionType::OP_R2       },
+    { Instruction::LB,        "LB",     InstructionType::OP_R2       },
+    { Instruction::LBU,       "LBU",    InstructionType::OP_R2       },
+    { Instruction::LH,        "LH",     InstructionType::OP_R2       },
+    { Instruction::LHU,       "LHU",    InstructionType::OP_R2       },
+    { Instruction::LW,        "LW",     InstructionType::OP_R2       },
+    { Instruction::LWU,       "LWU",    InstructionType::OP_R2       },
+    { Instruction::SB,        "SB",     InstructionType::OP_R2       },
+    { Instruction::SH,        "SH",     InstructionType::OP_R2       },
+    { Instruction::SW,        "SW",     InstructionType::OP_R2       },
+    { Instruction::CMP,       "CMP",    InstructionType::OP_R2       },
+    { Instruction::CMPI,      "CMPI",   InstructionType::OP_R1_IMM16 },
+    { Instruction::B,         "B",      InstructionType::OP_J        },
+    { Instruction::BEQ,       "BEQ",    InstructionType::OP_J        },
+    { Instruction::BNE,       "BNE",    InstructionType::OP_J        },
+    { Instruction::BGT,       "BGT",    InstructionType::OP_J        },
+    { Instruction::BGE,       "BGE",    InstructionType::OP_J        },
+    { Instruction::BLT,       "BLT",    InstructionType::OP_J        },
+    { Instruction::BLE,       "BLE",    InstructionType::OP_J        },
+    { Instruction::J,         "J",      InstructionType::OP_J        },
+    { Instruction::JR,        "JR",     InstructionType::OP_R1       },
+    { Instruction::CALL,      "CALL",   InstructionType::OP_J        },
+    { Instruction::CALLR,     "CALLR",  InstructionType::OP_R1       },
+    { Instruction::RET,       "RET",    InstructionType::OP          },
+    { Instruction::PUSH,      "PUSH",   InstructionType::OP_R1       },
+    { Instruction::POP,       "POP",    InstructionType::OP_R1       },
+    { Instruction::HALT,      "HALT",   InstructionType::OP          },
+    { Instruction::RETI,      "RETI",   InstructionType::OP          },
+    { Instruction::MUL,       "MUL",    InstructionType::OP_R3       },
+    { Instruction::MULH,      "MULH",   InstructionType::OP_R3       },
+    { Instruction::MULHU,     "MULHU",  InstructionType::OP_R3       },
+    { Instruction::DIV,       "DIV",    InstructionType::OP_R3       },
+    { Instruction::DIVU,      "DIVU",   InstructionType::OP_R3       },
+    { Instruction::REM,       "REM",    InstructionType::OP_R3       },
+    { Instruction::ADC,       "ADC",    InstructionType::OP_R3       },
+    { Instruction::SBC,       "SBC",    InstructionType::OP_R3       },
+    { Instruction::ADDUSB,    "ADDUSB", InstructionType::OP_R3       },
+    { Instruction::SUBUSB,    "SUBUSB", InstructionType::OP_R3       },
+    { Instruction::ADDUSH,    "ADDUSH", InstructionType::OP_R3       },
+    { Instruction::SUBUSH,    "SUBUSH", InstructionType::OP_R3       },
+    { Instruction::CMPEQB,    "CMPEQB", InstructionType::OP_R3       },
+    { Instruction::FFZB,      "FFZB",   InstructionType::OP_R2       },
+    { Instruction::SHUFB,     "SHUFB",  InstructionType::OP_R3       },
+    { Instruction::MEMCPY,    "MEMCPY", InstructionType::OP_R3       },
+    { Instruction::MEMSET,    "MEMSET", InstructionType::OP_R3       },
+    { Instruction::PUSHM,     "PUSHM",  InstructionType::OP_LIST     },
+    { Instruction::POPM,      "POPM",   InstructionType::OP_LIST     },
+    { Instruction::WAIT,      "WAIT",   InstructionType::OP          }
+};
+
+constexpr WORD OPCODE_COUNT = 64;   // 6 bit opcode field
+
+// Every Instruction up to __NUM has exactly one entry
+constexpr bool CoversInstructionSet()
+{
+    size_t count = sizeof(INSTRUCTION_SET) / sizeof(INSTRUCTION_SET[0]);
+    if (count != static_cast<size_t>(Instruction::__NUM) - 1)
+        return false;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (static_cast<size_t>(INSTRUCTION_SET[i].op) != i + 1)
+            return false;
+    }
+    return true;
+}
+
+static_assert(CoversInstructionSet(), "INSTRUCTION_SET must list every Instruction in order");
+static_assert(static_cast<WORD>(Instruction::__NUM) <= OPCODE_COUNT, "Instruction must fit the opcode field");
+
+constexpr int TypeRegisters(InstructionType type)
+{
+    switch (type)
+    {
+    case InstructionType::OP_R3:
+        return 3;
+    case InstructionType::OP_R2_IMM16:
+    case InstructionType::OP_R2:
+        return 2;
+    case InstructionType::OP_R1_IMM16:
+    case InstructionType::OP_R1:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// INSTRUCTION_SET indexed by opcode, undefined opcodes have no mnemonic and -1 registers
+struct OpcodeInfo
+{
+    const char*     mnemonic{ nullptr };
+    InstructionType type{ InstructionType::OP };
+    int8_t          registers{ -1 };
+};
+
+constexpr std::array<OpcodeInfo, OPCODE_COUNT> MakeOpcodeTable()
+{
+    std::array<OpcodeInfo, OPCODE_COUNT> table{};
+    for (const InstructionDefinition& def : INSTRUCTION_SET)
+        table[static_cast<size_t>(def.op)] = OpcodeInfo{ def.mnemonic, def.type, static_cast<int8_t>(TypeRegisters(def.type)) };
+    return table;
+}
+
+inline constexpr std::array<OpcodeInfo, OPCODE_COUNT> OPCODES = MakeOpcodeTable();
+
+constexpr const OpcodeInfo& GetOpcodeInfo(Instruction op)
+{
+    return OPCODES[static_cast<size_t>(op) & (OPCODE_COUNT - 1)];
+}
+
+constexpr bool IsDefined(Instruction op)
+{
+    return static_cast<WORD>(op) < OPCODE_COUNT && GetOpcodeInfo(op).mnemonic != nullptr;
+}
+
+constexpr const char* Mnemonic(Instruction op)
+{
+    return IsDefined(op) ? GetOpcodeInfo(op).mnemonic : nullptr;
+}
+
+constexpr InstructionType GetInstructionType(Instruction op)
+{
+    return GetOpcodeInfo(op).type;
+}
+
+// Number of register fields an instruction encodes, -1 for an undefined opcode
+constexpr int RegisterOperands(Instruction op)
+{
+    return static_cast<WORD>(op) < OPCODE_COUNT ? GetOpcodeInfo(op).registers : -1;
+}
+
+constexpr bool IsLoadStore(Instruction op)
+{
+    switch (op)
+    {
+    case Instruction::LB:   case Instruction::LBU:  case Instruction::LH:   case Instruction::LHU:
+    case Instruction::LW:   case Instruction::LWU:  case Instruction::SB:   case Instruction::SH:
+    case Instruction::SW:
+        return true;
+    default:
+        return false;
+    }
+}
+
+constexpr bool IsStore(Instruction op)
+{
+    return op == Instruction::SB || op == Instruction::SH || op == Instruction::SW;
+}
+
+// Bytes moved by a load or store
+constexpr WORD AccessSize(Instruction op)
+{
+    switch (op)
+    {
+    case Instruction::LB:   case Instruction::LBU:  case Instruction::SB:
+        return sizeof(BYTE);
+    case Instruction::LH:   case Instruction::LHU:  case Instruction::SH:
+        return sizeof(HWORD);
+    default:
+        return sizeof(WORD);
+    }
+}
+
+//  Address mode field of a load/store, bits 15..0
+
+constexpr AddressMode GetAddressMode(WORD instruction)
+{
+    return static_cast<AddressMode>((instruction >> 14) & 0x3);
+}
+
+// Sign extended offset of the Offset and PostIncrement forms
+constexpr WORD GetAddressOffset(WORD instruction)
+{
+    WORD offset = instruction & 0x3FFF;
+    return (offset & (1u << 13)) ? (offset | 0xFFFFC000u) : offset;
+}
+
+constexpr Register GetAddressIndex(WORD instruction)
+{
+    return static_cast<Register>((instruction >> 9) & 0x1F);
+}
+
+constexpr WORD GetAddressShift(WORD instruction)
+{
+    return (instruction >> 7) & 0x3;
+}
+
+constexpr bool IsValidAddress(WORD instruction)
+{
+    switch (GetAddressMode(instruction))
+    {
+    case AddressMode::Offset:
+    case AddressMode::PostIncrement:
+        return true;
+    case AddressMode::Indexed:
+        return GetAddressIndex(instruction) < Register::__NUM && (instruction & 0x7F) == 0;
+    default:
+        return false;
+    }
+}
+
+constexpr WORD AddressOffset(int32_t offset)
+{
+    return static_cast<WORD>(offset) & 0x3FFF;
+}
+
+constexpr WORD AddressIndexed(Register index, WORD shift)
+{
+    return (static_cast<WORD>(AddressMode::Indexed) << 14) | (static_cast<WORD>(index) << 9) | ((shift & 0x3) << 7);
+}
+
+constexpr WORD AddressPostIncrement(int32_t offset)
+{
+    return (static_cast<WORD>(AddressMode::PostIncrement) << 14) | AddressOffset(offset);
+}
+
+//  PUSHM/POPM register list, bits 15..0
+
+constexpr WORD REGISTER_LIST        = 0x03FE;
+constexpr WORD REGISTER_LIST_MAX    = 9;
+
+constexpr bool IsRegisterList(Instruction op)
+{
+    return op == Instruction::PUSHM || op == Instruction::POPM;
+}
+
+constexpr bool IsValidRegisterList(WORD instruction)
+{
+    return (instruction & 0x3FFFFFF & ~REGISTER_LIST) == 0;
+}
+
+constexpr WORD RegisterBit(Register reg)
+{
+    return WORD{ 1 } << static_cast<WORD>(reg);
+}
+